@@ -0,0 +1,106 @@
+; application processor startup code
+
+; smp_init() copies everything between ap_trampoline_start and
+; ap_trampoline_end to a free page below 1MB and sends the STARTUP IPI
+; with its page number, so the AP starts here in real mode at page:0.
+; nothing in here may use absolute addresses, the page base is taken
+; from cs. the fields at the end are filled in by the BSP.
+
+section .rodata
+global ap_trampoline_start
+global ap_trampoline_end
+global ap_trampoline_data
+
+%define OFF(x) ((x) - ap_trampoline_start)
+
+[BITS 16]
+ap_trampoline_start:
+    cli
+    cld
+    mov ax, cs
+    mov ds, ax
+    mov ss, ax
+    mov sp, 0x1000                  ; top of the page
+
+    ; ebx = linear address of the page
+    xor ebx, ebx
+    mov bx, ax
+    shl ebx, 4
+
+    ; the gdt pointer needs a linear address
+    lea eax, [ebx + OFF(tramp_gdt)]
+    mov [OFF(tramp_gdt_ptr) + 2], eax
+    lgdt [OFF(tramp_gdt_ptr)]
+
+    mov eax, cr0
+    or eax, 1                       ; PE
+    mov cr0, eax
+
+    ; far jump into the 32 bit code segment
+    push dword 0x08
+    lea eax, [ebx + OFF(ap_protected)]
+    push eax
+    o32 retf
+
+[BITS 32]
+ap_protected:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    lea esp, [ebx + 0x1000]
+
+    ; same paging setup as the BSP: CR4 (PAE and friends), page tables,
+    ; EFER.LME, then paging on
+    mov eax, [ebx + OFF(tramp_cr4)]
+    mov cr4, eax
+    mov eax, [ebx + OFF(tramp_cr3)]
+    mov cr3, eax
+
+    mov ecx, 0xC0000080
+    mov eax, [ebx + OFF(tramp_efer)]
+    xor edx, edx
+    wrmsr
+
+    mov eax, [ebx + OFF(tramp_cr0)]
+    mov cr0, eax
+
+    ; compatibility mode now, the 64 bit code segment finishes the switch
+    push dword 0x18
+    lea eax, [ebx + OFF(ap_long)]
+    push eax
+    retf
+
+[BITS 64]
+ap_long:
+    mov ebx, ebx                    ; upper half is undefined after the switch
+    mov rsp, [rbx + OFF(tramp_stack)]
+    mov rdi, [rbx + OFF(tramp_cpu)]
+    mov rax, [rbx + OFF(tramp_entry)]
+    xor ebp, ebp
+    push 0                          ; no return address, keeps the ABI alignment
+    jmp rax
+
+align 8
+tramp_gdt:
+    dq 0
+    dq 0x00CF9A000000FFFF           ; 0x08 32 bit code
+    dq 0x00CF92000000FFFF           ; 0x10 data
+    dq 0x00AF9A000000FFFF           ; 0x18 64 bit code
+tramp_gdt_end:
+
+tramp_gdt_ptr:
+    dw tramp_gdt_end - tramp_gdt - 1
+    dd 0
+
+; filled in by the BSP, see TrampolineData in smp.c
+align 8
+ap_trampoline_data:
+tramp_cr3:   dq 0
+tramp_cr4:   dq 0
+tramp_efer:  dq 0
+tramp_cr0:   dq 0
+tramp_stack: dq 0
+tramp_entry: dq 0
+tramp_cpu:   dq 0
+ap_trampoline_end:
@@ -0,0 +1,680 @@
+#include "bcache.h"
+#include "../../include/lib/string.h"
+#include "../../include/memory/memory.h"
+#include "../../include/memory/pmm.h"
+#include "../../kernel/idt.h"
+#include "../../kernel/sched.h"
+#include "../../kernel/lock.h"
+#include "../../kernel/time.h"
+#include <stddef.h>
+
+#define LIST_NONE   0                // free header
+#define LIST_A1IN   1                // seen once, FIFO
+#define LIST_AM     2                // seen again, LRU
+#define LIST_A1OUT  3                // ghosts: key only, no data
+#define LIST_COUNT  4
+
+// Dirty blocks submitted together, the elevator merges neighbours
+#define WRITEBACK_BATCH 64
+
+// Head is the newest entry
+typedef struct {
+    Buffer* head;
+    Buffer* tail;
+    uint32_t count;
+} BufferList;
+
+// Sequential read detection per device
+typedef struct {
+    int valid;
+    uint64_t last;                   // last block read
+    uint64_t next;                   // first block not read ahead yet
+    uint32_t window;
+} ReadAhead;
+
+static LockStats cache_lock_stats = LOCK_STATS_INIT("bcache");
+static TicketLock cache_lock = TICKET_LOCK_INIT(&cache_lock_stats);
+static WaitQueue io_waiters;
+
+static Buffer* headers;
+static uint32_t header_count;
+static Buffer* free_headers;
+static Buffer** hash_table;
+static uint32_t hash_mask;
+static BufferList lists[LIST_COUNT];
+static Buffer* dirty_head;
+static Buffer* dirty_tail;
+static void* free_data;              // unused blocks, linked through their first word
+static uint32_t a1in_max;
+static uint32_t a1out_max;
+static uint32_t io_count;            // buffers with BUF_IO
+static uint32_t writes_in_flight[BLOCK_MAX_DEVICES];
+static uint64_t write_errors;
+static ReadAhead readahead[BLOCK_MAX_DEVICES];
+static BCacheStats stats;
+static int initialized = 0;
+
+static inline uint32_t hash_index(int dev, uint64_t block) {
+    return (uint32_t)(((block ^ ((uint64_t)dev << 48)) * 0x9E3779B97F4A7C15ull) >> 32) & hash_mask;
+}
+
+static Buffer* hash_lookup(int dev, uint64_t block) {
+    Buffer* b = hash_table[hash_index(dev, block)];
+    while (b && (b->dev != dev || b->block != block)) {
+        b = b->hash_next;
+    }
+    return b;
+}
+
+static void hash_insert(Buffer* b) {
+    Buffer** slot = &hash_table[hash_index(b->dev, b->block)];
+    b->hash_next = *slot;
+    *slot = b;
+}
+
+static void hash_remove(Buffer* b) {
+    Buffer** slot = &hash_table[hash_index(b->dev, b->block)];
+    while (*slot != b) {
+        slot = &(*slot)->hash_next;
+    }
+    *slot = b->hash_next;
+}
+
+static void list_remove(Buffer* b) {
+    BufferList* list = &lists[b->list];
+    if (b->prev) {
+        b->prev->next = b->next;
+    } else {
+        list->head = b->next;
+    }
+    if (b->next) {
+        b->next->prev = b->prev;
+    } else {
+        list->tail = b->prev;
+    }
+    list->count--;
+    b->list = LIST_NONE;
+}
+
+static void list_push(Buffer* b, int which) {
+    BufferList* list = &lists[which];
+    b->list = which;
+    b->prev = NULL;
+    b->next = list->head;
+    if (list->head) {
+        list->head->prev = b;
+    } else {
+        list->tail = b;
+    }
+    list->head = b;
+    list->count++;
+}
+
+static void dirty_add(Buffer* b) {
+    b->dirty_ns = ktime_ns();
+    b->dirty_prev = dirty_tail;
+    b->dirty_next = NULL;
+    if (dirty_tail) {
+        dirty_tail->dirty_next = b;
+    } else {
+        dirty_head = b;
+    }
+    dirty_tail = b;
+    stats.dirty++;
+}
+
+static void dirty_remove(Buffer* b) {
+    if (b->dirty_prev) {
+        b->dirty_prev->dirty_next = b->dirty_next;
+    } else {
+        dirty_head = b->dirty_next;
+    }
+    if (b->dirty_next) {
+        b->dirty_next->dirty_prev = b->dirty_prev;
+    } else {
+        dirty_tail = b->dirty_prev;
+    }
+    stats.dirty--;
+}
+
+static uint8_t* data_alloc(void) {
+    if (free_data) {
+        void* data = free_data;
+        free_data = *(void**)data;
+        return (uint8_t*)data;
+    }
+    if (stats.allocated >= stats.capacity) {
+        return NULL;
+    }
+    uint8_t* data = (uint8_t*)kmalloc_aligned(BCACHE_BLOCK_SIZE, PAGE_SIZE);
+    if (data) {
+        stats.allocated++;
+    }
+    return data;
+}
+
+static void data_free(uint8_t* data) {
+    *(void**)data = free_data;
+    free_data = data;
+}
+
+static void header_free(Buffer* b) {
+    hash_remove(b);
+    list_remove(b);
+    b->next = free_headers;
+    free_headers = b;
+}
+
+static inline int evictable(const Buffer* b) {
+    return !b->refs && !(b->flags & (BUF_DIRTY | BUF_IO));
+}
+
+static Buffer* find_victim(BufferList* list) {
+    Buffer* b = list->tail;
+    while (b && !evictable(b)) {
+        b = b->prev;
+    }
+    return b;
+}
+
+// Free the memory of one block: the oldest of A1in while it is over its
+// share, else the least recently used of Am. Blocks leaving A1in stay
+// behind as ghosts. -1 if every block is busy or dirty.
+static int reclaim(void) {
+    Buffer* victim = NULL;
+    if (lists[LIST_A1IN].count > a1in_max) {
+        victim = find_victim(&lists[LIST_A1IN]);
+    }
+    if (!victim) {
+        victim = find_victim(&lists[LIST_AM]);
+    }
+    if (!victim) {
+        victim = find_victim(&lists[LIST_A1IN]);
+    }
+    if (!victim) {
+        return -1;
+    }
+
+    stats.evictions++;
+    data_free(victim->data);
+    victim->data = NULL;
+
+    if (victim->list == LIST_A1IN) {
+        list_remove(victim);
+        victim->flags = 0;
+        list_push(victim, LIST_A1OUT);
+        if (lists[LIST_A1OUT].count > a1out_max) {
+            header_free(lists[LIST_A1OUT].tail);
+        }
+    } else {
+        header_free(victim);
+    }
+    return 0;
+}
+
+// New block in the cache. A remembered ghost goes straight to Am when
+// demand asks for it. NULL if nothing can be reclaimed. Lock held.
+static Buffer* buffer_new(int dev, uint64_t block, int demand) {
+    int hot = 0;
+    Buffer* ghost = hash_lookup(dev, block);
+    if (ghost) {
+        hot = demand;
+        stats.ghost_hits += demand;
+        header_free(ghost);
+    }
+
+    uint8_t* data = data_alloc();
+    if (!data && reclaim() == 0) {
+        data = data_alloc();
+    }
+    if (!data || !free_headers) {
+        if (data) {
+            data_free(data);
+        }
+        return NULL;
+    }
+
+    Buffer* b = free_headers;
+    free_headers = b->next;
+    memset(b, 0, sizeof(Buffer));
+    b->dev = dev;
+    b->block = block;
+    b->data = data;
+    hash_insert(b);
+    list_push(b, hot ? LIST_AM : LIST_A1IN);
+    return b;
+}
+
+static void buffer_io_done(Bio* bio) {
+    Buffer* b = (Buffer*)bio->private;
+    int failed = bio->status != 0;
+
+    uint64_t flags = ticket_lock_irqsave(&cache_lock);
+    if (bio->op == DISK_READ) {
+        if (failed) {
+            b->flags |= BUF_ERROR;
+        } else {
+            b->flags = (b->flags | BUF_VALID) & ~BUF_ERROR;
+        }
+    } else {
+        writes_in_flight[b->dev]--;
+        if (failed) {
+            // Keep it dirty, the flusher tries again
+            write_errors++;
+            if (!(b->flags & BUF_DIRTY)) {
+                b->flags |= BUF_DIRTY;
+                dirty_add(b);
+            }
+        } else {
+            stats.writebacks++;
+        }
+    }
+    if (failed) {
+        stats.errors++;
+    }
+    b->flags &= ~BUF_IO;
+    io_count--;
+    ticket_unlock_irqrestore(&cache_lock, flags);
+
+    wait_queue_wake_all(&io_waiters);
+}
+
+// Mark the buffer busy and set up its bio. Lock held.
+static void buffer_start_io(Buffer* b, DiskOp op) {
+    b->flags |= BUF_IO;
+    io_count++;
+    if (op == DISK_WRITE) {
+        writes_in_flight[b->dev]++;
+    }
+
+    memset(&b->bio, 0, sizeof(Bio));
+    b->bio.dev = b->dev;
+    b->bio.op = op;
+    b->bio.sector = b->block * BCACHE_BLOCK_SECTORS;
+    b->bio.count = BCACHE_BLOCK_SECTORS;
+    b->bio.buffer = b->data;
+    b->bio.done = buffer_io_done;
+    b->bio.private = b;
+}
+
+// Submit under one plug so neighbouring blocks merge
+static void submit_io(Buffer** bufs, int count) {
+    BlockPlug plug;
+    block_start_plug(&plug);
+    for (int i = 0; i < count; i++) {
+        if (block_submit(&bufs[i]->bio) != 0) {
+            bufs[i]->bio.status = -1;
+            buffer_io_done(&bufs[i]->bio);
+        }
+    }
+    block_finish_plug(&plug);
+}
+
+// Sleep until some I/O finishes. Called with the lock held and
+// interrupts off, completions only run on this CPU, so none is missed.
+static void wait_io(void) {
+    ticket_unlock(&cache_lock);
+    wait_queue_sleep(&io_waiters);
+    ticket_lock(&cache_lock);
+}
+
+static uint64_t device_blocks(int dev) {
+    BlockDeviceInfo info;
+    if (block_get_info(dev, &info) != 0) {
+        return 0;
+    }
+    return info.sectors / BCACHE_BLOCK_SECTORS;
+}
+
+// Sequential reads open a window of blocks ahead that doubles every
+// time the reader gets halfway into it; a jump closes it again. Fills
+// out with the blocks to read. Lock held.
+static int readahead_start(int dev, uint64_t block, Buffer** out) {
+    ReadAhead* ra = &readahead[dev];
+    int sequential = ra->valid && block == ra->last + 1;
+    ra->valid = 1;
+    ra->last = block;
+
+    if (!sequential) {
+        ra->window = 0;
+        ra->next = 0;
+        return 0;
+    }
+    if (ra->window && block + ra->window / 2 < ra->next) {
+        return 0;
+    }
+    if (!ra->window) {
+        ra->window = BCACHE_READAHEAD_MIN;
+    } else if (ra->window < BCACHE_READAHEAD_MAX) {
+        ra->window *= 2;
+    }
+
+    uint64_t start = ra->next > block + 1 ? ra->next : block + 1;
+    uint64_t end = block + 1 + ra->window;
+    uint64_t blocks = device_blocks(dev);
+    if (end > blocks) {
+        end = blocks;
+    }
+
+    int count = 0;
+    uint64_t blk = start;
+    for (; blk < end; blk++) {
+        Buffer* b = hash_lookup(dev, blk);
+        if (b && b->list != LIST_A1OUT) {
+            continue;
+        }
+        b = buffer_new(dev, blk, 0);
+        if (!b) {
+            break;
+        }
+        b->flags |= BUF_READAHEAD;
+        buffer_start_io(b, DISK_READ);
+        out[count++] = b;
+        stats.readahead++;
+    }
+    ra->next = blk;
+    return count;
+}
+
+static int writeback(int dev, uint64_t min_age_ns);
+
+static Buffer* buffer_lookup(int dev, uint64_t block, int read) {
+    if (!initialized || block >= device_blocks(dev)) {
+        return NULL;
+    }
+
+    Buffer* io[1 + BCACHE_READAHEAD_MAX];
+    int count = 0;
+
+    // A read ahead block we wait for may still sit in our own plug
+    block_flush_plug();
+
+    uint64_t flags = ticket_lock_irqsave(&cache_lock);
+    Buffer* b;
+    for (;;) {
+        b = hash_lookup(dev, block);
+        if (b && b->list != LIST_A1OUT) {
+            stats.hits++;
+            if (b->flags & BUF_READAHEAD) {
+                b->flags &= ~BUF_READAHEAD;
+                stats.readahead_hits++;
+            }
+            if (b->list == LIST_AM) {
+                list_remove(b);
+                list_push(b, LIST_AM);
+            }
+            break;
+        }
+
+        b = buffer_new(dev, block, 1);
+        if (b) {
+            stats.misses++;
+            break;
+        }
+
+        // Every block is in use, dirty or being written
+        if (io_count) {
+            wait_io();
+        } else if (dirty_head) {
+            ticket_unlock_irqrestore(&cache_lock, flags);
+            writeback(-1, 0);
+            block_flush_plug();
+            flags = ticket_lock_irqsave(&cache_lock);
+        } else {
+            ticket_unlock_irqrestore(&cache_lock, flags);
+            return NULL;
+        }
+    }
+    b->refs++;
+
+    if (read && !(b->flags & (BUF_VALID | BUF_IO))) {
+        buffer_start_io(b, DISK_READ);
+        io[count++] = b;
+    }
+    if (read) {
+        count += readahead_start(dev, block, io + count);
+    }
+    ticket_unlock_irqrestore(&cache_lock, flags);
+
+    if (count) {
+        submit_io(io, count);
+        block_flush_plug();
+    }
+
+    flags = ticket_lock_irqsave(&cache_lock);
+    while (b->flags & BUF_IO) {
+        wait_io();
+    }
+    if (read && !(b->flags & BUF_VALID)) {
+        b->refs--;
+        b = NULL;
+    }
+    ticket_unlock_irqrestore(&cache_lock, flags);
+    return b;
+}
+
+Buffer* bcache_read(int dev, uint64_t block) {
+    return buffer_lookup(dev, block, 1);
+}
+
+Buffer* bcache_get(int dev, uint64_t block) {
+    return buffer_lookup(dev, block, 0);
+}
+
+void bcache_release(Buffer* buf) {
+    uint64_t flags = ticket_lock_irqsave(&cache_lock);
+    buf->refs--;
+    ticket_unlock_irqrestore(&cache_lock, flags);
+}
+
+void bcache_mark_dirty(Buffer* buf) {
+    uint64_t flags = ticket_lock_irqsave(&cache_lock);
+    buf->flags = (buf->flags | BUF_VALID) & ~(BUF_READAHEAD | BUF_ERROR);
+    if (!(buf->flags & BUF_DIRTY)) {
+        buf->flags |= BUF_DIRTY;
+        dirty_add(buf);
+    }
+    ticket_unlock_irqrestore(&cache_lock, flags);
+}
+
+// Submit the dirty blocks of dev older than the age, oldest first.
+// Returns how many were submitted.
+static int writeback(int dev, uint64_t min_age_ns) {
+    Buffer* io[WRITEBACK_BATCH];
+    int total = 0;
+
+    for (;;) {
+        int count = 0;
+        uint64_t now = ktime_ns();
+
+        uint64_t flags = ticket_lock_irqsave(&cache_lock);
+        Buffer* b = dirty_head;
+        while (b && count < WRITEBACK_BATCH && now - b->dirty_ns >= min_age_ns) {
+            Buffer* next = b->dirty_next;
+            // One still being written was dirtied again, it waits its turn
+            if ((dev < 0 || b->dev == dev) && !(b->flags & BUF_IO)) {
+                dirty_remove(b);
+                b->flags &= ~BUF_DIRTY;
+                buffer_start_io(b, DISK_WRITE);
+                io[count++] = b;
+            }
+            b = next;
+        }
+        ticket_unlock_irqrestore(&cache_lock, flags);
+
+        if (count) {
+            submit_io(io, count);
+            total += count;
+        }
+        if (count < WRITEBACK_BATCH) {
+            return total;
+        }
+    }
+}
+
+static int writes_pending(int dev) {
+    if (dev >= 0) {
+        return writes_in_flight[dev] != 0;
+    }
+    for (int i = 0; i < BLOCK_MAX_DEVICES; i++) {
+        if (writes_in_flight[i]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Called with the cache lock held
+static int has_dirty(int dev) {
+    for (Buffer* b = dirty_head; b; b = b->dirty_next) {
+        if (dev < 0 || b->dev == dev) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int bcache_sync(int dev) {
+    if (!initialized) {
+        return 0;
+    }
+
+    uint64_t flags = ticket_lock_irqsave(&cache_lock);
+    uint64_t errors = write_errors;
+    ticket_unlock_irqrestore(&cache_lock, flags);
+
+    // writeback() skips blocks dirtied again while their last write is
+    // in flight, so go round until none of them is left. Failed writes
+    // stay dirty as well, those end it with an error.
+    int result;
+    int dirty;
+    do {
+        writeback(dev, 0);
+        block_flush_plug();
+
+        flags = ticket_lock_irqsave(&cache_lock);
+        while (writes_pending(dev)) {
+            wait_io();
+        }
+        result = write_errors == errors ? 0 : -1;
+        dirty = has_dirty(dev);
+        ticket_unlock_irqrestore(&cache_lock, flags);
+    } while (dirty && result == 0);
+
+    for (int i = 0; i < block_count(); i++) {
+        if ((dev < 0 || dev == i) && block_flush(i) != 0) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+void bcache_invalidate(int dev) {
+    if (!initialized) {
+        return;
+    }
+
+    uint64_t flags = ticket_lock_irqsave(&cache_lock);
+    for (uint32_t i = 0; i < header_count; i++) {
+        Buffer* b = &headers[i];
+        if (b->list == LIST_NONE || (dev >= 0 && b->dev != dev)) {
+            continue;
+        }
+        if (b->list == LIST_A1OUT) {
+            header_free(b);
+        } else if (evictable(b)) {
+            data_free(b->data);
+            header_free(b);
+        }
+    }
+    for (int i = 0; i < BLOCK_MAX_DEVICES; i++) {
+        if (dev < 0 || dev == i) {
+            readahead[i].valid = 0;
+        }
+    }
+    ticket_unlock_irqrestore(&cache_lock, flags);
+}
+
+void bcache_get_stats(BCacheStats* out) {
+    uint64_t flags = ticket_lock_irqsave(&cache_lock);
+    *out = stats;
+    out->a1in = lists[LIST_A1IN].count;
+    out->am = lists[LIST_AM].count;
+    out->a1out = lists[LIST_A1OUT].count;
+    ticket_unlock_irqrestore(&cache_lock, flags);
+}
+
+void bcache_reset_stats(void) {
+    uint64_t flags = ticket_lock_irqsave(&cache_lock);
+    BCacheStats kept = stats;
+    memset(&stats, 0, sizeof(BCacheStats));
+    stats.capacity = kept.capacity;
+    stats.allocated = kept.allocated;
+    stats.dirty = kept.dirty;
+    ticket_unlock_irqrestore(&cache_lock, flags);
+}
+
+static void flusher_main(void* arg) {
+    (void)arg;
+
+    for (;;) {
+        thread_sleep_ms(BCACHE_FLUSH_INTERVAL_MS);
+
+        uint64_t flags = ticket_lock_irqsave(&cache_lock);
+        int pressure = stats.dirty > stats.capacity * BCACHE_DIRTY_PERCENT / 100;
+        ticket_unlock_irqrestore(&cache_lock, flags);
+
+        if (writeback(-1, pressure ? 0 : (uint64_t)BCACHE_DIRTY_AGE_MS * 1000000) > 0) {
+            flags = ticket_lock_irqsave(&cache_lock);
+            stats.flusher_runs++;
+            ticket_unlock_irqrestore(&cache_lock, flags);
+        }
+    }
+}
+
+uint32_t bcache_init(void) {
+    if (initialized) {
+        return stats.capacity;
+    }
+
+    uint64_t ram = (uint64_t)pmm_get_total_pages() * PAGE_SIZE;
+    uint64_t blocks = (ram >> BCACHE_RAM_SHIFT) / BCACHE_BLOCK_SIZE;
+    if (blocks < BCACHE_MIN_BLOCKS) {
+        blocks = BCACHE_MIN_BLOCKS;
+    }
+    if (blocks > BCACHE_MAX_BLOCKS) {
+        blocks = BCACHE_MAX_BLOCKS;
+    }
+
+    // Headers for every block plus the ghosts
+    a1in_max = (uint32_t)blocks * BCACHE_A1IN_PERCENT / 100;
+    a1out_max = (uint32_t)blocks * BCACHE_A1OUT_PERCENT / 100;
+    header_count = (uint32_t)blocks + a1out_max + 1;
+
+    uint32_t buckets = 1;
+    while (buckets < header_count) {
+        buckets <<= 1;
+    }
+
+    headers = (Buffer*)kmalloc(header_count * sizeof(Buffer));
+    hash_table = (Buffer**)kmalloc(buckets * sizeof(Buffer*));
+    if (!headers || !hash_table) {
+        kfree(headers);
+        kfree(hash_table);
+        return 0;
+    }
+    memset(headers, 0, header_count * sizeof(Buffer));
+    memset(hash_table, 0, buckets * sizeof(Buffer*));
+    hash_mask = buckets - 1;
+
+    for (uint32_t i = 0; i < header_count; i++) {
+        headers[i].next = free_headers;
+        free_headers = &headers[i];
+    }
+
+    stats.capacity = (uint32_t)blocks;
+    initialized = 1;
+
+    thread_create("bflush", flusher_main, NULL, PRIORITY_LOW);
+    return stats.capacity;
+}
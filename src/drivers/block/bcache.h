@@ -0,0 +1,105 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <stdint.h>
+#include "block.h"
+
+// Buffer cache for block devices, 4 KB blocks keyed by (device, block)
+// in a hash table. Replacement is 2Q: blocks seen once sit in a short
+// FIFO (A1in) and leave it first, blocks referenced again after they
+// fell out (remembered in the ghost list A1out) go to the main LRU, so
+// one long scan can't push out the working set. Dirty blocks are written
+// back by a flusher thread after a while, sequential reads start a
+// read-ahead window that grows while they stay sequential.
+
+#define BCACHE_BLOCK_SIZE      4096
+#define BCACHE_BLOCK_SECTORS   (BCACHE_BLOCK_SIZE / DISK_SECTOR_SIZE)
+
+// Size: a share of usable RAM, within these limits (in blocks)
+#define BCACHE_RAM_SHIFT       4         // 1/16
+#define BCACHE_MIN_BLOCKS      64
+#define BCACHE_MAX_BLOCKS      16384     // 64 MB
+
+// 2Q list sizes in percent of the cache
+#define BCACHE_A1IN_PERCENT    25
+#define BCACHE_A1OUT_PERCENT   50
+
+// The flusher writes blocks dirty for longer than the age, or all of
+// them once too much of the cache is dirty
+#define BCACHE_FLUSH_INTERVAL_MS 100
+#define BCACHE_DIRTY_AGE_MS      3000
+#define BCACHE_DIRTY_PERCENT     25
+
+// Read-ahead window in blocks
+#define BCACHE_READAHEAD_MIN   4
+#define BCACHE_READAHEAD_MAX   32
+
+// Buffer flags
+#define BUF_VALID      0x01      // data matches the disk or is newer
+#define BUF_DIRTY      0x02
+#define BUF_IO         0x04      // read or write in flight
+#define BUF_READAHEAD  0x08      // read ahead and not used yet
+#define BUF_ERROR      0x10      // the last read failed
+
+typedef struct Buffer {
+    int dev;
+    uint64_t block;
+    uint8_t* data;               // BCACHE_BLOCK_SIZE bytes
+
+    // Owned by the cache
+    volatile uint32_t flags;
+    uint32_t refs;
+    int list;
+    uint64_t dirty_ns;
+    struct Buffer* hash_next;
+    struct Buffer* prev;         // 2Q list
+    struct Buffer* next;
+    struct Buffer* dirty_prev;   // dirty blocks, oldest first
+    struct Buffer* dirty_next;
+    Bio bio;
+} Buffer;
+
+typedef struct {
+    uint32_t capacity;           // blocks
+    uint32_t allocated;          // blocks with memory
+    uint32_t a1in;
+    uint32_t am;
+    uint32_t a1out;              // ghosts
+    uint32_t dirty;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t ghost_hits;         // misses that went straight to the main LRU
+    uint64_t evictions;
+    uint64_t readahead;          // blocks read ahead
+    uint64_t readahead_hits;     // of them used later
+    uint64_t writebacks;         // blocks written
+    uint64_t flusher_runs;       // flusher passes that wrote something
+    uint64_t errors;
+} BCacheStats;
+
+// Size the cache from the usable RAM and start the flusher thread,
+// after sched_init(). Returns the size in blocks, 0 without memory.
+uint32_t bcache_init(void);
+
+// Block with its data read, referenced; NULL on an I/O error. Only
+// threads may call these, not interrupt handlers.
+Buffer* bcache_read(int dev, uint64_t block);
+
+// Block without reading it, referenced. Unless BUF_VALID is set the
+// data is undefined, the caller fills all of it and marks it dirty.
+Buffer* bcache_get(int dev, uint64_t block);
+
+void bcache_release(Buffer* buf);
+void bcache_mark_dirty(Buffer* buf);
+
+// Write the dirty blocks of dev (all devices if dev < 0), wait for them
+// and flush the disks. 0 if every write succeeded.
+int bcache_sync(int dev);
+
+// Drop the clean, unused blocks of dev (all if dev < 0)
+void bcache_invalidate(int dev);
+
+void bcache_get_stats(BCacheStats* stats);
+void bcache_reset_stats(void);
+
+#endif
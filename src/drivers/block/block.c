@@ -0,0 +1,602 @@
+#include "block.h"
+#include "../../include/lib/string.h"
+#include "../../include/memory/slab.h"
+#include "../../kernel/idt.h"
+#include "../../kernel/sched.h"
+#include "../../kernel/lock.h"
+#include "../../kernel/time.h"
+#include <stddef.h>
+
+#define FIFO_READ   0
+#define FIFO_WRITE  1
+#define FIFO_FLUSH  2                // flushes skip the elevator
+#define FIFO_COUNT  3
+
+struct BlockDevice;
+
+// Driver request made of one or more adjacent bios of the same kind
+typedef struct BlockRequest {
+    DiskRequest disk;
+    struct BlockDevice* dev;
+    DiskOp op;
+    uint64_t sector;
+    uint32_t count;
+    Bio* bios;                       // in sector order
+    Bio* bios_tail;
+    uint32_t bio_count;
+    uint64_t deadline;               // ktime_ns() by which it should be dispatched
+
+    struct BlockRequest* sort_prev;  // queued requests by sector
+    struct BlockRequest* sort_next;
+    struct BlockRequest* fifo_prev;  // by deadline, per direction
+    struct BlockRequest* fifo_next;
+
+    DiskSegment segments[DISK_MAX_SEGMENTS];
+} BlockRequest;
+
+typedef struct {
+    BlockRequest* head;
+    BlockRequest* tail;
+} BlockFifo;
+
+typedef struct BlockDevice {
+    BlockDeviceInfo info;
+    const BlockDriver* driver;
+    TicketLock lock;
+    BlockRequest* sorted;
+    BlockFifo fifo[FIFO_COUNT];
+    uint64_t head_sector;            // where the last dispatched request ended
+    BlockStats stats;
+    WaitQueue waiters;
+} BlockDevice;
+
+static LockStats device_lock_stats[BLOCK_MAX_DEVICES] = {
+    LOCK_STATS_INIT("block0"),
+    LOCK_STATS_INIT("block1"),
+    LOCK_STATS_INIT("block2"),
+    LOCK_STATS_INIT("block3"),
+    LOCK_STATS_INIT("block4"),
+    LOCK_STATS_INIT("block5"),
+    LOCK_STATS_INIT("block6"),
+    LOCK_STATS_INIT("block7"),
+};
+
+static BlockDevice devices[BLOCK_MAX_DEVICES];
+static int device_count = 0;
+
+// Every queued request comes from here, in and out at the I/O rate
+static kmem_cache* request_cache = NULL;
+
+int block_register(const char* name, const BlockDriver* driver, int drive,
+                   uint64_t sectors, uint32_t max_sectors, uint32_t depth) {
+    if (device_count >= BLOCK_MAX_DEVICES || !max_sectors) {
+        return -1;
+    }
+    if (!request_cache) {
+        request_cache = kmem_cache_create("block_request", sizeof(BlockRequest), 8, NULL);
+        if (!request_cache) {
+            return -1;
+        }
+    }
+
+    BlockDevice* dev = &devices[device_count];
+    memset(dev, 0, sizeof(BlockDevice));
+
+    int i = 0;
+    for (; name[i] && i < BLOCK_NAME_LENGTH - 1; i++) {
+        dev->info.name[i] = name[i];
+    }
+    dev->info.name[i] = '\0';
+    dev->info.driver = driver->name;
+    dev->info.drive = drive;
+    dev->info.sectors = sectors;
+    dev->info.max_sectors = max_sectors;
+    dev->info.depth = depth < 1 ? 1 : depth > BLOCK_MAX_DEPTH ? BLOCK_MAX_DEPTH : depth;
+    dev->driver = driver;
+    dev->lock = (TicketLock)TICKET_LOCK_INIT(&device_lock_stats[device_count]);
+
+    return device_count++;
+}
+
+int block_count(void) {
+    return device_count;
+}
+
+int block_find(const char* name) {
+    for (int i = 0; i < device_count; i++) {
+        if (strcmp(devices[i].info.name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int block_get_info(int dev, BlockDeviceInfo* info) {
+    if (dev < 0 || dev >= device_count) {
+        return -1;
+    }
+    *info = devices[dev].info;
+    return 0;
+}
+
+void block_get_stats(int dev, BlockStats* stats) {
+    if (dev < 0 || dev >= device_count) {
+        return;
+    }
+    BlockDevice* d = &devices[dev];
+    uint64_t flags = ticket_lock_irqsave(&d->lock);
+    *stats = d->stats;
+    ticket_unlock_irqrestore(&d->lock, flags);
+}
+
+void block_reset_stats(int dev) {
+    if (dev < 0 || dev >= device_count) {
+        return;
+    }
+    BlockDevice* d = &devices[dev];
+    uint64_t flags = ticket_lock_irqsave(&d->lock);
+    uint32_t queued = d->stats.queued;
+    uint32_t in_flight = d->stats.in_flight;
+    memset(&d->stats, 0, sizeof(BlockStats));
+    d->stats.queued = queued;
+    d->stats.in_flight = in_flight;
+    d->stats.max_queue_depth = queued + in_flight;
+    ticket_unlock_irqrestore(&d->lock, flags);
+}
+
+static void fifo_remove(BlockFifo* fifo, BlockRequest* rq) {
+    if (rq->fifo_prev) {
+        rq->fifo_prev->fifo_next = rq->fifo_next;
+    } else {
+        fifo->head = rq->fifo_next;
+    }
+    if (rq->fifo_next) {
+        rq->fifo_next->fifo_prev = rq->fifo_prev;
+    } else {
+        fifo->tail = rq->fifo_prev;
+    }
+}
+
+// Insert before pos, at the tail if pos is NULL
+static void fifo_insert(BlockFifo* fifo, BlockRequest* rq, BlockRequest* pos) {
+    rq->fifo_next = pos;
+    rq->fifo_prev = pos ? pos->fifo_prev : fifo->tail;
+    if (rq->fifo_prev) {
+        rq->fifo_prev->fifo_next = rq;
+    } else {
+        fifo->head = rq;
+    }
+    if (pos) {
+        pos->fifo_prev = rq;
+    } else {
+        fifo->tail = rq;
+    }
+}
+
+static void sort_remove(BlockDevice* dev, BlockRequest* rq) {
+    if (rq->sort_prev) {
+        rq->sort_prev->sort_next = rq->sort_next;
+    } else {
+        dev->sorted = rq->sort_next;
+    }
+    if (rq->sort_next) {
+        rq->sort_next->sort_prev = rq->sort_prev;
+    }
+}
+
+static int fifo_index(DiskOp op) {
+    return op == DISK_READ ? FIFO_READ : op == DISK_WRITE ? FIFO_WRITE : FIFO_FLUSH;
+}
+
+static int bio_fits(BlockDevice* dev, BlockRequest* rq, Bio* bio) {
+    return rq->op == bio->op && rq->bio_count < DISK_MAX_SEGMENTS &&
+           rq->count + bio->count <= dev->info.max_sectors;
+}
+
+// Queue a bio, merging it into a request next to it. -1 if there is no
+// memory for a new request. Lock held.
+static int elevator_add(BlockDevice* dev, Bio* bio) {
+    dev->stats.bios++;
+
+    if (bio->op == DISK_FLUSH) {
+        dev->stats.flushes++;
+    } else {
+        // Last request starting at or before the bio, and the one after it
+        BlockRequest* prev = NULL;
+        BlockRequest* next = dev->sorted;
+        while (next && next->sector <= bio->sector) {
+            prev = next;
+            next = next->sort_next;
+        }
+
+        if (prev && prev->sector + prev->count == bio->sector && bio_fits(dev, prev, bio)) {
+            prev->bios_tail->next = bio;
+            prev->bios_tail = bio;
+            prev->bio_count++;
+            prev->count += bio->count;
+            dev->stats.back_merges++;
+
+            // The bio may have closed the gap to the next request
+            if (next && prev->sector + prev->count == next->sector && next->op == prev->op &&
+                prev->bio_count + next->bio_count <= DISK_MAX_SEGMENTS &&
+                prev->count + next->count <= dev->info.max_sectors) {
+                BlockFifo* fifo = &dev->fifo[fifo_index(prev->op)];
+                if (next->deadline < prev->deadline) {
+                    prev->deadline = next->deadline;
+                    fifo_remove(fifo, prev);
+                    fifo_insert(fifo, prev, next);
+                }
+                fifo_remove(fifo, next);
+                sort_remove(dev, next);
+
+                prev->bios_tail->next = next->bios;
+                prev->bios_tail = next->bios_tail;
+                prev->bio_count += next->bio_count;
+                prev->count += next->count;
+                dev->stats.queued--;
+                kmem_cache_free(request_cache, next);
+            }
+            return 0;
+        }
+
+        if (next && bio->sector + bio->count == next->sector && bio_fits(dev, next, bio)) {
+            bio->next = next->bios;
+            next->bios = bio;
+            next->bio_count++;
+            next->sector = bio->sector;
+            next->count += bio->count;
+            dev->stats.front_merges++;
+            return 0;
+        }
+    }
+
+    BlockRequest* rq = (BlockRequest*)kmem_cache_alloc(request_cache);
+    if (!rq) {
+        return -1;
+    }
+    memset(rq, 0, sizeof(BlockRequest));
+    rq->dev = dev;
+    rq->op = bio->op;
+    rq->sector = bio->sector;
+    rq->count = bio->count;
+    rq->bios = bio;
+    rq->bios_tail = bio;
+    rq->bio_count = 1;
+    rq->deadline = bio->submit_ns + (uint64_t)(bio->op == DISK_READ ? BLOCK_READ_DEADLINE_MS
+                                                                    : BLOCK_WRITE_DEADLINE_MS) * 1000000;
+
+    if (bio->op != DISK_FLUSH) {
+        BlockRequest* prev = NULL;
+        BlockRequest* next = dev->sorted;
+        while (next && next->sector <= bio->sector) {
+            prev = next;
+            next = next->sort_next;
+        }
+        rq->sort_prev = prev;
+        rq->sort_next = next;
+        if (prev) {
+            prev->sort_next = rq;
+        } else {
+            dev->sorted = rq;
+        }
+        if (next) {
+            next->sort_prev = rq;
+        }
+    }
+    fifo_insert(&dev->fifo[fifo_index(bio->op)], rq, NULL);
+
+    dev->stats.queued++;
+    uint32_t depth = dev->stats.queued + dev->stats.in_flight;
+    if (depth > dev->stats.max_queue_depth) {
+        dev->stats.max_queue_depth = depth;
+    }
+    return 0;
+}
+
+// Request to dispatch next: flushes, then expired requests (reads
+// first), otherwise the next one upwards from the head. Lock held.
+static BlockRequest* elevator_next(BlockDevice* dev, uint64_t now) {
+    if (dev->fifo[FIFO_FLUSH].head) {
+        return dev->fifo[FIFO_FLUSH].head;
+    }
+    for (int i = FIFO_READ; i <= FIFO_WRITE; i++) {
+        BlockRequest* rq = dev->fifo[i].head;
+        if (rq && rq->deadline <= now) {
+            dev->stats.expired++;
+            return rq;
+        }
+    }
+
+    BlockRequest* rq = dev->sorted;
+    while (rq && rq->sector < dev->head_sector) {
+        rq = rq->sort_next;
+    }
+    return rq ? rq : dev->sorted;
+}
+
+static void request_done(DiskRequest* disk);
+
+// Turn the bios into the driver request, contiguous buffers become one piece
+static void request_prepare(BlockDevice* dev, BlockRequest* rq) {
+    DiskRequest* disk = &rq->disk;
+    memset(disk, 0, sizeof(DiskRequest));
+    disk->drive = dev->info.drive;
+    disk->op = rq->op;
+    disk->lba = rq->sector;
+    disk->count = rq->count;
+    disk->done = request_done;
+    disk->private = rq;
+
+    uint32_t pieces = 0;
+    for (Bio* bio = rq->bios; bio && rq->op != DISK_FLUSH; bio = bio->next) {
+        DiskSegment* last = pieces ? &rq->segments[pieces - 1] : NULL;
+        if (last && (uint8_t*)last->buffer + last->count * DISK_SECTOR_SIZE == bio->buffer) {
+            last->count += bio->count;
+        } else {
+            rq->segments[pieces].buffer = bio->buffer;
+            rq->segments[pieces].count = bio->count;
+            pieces++;
+        }
+    }
+
+    if (pieces == 1) {
+        disk->buffer = rq->segments[0].buffer;
+    } else if (pieces > 1) {
+        disk->segments = rq->segments;
+        disk->segment_count = pieces;
+    }
+}
+
+// Finish one bio. It may be gone once its status is set.
+static void bio_end(Bio* bio, int status) {
+    void (*done)(Bio*) = bio->done;
+    __atomic_store_n(&bio->status, status, __ATOMIC_RELEASE);
+    if (done) {
+        done(bio);
+    }
+}
+
+static void request_complete(BlockDevice* dev, BlockRequest* rq, int status) {
+    uint64_t now = ktime_ns();
+
+    uint64_t flags = ticket_lock_irqsave(&dev->lock);
+    dev->stats.in_flight--;
+    dev->stats.completed += rq->bio_count;
+    if (status != 0) {
+        dev->stats.errors++;
+    } else if (rq->op == DISK_READ) {
+        dev->stats.sectors_read += rq->count;
+    } else if (rq->op == DISK_WRITE) {
+        dev->stats.sectors_written += rq->count;
+    }
+    for (Bio* bio = rq->bios; bio; bio = bio->next) {
+        uint64_t us = (now - bio->submit_ns) / 1000;
+        int bucket = 0;
+        while (bucket < BLOCK_LATENCY_BUCKETS - 1 && us >= (1ull << bucket)) {
+            bucket++;
+        }
+        dev->stats.latency[bucket]++;
+        dev->stats.latency_total_us += us;
+    }
+    ticket_unlock_irqrestore(&dev->lock, flags);
+
+    Bio* bio = rq->bios;
+    while (bio) {
+        Bio* next = bio->next;
+        bio_end(bio, status);
+        bio = next;
+    }
+    kmem_cache_free(request_cache, rq);
+    wait_queue_wake_all(&dev->waiters);
+}
+
+// Hand requests to the driver until it has depth of them in flight.
+// The driver is called without the lock, in one batch.
+static void block_dispatch(BlockDevice* dev) {
+    for (;;) {
+        DiskRequest* batch[BLOCK_MAX_DEPTH];
+        int count = 0;
+        uint64_t now = ktime_ns();
+
+        uint64_t flags = ticket_lock_irqsave(&dev->lock);
+        while (dev->stats.in_flight < dev->info.depth) {
+            BlockRequest* rq = elevator_next(dev, now);
+            if (!rq) {
+                break;
+            }
+            fifo_remove(&dev->fifo[fifo_index(rq->op)], rq);
+            if (rq->op != DISK_FLUSH) {
+                sort_remove(dev, rq);
+                dev->head_sector = rq->sector + rq->count;
+            }
+            request_prepare(dev, rq);
+            dev->stats.queued--;
+            dev->stats.in_flight++;
+            dev->stats.requests++;
+            batch[count++] = &rq->disk;
+        }
+        ticket_unlock_irqrestore(&dev->lock, flags);
+
+        if (!count || dev->driver->submit_batch(batch, count) == 0) {
+            return;
+        }
+        for (int i = 0; i < count; i++) {
+            request_complete(dev, (BlockRequest*)batch[i]->private, -1);
+        }
+    }
+}
+
+// Completion from the driver, usually in its interrupt handler
+static void request_done(DiskRequest* disk) {
+    BlockRequest* rq = (BlockRequest*)disk->private;
+    BlockDevice* dev = rq->dev;
+    request_complete(dev, rq, disk->status);
+    block_dispatch(dev);
+}
+
+static int bio_valid(const Bio* bio) {
+    if (bio->dev < 0 || bio->dev >= device_count) {
+        return 0;
+    }
+    if (bio->op == DISK_FLUSH) {
+        return 1;
+    }
+    const BlockDeviceInfo* info = &devices[bio->dev].info;
+    return bio->count && bio->count <= info->max_sectors && bio->buffer &&
+           bio->sector + bio->count <= info->sectors;
+}
+
+// Queue the plugged bios, then let each device they went to dispatch
+static void plug_flush(BlockPlug* plug) {
+    Bio* bio = plug->head;
+    plug->head = NULL;
+    plug->tail = NULL;
+    plug->count = 0;
+
+    uint32_t touched = 0;
+    while (bio) {
+        Bio* next = bio->next;
+        BlockDevice* dev = &devices[bio->dev];
+        bio->next = NULL;
+
+        uint64_t flags = ticket_lock_irqsave(&dev->lock);
+        int queued = elevator_add(dev, bio);
+        ticket_unlock_irqrestore(&dev->lock, flags);
+
+        if (queued == 0) {
+            touched |= 1u << bio->dev;
+        } else {
+            bio_end(bio, -1);
+            wait_queue_wake_all(&dev->waiters);
+        }
+        bio = next;
+    }
+
+    for (int i = 0; i < device_count; i++) {
+        if (touched & (1u << i)) {
+            block_dispatch(&devices[i]);
+        }
+    }
+}
+
+int block_submit(Bio* bio) {
+    if (!bio_valid(bio)) {
+        return -1;
+    }
+    if (bio->op == DISK_FLUSH) {
+        bio->count = 0;
+    }
+    bio->status = DISK_PENDING;
+    bio->next = NULL;
+    bio->submit_ns = ktime_ns();
+
+    BlockPlug* plug = (BlockPlug*)thread_current()->plug;
+    if (plug && irqs_enabled()) {
+        if (plug->tail) {
+            plug->tail->next = bio;
+        } else {
+            plug->head = bio;
+        }
+        plug->tail = bio;
+        if (++plug->count >= BLOCK_PLUG_MAX) {
+            plug_flush(plug);
+        }
+        return 0;
+    }
+
+    BlockDevice* dev = &devices[bio->dev];
+    uint64_t flags = ticket_lock_irqsave(&dev->lock);
+    int queued = elevator_add(dev, bio);
+    ticket_unlock_irqrestore(&dev->lock, flags);
+    if (queued != 0) {
+        return -1;
+    }
+
+    block_dispatch(dev);
+    return 0;
+}
+
+void block_flush_plug(void) {
+    BlockPlug* plug = (BlockPlug*)thread_current()->plug;
+    if (plug && plug->head) {
+        plug_flush(plug);
+    }
+}
+
+int block_wait(Bio* bio) {
+    block_flush_plug();
+
+    BlockDevice* dev = &devices[bio->dev];
+    uint64_t flags = irq_save();
+    while (__atomic_load_n(&bio->status, __ATOMIC_ACQUIRE) == DISK_PENDING) {
+        wait_queue_sleep(&dev->waiters);
+    }
+    irq_restore(flags);
+    return bio->status;
+}
+
+void block_start_plug(BlockPlug* plug) {
+    plug->head = NULL;
+    plug->tail = NULL;
+    plug->count = 0;
+    plug->active = 0;
+
+    Thread* thread = thread_current();
+    if (!thread->plug) {
+        thread->plug = plug;
+        plug->active = 1;
+    }
+}
+
+void block_finish_plug(BlockPlug* plug) {
+    if (!plug->active) {
+        return;
+    }
+    plug_flush(plug);
+    thread_current()->plug = NULL;
+    plug->active = 0;
+}
+
+static int block_transfer(int dev, DiskOp op, uint64_t sector, uint32_t count, void* buffer) {
+    if (dev < 0 || dev >= device_count) {
+        return -1;
+    }
+    uint32_t max = devices[dev].info.max_sectors;
+
+    while (count) {
+        uint32_t chunk = count < max ? count : max;
+        Bio bio = {
+            .dev = dev,
+            .op = op,
+            .sector = sector,
+            .count = chunk,
+            .buffer = buffer,
+        };
+        if (block_submit(&bio) != 0 || block_wait(&bio) != 0) {
+            return -1;
+        }
+        sector += chunk;
+        count -= chunk;
+        buffer = (uint8_t*)buffer + (uint64_t)chunk * DISK_SECTOR_SIZE;
+    }
+    return 0;
+}
+
+int block_read(int dev, uint64_t sector, uint32_t count, void* buffer) {
+    return block_transfer(dev, DISK_READ, sector, count, buffer);
+}
+
+int block_write(int dev, uint64_t sector, uint32_t count, const void* buffer) {
+    return block_transfer(dev, DISK_WRITE, sector, count, (void*)buffer);
+}
+
+int block_flush(int dev) {
+    Bio bio = {
+        .dev = dev,
+        .op = DISK_FLUSH,
+    };
+    if (block_submit(&bio) != 0) {
+        return -1;
+    }
+    return block_wait(&bio);
+}
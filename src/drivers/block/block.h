@@ -0,0 +1,124 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include <stdint.h>
+#include "../disk/disk_driver.h"
+
+// Block layer between filesystems and the disk drivers. Callers submit
+// bios (one contiguous sector range each); they queue per device, bios
+// next to each other merge into one driver request, and a deadline
+// elevator picks what goes to the driver next: expired requests first
+// (reads sooner than writes), otherwise in ascending sector order from
+// where the disk head is. A thread can plug its submissions so a burst
+// reaches the queues - and merges - in one go.
+
+#define BLOCK_MAX_DEVICES      8
+#define BLOCK_NAME_LENGTH      8
+
+// Requests handed to a driver at once per device
+#define BLOCK_MAX_DEPTH        32
+
+#define BLOCK_READ_DEADLINE_MS  100
+#define BLOCK_WRITE_DEADLINE_MS 1000
+
+// Bios a plug collects before it submits them anyway
+#define BLOCK_PLUG_MAX         32
+
+// Latency histogram, bucket n counts bios that took under 2^n us
+#define BLOCK_LATENCY_BUCKETS  16
+
+// How the driver of a device takes requests. submit_batch() gets
+// requests for the device's drive number; 0 if all are queued, -1 if
+// none is. Completions arrive through DiskRequest.done.
+typedef struct {
+    const char* name;
+    int (*submit_batch)(DiskRequest** reqs, int count);
+} BlockDriver;
+
+typedef struct Bio {
+    int dev;
+    DiskOp op;
+    uint64_t sector;
+    uint32_t count;                  // sectors, at most the device's max_sectors
+    void* buffer;
+
+    // 0 when done, -1 on an error. Set right before done() is called,
+    // the block layer doesn't touch the bio afterwards.
+    volatile int status;
+    void (*done)(struct Bio* bio);
+    void* private;
+
+    // Owned by the block layer while the bio is pending
+    struct Bio* next;
+    uint64_t submit_ns;
+} Bio;
+
+// Bios collected by block_start_plug(), lives on the caller's stack
+typedef struct {
+    Bio* head;
+    Bio* tail;
+    uint32_t count;
+    int active;
+} BlockPlug;
+
+typedef struct {
+    char name[BLOCK_NAME_LENGTH];
+    const char* driver;
+    int drive;                       // number within the driver
+    uint64_t sectors;
+    uint32_t max_sectors;            // per request
+    uint32_t depth;                  // requests in flight at the driver
+} BlockDeviceInfo;
+
+typedef struct {
+    uint64_t bios;
+    uint64_t requests;               // handed to the driver
+    uint64_t back_merges;            // bios appended to a queued request
+    uint64_t front_merges;
+    uint64_t sectors_read;
+    uint64_t sectors_written;
+    uint64_t flushes;
+    uint64_t completed;              // bios
+    uint64_t expired;                // requests dispatched for their deadline
+    uint64_t errors;
+    uint32_t queued;                 // requests waiting in the elevator
+    uint32_t in_flight;
+    uint32_t max_queue_depth;        // queued plus in flight
+    uint64_t latency_total_us;
+    uint64_t latency[BLOCK_LATENCY_BUCKETS];
+} BlockStats;
+
+// Add a device, drivers call this from their init. Returns its number.
+int block_register(const char* name, const BlockDriver* driver, int drive,
+                   uint64_t sectors, uint32_t max_sectors, uint32_t depth);
+
+int block_count(void);
+int block_find(const char* name);    // -1 if there is no such device
+int block_get_info(int dev, BlockDeviceInfo* info);
+void block_get_stats(int dev, BlockStats* stats);
+void block_reset_stats(int dev);
+
+// Queue a bio, -1 if it is invalid (no callback then). The bio and its
+// buffer must stay valid until it is done. A flush bio (no data) makes
+// the writes completed before it durable.
+int block_submit(Bio* bio);
+
+// Sleep until a submitted bio is done, returns its status. Submits the
+// thread's plugged bios first.
+int block_wait(Bio* bio);
+
+// Collect the thread's bios until block_finish_plug(). A plug inside
+// another one does nothing. Interrupt handlers never plug.
+void block_start_plug(BlockPlug* plug);
+void block_finish_plug(BlockPlug* plug);
+
+// Submit what the thread's plug collected so far, for code that waits
+// for bios on its own
+void block_flush_plug(void);
+
+// Submit and wait, 0 on success
+int block_read(int dev, uint64_t sector, uint32_t count, void* buffer);
+int block_write(int dev, uint64_t sector, uint32_t count, const void* buffer);
+int block_flush(int dev);
+
+#endif
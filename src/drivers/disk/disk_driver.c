@@ -0,0 +1,759 @@
+#include "disk_driver.h"
+#include "../pci/pci.h"
+#include "../block/block.h"
+#include "../../include/io.h"
+#include "../../include/memory/memory.h"
+#include "../../include/memory/paging.h"
+#include "../../include/memory/pmm.h"
+#include "../../kernel/idt.h"
+#include "../../kernel/sched.h"
+#include "../../kernel/lock.h"
+#include "../../kernel/time.h"
+#include <stddef.h>
+
+#define ATA_SR_ERR   0x01
+#define ATA_SR_DRQ   0x08
+#define ATA_SR_DF    0x20
+#define ATA_SR_BSY   0x80
+
+#define ATA_CTRL_NIEN 0x02           // no interrupts
+#define ATA_CTRL_SRST 0x04           // software reset of both drives
+
+#define ATA_CMD_READ_PIO       0x20
+#define ATA_CMD_READ_PIO_EXT   0x24
+#define ATA_CMD_READ_DMA       0xC8
+#define ATA_CMD_READ_DMA_EXT   0x25
+#define ATA_CMD_WRITE_PIO      0x30
+#define ATA_CMD_WRITE_PIO_EXT  0x34
+#define ATA_CMD_WRITE_DMA      0xCA
+#define ATA_CMD_WRITE_DMA_EXT  0x35
+#define ATA_CMD_FLUSH          0xE7
+#define ATA_CMD_FLUSH_EXT      0xEA
+#define ATA_CMD_IDENTIFY       0xEC
+
+#define BM_CMD_START  0x01
+#define BM_CMD_READ   0x08           // device to memory
+#define BM_SR_ERR     0x02
+#define BM_SR_IRQ     0x04
+
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_IDE  0x01
+#define PCI_IDE_PRIMARY_NATIVE    0x01
+#define PCI_IDE_SECONDARY_NATIVE  0x04
+
+// Status polls before a drive counts as dead
+#define ATA_TIMEOUT   1000000
+
+#define LBA28_LIMIT   (1ULL << 28)
+
+// Physical region descriptor: one piece of the buffer, may not cross a
+// 64KB boundary. A byte count of 0 means 64KB.
+typedef struct {
+    uint32_t phys;
+    uint16_t bytes;
+    uint16_t flags;
+} __attribute__((packed)) PrdEntry;
+
+#define PRD_EOT      0x8000
+#define PRD_ENTRIES  256             // one 2KB table per channel, never crosses 64KB
+
+_Static_assert(PRD_ENTRIES >= DISK_MAX_TRANSFER * DISK_SECTOR_SIZE / PAGE_SIZE + DISK_MAX_SEGMENTS,
+               "a transfer must fit the PRD table one page per entry");
+
+typedef struct {
+    uint16_t io;
+    uint16_t ctrl;
+    uint16_t bmide;                  // 0 without bus-master DMA
+    uint8_t irq;
+    int selected;                    // drive register contents, -1 unknown
+
+    TicketLock lock;
+    DiskRequest* head;               // in flight once busy is set
+    DiskRequest* tail;
+    WaitQueue waiters;
+
+    // The command in flight
+    int busy;
+    int dma;
+    uint32_t chunk;                  // sectors it moves
+    uint32_t left;                   // PIO: sectors still to move
+    uint32_t pio_sector;             // PIO: next sector of the request
+
+    PrdEntry* prdt;
+    uint32_t prdt_phys;
+} AtaChannel;
+
+typedef struct {
+    AtaChannel* channel;
+    int slave;
+    DiskDriveInfo info;
+    DiskStats stats;
+} AtaDrive;
+
+static LockStats channel_lock_stats[2] = {
+    LOCK_STATS_INIT("ata0"),
+    LOCK_STATS_INIT("ata1"),
+};
+
+static AtaChannel channels[2];
+static AtaDrive drives[DISK_MAX_DRIVES];
+static int drive_count = 0;
+static int boot_drive = -1;
+static DiskInfo boot_info;
+
+static int disk_submit_batch(DiskRequest** reqs, int count);
+
+static const BlockDriver ata_block_driver = {
+    .name = "ata",
+    .submit_batch = disk_submit_batch,
+};
+
+static void ata_irq(InterruptFrame* frame);
+
+static inline uint8_t ata_status(AtaChannel* ch) {
+    return inb(ch->io + ATA_REG_STATUS);
+}
+
+// The alternate status doesn't acknowledge the interrupt
+static inline uint8_t ata_alt_status(AtaChannel* ch) {
+    return inb(ch->ctrl);
+}
+
+// 400ns for the drive to put its status out, four alternate status reads
+static void ata_delay(AtaChannel* ch) {
+    for (int i = 0; i < 4; i++) {
+        ata_alt_status(ch);
+    }
+}
+
+static int ata_wait_idle(AtaChannel* ch) {
+    for (int i = 0; i < ATA_TIMEOUT; i++) {
+        uint8_t status = ata_alt_status(ch);
+        if (!(status & ATA_SR_BSY)) {
+            return status;
+        }
+    }
+    return -1;
+}
+
+static int ata_wait_drq(AtaChannel* ch) {
+    for (int i = 0; i < ATA_TIMEOUT; i++) {
+        uint8_t status = ata_alt_status(ch);
+        if (status & (ATA_SR_ERR | ATA_SR_DF)) {
+            return -1;
+        }
+        if (!(status & ATA_SR_BSY) && (status & ATA_SR_DRQ)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Software reset, for a drive that stopped answering in the middle of
+// a command. Both drives of the channel go back to idle.
+static void ata_reset(AtaChannel* ch) {
+    outb(ch->ctrl, ATA_CTRL_SRST | ATA_CTRL_NIEN);
+    udelay(5);
+    outb(ch->ctrl, 0);
+    ata_delay(ch);
+    ata_wait_idle(ch);
+    ata_status(ch);
+    ch->selected = -1;
+}
+
+// Write the drive register; only switching drives needs the delay
+static void ata_select(AtaChannel* ch, int slave, uint8_t value) {
+    outb(ch->io + ATA_REG_DRIVE, value | (slave << 4));
+    if (ch->selected != slave) {
+        ata_delay(ch);
+        ch->selected = slave;
+    }
+}
+
+// Load the taskfile and send cmd. LBA48 writes the high bytes first.
+static void ata_command(AtaChannel* ch, int slave, uint8_t cmd, uint64_t lba, uint32_t count, int ext) {
+    if (ext) {
+        ata_select(ch, slave, 0x40);
+        outb(ch->io + ATA_REG_COUNT, (uint8_t)(count >> 8));
+        outb(ch->io + ATA_REG_LBA0, (uint8_t)(lba >> 24));
+        outb(ch->io + ATA_REG_LBA1, (uint8_t)(lba >> 32));
+        outb(ch->io + ATA_REG_LBA2, (uint8_t)(lba >> 40));
+    } else {
+        ata_select(ch, slave, 0xE0 | ((lba >> 24) & 0x0F));
+    }
+    outb(ch->io + ATA_REG_COUNT, (uint8_t)count);
+    outb(ch->io + ATA_REG_LBA0, (uint8_t)lba);
+    outb(ch->io + ATA_REG_LBA1, (uint8_t)(lba >> 8));
+    outb(ch->io + ATA_REG_LBA2, (uint8_t)(lba >> 16));
+    outb(ch->io + ATA_REG_STATUS, cmd);
+}
+
+// Words of IDENTIFY data hold their two characters swapped
+static void ata_copy_model(char* out, const uint16_t* words) {
+    for (int i = 0; i < 20; i++) {
+        out[i * 2] = (char)(words[i] >> 8);
+        out[i * 2 + 1] = (char)words[i];
+    }
+    int len = 40;
+    while (len > 0 && out[len - 1] == ' ') {
+        len--;
+    }
+    out[len] = '\0';
+}
+
+// Polled, runs before the IRQ is taken
+static int ata_identify(AtaDrive* drive) {
+    AtaChannel* ch = drive->channel;
+    uint16_t id[256];
+
+    ata_select(ch, drive->slave, 0xA0);
+    outb(ch->io + ATA_REG_COUNT, 0);
+    outb(ch->io + ATA_REG_LBA0, 0);
+    outb(ch->io + ATA_REG_LBA1, 0);
+    outb(ch->io + ATA_REG_LBA2, 0);
+    outb(ch->io + ATA_REG_STATUS, ATA_CMD_IDENTIFY);
+    ata_delay(ch);
+
+    // Nothing on the bus reads as 0 or floating 0xFF
+    uint8_t status = ata_alt_status(ch);
+    if (status == 0 || status == 0xFF || ata_wait_idle(ch) < 0) {
+        return -1;
+    }
+
+    // ATAPI and SATA bridges put a signature here, they need other commands
+    if (inb(ch->io + ATA_REG_LBA1) || inb(ch->io + ATA_REG_LBA2)) {
+        return -1;
+    }
+    if (ata_wait_drq(ch) < 0) {
+        return -1;
+    }
+    insw(ch->io + ATA_REG_DATA, id, 256);
+    ata_status(ch);
+
+    DiskDriveInfo* info = &drive->info;
+    info->lba48 = (id[83] & (1 << 10)) != 0;
+    if (info->lba48) {
+        info->sectors = (uint64_t)id[100] | ((uint64_t)id[101] << 16) |
+                        ((uint64_t)id[102] << 32) | ((uint64_t)id[103] << 48);
+    } else {
+        info->sectors = (uint64_t)id[60] | ((uint64_t)id[61] << 16);
+    }
+    info->dma = ch->bmide && (id[49] & (1 << 8));
+    ata_copy_model(info->model, &id[27]);
+    info->present = 1;
+    return 0;
+}
+
+// Append the physical pieces of a virtual range to the PRD table
+static int prdt_add(AtaChannel* ch, int* count, uint64_t virt, uint32_t bytes) {
+    while (bytes) {
+        uint64_t phys = paging_get_phys(virt);
+        uint32_t len = PAGE_SIZE - (virt & (PAGE_SIZE - 1));
+        if (len > bytes) {
+            len = bytes;
+        }
+        if (!phys || phys + len > 0x100000000ULL) {
+            return -1;
+        }
+
+        // Extend the last entry while memory is contiguous within 64KB
+        PrdEntry* last = *count ? &ch->prdt[*count - 1] : NULL;
+        uint32_t last_bytes = last ? (last->bytes ? last->bytes : 0x10000) : 0;
+        if (last && last->phys + last_bytes == phys &&
+            (last->phys >> 16) == ((phys + len - 1) >> 16) && last_bytes + len < 0x10000) {
+            last->bytes = (uint16_t)(last_bytes + len);
+        } else {
+            if (*count == PRD_ENTRIES) {
+                return -1;
+            }
+            ch->prdt[*count].phys = (uint32_t)phys;
+            ch->prdt[*count].bytes = (uint16_t)len;
+            ch->prdt[*count].flags = 0;
+            (*count)++;
+        }
+
+        virt += len;
+        bytes -= len;
+    }
+    return 0;
+}
+
+// Describe sectors [first, first + sectors) of req in the PRD table, 0
+// if DMA can reach every byte of them
+static int ata_build_prdt(AtaChannel* ch, const DiskRequest* req, uint32_t first, uint32_t sectors) {
+    int count = 0;
+    while (sectors) {
+        uint32_t run;
+        uint64_t virt = (uint64_t)disk_request_data(req, first, &run);
+        if (run > sectors) {
+            run = sectors;
+        }
+        if ((virt & 1) || prdt_add(ch, &count, virt, run * DISK_SECTOR_SIZE) != 0) {
+            return -1;
+        }
+        first += run;
+        sectors -= run;
+    }
+
+    ch->prdt[count - 1].flags = PRD_EOT;
+    return 0;
+}
+
+static AtaDrive* request_drive(const DiskRequest* req) {
+    return &drives[req->drive];
+}
+
+// Send the command for the next chunk of req, which heads the queue.
+// -1 if the drive never asked for the first sector of a PIO write.
+static int ata_issue(AtaChannel* ch, DiskRequest* req) {
+    AtaDrive* drive = request_drive(req);
+    uint64_t lba = req->lba + req->progress;
+    uint32_t chunk = req->count - req->progress;
+    uint32_t max = drive->info.lba48 ? DISK_MAX_TRANSFER : 256;
+    if (chunk > max) {
+        chunk = max;
+    }
+
+    int ext = lba + chunk > LBA28_LIMIT || chunk > 256;
+    ch->busy = 1;
+    ch->chunk = chunk;
+
+    if (req->op == DISK_FLUSH) {
+        ch->dma = 0;
+        ch->left = 0;
+        ata_command(ch, drive->slave, drive->info.lba48 ? ATA_CMD_FLUSH_EXT : ATA_CMD_FLUSH, 0, 0, 0);
+        return 0;
+    }
+
+    int write = req->op == DISK_WRITE;
+    ch->dma = drive->info.dma && !(req->flags & DISK_REQ_PIO) &&
+              ata_build_prdt(ch, req, req->progress, chunk) == 0;
+
+    if (ch->dma) {
+        drive->stats.dma_commands++;
+        outb(ch->bmide + BM_REG_COMMAND, 0);
+        outl(ch->bmide + BM_REG_PRDT, ch->prdt_phys);
+        outb(ch->bmide + BM_REG_STATUS, inb(ch->bmide + BM_REG_STATUS) | BM_SR_ERR | BM_SR_IRQ);
+
+        uint8_t cmd = write ? (ext ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA)
+                            : (ext ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA);
+        ata_command(ch, drive->slave, cmd, lba, chunk, ext);
+        outb(ch->bmide + BM_REG_COMMAND, BM_CMD_START | (write ? 0 : BM_CMD_READ));
+        return 0;
+    }
+
+    drive->stats.pio_commands++;
+    ch->pio_sector = req->progress;
+    ch->left = chunk;
+
+    uint8_t cmd = write ? (ext ? ATA_CMD_WRITE_PIO_EXT : ATA_CMD_WRITE_PIO)
+                        : (ext ? ATA_CMD_READ_PIO_EXT : ATA_CMD_READ_PIO);
+    ata_command(ch, drive->slave, cmd, lba, chunk, ext);
+
+    // A PIO write interrupts after each sector but the first, which the
+    // drive asks for right away
+    if (write) {
+        if (ata_wait_drq(ch) < 0) {
+            return -1;
+        }
+        outsw(ch->io + ATA_REG_DATA, disk_request_data(req, ch->pio_sector++, NULL), DISK_SECTOR_SIZE / 2);
+        ch->left--;
+    }
+    return 0;
+}
+
+// The command in flight has ended (result 0) or failed (-1). Returns
+// the request if it is complete now, after taking it off the queue.
+static DiskRequest* ata_chunk_done(AtaChannel* ch, int result) {
+    DiskRequest* req = ch->head;
+    AtaDrive* drive = request_drive(req);
+    ch->busy = 0;
+
+    if (result < 0) {
+        drive->stats.errors++;
+        if (ch->dma) {
+            // Give it another go without DMA before failing the request
+            req->flags |= DISK_REQ_PIO;
+            return NULL;
+        }
+    } else {
+        req->progress += ch->chunk;
+        if (req->op == DISK_READ) {
+            drive->stats.sectors_read += ch->chunk;
+        } else if (req->op == DISK_WRITE) {
+            drive->stats.sectors_written += ch->chunk;
+        }
+        if (req->op != DISK_FLUSH && req->progress < req->count) {
+            return NULL;
+        }
+    }
+
+    ch->head = req->next;
+    if (!ch->head) {
+        ch->tail = NULL;
+    }
+    req->next = NULL;
+    req->error = result < 0;
+    drive->stats.queue_depth--;
+    return req;
+}
+
+// Issue the command for the next chunk of the request at the head of
+// the queue. Channel lock held. Returns the requests that failed before
+// their command got going, linked through next, for the caller to
+// complete once the lock is dropped.
+static DiskRequest* ata_start(AtaChannel* ch) {
+    DiskRequest* failed = NULL;
+    DiskRequest** failed_tail = &failed;
+
+    while (!ch->busy && ch->head) {
+        DiskRequest* req = ch->head;
+        if (ata_issue(ch, req) == 0) {
+            break;
+        }
+
+        // No interrupt comes for a command the drive never took up
+        ata_reset(ch);
+        DiskRequest* done = ata_chunk_done(ch, -1);
+        if (done) {
+            *failed_tail = done;
+            failed_tail = &done->next;
+        }
+    }
+    return failed;
+}
+
+// Publish the result of finished requests (linked through next) and
+// wake their waiters. Channel lock not held.
+static void ata_complete(AtaChannel* ch, DiskRequest* done) {
+    if (!done) {
+        return;
+    }
+    while (done) {
+        DiskRequest* next = done->next;
+        void (*callback)(DiskRequest*) = done->done;
+        __atomic_store_n(&done->status, done->error ? -1 : 0, __ATOMIC_RELEASE);
+        if (callback) {
+            callback(done);
+        }
+        done = next;
+    }
+    wait_queue_wake_all(&ch->waiters);
+}
+
+// Handle an interrupt for the command in flight: 1 if it ended (the
+// result goes to *result), 0 if more PIO sectors are to come, -1 if
+// the interrupt wasn't ours
+static int ata_service(AtaChannel* ch, int* result) {
+    if (ch->dma) {
+        uint8_t bm_status = inb(ch->bmide + BM_REG_STATUS);
+        if (!(bm_status & BM_SR_IRQ)) {
+            return -1;
+        }
+        outb(ch->bmide + BM_REG_COMMAND, 0);
+        uint8_t status = ata_status(ch);
+        outb(ch->bmide + BM_REG_STATUS, bm_status | BM_SR_ERR | BM_SR_IRQ);
+
+        *result = (bm_status & BM_SR_ERR) || (status & (ATA_SR_ERR | ATA_SR_DF)) ? -1 : 0;
+        return 1;
+    }
+
+    uint8_t status = ata_status(ch);
+    if (status & ATA_SR_BSY) {
+        return -1;
+    }
+    if (status & (ATA_SR_ERR | ATA_SR_DF)) {
+        *result = -1;
+        return 1;
+    }
+
+    DiskRequest* req = ch->head;
+    if (req->op == DISK_READ && ch->left) {
+        if (!(status & ATA_SR_DRQ)) {
+            *result = -1;
+            return 1;
+        }
+        insw(ch->io + ATA_REG_DATA, disk_request_data(req, ch->pio_sector++, NULL), DISK_SECTOR_SIZE / 2);
+        ch->left--;
+    } else if (req->op == DISK_WRITE && ch->left) {
+        if (!(status & ATA_SR_DRQ)) {
+            *result = -1;
+            return 1;
+        }
+        outsw(ch->io + ATA_REG_DATA, disk_request_data(req, ch->pio_sector++, NULL), DISK_SECTOR_SIZE / 2);
+        ch->left--;
+        return 0;
+    }
+
+    if (ch->left) {
+        return 0;
+    }
+    *result = 0;
+    return 1;
+}
+
+static void ata_channel_irq(AtaChannel* ch) {
+    ticket_lock(&ch->lock);
+
+    if (!ch->busy) {
+        // Nothing in flight, just acknowledge the drive
+        ata_status(ch);
+        ticket_unlock(&ch->lock);
+        return;
+    }
+
+    request_drive(ch->head)->stats.interrupts++;
+
+    int result = 0;
+    DiskRequest* done = NULL;
+    if (ata_service(ch, &result) == 1) {
+        done = ata_chunk_done(ch, result);
+        // Start the next chunk or request before anyone is woken
+        DiskRequest* failed = ata_start(ch);
+        if (done) {
+            done->next = failed;
+        } else {
+            done = failed;
+        }
+    }
+
+    ticket_unlock(&ch->lock);
+    ata_complete(ch, done);
+}
+
+static void ata_irq(InterruptFrame* frame) {
+    uint8_t irq = (uint8_t)(frame->vector - IRQ_BASE);
+
+    // Native mode channels may share one line
+    for (int i = 0; i < 2; i++) {
+        if (channels[i].io && channels[i].irq == irq) {
+            ata_channel_irq(&channels[i]);
+        }
+    }
+}
+
+static void channel_setup(int index, const PciDevice* pci) {
+    AtaChannel* ch = &channels[index];
+    uint8_t native = index ? PCI_IDE_SECONDARY_NATIVE : PCI_IDE_PRIMARY_NATIVE;
+
+    if (pci && (pci->prog_if & native)) {
+        ch->io = (uint16_t)pci_bar_address(pci, index * 2);
+        ch->ctrl = (uint16_t)pci_bar_address(pci, index * 2 + 1) + 2;
+        ch->irq = pci->irq_line;
+    } else {
+        ch->io = index ? ATA_SECONDARY_IO : ATA_PRIMARY_IO;
+        ch->ctrl = index ? ATA_SECONDARY_CTRL : ATA_PRIMARY_CTRL;
+        ch->irq = index ? IRQ_ATA_SECONDARY : IRQ_ATA_PRIMARY;
+    }
+
+    ch->selected = -1;
+    ch->lock = (TicketLock)TICKET_LOCK_INIT(&channel_lock_stats[index]);
+
+    // Bus mastering needs an I/O BAR4 and a PRD table DMA can reach
+    if (pci && pci_bar_is_io(pci, 4) && pci_bar_address(pci, 4)) {
+        PrdEntry* prdt = (PrdEntry*)kmalloc_aligned(PRD_ENTRIES * sizeof(PrdEntry), PAGE_SIZE);
+        uint64_t phys = prdt ? paging_get_phys((uint64_t)prdt) : 0;
+        if (phys && phys < 0x100000000ULL) {
+            ch->bmide = (uint16_t)pci_bar_address(pci, 4) + index * 8;
+            ch->prdt = prdt;
+            ch->prdt_phys = (uint32_t)phys;
+        } else if (prdt) {
+            kfree(prdt);
+        }
+    }
+
+    // Polled until the IRQ handler is in place
+    outb(ch->ctrl, ATA_CTRL_NIEN);
+}
+
+int disk_init(const DiskInfo* boot) {
+    if (drive_count) {
+        return drive_count;
+    }
+
+    if (boot) {
+        boot_info = *boot;
+    }
+
+    // Without a PCI IDE function the legacy ports may still answer, PIO only
+    pci_init();
+    const PciDevice* pci = pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, 0);
+    if (pci) {
+        pci_enable(pci, 1);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        channel_setup(i, pci);
+    }
+
+    for (int i = 0; i < DISK_MAX_DRIVES; i++) {
+        AtaDrive* drive = &drives[i];
+        drive->channel = &channels[i / 2];
+        drive->slave = i & 1;
+        if (ata_identify(drive) == 0) {
+            // BIOS numbering counts hard disks in the same order
+            if (boot && boot->drive_type == 1 && boot->drive_number - 0x80 == drive_count) {
+                boot_drive = i;
+            }
+            drive_count++;
+        }
+    }
+
+    for (int i = 0; i < 2; i++) {
+        AtaChannel* ch = &channels[i];
+        if (!drives[i * 2].info.present && !drives[i * 2 + 1].info.present) {
+            continue;
+        }
+        ata_status(ch);
+        irq_register(ch->irq, ata_irq);
+        outb(ch->ctrl, 0);
+    }
+
+    // hd0..hd3 by position, one request waiting behind the running one
+    for (int i = 0; i < DISK_MAX_DRIVES; i++) {
+        if (drives[i].info.present) {
+            char name[] = "hd0";
+            name[2] = (char)('0' + i);
+            block_register(name, &ata_block_driver, i, drives[i].info.sectors, DISK_MAX_TRANSFER, 2);
+        }
+    }
+
+    return drive_count;
+}
+
+int disk_boot_drive(void) {
+    return boot_drive;
+}
+
+const DiskInfo* disk_boot_info(void) {
+    return &boot_info;
+}
+
+int disk_get_info(int drive, DiskDriveInfo* info) {
+    if (drive < 0 || drive >= DISK_MAX_DRIVES || !drives[drive].info.present) {
+        return -1;
+    }
+    *info = drives[drive].info;
+    return 0;
+}
+
+void disk_get_stats(int drive, DiskStats* stats) {
+    if (drive < 0 || drive >= DISK_MAX_DRIVES) {
+        return;
+    }
+    AtaChannel* ch = drives[drive].channel;
+    uint64_t flags = ticket_lock_irqsave(&ch->lock);
+    *stats = drives[drive].stats;
+    ticket_unlock_irqrestore(&ch->lock, flags);
+}
+
+static int request_valid(const DiskRequest* req) {
+    if (req->drive < 0 || req->drive >= DISK_MAX_DRIVES || !drives[req->drive].info.present) {
+        return 0;
+    }
+    return req->op == DISK_FLUSH ||
+           (req->count && (req->buffer || req->segments) && req->segment_count <= DISK_MAX_SEGMENTS &&
+            req->lba + req->count <= drives[req->drive].info.sectors);
+}
+
+int disk_submit(DiskRequest* req) {
+    if (!request_valid(req)) {
+        return -1;
+    }
+
+    AtaDrive* drive = &drives[req->drive];
+
+    req->status = DISK_PENDING;
+    req->progress = 0;
+    req->next = NULL;
+
+    AtaChannel* ch = drive->channel;
+    uint64_t flags = ticket_lock_irqsave(&ch->lock);
+
+    if (ch->tail) {
+        ch->tail->next = req;
+    } else {
+        ch->head = req;
+    }
+    ch->tail = req;
+
+    drive->stats.requests++;
+    if (++drive->stats.queue_depth > drive->stats.max_queue_depth) {
+        drive->stats.max_queue_depth = drive->stats.queue_depth;
+    }
+
+    DiskRequest* failed = ata_start(ch);
+    ticket_unlock_irqrestore(&ch->lock, flags);
+    ata_complete(ch, failed);
+    return 0;
+}
+
+// Block layer batches: all or nothing, each channel works through its queue
+static int disk_submit_batch(DiskRequest** reqs, int count) {
+    for (int i = 0; i < count; i++) {
+        if (!request_valid(reqs[i])) {
+            return -1;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        disk_submit(reqs[i]);
+    }
+    return 0;
+}
+
+uint8_t* disk_request_data(const DiskRequest* req, uint32_t sector, uint32_t* run) {
+    if (!req->segments) {
+        if (run) {
+            *run = req->count - sector;
+        }
+        return (uint8_t*)req->buffer + (uint64_t)sector * DISK_SECTOR_SIZE;
+    }
+
+    const DiskSegment* seg = req->segments;
+    while (sector >= seg->count) {
+        sector -= seg->count;
+        seg++;
+    }
+    if (run) {
+        *run = seg->count - sector;
+    }
+    return (uint8_t*)seg->buffer + (uint64_t)sector * DISK_SECTOR_SIZE;
+}
+
+int disk_wait(DiskRequest* req) {
+    AtaChannel* ch = drives[req->drive].channel;
+
+    // Checked with interrupts off, the IRQ can't slip in between
+    uint64_t flags = irq_save();
+    while (__atomic_load_n(&req->status, __ATOMIC_ACQUIRE) == DISK_PENDING) {
+        wait_queue_sleep(&ch->waiters);
+    }
+    irq_restore(flags);
+    return req->status;
+}
+
+static int disk_transfer(int drive, DiskOp op, uint64_t lba, uint32_t count, void* buffer) {
+    DiskRequest req = {
+        .drive = drive,
+        .op = op,
+        .lba = lba,
+        .count = count,
+        .buffer = buffer,
+    };
+    if (disk_submit(&req) != 0) {
+        return -1;
+    }
+    return disk_wait(&req);
+}
+
+int disk_read(int drive, uint64_t lba, uint32_t count, void* buffer) {
+    return disk_transfer(drive, DISK_READ, lba, count, buffer);
+}
+
+int disk_write(int drive, uint64_t lba, uint32_t count, const void* buffer) {
+    return disk_transfer(drive, DISK_WRITE, lba, count, (void*)buffer);
+}
+
+int disk_flush(int drive) {
+    return disk_transfer(drive, DISK_FLUSH, 0, 0, NULL);
+}
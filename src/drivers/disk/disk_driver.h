@@ -0,0 +1,136 @@
+#ifndef DISK_DRIVER_H
+#define DISK_DRIVER_H
+
+#include <stdint.h>
+#include "../../include/boot.h"
+
+// IDE/ATA disks behind the PCI IDE controller (or the legacy ports if
+// there is none). Requests queue up per channel and the IRQ 14/15
+// handler finishes one and starts the next. Data moves by bus-master
+// DMA; buffers DMA can't reach, drives without it and DMA errors fall
+// back to interrupt-driven PIO.
+
+#define DISK_SECTOR_SIZE   512
+#define DISK_MAX_DRIVES    4         // primary master/slave, secondary master/slave
+
+// Sectors moved by one ATA command, longer requests take several
+#define DISK_MAX_TRANSFER  1024
+
+// Primary and secondary channel in compatibility mode
+#define ATA_PRIMARY_IO     0x1F0
+#define ATA_PRIMARY_CTRL   0x3F6
+#define ATA_SECONDARY_IO   0x170
+#define ATA_SECONDARY_CTRL 0x376
+#define IRQ_ATA_PRIMARY    14
+#define IRQ_ATA_SECONDARY  15
+
+// Command block registers (offsets from the I/O base)
+#define ATA_REG_DATA       0
+#define ATA_REG_ERROR      1         // features on write
+#define ATA_REG_COUNT      2
+#define ATA_REG_LBA0       3
+#define ATA_REG_LBA1       4
+#define ATA_REG_LBA2       5
+#define ATA_REG_DRIVE      6
+#define ATA_REG_STATUS     7         // command on write
+
+// Bus master registers (offsets from the channel's part of BAR4)
+#define BM_REG_COMMAND     0
+#define BM_REG_STATUS      2
+#define BM_REG_PRDT        4
+
+typedef enum {
+    DISK_READ,
+    DISK_WRITE,
+    DISK_FLUSH                       // write the drive's cache back, no data
+} DiskOp;
+
+// Pieces a scattered request buffer may have
+#define DISK_MAX_SEGMENTS  32
+
+typedef struct {
+    void* buffer;
+    uint32_t count;                  // sectors
+} DiskSegment;
+
+// Request flags
+#define DISK_REQ_PIO       0x01      // don't use DMA
+
+// status while the request is queued or in flight
+#define DISK_PENDING       1
+
+typedef struct DiskRequest {
+    int drive;
+    DiskOp op;
+    uint32_t flags;
+    uint64_t lba;
+    uint32_t count;                  // sectors
+    void* buffer;                    // count * DISK_SECTOR_SIZE bytes, or
+    const DiskSegment* segments;     // pieces adding up to count sectors
+    uint32_t segment_count;
+
+    // 0 when done, -1 on an error. Set right before done() is called,
+    // in the IRQ handler or by submit for a command that never started.
+    // The driver doesn't touch the request afterwards.
+    volatile int status;
+    void (*done)(struct DiskRequest* req);
+    void* private;
+
+    // Owned by the driver while the request is pending
+    struct DiskRequest* next;
+    uint32_t progress;               // sectors finished
+    int error;
+} DiskRequest;
+
+typedef struct {
+    uint64_t requests;
+    uint64_t sectors_read;
+    uint64_t sectors_written;
+    uint64_t dma_commands;
+    uint64_t pio_commands;
+    uint64_t errors;
+    uint64_t interrupts;
+    uint32_t queue_depth;            // queued or in flight right now
+    uint32_t max_queue_depth;
+} DiskStats;
+
+typedef struct {
+    int present;
+    int dma;                         // bus-master DMA is used
+    int lba48;
+    uint64_t sectors;
+    char model[41];
+} DiskDriveInfo;
+
+// Find the controller and IDENTIFY the drives, then take IRQ 14/15.
+// boot is the BIOS view of the boot drive. The drives show up in the
+// block layer as hd0..hd3. Returns the number of drives.
+int disk_init(const DiskInfo* boot);
+
+// Drive the BIOS booted from (drive number 0x80 is the first disk
+// found), -1 if it isn't an ATA disk
+int disk_boot_drive(void);
+const DiskInfo* disk_boot_info(void);
+
+int disk_get_info(int drive, DiskDriveInfo* info);
+void disk_get_stats(int drive, DiskStats* stats);
+
+// Queue a request and return, -1 if it is invalid (no callback then).
+// The request and its buffer must stay valid until it is done. DMA
+// needs an even buffer address below 4GB.
+int disk_submit(DiskRequest* req);
+
+// Where sector of the request's data is, for drivers. *run (if not
+// NULL) is the number of sectors that follow it in the same piece.
+uint8_t* disk_request_data(const DiskRequest* req, uint32_t sector, uint32_t* run);
+
+// Sleep until a submitted request is done, returns its status. Only
+// threads may wait, not interrupt handlers or parallel_for() work.
+int disk_wait(DiskRequest* req);
+
+// Submit and wait, 0 on success
+int disk_read(int drive, uint64_t lba, uint32_t count, void* buffer);
+int disk_write(int drive, uint64_t lba, uint32_t count, const void* buffer);
+int disk_flush(int drive);
+
+#endif
@@ -0,0 +1,636 @@
+#include "virtio_blk.h"
+#include "../pci/pci.h"
+#include "../block/block.h"
+#include "../../include/io.h"
+#include "../../include/lib/string.h"
+#include "../../include/memory/memory.h"
+#include "../../include/memory/paging.h"
+#include "../../include/memory/pmm.h"
+#include "../../kernel/idt.h"
+#include "../../kernel/sched.h"
+#include "../../kernel/lock.h"
+#include <stddef.h>
+
+#define VIRTIO_STATUS_ACK         0x01
+#define VIRTIO_STATUS_DRIVER      0x02
+#define VIRTIO_STATUS_DRIVER_OK   0x04
+#define VIRTIO_STATUS_FAILED      0x80
+
+#define VIRTIO_ISR_QUEUE          0x01
+
+#define VIRTIO_BLK_F_SEG_MAX      (1u << 2)
+#define VIRTIO_BLK_F_RO           (1u << 5)
+#define VIRTIO_BLK_F_FLUSH        (1u << 9)
+
+#define VIRTIO_BLK_T_IN           0
+#define VIRTIO_BLK_T_OUT          1
+#define VIRTIO_BLK_T_FLUSH        4
+
+#define VIRTIO_BLK_S_OK           0
+
+// Device config: capacity at 0, size_max at 8, seg_max at 12
+#define VIRTIO_BLK_CFG_CAPACITY   0
+#define VIRTIO_BLK_CFG_SEG_MAX    12
+
+#define VRING_DESC_F_NEXT         1
+#define VRING_DESC_F_WRITE        2      // the device writes this buffer
+#define VRING_AVAIL_F_NO_INTERRUPT 1
+#define VRING_USED_F_NO_NOTIFY    1
+
+// Legacy devices take the ring by page number, the used ring starts on
+// a page boundary
+#define VRING_ALIGN               PAGE_SIZE
+
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} __attribute__((packed)) VringDesc;
+
+typedef struct {
+    uint16_t flags;
+    volatile uint16_t idx;
+    uint16_t ring[];
+} __attribute__((packed)) VringAvail;
+
+typedef struct {
+    uint32_t id;
+    uint32_t len;
+} __attribute__((packed)) VringUsedElem;
+
+typedef struct {
+    volatile uint16_t flags;
+    volatile uint16_t idx;
+    VringUsedElem ring[];
+} __attribute__((packed)) VringUsed;
+
+typedef struct {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+} __attribute__((packed)) VirtioBlkHeader;
+
+typedef struct {
+    const PciDevice* pci;
+    uint16_t io;
+    uint8_t irq;
+    VirtioBlkInfo info;
+    VirtioBlkStats stats;
+
+    TicketLock lock;
+    WaitQueue waiters;
+
+    // The split virtqueue
+    uint16_t size;
+    VringDesc* desc;
+    VringAvail* avail;
+    VringUsed* used;
+    uint16_t free_head;              // descriptors not in use, chained by next
+    uint16_t free_count;
+    uint16_t avail_idx;              // next avail slot, published on kick
+    uint16_t last_used;
+
+    // Indexed by the head descriptor of a request
+    DiskRequest** slots;
+    VirtioBlkHeader* headers;
+    uint64_t headers_phys;
+    volatile uint8_t* status;
+    uint64_t status_phys;
+
+    // Waiting for descriptors, filled in as completions free them
+    DiskRequest* pending_head;
+    DiskRequest* pending_tail;
+} VirtioBlk;
+
+static LockStats device_lock_stats[VIRTIO_BLK_MAX_DEVICES] = {
+    LOCK_STATS_INIT("vblk0"),
+    LOCK_STATS_INIT("vblk1"),
+    LOCK_STATS_INIT("vblk2"),
+    LOCK_STATS_INIT("vblk3"),
+};
+
+static VirtioBlk devices[VIRTIO_BLK_MAX_DEVICES];
+static int device_count = 0;
+
+static void virtio_blk_irq(InterruptFrame* frame);
+
+// Descriptors, then the avail ring, then the used ring on the next page
+static uint32_t used_offset(uint16_t size) {
+    uint32_t avail_end = size * sizeof(VringDesc) + sizeof(VringAvail) + (size + 1) * sizeof(uint16_t);
+    return (avail_end + VRING_ALIGN - 1) & ~(VRING_ALIGN - 1);
+}
+
+static uint32_t ring_bytes(uint16_t size) {
+    return used_offset(size) + sizeof(VringUsed) + size * sizeof(VringUsedElem) + sizeof(uint16_t);
+}
+
+static int device_setup(VirtioBlk* dev, int index) {
+    uint16_t io = dev->io;
+
+    // Reset, then tell the device a driver is here
+    outb(io + VIRTIO_REG_STATUS, 0);
+    outb(io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACK);
+    outb(io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+
+    uint32_t features = inl(io + VIRTIO_REG_HOST_FEATURES);
+    features &= VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO | VIRTIO_BLK_F_FLUSH;
+    outl(io + VIRTIO_REG_GUEST_FEATURES, features);
+
+    outw(io + VIRTIO_REG_QUEUE_SELECT, 0);
+    uint16_t size = inw(io + VIRTIO_REG_QUEUE_SIZE);
+    if (size < 4 || (size & (size - 1))) {
+        return -1;
+    }
+
+    dev->slots = (DiskRequest**)kmalloc(size * sizeof(DiskRequest*));
+    if (!dev->slots) {
+        return -1;
+    }
+
+    // Ring, then a header and a status byte per descriptor, in memory
+    // that stays physically contiguous
+    uint32_t ring = ring_bytes(size);
+    uint32_t headers_offset = (ring + 15) & ~15u;
+    uint32_t status_offset = headers_offset + size * sizeof(VirtioBlkHeader);
+    uint32_t pages = (status_offset + size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    uint64_t phys = pmm_alloc_pages(pages);
+    uint8_t* base = phys ? (uint8_t*)paging_map_mmio(phys, (uint64_t)pages * PAGE_SIZE, PAGE_WRITE) : NULL;
+    if (!base) {
+        if (phys) {
+            pmm_free_pages(phys, pages);
+        }
+        kfree(dev->slots);
+        return -1;
+    }
+    memset(base, 0, (size_t)pages * PAGE_SIZE);
+
+    dev->size = size;
+    dev->desc = (VringDesc*)base;
+    dev->avail = (VringAvail*)(base + size * sizeof(VringDesc));
+    dev->used = (VringUsed*)(base + used_offset(size));
+    dev->headers = (VirtioBlkHeader*)(base + headers_offset);
+    dev->headers_phys = phys + headers_offset;
+    dev->status = base + status_offset;
+    dev->status_phys = phys + status_offset;
+    memset(dev->slots, 0, size * sizeof(DiskRequest*));
+
+    for (uint16_t i = 0; i < size; i++) {
+        dev->desc[i].next = (uint16_t)(i + 1);
+    }
+    dev->free_head = 0;
+    dev->free_count = size;
+
+    outl(io + VIRTIO_REG_QUEUE_PFN, (uint32_t)(phys >> PAGE_SHIFT));
+
+    // Capacity is in 512 byte sectors whatever the block size
+    uint64_t capacity = inl(io + VIRTIO_REG_CONFIG + VIRTIO_BLK_CFG_CAPACITY) |
+                        ((uint64_t)inl(io + VIRTIO_REG_CONFIG + VIRTIO_BLK_CFG_CAPACITY + 4) << 32);
+    uint32_t seg_max = (features & VIRTIO_BLK_F_SEG_MAX)
+                           ? inl(io + VIRTIO_REG_CONFIG + VIRTIO_BLK_CFG_SEG_MAX) : 0;
+
+    // Header and status take two descriptors, the data at most one per
+    // page plus one for the unaligned start of every piece
+    uint32_t segments = size - 2;
+    if (seg_max && seg_max < segments) {
+        segments = seg_max;
+    }
+    uint32_t pieces = segments / 2 < DISK_MAX_SEGMENTS ? segments / 2 : DISK_MAX_SEGMENTS;
+    uint32_t max_sectors = (segments - pieces) * (PAGE_SIZE / DISK_SECTOR_SIZE);
+    if (max_sectors > VIRTIO_BLK_MAX_SECTORS) {
+        max_sectors = VIRTIO_BLK_MAX_SECTORS;
+    }
+
+    dev->info.sectors = capacity;
+    dev->info.queue_size = size;
+    dev->info.max_sectors = max_sectors;
+    dev->info.read_only = (features & VIRTIO_BLK_F_RO) != 0;
+    dev->info.flush = (features & VIRTIO_BLK_F_FLUSH) != 0;
+
+    dev->lock = (TicketLock)TICKET_LOCK_INIT(&device_lock_stats[index]);
+    dev->irq = dev->pci->irq_line;
+
+    outb(io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+    return 0;
+}
+
+static const BlockDriver virtio_block_driver = {
+    .name = "virtio",
+    .submit_batch = virtio_blk_submit_batch,
+};
+
+int virtio_blk_init(void) {
+    if (device_count) {
+        return device_count;
+    }
+
+    pci_init();
+
+    const PciDevice* pci;
+    for (int i = 0; device_count < VIRTIO_BLK_MAX_DEVICES &&
+                    (pci = pci_find_device(VIRTIO_PCI_VENDOR, VIRTIO_PCI_BLK_LEGACY, i)); i++) {
+        if (!pci_bar_is_io(pci, 0)) {
+            continue;
+        }
+
+        VirtioBlk* dev = &devices[device_count];
+        dev->pci = pci;
+        dev->io = (uint16_t)pci_bar_address(pci, 0);
+        pci_enable(pci, 1);
+
+        if (device_setup(dev, device_count) != 0) {
+            outb(dev->io + VIRTIO_REG_STATUS, VIRTIO_STATUS_FAILED);
+            continue;
+        }
+        device_count++;
+    }
+
+    // PCI lines are often shared, the handler looks at every device
+    for (int i = 0; i < device_count; i++) {
+        inb(devices[i].io + VIRTIO_REG_ISR);
+        irq_register(devices[i].irq, virtio_blk_irq);
+    }
+
+    // The ring holds a handful of full sized requests, the rest wait in
+    // the elevator where they can still merge
+    for (int i = 0; i < device_count; i++) {
+        char name[] = "vd0";
+        name[2] = (char)('0' + i);
+        const VirtioBlkInfo* info = &devices[i].info;
+        block_register(name, &virtio_block_driver, i, info->sectors, info->max_sectors,
+                       info->queue_size / 16);
+    }
+
+    return device_count;
+}
+
+int virtio_blk_count(void) {
+    return device_count;
+}
+
+int virtio_blk_get_info(int dev, VirtioBlkInfo* info) {
+    if (dev < 0 || dev >= device_count) {
+        return -1;
+    }
+    *info = devices[dev].info;
+    return 0;
+}
+
+void virtio_blk_get_stats(int dev, VirtioBlkStats* stats) {
+    if (dev < 0 || dev >= device_count) {
+        return;
+    }
+    uint64_t flags = ticket_lock_irqsave(&devices[dev].lock);
+    *stats = devices[dev].stats;
+    ticket_unlock_irqrestore(&devices[dev].lock, flags);
+}
+
+static int request_valid(const DiskRequest* req) {
+    if (req->drive < 0 || req->drive >= device_count) {
+        return 0;
+    }
+
+    const VirtioBlkInfo* info = &devices[req->drive].info;
+    if (req->op == DISK_FLUSH) {
+        return 1;
+    }
+    if (req->op == DISK_WRITE && info->read_only) {
+        return 0;
+    }
+    return req->count && req->count <= info->max_sectors &&
+           (req->buffer || req->segments) && req->segment_count <= DISK_MAX_SEGMENTS &&
+           req->lba + req->count <= info->sectors;
+}
+
+static uint16_t desc_alloc(VirtioBlk* dev) {
+    uint16_t id = dev->free_head;
+    dev->free_head = dev->desc[id].next;
+    dev->free_count--;
+    return id;
+}
+
+// Data descriptors a request needs at most: one per page touched
+static uint32_t data_descriptors(const DiskRequest* req) {
+    uint32_t descriptors = 0;
+    uint32_t sector = 0;
+    while (req->op != DISK_FLUSH && sector < req->count) {
+        uint32_t run;
+        uint64_t virt = (uint64_t)disk_request_data(req, sector, &run);
+        descriptors += (uint32_t)(((virt & (PAGE_SIZE - 1)) + (uint64_t)run * DISK_SECTOR_SIZE +
+                                   PAGE_SIZE - 1) / PAGE_SIZE);
+        sector += run;
+    }
+    return descriptors;
+}
+
+// Chain of descriptors for one request: header, the pieces of the
+// caller's buffer, status. 0 if it is in the ring, -1 if there are not
+// enough free descriptors. Lock held.
+static int ring_add(VirtioBlk* dev, DiskRequest* req) {
+    if (dev->free_count < data_descriptors(req) + 2) {
+        return -1;
+    }
+
+    uint16_t head = desc_alloc(dev);
+    VirtioBlkHeader* header = &dev->headers[head];
+    header->type = req->op == DISK_READ ? VIRTIO_BLK_T_IN :
+                   req->op == DISK_WRITE ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_FLUSH;
+    header->reserved = 0;
+    header->sector = req->op == DISK_FLUSH ? 0 : req->lba;
+
+    VringDesc* d = &dev->desc[head];
+    d->addr = dev->headers_phys + head * sizeof(VirtioBlkHeader);
+    d->len = sizeof(VirtioBlkHeader);
+    d->flags = VRING_DESC_F_NEXT;
+
+    // Scatter-gather straight from the buffer, merging contiguous frames
+    uint16_t data_flags = req->op == DISK_READ ? VRING_DESC_F_WRITE : 0;
+    VringDesc* last_data = NULL;
+    uint32_t sector = 0;
+    while (req->op != DISK_FLUSH && sector < req->count) {
+        uint32_t run;
+        uint64_t virt = (uint64_t)disk_request_data(req, sector, &run);
+        uint32_t bytes = run * DISK_SECTOR_SIZE;
+        sector += run;
+
+        while (bytes) {
+            uint32_t len = PAGE_SIZE - (virt & (PAGE_SIZE - 1));
+            if (len > bytes) {
+                len = bytes;
+            }
+            uint64_t phys = paging_get_phys(virt);
+
+            if (last_data && last_data->addr + last_data->len == phys) {
+                last_data->len += len;
+            } else {
+                uint16_t id = desc_alloc(dev);
+                d->next = id;
+                d = &dev->desc[id];
+                d->addr = phys;
+                d->len = len;
+                d->flags = data_flags | VRING_DESC_F_NEXT;
+                last_data = d;
+            }
+            virt += len;
+            bytes -= len;
+        }
+    }
+
+    uint16_t status_id = desc_alloc(dev);
+    d->next = status_id;
+    d = &dev->desc[status_id];
+    d->addr = dev->status_phys + head;
+    d->len = 1;
+    d->flags = VRING_DESC_F_WRITE;
+    dev->status[head] = 0xFF;
+
+    dev->slots[head] = req;
+    dev->avail->ring[dev->avail_idx & (dev->size - 1)] = head;
+    dev->avail_idx++;
+    return 0;
+}
+
+// Move pending requests into the ring while descriptors last, then
+// publish all of them with one index update and one doorbell. Lock held.
+static void ring_fill(VirtioBlk* dev) {
+    uint32_t added = 0;
+
+    while (dev->pending_head) {
+        DiskRequest* req = dev->pending_head;
+        if (ring_add(dev, req) != 0) {
+            dev->stats.ring_full++;
+            break;
+        }
+        dev->pending_head = req->next;
+        req->next = NULL;
+        added++;
+    }
+    if (!dev->pending_head) {
+        dev->pending_tail = NULL;
+    }
+    if (!added) {
+        return;
+    }
+
+    __atomic_store_n(&dev->avail->idx, dev->avail_idx, __ATOMIC_RELEASE);
+    if (added > dev->stats.max_batch) {
+        dev->stats.max_batch = added;
+    }
+
+    // The device may still be working through the ring and not need one
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (dev->used->flags & VRING_USED_F_NO_NOTIFY) {
+        dev->stats.notifies_skipped++;
+        return;
+    }
+    outw(dev->io + VIRTIO_REG_QUEUE_NOTIFY, 0);
+    dev->stats.notifies++;
+}
+
+int virtio_blk_submit_batch(DiskRequest** reqs, int count) {
+    if (count <= 0) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (!request_valid(reqs[i]) || reqs[i]->drive != reqs[0]->drive) {
+            return -1;
+        }
+    }
+
+    VirtioBlk* dev = &devices[reqs[0]->drive];
+    DiskRequest* done = NULL;
+    DiskRequest** done_tail = &done;
+    int queued = 0;
+
+    uint64_t flags = ticket_lock_irqsave(&dev->lock);
+
+    for (int i = 0; i < count; i++) {
+        DiskRequest* req = reqs[i];
+        req->status = DISK_PENDING;
+        req->progress = 0;
+        req->error = 0;
+        req->next = NULL;
+
+        // Without a volatile write cache there is nothing to flush, the
+        // device may not even accept the command
+        if (req->op == DISK_FLUSH && !dev->info.flush) {
+            *done_tail = req;
+            done_tail = &req->next;
+            continue;
+        }
+
+        if (dev->pending_tail) {
+            dev->pending_tail->next = req;
+        } else {
+            dev->pending_head = req;
+        }
+        dev->pending_tail = req;
+        queued++;
+    }
+
+    dev->stats.requests += count;
+    dev->stats.queue_depth += queued;
+    if (dev->stats.queue_depth > dev->stats.max_queue_depth) {
+        dev->stats.max_queue_depth = dev->stats.queue_depth;
+    }
+
+    ring_fill(dev);
+    ticket_unlock_irqrestore(&dev->lock, flags);
+
+    // Same as device_irq(), callbacks run without the lock
+    while (done) {
+        DiskRequest* next = done->next;
+        void (*callback)(DiskRequest*) = done->done;
+        __atomic_store_n(&done->status, 0, __ATOMIC_RELEASE);
+        if (callback) {
+            callback(done);
+        }
+        done = next;
+    }
+    return 0;
+}
+
+int virtio_blk_submit(DiskRequest* req) {
+    return virtio_blk_submit_batch(&req, 1);
+}
+
+// Take finished requests off the used ring and give their descriptors
+// back. Returns them linked through next. Lock held.
+static DiskRequest* ring_drain(VirtioBlk* dev) {
+    DiskRequest* done = NULL;
+    DiskRequest** done_tail = &done;
+
+    while (dev->last_used != __atomic_load_n(&dev->used->idx, __ATOMIC_ACQUIRE)) {
+        VringUsedElem* elem = &dev->used->ring[dev->last_used & (dev->size - 1)];
+        uint16_t head = (uint16_t)elem->id;
+        dev->last_used++;
+
+        DiskRequest* req = dev->slots[head];
+        dev->slots[head] = NULL;
+        int ok = dev->status[head] == VIRTIO_BLK_S_OK;
+
+        // Put the whole chain back on the free list
+        uint16_t id = head;
+        while (dev->desc[id].flags & VRING_DESC_F_NEXT) {
+            id = dev->desc[id].next;
+            dev->free_count++;
+        }
+        dev->free_count++;
+        dev->desc[id].next = dev->free_head;
+        dev->free_head = head;
+
+        if (ok && req->op == DISK_READ) {
+            dev->stats.sectors_read += req->count;
+        } else if (ok && req->op == DISK_WRITE) {
+            dev->stats.sectors_written += req->count;
+        } else if (!ok) {
+            dev->stats.errors++;
+        }
+        dev->stats.drained++;
+        dev->stats.queue_depth--;
+
+        // status is only published after the unlock
+        req->progress = ok ? req->count : 0;
+        req->error = !ok;
+        req->next = NULL;
+        *done_tail = req;
+        done_tail = &req->next;
+    }
+    return done;
+}
+
+static void device_irq(VirtioBlk* dev) {
+    // Reading the ISR acknowledges the interrupt
+    if (!(inb(dev->io + VIRTIO_REG_ISR) & VIRTIO_ISR_QUEUE)) {
+        return;
+    }
+
+    DiskRequest* done = NULL;
+    DiskRequest** done_tail = &done;
+
+    ticket_lock(&dev->lock);
+    dev->stats.interrupts++;
+
+    // No interrupts while draining; look once more after turning them
+    // back on, for completions that came in between
+    while (1) {
+        dev->avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+        DiskRequest* batch = ring_drain(dev);
+        if (batch) {
+            *done_tail = batch;
+            while (*done_tail) {
+                done_tail = &(*done_tail)->next;
+            }
+        }
+        ring_fill(dev);
+
+        dev->avail->flags = 0;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (dev->last_used == __atomic_load_n(&dev->used->idx, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+    }
+
+    ticket_unlock(&dev->lock);
+
+    while (done) {
+        DiskRequest* next = done->next;
+        void (*callback)(DiskRequest*) = done->done;
+        __atomic_store_n(&done->status, done->error ? -1 : 0, __ATOMIC_RELEASE);
+        if (callback) {
+            callback(done);
+        }
+        done = next;
+    }
+    wait_queue_wake_all(&dev->waiters);
+}
+
+static void virtio_blk_irq(InterruptFrame* frame) {
+    uint8_t irq = (uint8_t)(frame->vector - IRQ_BASE);
+    for (int i = 0; i < device_count; i++) {
+        if (devices[i].irq == irq) {
+            device_irq(&devices[i]);
+        }
+    }
+}
+
+int virtio_blk_wait(DiskRequest* req) {
+    VirtioBlk* dev = &devices[req->drive];
+
+    uint64_t flags = irq_save();
+    while (__atomic_load_n(&req->status, __ATOMIC_ACQUIRE) == DISK_PENDING) {
+        wait_queue_sleep(&dev->waiters);
+    }
+    irq_restore(flags);
+    return req->status;
+}
+
+static int virtio_blk_transfer(int dev, DiskOp op, uint64_t lba, uint32_t count, void* buffer) {
+    DiskRequest req = {
+        .drive = dev,
+        .op = op,
+        .lba = lba,
+        .count = count,
+        .buffer = buffer,
+    };
+    if (virtio_blk_submit(&req) != 0) {
+        return -1;
+    }
+    return virtio_blk_wait(&req);
+}
+
+int virtio_blk_read(int dev, uint64_t lba, uint32_t count, void* buffer) {
+    return virtio_blk_transfer(dev, DISK_READ, lba, count, buffer);
+}
+
+int virtio_blk_write(int dev, uint64_t lba, uint32_t count, const void* buffer) {
+    return virtio_blk_transfer(dev, DISK_WRITE, lba, count, (void*)buffer);
+}
+
+int virtio_blk_flush(int dev) {
+    if (dev >= 0 && dev < device_count && !devices[dev].info.flush) {
+        return 0;
+    }
+    return virtio_blk_transfer(dev, DISK_FLUSH, 0, 0, NULL);
+}
@@ -0,0 +1,77 @@
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#include <stdint.h>
+#include "disk_driver.h"
+
+// virtio-blk over the legacy (transitional) PCI interface, as QEMU's
+// "-drive if=virtio" provides it. One split virtqueue per device; the
+// driver fills as many requests into it as fit before it rings the
+// doorbell once, and keeps interrupts off while it drains the used ring.
+// Requests use the DiskRequest of the ATA driver, drive is the index of
+// the virtio disk. Data goes straight from and to the caller's buffer.
+
+#define VIRTIO_BLK_MAX_DEVICES  4
+
+#define VIRTIO_PCI_VENDOR       0x1AF4
+#define VIRTIO_PCI_BLK_LEGACY   0x1001
+
+// Legacy register layout in BAR0 (I/O space, MSI-X off)
+#define VIRTIO_REG_HOST_FEATURES  0x00
+#define VIRTIO_REG_GUEST_FEATURES 0x04
+#define VIRTIO_REG_QUEUE_PFN      0x08
+#define VIRTIO_REG_QUEUE_SIZE     0x0C
+#define VIRTIO_REG_QUEUE_SELECT   0x0E
+#define VIRTIO_REG_QUEUE_NOTIFY   0x10
+#define VIRTIO_REG_STATUS         0x12
+#define VIRTIO_REG_ISR            0x13
+#define VIRTIO_REG_CONFIG         0x14
+
+// Sectors one request may move at most, longer ones are refused
+#define VIRTIO_BLK_MAX_SECTORS  1024
+
+typedef struct {
+    uint64_t sectors;
+    uint32_t queue_size;             // descriptors in the ring
+    uint32_t max_sectors;            // per request, limited by seg_max
+    int read_only;
+    int flush;                       // the device has a write cache to flush
+} VirtioBlkInfo;
+
+typedef struct {
+    uint64_t requests;
+    uint64_t sectors_read;
+    uint64_t sectors_written;
+    uint64_t notifies;               // doorbell writes
+    uint64_t notifies_skipped;       // the device said it was still polling
+    uint64_t interrupts;
+    uint64_t drained;                // requests completed by the interrupts
+    uint64_t ring_full;              // times requests waited for descriptors
+    uint64_t errors;
+    uint32_t max_batch;              // most requests published by one doorbell
+    uint32_t queue_depth;
+    uint32_t max_queue_depth;
+} VirtioBlkStats;
+
+// Find and start every virtio-blk device and add them to the block
+// layer as vd0.., returns how many there are
+int virtio_blk_init(void);
+int virtio_blk_count(void);
+
+int virtio_blk_get_info(int dev, VirtioBlkInfo* info);
+void virtio_blk_get_stats(int dev, VirtioBlkStats* stats);
+
+// Queue count requests for the same device and notify it once. -1 (and
+// nothing queued) if any of them is invalid. Same lifetime rules as
+// disk_submit().
+int virtio_blk_submit_batch(DiskRequest** reqs, int count);
+int virtio_blk_submit(DiskRequest* req);
+
+// Sleep until the request is done, returns its status
+int virtio_blk_wait(DiskRequest* req);
+
+int virtio_blk_read(int dev, uint64_t lba, uint32_t count, void* buffer);
+int virtio_blk_write(int dev, uint64_t lba, uint32_t count, const void* buffer);
+int virtio_blk_flush(int dev);
+
+#endif
@@ -1,21 +1,35 @@
 #include "keyboard.h"
-
-// Port I/O functions - these need to be implemented or included
-static inline uint8_t inb(uint16_t port) {
-    uint8_t result;
-    asm volatile ("inb %1, %0" : "=a"(result) : "Nd"(port));
-    return result;
-}
-
-static inline void outb(uint16_t port, uint8_t data) {
-    asm volatile ("outb %0, %1" : : "a"(data), "Nd"(port));
-}
+#include "../../include/io.h"
+#include "../../kernel/idt.h"
+#include "../../kernel/sched.h"
+#include "../../kernel/lock.h"
 
 // Global keyboard state
 static KeyboardBuffer kb_buffer = {0};
 static KeyboardState kb_state = {0};
+static WaitQueue kb_waiters = {0};
+static LockStats kb_lock_stats = LOCK_STATS_INIT("keyboard");
+static TicketLock kb_lock = TICKET_LOCK_INIT(&kb_lock_stats);
 static uint8_t keyboard_read_data(void);
 static uint8_t keyboard_read_status(void);
+static void keyboard_irq(InterruptFrame* frame);
+
+_Static_assert((KEYBOARD_BUFFER_SIZE & (KEYBOARD_BUFFER_SIZE - 1)) == 0,
+               "KEYBOARD_BUFFER_SIZE must be a power of two");
+
+// Keys come from the keyboard IRQ and from the serial port, and any
+// thread may read them, so both ends of the ring take kb_lock. Both
+// indices run freely and are masked on access, head - tail is the fill
+// level. keyboard_has_key() only peeks and goes without the lock.
+#define KB_MASK (KEYBOARD_BUFFER_SIZE - 1)
+
+static inline uint32_t kb_load_acquire(const uint32_t* index) {
+    return __atomic_load_n(index, __ATOMIC_ACQUIRE);
+}
+
+static inline void kb_store_release(uint32_t* index, uint32_t value) {
+    __atomic_store_n(index, value, __ATOMIC_RELEASE);
+}
 
 // US QWERTY scancode to ASCII conversion table
 static const char scancode_to_char[] = {
@@ -41,18 +55,26 @@ void keyboard_init(void) {
     // Initialize buffer
     kb_buffer.head = 0;
     kb_buffer.tail = 0;
-    kb_buffer.count = 0;
 
     // Initialize state
     kb_state.shift_pressed = false;
     kb_state.ctrl_pressed = false;
     kb_state.alt_pressed = false;
     kb_state.caps_lock = false;
+    kb_state.extended = false;
 
     // Flush any pending keyboard data
     while (keyboard_read_status() & KEYBOARD_STATUS_OUTPUT_BUFFER_FULL) {
         keyboard_read_data();
     }
+
+    // Scancodes arrive through IRQ1 from now on
+    irq_register(IRQ_KEYBOARD, keyboard_irq);
+}
+
+static void keyboard_irq(InterruptFrame* frame) {
+    (void)frame;
+    keyboard_handler();
 }
 
 static uint8_t keyboard_read_data(void) {
@@ -88,6 +110,63 @@ static char scancode_to_ascii(uint8_t scancode, bool shift, bool caps) {
     return c;
 }
 
+// Producer side of the ring, called from the IRQ handlers
+static void keyboard_push(char key) {
+    uint64_t flags = ticket_lock_irqsave(&kb_lock);
+
+    // Publish the slot before the new head
+    uint32_t head = kb_buffer.head;
+    bool stored = head - kb_buffer.tail < KEYBOARD_BUFFER_SIZE;
+    if (stored) {
+        kb_buffer.buffer[head & KB_MASK] = key;
+        kb_store_release(&kb_buffer.head, head + 1);
+    }
+
+    ticket_unlock_irqrestore(&kb_lock, flags);
+    if (stored) {
+        wait_queue_wake_all(&kb_waiters);
+    }
+}
+
+void keyboard_input(char key) {
+    keyboard_push(key);
+}
+
+// Keys behind the 0xE0 prefix, these share their scancodes with the
+// keypad, so they must not go through the ASCII tables
+static void keyboard_handle_extended(uint8_t scancode) {
+    bool released = scancode & 0x80;
+    scancode &= 0x7F;
+
+    switch (scancode) {
+        case KEY_CTRL:
+            kb_state.ctrl_pressed = !released;
+            return;
+        case KEY_ALT:
+            kb_state.alt_pressed = !released;
+            return;
+    }
+
+    if (released) {
+        return;
+    }
+
+    switch (scancode) {
+        case KEY_ENTER:
+            keyboard_push('\n');
+            break;
+        case KEY_KP_SLASH:
+            keyboard_push('/');
+            break;
+        case KEY_PAGE_UP:
+            keyboard_push(KEYCODE_PAGE_UP);
+            break;
+        case KEY_PAGE_DOWN:
+            keyboard_push(KEYCODE_PAGE_DOWN);
+            break;
+    }
+}
+
 void keyboard_handler(void) {
     uint8_t status = keyboard_read_status();
 
@@ -97,6 +176,17 @@ void keyboard_handler(void) {
 
     uint8_t scancode = keyboard_read_data();
 
+    if (scancode == KEY_EXTENDED) {
+        kb_state.extended = true;
+        return;
+    }
+
+    if (kb_state.extended) {
+        kb_state.extended = false;
+        keyboard_handle_extended(scancode);
+        return;
+    }
+
     // Handle key releases (bit 7 set)
     if (scancode & 0x80) {
         scancode &= 0x7F; // Remove release bit
@@ -148,11 +238,7 @@ void keyboard_handler(void) {
 
             // Add to buffer if it's a printable character or special key
             if (ascii != 0) {
-                if (kb_buffer.count < KEYBOARD_BUFFER_SIZE - 1) {
-                    kb_buffer.buffer[kb_buffer.head] = ascii;
-                    kb_buffer.head = (kb_buffer.head + 1) % KEYBOARD_BUFFER_SIZE;
-                    kb_buffer.count++;
-                }
+                keyboard_push(ascii);
             }
             break;
         }
@@ -160,25 +246,50 @@ void keyboard_handler(void) {
 }
 
 bool keyboard_has_key(void) {
-    // Check if there's data available first
-    keyboard_handler();
-    return kb_buffer.count > 0;
+    return kb_load_acquire(&kb_buffer.head) != kb_buffer.tail;
+}
+
+int keyboard_read_keys(char* buf, int max) {
+    uint64_t flags = ticket_lock_irqsave(&kb_lock);
+    uint32_t tail = kb_buffer.tail;
+    uint32_t available = kb_buffer.head - tail;
+
+    int count = (uint32_t)max < available ? max : (int)available;
+    for (int i = 0; i < count; i++) {
+        buf[i] = kb_buffer.buffer[(tail + i) & KB_MASK];
+    }
+
+    // Consumer: hand the slots back only after reading them
+    kb_store_release(&kb_buffer.tail, tail + count);
+    ticket_unlock_irqrestore(&kb_lock, flags);
+    return count;
 }
 
 char keyboard_get_key(void) {
-    if (!keyboard_has_key()) {
+    char key;
+    if (keyboard_read_keys(&key, 1) == 0) {
         return 0;
     }
+    return key;
+}
 
-    char key = kb_buffer.buffer[kb_buffer.tail];
-    kb_buffer.tail = (kb_buffer.tail + 1) % KEYBOARD_BUFFER_SIZE;
-    kb_buffer.count--;
+void keyboard_wait(void) {
+    // Check with interrupts off, so a key arriving right before we
+    // block still wakes us up
+    uint64_t flags = irq_save();
+    while (!keyboard_has_key()) {
+        wait_queue_sleep(&kb_waiters);
+    }
+    irq_restore(flags);
+}
 
-    return key;
+char keyboard_wait_key(void) {
+    keyboard_wait();
+    return keyboard_get_key();
 }
 
 void keyboard_flush_buffer(void) {
-    kb_buffer.head = 0;
-    kb_buffer.tail = 0;
-    kb_buffer.count = 0;
+    uint64_t flags = ticket_lock_irqsave(&kb_lock);
+    kb_store_release(&kb_buffer.tail, kb_buffer.head);
+    ticket_unlock_irqrestore(&kb_lock, flags);
 }
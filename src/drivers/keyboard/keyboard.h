@@ -39,14 +39,26 @@
 #define KEY_F11        0x57
 #define KEY_F12        0x58
 
-// Key buffer size
+// Extended keys (sent after an 0xE0 prefix)
+#define KEY_EXTENDED   0xE0
+#define KEY_KP_SLASH   0x35
+#define KEY_PAGE_UP    0x49
+#define KEY_PAGE_DOWN  0x51
+
+// Codes put into the buffer for keys without an ASCII character
+#define KEYCODE_PAGE_UP   ((char)0x81)
+#define KEYCODE_PAGE_DOWN ((char)0x82)
+
+// Key buffer size (power of two)
 #define KEYBOARD_BUFFER_SIZE 256
 
+// Ring of keys. The keyboard and serial IRQs push at head, readers pop
+// at tail, and both ends take kb_lock; only keyboard_has_key() peeks
+// without it. The indices run freely and head - tail is the fill level.
 typedef struct {
     char buffer[KEYBOARD_BUFFER_SIZE];
-    int head;
-    int tail;
-    int count;
+    uint32_t head;
+    uint32_t tail;
 } KeyboardBuffer;
 
 typedef struct {
@@ -54,6 +66,7 @@ typedef struct {
     bool ctrl_pressed;
     bool alt_pressed;
     bool caps_lock;
+    bool extended;      // last byte was the 0xE0 prefix
 } KeyboardState;
 
 // Function declarations
@@ -61,8 +74,15 @@ void keyboard_init(void);
 void keyboard_handler(void);
 bool keyboard_has_key(void);
 char keyboard_get_key(void);
+int keyboard_read_keys(char* buf, int max);   // returns the number of keys read
+void keyboard_wait(void);                      // sleeps until a key is available
+char keyboard_wait_key(void);
 void keyboard_flush_buffer(void);
 
+// Queue a key from another input device (serial), interrupts must be
+// off like in the keyboard IRQ handler
+void keyboard_input(char key);
+
 // Internal functions (implemented in keyboard.c)
 // These are not exposed in the header since they're static
 
@@ -0,0 +1,161 @@
+#include "pci.h"
+#include "../../include/io.h"
+#include "../../kernel/lock.h"
+#include <stddef.h>
+
+#define PCI_MULTIFUNCTION 0x80
+
+static PciDevice devices[PCI_MAX_DEVICES];
+static int device_count = 0;
+
+// The address/data port pair is one shared window
+static LockStats config_lock_stats = LOCK_STATS_INIT("pci config");
+static TicketLock config_lock = TICKET_LOCK_INIT(&config_lock_stats);
+
+static uint32_t config_address(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+    return 0x80000000u | ((uint32_t)bus << 16) | ((uint32_t)slot << 11) |
+           ((uint32_t)func << 8) | (offset & 0xFC);
+}
+
+static uint32_t config_read(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+    uint64_t flags = ticket_lock_irqsave(&config_lock);
+    outl(PCI_CONFIG_ADDRESS, config_address(bus, slot, func, offset));
+    uint32_t value = inl(PCI_CONFIG_DATA);
+    ticket_unlock_irqrestore(&config_lock, flags);
+    return value;
+}
+
+static void config_write(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t value) {
+    uint64_t flags = ticket_lock_irqsave(&config_lock);
+    outl(PCI_CONFIG_ADDRESS, config_address(bus, slot, func, offset));
+    outl(PCI_CONFIG_DATA, value);
+    ticket_unlock_irqrestore(&config_lock, flags);
+}
+
+uint32_t pci_read32(const PciDevice* dev, uint8_t offset) {
+    return config_read(dev->bus, dev->slot, dev->func, offset);
+}
+
+uint16_t pci_read16(const PciDevice* dev, uint8_t offset) {
+    return (uint16_t)(pci_read32(dev, offset) >> ((offset & 2) * 8));
+}
+
+uint8_t pci_read8(const PciDevice* dev, uint8_t offset) {
+    return (uint8_t)(pci_read32(dev, offset) >> ((offset & 3) * 8));
+}
+
+void pci_write32(const PciDevice* dev, uint8_t offset, uint32_t value) {
+    config_write(dev->bus, dev->slot, dev->func, offset, value);
+}
+
+void pci_write16(const PciDevice* dev, uint8_t offset, uint16_t value) {
+    // Read-modify-write of the dword, status bits are write-1-to-clear
+    // so the command register's neighbour is written back as zero
+    uint32_t shift = (offset & 2) * 8;
+    uint32_t old = pci_read32(dev, offset);
+    if ((offset & 0xFC) == PCI_COMMAND) {
+        old &= 0x0000FFFF;
+    }
+    uint32_t value32 = (old & ~(0xFFFFu << shift)) | ((uint32_t)value << shift);
+    pci_write32(dev, offset, value32);
+}
+
+static void add_function(uint8_t bus, uint8_t slot, uint8_t func) {
+    if (device_count == PCI_MAX_DEVICES) {
+        return;
+    }
+
+    uint32_t id = config_read(bus, slot, func, PCI_VENDOR_ID);
+    uint32_t class_reg = config_read(bus, slot, func, 0x08);
+
+    PciDevice* dev = &devices[device_count++];
+    dev->bus = bus;
+    dev->slot = slot;
+    dev->func = func;
+    dev->vendor_id = (uint16_t)id;
+    dev->device_id = (uint16_t)(id >> 16);
+    dev->class_code = (uint8_t)(class_reg >> 24);
+    dev->subclass = (uint8_t)(class_reg >> 16);
+    dev->prog_if = (uint8_t)(class_reg >> 8);
+    dev->irq_line = (uint8_t)config_read(bus, slot, func, PCI_INTERRUPT_LINE);
+}
+
+int pci_init(void) {
+    if (device_count) {
+        return 0;
+    }
+
+    // Brute force over all buses, bridges need no special care that way
+    for (uint32_t bus = 0; bus < 256; bus++) {
+        for (uint8_t slot = 0; slot < 32; slot++) {
+            if ((config_read(bus, slot, 0, PCI_VENDOR_ID) & 0xFFFF) == 0xFFFF) {
+                continue;
+            }
+
+            uint8_t header = (uint8_t)(config_read(bus, slot, 0, 0x0C) >> 16);
+            uint8_t functions = (header & PCI_MULTIFUNCTION) ? 8 : 1;
+            for (uint8_t func = 0; func < functions; func++) {
+                if ((config_read(bus, slot, func, PCI_VENDOR_ID) & 0xFFFF) != 0xFFFF) {
+                    add_function(bus, slot, func);
+                }
+            }
+        }
+    }
+    return device_count ? 0 : -1;
+}
+
+int pci_device_count(void) {
+    return device_count;
+}
+
+const PciDevice* pci_device(int index) {
+    return index >= 0 && index < device_count ? &devices[index] : NULL;
+}
+
+const PciDevice* pci_find_class(uint8_t class_code, uint8_t subclass, int index) {
+    for (int i = 0; i < device_count; i++) {
+        if (devices[i].class_code == class_code && devices[i].subclass == subclass && index-- == 0) {
+            return &devices[i];
+        }
+    }
+    return NULL;
+}
+
+const PciDevice* pci_find_device(uint16_t vendor_id, uint16_t device_id, int index) {
+    for (int i = 0; i < device_count; i++) {
+        if (devices[i].vendor_id == vendor_id && devices[i].device_id == device_id && index-- == 0) {
+            return &devices[i];
+        }
+    }
+    return NULL;
+}
+
+int pci_bar_is_io(const PciDevice* dev, int bar) {
+    return pci_read32(dev, PCI_BAR0 + bar * 4) & PCI_BAR_IO;
+}
+
+uint64_t pci_bar_address(const PciDevice* dev, int bar) {
+    if (bar < 0 || bar > 5) {
+        return 0;
+    }
+
+    uint32_t low = pci_read32(dev, PCI_BAR0 + bar * 4);
+    if (low & PCI_BAR_IO) {
+        return low & ~0x3u;
+    }
+
+    uint64_t address = low & ~0xFu;
+    if ((low & 0x6) == PCI_BAR_64BIT && bar < 5) {
+        address |= (uint64_t)pci_read32(dev, PCI_BAR0 + (bar + 1) * 4) << 32;
+    }
+    return address;
+}
+
+void pci_enable(const PciDevice* dev, int bus_master) {
+    uint16_t command = pci_read16(dev, PCI_COMMAND);
+    command |= PCI_COMMAND_IO | PCI_COMMAND_MEMORY;
+    if (bus_master) {
+        command |= PCI_COMMAND_BUS_MASTER;
+    }
+    pci_write16(dev, PCI_COMMAND, command);
+}
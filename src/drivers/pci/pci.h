@@ -0,0 +1,67 @@
+#ifndef PCI_H
+#define PCI_H
+
+#include <stdint.h>
+
+// Configuration mechanism #1
+#define PCI_CONFIG_ADDRESS  0xCF8
+#define PCI_CONFIG_DATA     0xCFC
+
+// Configuration space offsets
+#define PCI_VENDOR_ID       0x00
+#define PCI_DEVICE_ID       0x02
+#define PCI_COMMAND         0x04
+#define PCI_STATUS          0x06
+#define PCI_PROG_IF         0x09
+#define PCI_SUBCLASS        0x0A
+#define PCI_CLASS           0x0B
+#define PCI_HEADER_TYPE     0x0E
+#define PCI_BAR0            0x10
+#define PCI_INTERRUPT_LINE  0x3C
+
+#define PCI_COMMAND_IO          0x0001
+#define PCI_COMMAND_MEMORY      0x0002
+#define PCI_COMMAND_BUS_MASTER  0x0004
+
+#define PCI_BAR_IO          0x1     // I/O space, the others are memory
+#define PCI_BAR_64BIT       0x4     // memory BAR spanning two slots
+
+#define PCI_MAX_DEVICES     64
+
+typedef struct {
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t func;
+    uint8_t irq_line;             // legacy PIC IRQ set up by the BIOS
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint8_t class_code;
+    uint8_t subclass;
+    uint8_t prog_if;
+} PciDevice;
+
+// Scan every bus once, 0 on success. Later lookups use the list.
+int pci_init(void);
+
+int pci_device_count(void);
+const PciDevice* pci_device(int index);
+
+// index-th match, NULL if there are fewer
+const PciDevice* pci_find_class(uint8_t class_code, uint8_t subclass, int index);
+const PciDevice* pci_find_device(uint16_t vendor_id, uint16_t device_id, int index);
+
+uint8_t pci_read8(const PciDevice* dev, uint8_t offset);
+uint16_t pci_read16(const PciDevice* dev, uint8_t offset);
+uint32_t pci_read32(const PciDevice* dev, uint8_t offset);
+void pci_write16(const PciDevice* dev, uint8_t offset, uint16_t value);
+void pci_write32(const PciDevice* dev, uint8_t offset, uint32_t value);
+
+// Address in BAR n with the type bits cleared (both halves of a 64 bit
+// one), 0 if it is unused
+uint64_t pci_bar_address(const PciDevice* dev, int bar);
+int pci_bar_is_io(const PciDevice* dev, int bar);
+
+// Turn on decoding of the BARs and let the device master the bus
+void pci_enable(const PciDevice* dev, int bus_master);
+
+#endif
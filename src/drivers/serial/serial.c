@@ -0,0 +1,245 @@
+#include "serial.h"
+#include "../keyboard/keyboard.h"
+#include "../../include/io.h"
+#include "../../kernel/idt.h"
+#include "../../kernel/lock.h"
+
+#define COM1 SERIAL_COM1_PORT
+
+// Line control: 8 data bits, no parity, one stop bit
+#define UART_LCR_8N1   0x03
+#define UART_LCR_DLAB  0x80
+
+// FIFO control: enable, clear both FIFOs, RX interrupt at 14 bytes
+#define UART_FCR_INIT  0xC7
+
+// Modem control: DTR, RTS and OUT2 (routes the interrupt to the PIC)
+#define UART_MCR_INIT  0x0B
+
+#define UART_IER_RX    0x01
+#define UART_IER_THRE  0x02
+
+#define UART_IIR_NO_INT     0x01
+#define UART_IIR_ID_MASK    0x0E
+#define UART_IIR_MSR        0x00
+#define UART_IIR_THRE       0x02
+#define UART_IIR_RX_DATA    0x04
+#define UART_IIR_RX_LINE    0x06
+#define UART_IIR_RX_TIMEOUT 0x0C
+
+#define UART_LSR_DATA_READY 0x01
+#define UART_LSR_ERRORS     0x1E    // overrun, parity, framing, break
+#define UART_LSR_THRE       0x20
+
+#define TX_MASK (SERIAL_TX_SIZE - 1)
+
+_Static_assert((SERIAL_TX_SIZE & TX_MASK) == 0, "SERIAL_TX_SIZE must be a power of two");
+
+// Transmit ring, free-running indices like the keyboard buffer. Every
+// print() on any CPU can produce, so both sides take the lock.
+static LockStats tx_lock_stats = LOCK_STATS_INIT("serial tx");
+static TicketLock tx_lock = TICKET_LOCK_INIT(&tx_lock_stats);
+static char tx_ring[SERIAL_TX_SIZE];
+static uint32_t tx_head = 0;
+static uint32_t tx_tail = 0;
+
+// A THR empty interrupt is expected, the ISR keeps the FIFO fed
+static int tx_busy = 0;
+
+static int present = 0;
+static SerialStats stats = {0};
+
+// Escape sequences from the terminal (ESC [ 5 ~ is Page Up)
+enum { RX_NORMAL, RX_ESCAPE, RX_CSI };
+static int rx_state = RX_NORMAL;
+static char rx_param = 0;
+
+static void serial_irq(InterruptFrame* frame);
+
+int serial_init(void) {
+    // No UART if the scratch register doesn't hold a value
+    outb(COM1 + UART_SCR, 0xA5);
+    if (inb(COM1 + UART_SCR) != 0xA5) {
+        return -1;
+    }
+
+    uint16_t divisor = 115200 / SERIAL_BAUD;
+
+    outb(COM1 + UART_IER, 0);
+    outb(COM1 + UART_LCR, UART_LCR_DLAB);
+    outb(COM1 + UART_DATA, divisor & 0xFF);
+    outb(COM1 + UART_IER, divisor >> 8);
+    outb(COM1 + UART_LCR, UART_LCR_8N1);
+    outb(COM1 + UART_IIR, UART_FCR_INIT);
+    outb(COM1 + UART_MCR, UART_MCR_INIT);
+
+    // Drop anything left over from the bootloader
+    inb(COM1 + UART_LSR);
+    inb(COM1 + UART_DATA);
+    inb(COM1 + UART_IIR);
+    inb(COM1 + UART_MSR);
+
+    present = 1;
+    return 0;
+}
+
+void serial_enable_irq(void) {
+    if (!present) {
+        return;
+    }
+
+    irq_register(IRQ_COM1, serial_irq);
+
+    // Enabling the THR empty interrupt with an empty THR raises it right
+    // away, which sends whatever was queued during boot
+    outb(COM1 + UART_IER, UART_IER_RX | UART_IER_THRE);
+}
+
+int serial_present(void) {
+    return present;
+}
+
+void serial_get_stats(SerialStats* out) {
+    uint64_t flags = irq_save();
+    *out = stats;
+    irq_restore(flags);
+}
+
+// Move up to a FIFO worth of bytes from the ring to the UART
+static void serial_fill_fifo(void) {
+    int count = 0;
+    while (tx_tail != tx_head && count < UART_FIFO_SIZE) {
+        outb(COM1 + UART_DATA, tx_ring[tx_tail & TX_MASK]);
+        tx_tail++;
+        count++;
+    }
+
+    stats.tx_bytes += count;
+    tx_busy = count > 0;
+}
+
+static inline int tx_push(char c) {
+    if (tx_head - tx_tail == SERIAL_TX_SIZE) {
+        stats.tx_dropped++;
+        return 0;
+    }
+    tx_ring[tx_head & TX_MASK] = c;
+    tx_head++;
+    return 1;
+}
+
+void serial_write(const char* str, size_t len) {
+    if (!present) {
+        return;
+    }
+
+    uint64_t flags = ticket_lock_irqsave(&tx_lock);
+
+    for (size_t i = 0; i < len; i++) {
+        char c = str[i];
+        if (c == '\n') {
+            tx_push('\r');
+        } else if (c == '\b') {
+            // The console erases the character, so does the terminal
+            tx_push('\b');
+            tx_push(' ');
+        }
+        tx_push(c);
+    }
+
+    // Nothing in flight: start the FIFO, the interrupt does the rest
+    if (!tx_busy && (inb(COM1 + UART_LSR) & UART_LSR_THRE)) {
+        serial_fill_fifo();
+    }
+
+    ticket_unlock_irqrestore(&tx_lock, flags);
+}
+
+// Feed a received byte into the keyboard input, translating what
+// terminals send for Enter, Backspace and Page Up/Down. A lone ESC is
+// only passed on with the byte after it.
+static void serial_input(char c) {
+    switch (rx_state) {
+        case RX_ESCAPE:
+            if (c == '[') {
+                rx_state = RX_CSI;
+                rx_param = 0;
+                return;
+            }
+            keyboard_input(27);
+            rx_state = RX_NORMAL;
+            if (c == 27) {
+                rx_state = RX_ESCAPE;
+                return;
+            }
+            break;
+
+        case RX_CSI:
+            if (c >= '0' && c <= '9') {
+                rx_param = c;
+                return;
+            }
+            // Final byte, everything but Page Up/Down is ignored
+            if (c == '~' && rx_param == '5') {
+                keyboard_input(KEYCODE_PAGE_UP);
+            } else if (c == '~' && rx_param == '6') {
+                keyboard_input(KEYCODE_PAGE_DOWN);
+            }
+            if (c < '0' || c > '?') {
+                rx_state = RX_NORMAL;
+            }
+            return;
+    }
+
+    if (c == 27) {
+        rx_state = RX_ESCAPE;
+    } else if (c == '\r') {
+        keyboard_input('\n');
+    } else if (c == 0x7F) {
+        keyboard_input('\b');
+    } else if (c != '\n') {
+        keyboard_input(c);
+    }
+}
+
+static void serial_receive(void) {
+    uint8_t lsr;
+    while ((lsr = inb(COM1 + UART_LSR)) & UART_LSR_DATA_READY) {
+        char c = inb(COM1 + UART_DATA);
+        if (lsr & UART_LSR_ERRORS) {
+            stats.rx_errors++;
+            continue;
+        }
+        stats.rx_bytes++;
+        serial_input(c);
+    }
+}
+
+static void serial_irq(InterruptFrame* frame) {
+    (void)frame;
+    stats.interrupts++;
+
+    uint8_t iir;
+    while (!((iir = inb(COM1 + UART_IIR)) & UART_IIR_NO_INT)) {
+        switch (iir & UART_IIR_ID_MASK) {
+            case UART_IIR_RX_LINE:
+                if (inb(COM1 + UART_LSR) & UART_LSR_ERRORS) {
+                    stats.rx_errors++;
+                }
+                break;
+            case UART_IIR_RX_DATA:
+            case UART_IIR_RX_TIMEOUT:
+                serial_receive();
+                break;
+            case UART_IIR_THRE:
+                // Reading IIR acknowledged it, an empty ring ends the run
+                ticket_lock(&tx_lock);
+                serial_fill_fifo();
+                ticket_unlock(&tx_lock);
+                break;
+            case UART_IIR_MSR:
+                inb(COM1 + UART_MSR);
+                break;
+        }
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// 16550 UART on COM1
+#define SERIAL_COM1_PORT 0x3F8
+#define SERIAL_BAUD      115200
+
+// Register offsets
+#define UART_DATA  0     // RBR / THR, divisor low with DLAB
+#define UART_IER   1     // divisor high with DLAB
+#define UART_IIR   2     // FCR on write
+#define UART_LCR   3
+#define UART_MCR   4
+#define UART_LSR   5
+#define UART_MSR   6
+#define UART_SCR   7
+
+// Bytes the transmit FIFO takes after a THR empty interrupt
+#define UART_FIFO_SIZE 16
+
+// Transmit ring size (power of two). Output that doesn't fit is
+// dropped and counted instead of waiting for the wire.
+#define SERIAL_TX_SIZE 8192
+
+typedef struct {
+    uint64_t tx_bytes;      // written to the UART
+    uint64_t tx_dropped;    // lost because the ring was full
+    uint64_t rx_bytes;
+    uint64_t rx_errors;     // overrun, parity, framing
+    uint64_t interrupts;
+} SerialStats;
+
+// Program the UART, 0 on success, -1 if there is none. Output written
+// before serial_enable_irq() is queued and sent once IRQ 4 is on.
+int serial_init(void);
+void serial_enable_irq(void);
+
+// Queue bytes for transmission, never waits. '\n' is sent as "\r\n".
+void serial_write(const char* str, size_t len);
+
+int serial_present(void);
+void serial_get_stats(SerialStats* stats);
+
+#endif
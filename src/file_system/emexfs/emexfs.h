@@ -0,0 +1,49 @@
+#ifndef EMEXFS_H
+#define EMEXFS_H
+
+#include <stdint.h>
+#include "../fs.h"
+#include "format.h"
+
+// emexFS on a block device, through the buffer cache. One filesystem
+// is mounted at a time; paths are absolute, '/' separated. Only threads
+// may call these, not interrupt handlers.
+
+typedef struct {
+    int dev;                         // block device, -1 if nothing is mounted
+    char label[32];
+    uint32_t block_count;
+    uint32_t free_blocks;
+    uint32_t inode_count;
+    uint32_t free_inodes;
+    uint32_t groups;
+    uint64_t mount_us;               // time the mount took
+    int recovered;                   // it wasn't unmounted cleanly, counts were rebuilt
+} EmexfsInfo;
+
+// Mount the filesystem on a block device, -1 if it doesn't hold one
+int emexfs_mount(int dev);
+
+// Write everything back and mark the filesystem clean
+int emexfs_unmount(void);
+int emexfs_sync(void);
+
+int emexfs_lookup(const char* path, FsNode* node);
+
+// Entries of a directory in hash order, or -1. The callback runs with
+// the filesystem locked and must not call back into it.
+int emexfs_readdir(const char* path, FsDirCallback callback, void* arg);
+
+// Bytes read or written, -1 on an error. Writes past the end grow the file.
+int emexfs_read(const FsNode* node, uint64_t offset, void* buffer, uint32_t length);
+int emexfs_write(FsNode* node, uint64_t offset, const void* buffer, uint32_t length);
+
+// New empty file or directory, fills node if it isn't NULL
+int emexfs_create(const char* path, FsNodeType type, FsNode* node);
+
+// Remove a file or an empty directory
+int emexfs_remove(const char* path);
+
+void emexfs_get_info(EmexfsInfo* info);
+
+#endif
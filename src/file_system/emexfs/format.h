@@ -0,0 +1,117 @@
+#ifndef EMEXFS_FORMAT_H
+#define EMEXFS_FORMAT_H
+
+#include <stdint.h>
+
+// emexFS on-disk format, shared by the kernel and tools/mkfs_emexfs.
+// Everything is little endian, block numbers are 32 bit.
+//
+//   block 0                superblock
+//   summary_start          free block count of every group (uint32_t each)
+//   block_bitmap_start     one bitmap block per group of 32768 blocks
+//   inode_bitmap_start
+//   inode_table_start      EMEXFS_INODES_PER_BLOCK inodes per block
+//   data_start             file and directory data
+//
+// Files map their blocks with extents (runs of contiguous blocks), the
+// first few in the inode, more in one extent block. Directories are
+// hash tables: the directory's blocks are buckets of fixed size entries,
+// a name's hash picks the bucket and a full bucket doubles the table.
+// A cleanly unmounted filesystem mounts from the superblock and the
+// summary alone; after a crash the summary is counted from the bitmaps.
+
+#define EMEXFS_MAGIC            0x31534658454D45ull   // "EMEXFS1"
+#define EMEXFS_VERSION          1
+#define EMEXFS_BLOCK_SIZE       4096
+#define EMEXFS_BITS_PER_BLOCK   (EMEXFS_BLOCK_SIZE * 8)
+
+#define EMEXFS_STATE_CLEAN      1
+#define EMEXFS_STATE_MOUNTED    2
+
+#define EMEXFS_ROOT_INODE       1         // inode 0 is never used
+
+#define EMEXFS_TYPE_FILE        1
+#define EMEXFS_TYPE_DIR         2
+
+#define EMEXFS_INLINE_EXTENTS   6
+#define EMEXFS_BLOCK_EXTENTS    (EMEXFS_BLOCK_SIZE / sizeof(EmexfsExtent))
+#define EMEXFS_MAX_EXTENTS      (EMEXFS_INLINE_EXTENTS + EMEXFS_BLOCK_EXTENTS)
+
+#define EMEXFS_NAME_MAX         54
+#define EMEXFS_DIRENTS_PER_BLOCK (EMEXFS_BLOCK_SIZE / sizeof(EmexfsDirent))
+#define EMEXFS_DIR_MAX_BUCKETS  1024
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t block_count;
+    uint32_t inode_count;
+    uint32_t free_blocks;
+    uint32_t free_inodes;
+    uint32_t summary_start;
+    uint32_t summary_blocks;
+    uint32_t block_bitmap_start;
+    uint32_t block_bitmap_blocks;    // also the number of groups
+    uint32_t inode_bitmap_start;
+    uint32_t inode_bitmap_blocks;
+    uint32_t inode_table_start;
+    uint32_t inode_table_blocks;
+    uint32_t data_start;
+    uint32_t root_inode;
+    uint32_t state;
+    uint32_t checksum;               // emexfs_checksum() with this field 0
+    uint64_t created;                // seconds since 1970
+    char label[32];
+} EmexfsSuper;
+
+typedef struct {
+    uint32_t file_block;
+    uint32_t disk_block;
+    uint32_t length;                 // blocks
+    uint32_t reserved;
+} EmexfsExtent;
+
+typedef struct {
+    uint16_t type;                   // 0 for a free inode
+    uint16_t links;
+    uint32_t dir_buckets;            // directories: blocks of the hash table
+    uint64_t size;                   // bytes
+    uint64_t mtime;
+    uint32_t extent_count;           // in file block order
+    uint32_t extent_block;           // extents past the inline ones, 0 if none
+    EmexfsExtent extents[EMEXFS_INLINE_EXTENTS];
+} EmexfsInode;
+
+typedef struct {
+    uint32_t inode;                  // 0 for a free slot
+    uint32_t hash;
+    uint8_t name_len;
+    uint8_t type;
+    char name[EMEXFS_NAME_MAX];      // not terminated
+} EmexfsDirent;
+
+#define EMEXFS_INODE_SIZE       128
+#define EMEXFS_INODES_PER_BLOCK (EMEXFS_BLOCK_SIZE / EMEXFS_INODE_SIZE)
+
+_Static_assert(sizeof(EmexfsInode) == EMEXFS_INODE_SIZE, "inode size");
+_Static_assert(sizeof(EmexfsDirent) == 64, "directory entry size");
+_Static_assert(sizeof(EmexfsSuper) <= EMEXFS_BLOCK_SIZE, "superblock size");
+
+// FNV-1a, for directory names and the superblock checksum
+static inline uint32_t emexfs_hash(const void* data, uint32_t length) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static inline uint32_t emexfs_checksum(const EmexfsSuper* super) {
+    EmexfsSuper copy = *super;
+    copy.checksum = 0;
+    return emexfs_hash(&copy, sizeof(copy));
+}
+
+#endif
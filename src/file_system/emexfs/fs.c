@@ -0,0 +1,1004 @@
+#include "emexfs.h"
+#include "../../drivers/block/bcache.h"
+#include "../../include/lib/string.h"
+#include "../../include/memory/memory.h"
+#include "../../kernel/idt.h"
+#include "../../kernel/sched.h"
+#include "../../kernel/time.h"
+#include <stddef.h>
+
+_Static_assert(EMEXFS_BLOCK_SIZE == BCACHE_BLOCK_SIZE, "emexFS blocks are cache blocks");
+
+#define NO_BIT  EMEXFS_BITS_PER_BLOCK
+#define SUMMARY_PER_BLOCK (EMEXFS_BLOCK_SIZE / sizeof(uint32_t))
+
+static int fs_dev = -1;
+static EmexfsSuper super;
+static uint32_t* summary;            // free blocks per group, written back on sync
+static uint64_t mount_us;
+static int recovered;
+
+// Operations sleep on disk reads while they hold it, so it is a flag
+// and a wait queue rather than a spinlock. Threads only run on the BSP.
+static volatile int fs_busy = 0;
+static WaitQueue fs_waiters;
+
+static void fs_lock(void) {
+    uint64_t flags = irq_save();
+    while (fs_busy) {
+        wait_queue_sleep(&fs_waiters);
+    }
+    fs_busy = 1;
+    irq_restore(flags);
+}
+
+static void fs_unlock(void) {
+    uint64_t flags = irq_save();
+    fs_busy = 0;
+    irq_restore(flags);
+    wait_queue_wake_all(&fs_waiters);
+}
+
+static Buffer* fs_read(uint32_t block) {
+    return bcache_read(fs_dev, block);
+}
+
+// Bitmaps
+
+static inline int bit_test(const uint64_t* words, uint32_t bit) {
+    return (words[bit / 64] >> (bit % 64)) & 1;
+}
+
+static inline void bit_set(uint64_t* words, uint32_t bit) {
+    words[bit / 64] |= 1ull << (bit % 64);
+}
+
+static inline void bit_clear(uint64_t* words, uint32_t bit) {
+    words[bit / 64] &= ~(1ull << (bit % 64));
+}
+
+// First clear bit at or after start, NO_BIT if there is none
+static uint32_t find_zero(const uint64_t* words, uint32_t start) {
+    uint32_t i = start / 64;
+    uint64_t word = words[i] | ((1ull << (start % 64)) - 1);
+    for (;;) {
+        if (~word) {
+            return i * 64 + (uint32_t)__builtin_ctzll(~word);
+        }
+        if (++i == EMEXFS_BITS_PER_BLOCK / 64) {
+            return NO_BIT;
+        }
+        word = words[i];
+    }
+}
+
+static uint32_t count_bits(const uint64_t* words) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < EMEXFS_BITS_PER_BLOCK / 64; i++) {
+        uint64_t w = words[i];
+        w = w - ((w >> 1) & 0x5555555555555555ull);
+        w = (w & 0x3333333333333333ull) + ((w >> 2) & 0x3333333333333333ull);
+        w = (w + (w >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+        count += (uint32_t)((w * 0x0101010101010101ull) >> 56);
+    }
+    return count;
+}
+
+// Claim up to want free blocks in a row, searching from goal onwards.
+// The summary skips full groups without reading their bitmaps. Returns
+// the first block and sets *got, 0 if the disk is full.
+static uint32_t block_alloc(uint32_t goal, uint32_t want, uint32_t* got) {
+    uint32_t groups = super.block_bitmap_blocks;
+    if (goal < super.data_start || goal >= super.block_count) {
+        goal = super.data_start;
+    }
+    uint32_t first = goal / EMEXFS_BITS_PER_BLOCK;
+
+    for (uint32_t i = 0; i <= groups; i++) {
+        uint32_t g = (first + i) % groups;
+        if (!summary[g]) {
+            continue;
+        }
+        Buffer* buf = fs_read(super.block_bitmap_start + g);
+        if (!buf) {
+            return 0;
+        }
+        uint64_t* words = (uint64_t*)buf->data;
+
+        uint32_t bit = NO_BIT;
+        if (i == 0) {
+            bit = find_zero(words, goal % EMEXFS_BITS_PER_BLOCK);
+        }
+        if (bit == NO_BIT) {
+            bit = find_zero(words, 0);
+        }
+        if (bit == NO_BIT) {
+            bcache_release(buf);
+            continue;
+        }
+
+        uint32_t count = 0;
+        while (count < want && bit + count < EMEXFS_BITS_PER_BLOCK && !bit_test(words, bit + count)) {
+            bit_set(words, bit + count);
+            count++;
+        }
+        bcache_mark_dirty(buf);
+        bcache_release(buf);
+
+        summary[g] -= count;
+        super.free_blocks -= count;
+        *got = count;
+        return g * EMEXFS_BITS_PER_BLOCK + bit;
+    }
+    return 0;
+}
+
+static void block_free(uint32_t block, uint32_t count) {
+    while (count) {
+        uint32_t g = block / EMEXFS_BITS_PER_BLOCK;
+        uint32_t bit = block % EMEXFS_BITS_PER_BLOCK;
+        uint32_t n = EMEXFS_BITS_PER_BLOCK - bit;
+        if (n > count) {
+            n = count;
+        }
+
+        Buffer* buf = fs_read(super.block_bitmap_start + g);
+        if (!buf) {
+            return;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            bit_clear((uint64_t*)buf->data, bit + i);
+        }
+        bcache_mark_dirty(buf);
+        bcache_release(buf);
+
+        summary[g] += n;
+        super.free_blocks += n;
+        block += n;
+        count -= n;
+    }
+}
+
+// Inodes
+
+static uint32_t inode_alloc(void) {
+    if (!super.free_inodes) {
+        return 0;
+    }
+    for (uint32_t b = 0; b < super.inode_bitmap_blocks; b++) {
+        Buffer* buf = fs_read(super.inode_bitmap_start + b);
+        if (!buf) {
+            return 0;
+        }
+        uint32_t bit = find_zero((uint64_t*)buf->data, 0);
+        uint32_t ino = b * EMEXFS_BITS_PER_BLOCK + bit;
+        if (bit != NO_BIT && ino < super.inode_count) {
+            bit_set((uint64_t*)buf->data, bit);
+            bcache_mark_dirty(buf);
+            bcache_release(buf);
+            super.free_inodes--;
+            return ino;
+        }
+        bcache_release(buf);
+    }
+    return 0;
+}
+
+static int inode_read(uint32_t ino, EmexfsInode* inode) {
+    if (!ino || ino >= super.inode_count) {
+        return -1;
+    }
+    Buffer* buf = fs_read(super.inode_table_start + ino / EMEXFS_INODES_PER_BLOCK);
+    if (!buf) {
+        return -1;
+    }
+    memcpy(inode, buf->data + (ino % EMEXFS_INODES_PER_BLOCK) * EMEXFS_INODE_SIZE, sizeof(EmexfsInode));
+    bcache_release(buf);
+    return 0;
+}
+
+static int inode_write(uint32_t ino, const EmexfsInode* inode) {
+    Buffer* buf = fs_read(super.inode_table_start + ino / EMEXFS_INODES_PER_BLOCK);
+    if (!buf) {
+        return -1;
+    }
+    memcpy(buf->data + (ino % EMEXFS_INODES_PER_BLOCK) * EMEXFS_INODE_SIZE, inode, sizeof(EmexfsInode));
+    bcache_mark_dirty(buf);
+    bcache_release(buf);
+    return 0;
+}
+
+static void inode_free(uint32_t ino) {
+    EmexfsInode empty;
+    memset(&empty, 0, sizeof(empty));
+    inode_write(ino, &empty);
+
+    Buffer* buf = fs_read(super.inode_bitmap_start + ino / EMEXFS_BITS_PER_BLOCK);
+    if (buf) {
+        bit_clear((uint64_t*)buf->data, ino % EMEXFS_BITS_PER_BLOCK);
+        bcache_mark_dirty(buf);
+        bcache_release(buf);
+        super.free_inodes++;
+    }
+}
+
+// Extents
+
+static int extent_get(const EmexfsInode* inode, uint32_t index, EmexfsExtent* extent) {
+    if (index < EMEXFS_INLINE_EXTENTS) {
+        *extent = inode->extents[index];
+        return 0;
+    }
+    Buffer* buf = fs_read(inode->extent_block);
+    if (!buf) {
+        return -1;
+    }
+    *extent = ((EmexfsExtent*)buf->data)[index - EMEXFS_INLINE_EXTENTS];
+    bcache_release(buf);
+    return 0;
+}
+
+static int extent_set(EmexfsInode* inode, uint32_t index, const EmexfsExtent* extent) {
+    if (index < EMEXFS_INLINE_EXTENTS) {
+        inode->extents[index] = *extent;
+        return 0;
+    }
+    Buffer* buf = fs_read(inode->extent_block);
+    if (!buf) {
+        return -1;
+    }
+    ((EmexfsExtent*)buf->data)[index - EMEXFS_INLINE_EXTENTS] = *extent;
+    bcache_mark_dirty(buf);
+    bcache_release(buf);
+    return 0;
+}
+
+// Blocks the extents cover
+static uint32_t inode_blocks(const EmexfsInode* inode) {
+    EmexfsExtent last;
+    if (!inode->extent_count || extent_get(inode, inode->extent_count - 1, &last) != 0) {
+        return 0;
+    }
+    return last.file_block + last.length;
+}
+
+// Disk block of a file block by binary search over the extents, 0 if
+// it isn't mapped
+static uint32_t inode_map(const EmexfsInode* inode, uint32_t file_block) {
+    uint32_t lo = 0;
+    uint32_t hi = inode->extent_count;
+    EmexfsExtent extent;
+
+    // First extent starting after the block
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (extent_get(inode, mid, &extent) != 0) {
+            return 0;
+        }
+        if (extent.file_block <= file_block) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (!lo || extent_get(inode, lo - 1, &extent) != 0 ||
+        file_block >= extent.file_block + extent.length) {
+        return 0;
+    }
+    return extent.disk_block + (file_block - extent.file_block);
+}
+
+// Map length more blocks at the end of the file, growing the last
+// extent when they follow it on disk
+static int extent_append(EmexfsInode* inode, uint32_t disk_block, uint32_t length) {
+    EmexfsExtent extent;
+    uint32_t count = inode->extent_count;
+
+    if (count) {
+        if (extent_get(inode, count - 1, &extent) != 0) {
+            return -1;
+        }
+        if (extent.disk_block + extent.length == disk_block) {
+            extent.length += length;
+            return extent_set(inode, count - 1, &extent);
+        }
+    }
+    if (count >= EMEXFS_MAX_EXTENTS) {
+        return -1;
+    }
+
+    if (count == EMEXFS_INLINE_EXTENTS && !inode->extent_block) {
+        uint32_t got;
+        uint32_t block = block_alloc(disk_block, 1, &got);
+        Buffer* buf = block ? bcache_get(fs_dev, block) : NULL;
+        if (!buf) {
+            if (block) {
+                block_free(block, 1);
+            }
+            return -1;
+        }
+        memset(buf->data, 0, EMEXFS_BLOCK_SIZE);
+        bcache_mark_dirty(buf);
+        bcache_release(buf);
+        inode->extent_block = block;
+    }
+
+    extent.file_block = count ? extent.file_block + extent.length : 0;
+    extent.disk_block = disk_block;
+    extent.length = length;
+    extent.reserved = 0;
+    if (extent_set(inode, count, &extent) != 0) {
+        return -1;
+    }
+    inode->extent_count++;
+    return 0;
+}
+
+// Add count zeroed blocks to the end of the file, as few extents as
+// the free space allows
+static int file_extend(EmexfsInode* inode, uint32_t count) {
+    while (count) {
+        uint32_t have = inode_blocks(inode);
+        uint32_t goal = have ? inode_map(inode, have - 1) + 1 : super.data_start;
+
+        uint32_t got;
+        uint32_t block = block_alloc(goal, count, &got);
+        if (!block) {
+            return -1;
+        }
+        if (extent_append(inode, block, got) != 0) {
+            block_free(block, got);
+            return -1;
+        }
+
+        for (uint32_t i = 0; i < got; i++) {
+            Buffer* buf = bcache_get(fs_dev, block + i);
+            if (!buf) {
+                return -1;
+            }
+            memset(buf->data, 0, EMEXFS_BLOCK_SIZE);
+            bcache_mark_dirty(buf);
+            bcache_release(buf);
+        }
+        count -= got;
+    }
+    return 0;
+}
+
+static void file_free_blocks(const EmexfsInode* inode) {
+    for (uint32_t i = 0; i < inode->extent_count; i++) {
+        EmexfsExtent extent;
+        if (extent_get(inode, i, &extent) == 0) {
+            block_free(extent.disk_block, extent.length);
+        }
+    }
+    if (inode->extent_block) {
+        block_free(inode->extent_block, 1);
+    }
+}
+
+// Directories
+
+static int dir_find(const EmexfsInode* dir, const char* name, uint32_t length, EmexfsDirent* entry) {
+    uint32_t hash = emexfs_hash(name, length);
+    uint32_t block = inode_map(dir, hash & (dir->dir_buckets - 1));
+    Buffer* buf = block ? fs_read(block) : NULL;
+    if (!buf) {
+        return -1;
+    }
+
+    EmexfsDirent* slots = (EmexfsDirent*)buf->data;
+    for (uint32_t i = 0; i < EMEXFS_DIRENTS_PER_BLOCK; i++) {
+        EmexfsDirent* slot = &slots[i];
+        if (slot->inode && slot->hash == hash && slot->name_len == length &&
+            memcmp(slot->name, name, length) == 0) {
+            if (entry) {
+                *entry = *slot;
+            }
+            bcache_release(buf);
+            return 0;
+        }
+    }
+    bcache_release(buf);
+    return -1;
+}
+
+// A slot holds an entry of bucket b if its hash still maps there. A
+// dir_grow() that failed half way can leave copies of moved entries in
+// their old bucket; those read as free.
+static inline int slot_live(const EmexfsDirent* slot, const EmexfsInode* dir, uint32_t b) {
+    return slot->inode && (slot->hash & (dir->dir_buckets - 1)) == b;
+}
+
+// Double the buckets; entries of bucket i with the new hash bit set
+// move to bucket i + n, the others stay. The entries are copied first
+// and only cleared from bucket i once the inode points at the new
+// buckets, so an I/O error at any step leaves every entry reachable.
+static int dir_grow(uint32_t dir_ino, EmexfsInode* dir) {
+    uint32_t n = dir->dir_buckets;
+    if (n * 2 > EMEXFS_DIR_MAX_BUCKETS) {
+        return -1;
+    }
+    // An earlier grow that failed may have extended the file already
+    uint32_t have = inode_blocks(dir);
+    if (have < n * 2 && file_extend(dir, n * 2 - have) != 0) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        Buffer* from = fs_read(inode_map(dir, i));
+        Buffer* to = from ? fs_read(inode_map(dir, i + n)) : NULL;
+        if (!to) {
+            if (from) {
+                bcache_release(from);
+            }
+            // Keep the new blocks for the next try instead of leaking them
+            inode_write(dir_ino, dir);
+            return -1;
+        }
+
+        EmexfsDirent* old_slots = (EmexfsDirent*)from->data;
+        EmexfsDirent* new_slots = (EmexfsDirent*)to->data;
+        uint32_t used = 0;
+        memset(new_slots, 0, EMEXFS_BLOCK_SIZE);
+        for (uint32_t s = 0; s < EMEXFS_DIRENTS_PER_BLOCK; s++) {
+            if (slot_live(&old_slots[s], dir, i) && (old_slots[s].hash & n)) {
+                new_slots[used++] = old_slots[s];
+            }
+        }
+        bcache_mark_dirty(to);
+        bcache_release(from);
+        bcache_release(to);
+    }
+
+    dir->dir_buckets = n * 2;
+    dir->size = (uint64_t)dir->dir_buckets * EMEXFS_BLOCK_SIZE;
+    if (inode_write(dir_ino, dir) != 0) {
+        return -1;
+    }
+
+    // Lookups no longer go to bucket i for these; clearing them only
+    // gives the slots back, a block that can't be read keeps its copies
+    for (uint32_t i = 0; i < n; i++) {
+        Buffer* buf = fs_read(inode_map(dir, i));
+        if (!buf) {
+            continue;
+        }
+        EmexfsDirent* slots = (EmexfsDirent*)buf->data;
+        int cleared = 0;
+        for (uint32_t s = 0; s < EMEXFS_DIRENTS_PER_BLOCK; s++) {
+            if (slots[s].inode && !slot_live(&slots[s], dir, i)) {
+                memset(&slots[s], 0, sizeof(EmexfsDirent));
+                cleared = 1;
+            }
+        }
+        if (cleared) {
+            bcache_mark_dirty(buf);
+        }
+        bcache_release(buf);
+    }
+    return 0;
+}
+
+static int dir_add(uint32_t dir_ino, EmexfsInode* dir, const char* name, uint32_t length,
+                   uint32_t ino, uint8_t type) {
+    uint32_t hash = emexfs_hash(name, length);
+
+    for (;;) {
+        uint32_t bucket = hash & (dir->dir_buckets - 1);
+        uint32_t block = inode_map(dir, bucket);
+        Buffer* buf = block ? fs_read(block) : NULL;
+        if (!buf) {
+            return -1;
+        }
+
+        EmexfsDirent* slots = (EmexfsDirent*)buf->data;
+        for (uint32_t i = 0; i < EMEXFS_DIRENTS_PER_BLOCK; i++) {
+            if (!slot_live(&slots[i], dir, bucket)) {
+                memset(&slots[i], 0, sizeof(EmexfsDirent));
+                slots[i].inode = ino;
+                slots[i].hash = hash;
+                slots[i].name_len = (uint8_t)length;
+                slots[i].type = type;
+                memcpy(slots[i].name, name, length);
+                bcache_mark_dirty(buf);
+                bcache_release(buf);
+                return 0;
+            }
+        }
+        bcache_release(buf);
+
+        if (dir_grow(dir_ino, dir) != 0) {
+            return -1;
+        }
+    }
+}
+
+static int dir_remove(const EmexfsInode* dir, const char* name, uint32_t length) {
+    uint32_t hash = emexfs_hash(name, length);
+    uint32_t block = inode_map(dir, hash & (dir->dir_buckets - 1));
+    Buffer* buf = block ? fs_read(block) : NULL;
+    if (!buf) {
+        return -1;
+    }
+
+    EmexfsDirent* slots = (EmexfsDirent*)buf->data;
+    for (uint32_t i = 0; i < EMEXFS_DIRENTS_PER_BLOCK; i++) {
+        if (slots[i].inode && slots[i].hash == hash && slots[i].name_len == length &&
+            memcmp(slots[i].name, name, length) == 0) {
+            memset(&slots[i], 0, sizeof(EmexfsDirent));
+            bcache_mark_dirty(buf);
+            bcache_release(buf);
+            return 0;
+        }
+    }
+    bcache_release(buf);
+    return -1;
+}
+
+static int dir_empty(const EmexfsInode* dir) {
+    for (uint32_t b = 0; b < dir->dir_buckets; b++) {
+        Buffer* buf = fs_read(inode_map(dir, b));
+        if (!buf) {
+            return 0;
+        }
+        EmexfsDirent* slots = (EmexfsDirent*)buf->data;
+        for (uint32_t i = 0; i < EMEXFS_DIRENTS_PER_BLOCK; i++) {
+            if (slot_live(&slots[i], dir, b)) {
+                bcache_release(buf);
+                return 0;
+            }
+        }
+        bcache_release(buf);
+    }
+    return 1;
+}
+
+// Paths
+
+// Inode of the first length bytes of an absolute path
+static int path_walk(const char* path, uint32_t length, uint32_t* ino, EmexfsInode* inode) {
+    uint32_t current = super.root_inode;
+    if (inode_read(current, inode) != 0) {
+        return -1;
+    }
+
+    uint32_t i = 0;
+    for (;;) {
+        while (i < length && path[i] == '/') {
+            i++;
+        }
+        if (i == length) {
+            break;
+        }
+        uint32_t start = i;
+        while (i < length && path[i] != '/') {
+            i++;
+        }
+
+        EmexfsDirent entry;
+        if (inode->type != EMEXFS_TYPE_DIR || dir_find(inode, path + start, i - start, &entry) != 0 ||
+            inode_read(entry.inode, inode) != 0) {
+            return -1;
+        }
+        current = entry.inode;
+    }
+
+    *ino = current;
+    return 0;
+}
+
+// Directory holding the last component of a path, and that component
+static int path_parent(const char* path, uint32_t* dir_ino, EmexfsInode* dir,
+                       const char** name, uint32_t* name_length) {
+    uint32_t end = (uint32_t)strlen(path);
+    while (end && path[end - 1] == '/') {
+        end--;
+    }
+    uint32_t start = end;
+    while (start && path[start - 1] != '/') {
+        start--;
+    }
+
+    uint32_t length = end - start;
+    if (path[0] != '/' || !length || length > EMEXFS_NAME_MAX ||
+        (length == 1 && path[start] == '.') ||
+        (length == 2 && path[start] == '.' && path[start + 1] == '.')) {
+        return -1;
+    }
+    if (path_walk(path, start, dir_ino, dir) != 0 || dir->type != EMEXFS_TYPE_DIR) {
+        return -1;
+    }
+
+    *name = path + start;
+    *name_length = length;
+    return 0;
+}
+
+static void node_fill(FsNode* node, uint32_t ino, const EmexfsInode* inode) {
+    node->inode = ino;
+    node->type = inode->type == EMEXFS_TYPE_DIR ? FS_DIR : FS_FILE;
+    node->size = inode->size;
+}
+
+// Superblock and summary
+
+static int super_write(void) {
+    Buffer* buf = fs_read(0);
+    if (!buf) {
+        return -1;
+    }
+    super.checksum = emexfs_checksum(&super);
+    memcpy(buf->data, &super, sizeof(EmexfsSuper));
+    bcache_mark_dirty(buf);
+    bcache_release(buf);
+
+    uint32_t groups = super.block_bitmap_blocks;
+    for (uint32_t i = 0; i * SUMMARY_PER_BLOCK < groups; i++) {
+        buf = fs_read(super.summary_start + i);
+        if (!buf) {
+            return -1;
+        }
+        uint32_t count = groups - i * SUMMARY_PER_BLOCK;
+        if (count > SUMMARY_PER_BLOCK) {
+            count = SUMMARY_PER_BLOCK;
+        }
+        memcpy(buf->data, summary + i * SUMMARY_PER_BLOCK, count * sizeof(uint32_t));
+        bcache_mark_dirty(buf);
+        bcache_release(buf);
+    }
+    return 0;
+}
+
+// After a crash: free counts from the bitmaps (bits past the end are set)
+static int recount(void) {
+    super.free_blocks = 0;
+    for (uint32_t g = 0; g < super.block_bitmap_blocks; g++) {
+        Buffer* buf = fs_read(super.block_bitmap_start + g);
+        if (!buf) {
+            return -1;
+        }
+        summary[g] = EMEXFS_BITS_PER_BLOCK - count_bits((uint64_t*)buf->data);
+        super.free_blocks += summary[g];
+        bcache_release(buf);
+    }
+
+    super.free_inodes = 0;
+    for (uint32_t b = 0; b < super.inode_bitmap_blocks; b++) {
+        Buffer* buf = fs_read(super.inode_bitmap_start + b);
+        if (!buf) {
+            return -1;
+        }
+        super.free_inodes += EMEXFS_BITS_PER_BLOCK - count_bits((uint64_t*)buf->data);
+        bcache_release(buf);
+    }
+    return 0;
+}
+
+static int super_valid(const EmexfsSuper* sb, int dev) {
+    BlockDeviceInfo info;
+    if (block_get_info(dev, &info) != 0) {
+        return 0;
+    }
+    uint32_t groups = (sb->block_count + EMEXFS_BITS_PER_BLOCK - 1) / EMEXFS_BITS_PER_BLOCK;
+    return sb->magic == EMEXFS_MAGIC && sb->version == EMEXFS_VERSION &&
+           sb->block_size == EMEXFS_BLOCK_SIZE && sb->checksum == emexfs_checksum(sb) &&
+           sb->block_count && sb->block_count <= info.sectors / BCACHE_BLOCK_SECTORS &&
+           sb->block_bitmap_blocks == groups &&
+           sb->summary_blocks * SUMMARY_PER_BLOCK >= groups &&
+           sb->root_inode == EMEXFS_ROOT_INODE && sb->inode_count > EMEXFS_ROOT_INODE &&
+           sb->inode_bitmap_blocks * EMEXFS_BITS_PER_BLOCK >= sb->inode_count &&
+           sb->data_start < sb->block_count;
+}
+
+int emexfs_mount(int dev) {
+    uint64_t start = ktime_ns();
+    fs_lock();
+
+    Buffer* buf = fs_dev < 0 ? bcache_read(dev, 0) : NULL;
+    if (!buf) {
+        fs_unlock();
+        return -1;
+    }
+    EmexfsSuper sb;
+    memcpy(&sb, buf->data, sizeof(EmexfsSuper));
+    bcache_release(buf);
+
+    if (!super_valid(&sb, dev)) {
+        fs_unlock();
+        return -1;
+    }
+
+    summary = (uint32_t*)kmalloc(sb.summary_blocks * EMEXFS_BLOCK_SIZE);
+    if (!summary) {
+        fs_unlock();
+        return -1;
+    }
+    fs_dev = dev;
+    super = sb;
+
+    int failed = 0;
+    for (uint32_t i = 0; i < super.summary_blocks && !failed; i++) {
+        buf = fs_read(super.summary_start + i);
+        if (buf) {
+            memcpy((uint8_t*)summary + i * EMEXFS_BLOCK_SIZE, buf->data, EMEXFS_BLOCK_SIZE);
+            bcache_release(buf);
+        } else {
+            failed = 1;
+        }
+    }
+
+    recovered = super.state != EMEXFS_STATE_CLEAN;
+    if (!failed && recovered) {
+        failed = recount() != 0;
+    }
+
+    // Marked in use on disk until it is unmounted cleanly
+    super.state = EMEXFS_STATE_MOUNTED;
+    if (failed || super_write() != 0 || bcache_sync(dev) != 0) {
+        kfree(summary);
+        summary = NULL;
+        fs_dev = -1;
+        fs_unlock();
+        return -1;
+    }
+
+    mount_us = (ktime_ns() - start) / 1000;
+    fs_unlock();
+    return 0;
+}
+
+int emexfs_sync(void) {
+    fs_lock();
+    int result = -1;
+    if (fs_dev >= 0 && super_write() == 0) {
+        result = bcache_sync(fs_dev);
+    }
+    fs_unlock();
+    return result;
+}
+
+int emexfs_unmount(void) {
+    fs_lock();
+    if (fs_dev < 0) {
+        fs_unlock();
+        return -1;
+    }
+
+    super.state = EMEXFS_STATE_CLEAN;
+    int result = super_write() == 0 ? bcache_sync(fs_dev) : -1;
+    bcache_invalidate(fs_dev);
+    kfree(summary);
+    summary = NULL;
+    fs_dev = -1;
+    fs_unlock();
+    return result;
+}
+
+int emexfs_lookup(const char* path, FsNode* node) {
+    fs_lock();
+    uint32_t ino;
+    EmexfsInode inode;
+    int result = -1;
+    if (fs_dev >= 0 && path[0] == '/' && path_walk(path, (uint32_t)strlen(path), &ino, &inode) == 0) {
+        node_fill(node, ino, &inode);
+        result = 0;
+    }
+    fs_unlock();
+    return result;
+}
+
+int emexfs_readdir(const char* path, FsDirCallback callback, void* arg) {
+    fs_lock();
+    uint32_t ino;
+    EmexfsInode dir;
+    if (fs_dev < 0 || path[0] != '/' || path_walk(path, (uint32_t)strlen(path), &ino, &dir) != 0 ||
+        dir.type != EMEXFS_TYPE_DIR) {
+        fs_unlock();
+        return -1;
+    }
+
+    int count = 0;
+    for (uint32_t b = 0; b < dir.dir_buckets; b++) {
+        Buffer* buf = fs_read(inode_map(&dir, b));
+        if (!buf) {
+            fs_unlock();
+            return -1;
+        }
+        EmexfsDirent* slots = (EmexfsDirent*)buf->data;
+        for (uint32_t i = 0; i < EMEXFS_DIRENTS_PER_BLOCK; i++) {
+            EmexfsInode inode;
+            if (!slot_live(&slots[i], &dir, b) || inode_read(slots[i].inode, &inode) != 0) {
+                continue;
+            }
+            char name[EMEXFS_NAME_MAX + 1];
+            memcpy(name, slots[i].name, slots[i].name_len);
+            name[slots[i].name_len] = '\0';
+
+            FsNode node;
+            node_fill(&node, slots[i].inode, &inode);
+            callback(name, &node, arg);
+            count++;
+        }
+        bcache_release(buf);
+    }
+
+    fs_unlock();
+    return count;
+}
+
+int emexfs_read(const FsNode* node, uint64_t offset, void* buffer, uint32_t length) {
+    fs_lock();
+    EmexfsInode inode;
+    if (fs_dev < 0 || inode_read(node->inode, &inode) != 0 || inode.type != EMEXFS_TYPE_FILE) {
+        fs_unlock();
+        return -1;
+    }
+    if (offset >= inode.size) {
+        fs_unlock();
+        return 0;
+    }
+    if (length > inode.size - offset) {
+        length = (uint32_t)(inode.size - offset);
+    }
+
+    uint8_t* out = (uint8_t*)buffer;
+    uint32_t done = 0;
+    while (done < length) {
+        uint64_t pos = offset + done;
+        uint32_t within = (uint32_t)(pos % EMEXFS_BLOCK_SIZE);
+        uint32_t chunk = EMEXFS_BLOCK_SIZE - within;
+        if (chunk > length - done) {
+            chunk = length - done;
+        }
+
+        uint32_t block = inode_map(&inode, (uint32_t)(pos / EMEXFS_BLOCK_SIZE));
+        Buffer* buf = block ? fs_read(block) : NULL;
+        if (!buf) {
+            fs_unlock();
+            return -1;
+        }
+        memcpy(out + done, buf->data + within, chunk);
+        bcache_release(buf);
+        done += chunk;
+    }
+
+    fs_unlock();
+    return (int)done;
+}
+
+int emexfs_write(FsNode* node, uint64_t offset, const void* buffer, uint32_t length) {
+    fs_lock();
+    EmexfsInode inode;
+    uint64_t end = offset + length;
+    if (fs_dev < 0 || inode_read(node->inode, &inode) != 0 || inode.type != EMEXFS_TYPE_FILE ||
+        end / EMEXFS_BLOCK_SIZE >= 0xFFFFFFFFull) {
+        fs_unlock();
+        return -1;
+    }
+
+    uint32_t need = (uint32_t)((end + EMEXFS_BLOCK_SIZE - 1) / EMEXFS_BLOCK_SIZE);
+    uint32_t have = inode_blocks(&inode);
+    if (need > have && file_extend(&inode, need - have) != 0) {
+        // Keep whatever got mapped, the size stays
+        inode_write(node->inode, &inode);
+        fs_unlock();
+        return -1;
+    }
+
+    const uint8_t* in = (const uint8_t*)buffer;
+    uint32_t done = 0;
+    while (done < length) {
+        uint64_t pos = offset + done;
+        uint32_t within = (uint32_t)(pos % EMEXFS_BLOCK_SIZE);
+        uint32_t chunk = EMEXFS_BLOCK_SIZE - within;
+        if (chunk > length - done) {
+            chunk = length - done;
+        }
+
+        // A whole block is overwritten without reading it first
+        uint32_t block = inode_map(&inode, (uint32_t)(pos / EMEXFS_BLOCK_SIZE));
+        Buffer* buf = NULL;
+        if (block) {
+            buf = chunk == EMEXFS_BLOCK_SIZE ? bcache_get(fs_dev, block) : fs_read(block);
+        }
+        if (!buf) {
+            break;
+        }
+        memcpy(buf->data + within, in + done, chunk);
+        bcache_mark_dirty(buf);
+        bcache_release(buf);
+        done += chunk;
+    }
+
+    if (offset + done > inode.size) {
+        inode.size = offset + done;
+    }
+    int result = inode_write(node->inode, &inode) == 0 && done == length ? (int)done : -1;
+    node->size = inode.size;
+    fs_unlock();
+    return result;
+}
+
+int emexfs_create(const char* path, FsNodeType type, FsNode* node) {
+    fs_lock();
+    uint32_t dir_ino;
+    EmexfsInode dir;
+    const char* name;
+    uint32_t length;
+    if (fs_dev < 0 || (type != FS_FILE && type != FS_DIR) ||
+        path_parent(path, &dir_ino, &dir, &name, &length) != 0 ||
+        dir_find(&dir, name, length, NULL) == 0) {
+        fs_unlock();
+        return -1;
+    }
+
+    uint32_t ino = inode_alloc();
+    if (!ino) {
+        fs_unlock();
+        return -1;
+    }
+
+    EmexfsInode inode;
+    memset(&inode, 0, sizeof(inode));
+    inode.type = type == FS_DIR ? EMEXFS_TYPE_DIR : EMEXFS_TYPE_FILE;
+    inode.links = 1;
+    if (type == FS_DIR) {
+        inode.dir_buckets = 1;
+        inode.size = EMEXFS_BLOCK_SIZE;
+    }
+
+    if ((type == FS_DIR && file_extend(&inode, 1) != 0) || inode_write(ino, &inode) != 0 ||
+        dir_add(dir_ino, &dir, name, length, ino, (uint8_t)inode.type) != 0) {
+        file_free_blocks(&inode);
+        inode_free(ino);
+        fs_unlock();
+        return -1;
+    }
+
+    if (node) {
+        node_fill(node, ino, &inode);
+    }
+    fs_unlock();
+    return 0;
+}
+
+int emexfs_remove(const char* path) {
+    fs_lock();
+    uint32_t dir_ino;
+    EmexfsInode dir;
+    const char* name;
+    uint32_t length;
+    EmexfsDirent entry;
+    EmexfsInode inode;
+    if (fs_dev < 0 || path_parent(path, &dir_ino, &dir, &name, &length) != 0 ||
+        dir_find(&dir, name, length, &entry) != 0 || inode_read(entry.inode, &inode) != 0 ||
+        (inode.type == EMEXFS_TYPE_DIR && !dir_empty(&inode)) ||
+        dir_remove(&dir, name, length) != 0) {
+        fs_unlock();
+        return -1;
+    }
+
+    file_free_blocks(&inode);
+    inode_free(entry.inode);
+    fs_unlock();
+    return 0;
+}
+
+void emexfs_get_info(EmexfsInfo* info) {
+    fs_lock();
+    memset(info, 0, sizeof(EmexfsInfo));
+    info->dev = fs_dev;
+    if (fs_dev >= 0) {
+        memcpy(info->label, super.label, sizeof(info->label));
+        info->label[sizeof(info->label) - 1] = '\0';
+        info->block_count = super.block_count;
+        info->free_blocks = super.free_blocks;
+        info->inode_count = super.inode_count;
+        info->free_inodes = super.free_inodes;
+        info->groups = super.block_bitmap_blocks;
+        info->mount_us = mount_us;
+        info->recovered = recovered;
+    }
+    fs_unlock();
+}
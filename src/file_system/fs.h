@@ -1,4 +1,25 @@
 // this is the header for every file system in this os...
 // current file systems:
-// - emexFS
+// - emexFS (emexfs/emexfs.h, on-disk format in emexfs/format.h)
 //
+#ifndef FS_H
+#define FS_H
+
+#include <stdint.h>
+
+typedef enum {
+    FS_NONE,
+    FS_FILE,
+    FS_DIR
+} FsNodeType;
+
+typedef struct {
+    uint32_t inode;
+    FsNodeType type;
+    uint64_t size;                   // bytes
+} FsNode;
+
+// Called for every entry of a directory, in no particular order
+typedef void (*FsDirCallback)(const char* name, const FsNode* node, void* arg);
+
+#endif
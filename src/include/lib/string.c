@@ -0,0 +1,549 @@
+#include "string.h"
+#include "../text/text_utils.h"
+#include "../memory/memory.h"
+#include "../../kernel/idt.h"
+#include "../../kernel/time.h"
+
+// This file must be built with -fno-tree-loop-distribute-patterns,
+// otherwise gcc turns the copy loops below back into memcpy calls.
+
+// Unaligned, aliasing-safe access types
+typedef uint64_t u64_u __attribute__((aligned(1), may_alias));
+typedef uint32_t u32_u __attribute__((aligned(1), may_alias));
+typedef uint16_t u16_u __attribute__((aligned(1), may_alias));
+typedef long long v16_u __attribute__((vector_size(16), aligned(1), may_alias));
+typedef long long v32_u __attribute__((vector_size(32), aligned(1), may_alias));
+typedef char v16qi __attribute__((vector_size(16), may_alias));
+
+// AVX2 runs with interrupts off (ymm state is not saved on interrupt
+// entry), this bounds how long they stay off
+#define AVX2_CHUNK     4096
+#define AVX2_MIN_SIZE  256
+
+// CPUID bits
+#define CPUID1_ECX_XSAVE    (1u << 26)
+#define CPUID1_ECX_AVX      (1u << 28)
+#define CPUID7_EBX_AVX2     (1u << 5)
+#define CPUID7_EBX_ERMS     (1u << 9)
+
+#define CR4_OSXSAVE         (1ULL << 18)
+#define XCR0_X87_SSE_AVX    0x7
+
+// ---- small sizes ---------------------------------------------------------
+
+// Up to 64 bytes with two possibly overlapping loads and stores; all
+// loads happen before the stores so this is also safe for memmove
+static inline void copy_small(uint8_t* d, const uint8_t* s, size_t n) {
+    if (n >= 32) {
+        v16_u a = *(const v16_u*)s;
+        v16_u b = *(const v16_u*)(s + 16);
+        v16_u c = *(const v16_u*)(s + n - 32);
+        v16_u e = *(const v16_u*)(s + n - 16);
+        *(v16_u*)d = a;
+        *(v16_u*)(d + 16) = b;
+        *(v16_u*)(d + n - 32) = c;
+        *(v16_u*)(d + n - 16) = e;
+    } else if (n >= 16) {
+        v16_u a = *(const v16_u*)s;
+        v16_u b = *(const v16_u*)(s + n - 16);
+        *(v16_u*)d = a;
+        *(v16_u*)(d + n - 16) = b;
+    } else if (n >= 8) {
+        uint64_t a = *(const u64_u*)s;
+        uint64_t b = *(const u64_u*)(s + n - 8);
+        *(u64_u*)d = a;
+        *(u64_u*)(d + n - 8) = b;
+    } else if (n >= 4) {
+        uint32_t a = *(const u32_u*)s;
+        uint32_t b = *(const u32_u*)(s + n - 4);
+        *(u32_u*)d = a;
+        *(u32_u*)(d + n - 4) = b;
+    } else if (n >= 2) {
+        uint16_t a = *(const u16_u*)s;
+        uint16_t b = *(const u16_u*)(s + n - 2);
+        *(u16_u*)d = a;
+        *(u16_u*)(d + n - 2) = b;
+    } else if (n == 1) {
+        *d = *s;
+    }
+}
+
+static inline void set_small(uint8_t* d, uint64_t pattern, size_t n) {
+    if (n >= 16) {
+        v16_u v = { (long long)pattern, (long long)pattern };
+        for (size_t i = 0; i + 16 <= n; i += 16) {
+            *(v16_u*)(d + i) = v;
+        }
+        *(v16_u*)(d + n - 16) = v;
+    } else if (n >= 8) {
+        *(u64_u*)d = pattern;
+        *(u64_u*)(d + n - 8) = pattern;
+    } else if (n >= 4) {
+        *(u32_u*)d = (uint32_t)pattern;
+        *(u32_u*)(d + n - 4) = (uint32_t)pattern;
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            d[i] = (uint8_t)pattern;
+        }
+    }
+}
+
+// ---- SSE2 (always there on x86_64) -------------------------------------
+
+static void* memcpy_sse2(void* dest, const void* src, size_t n) {
+    uint8_t* d = dest;
+    const uint8_t* s = src;
+
+    if (n <= 64) {
+        copy_small(d, s, n);
+        return dest;
+    }
+
+    // The last 64 bytes are loaded first and stored last, which covers
+    // the tail and keeps forward overlapping moves (dest < src) correct
+    v16_u t0 = *(const v16_u*)(s + n - 64);
+    v16_u t1 = *(const v16_u*)(s + n - 48);
+    v16_u t2 = *(const v16_u*)(s + n - 32);
+    v16_u t3 = *(const v16_u*)(s + n - 16);
+    uint8_t* end = d + n - 64;
+
+    while (d < end) {
+        v16_u a = *(const v16_u*)s;
+        v16_u b = *(const v16_u*)(s + 16);
+        v16_u c = *(const v16_u*)(s + 32);
+        v16_u e = *(const v16_u*)(s + 48);
+        *(v16_u*)d = a;
+        *(v16_u*)(d + 16) = b;
+        *(v16_u*)(d + 32) = c;
+        *(v16_u*)(d + 48) = e;
+        d += 64;
+        s += 64;
+    }
+
+    *(v16_u*)end = t0;
+    *(v16_u*)(end + 16) = t1;
+    *(v16_u*)(end + 32) = t2;
+    *(v16_u*)(end + 48) = t3;
+    return dest;
+}
+
+static void* memset_sse2(void* dest, int c, size_t n) {
+    uint8_t* d = dest;
+    uint64_t pattern = 0x0101010101010101ULL * (uint8_t)c;
+
+    if (n <= 64) {
+        set_small(d, pattern, n);
+        return dest;
+    }
+
+    v16_u v = { (long long)pattern, (long long)pattern };
+    uint8_t* end = d + n - 64;
+    while (d < end) {
+        *(v16_u*)d = v;
+        *(v16_u*)(d + 16) = v;
+        *(v16_u*)(d + 32) = v;
+        *(v16_u*)(d + 48) = v;
+        d += 64;
+    }
+
+    *(v16_u*)end = v;
+    *(v16_u*)(end + 16) = v;
+    *(v16_u*)(end + 32) = v;
+    *(v16_u*)(end + 48) = v;
+    return dest;
+}
+
+// ---- ERMS (fast rep movsb / stosb) -------------------------------------
+
+static void* memcpy_erms(void* dest, const void* src, size_t n) {
+    void* d = dest;
+    asm volatile ("rep movsb" : "+D"(d), "+S"(src), "+c"(n) : : "memory");
+    return dest;
+}
+
+static void* memset_erms(void* dest, int c, size_t n) {
+    void* d = dest;
+    asm volatile ("rep stosb" : "+D"(d), "+c"(n) : "a"(c) : "memory");
+    return dest;
+}
+
+// ---- AVX2 ----------------------------------------------------------------
+
+// n is a multiple of 128; gcc adds the vzeroupper on return
+__attribute__((target("avx2"), noinline))
+static void avx2_copy_block(uint8_t* d, const uint8_t* s, size_t n) {
+    for (size_t i = 0; i < n; i += 128) {
+        v32_u a = *(const v32_u*)(s + i);
+        v32_u b = *(const v32_u*)(s + i + 32);
+        v32_u c = *(const v32_u*)(s + i + 64);
+        v32_u e = *(const v32_u*)(s + i + 96);
+        *(v32_u*)(d + i) = a;
+        *(v32_u*)(d + i + 32) = b;
+        *(v32_u*)(d + i + 64) = c;
+        *(v32_u*)(d + i + 96) = e;
+    }
+}
+
+__attribute__((target("avx2"), noinline))
+static void avx2_set_block(uint8_t* d, uint64_t pattern, size_t n) {
+    long long p = (long long)pattern;
+    v32_u v = { p, p, p, p };
+    for (size_t i = 0; i < n; i += 128) {
+        *(v32_u*)(d + i) = v;
+        *(v32_u*)(d + i + 32) = v;
+        *(v32_u*)(d + i + 64) = v;
+        *(v32_u*)(d + i + 96) = v;
+    }
+}
+
+static void* memcpy_avx2(void* dest, const void* src, size_t n) {
+    uint8_t* d = dest;
+    const uint8_t* s = src;
+
+    if (n < AVX2_MIN_SIZE) {
+        return memcpy_sse2(dest, src, n);
+    }
+
+    // Align the stores, split 32 byte stores are slow
+    size_t head = -(uintptr_t)d & 31;
+    copy_small(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+
+    while (n >= 128) {
+        size_t chunk = n < AVX2_CHUNK ? (n & ~(size_t)127) : AVX2_CHUNK;
+
+        uint64_t flags = irq_save();
+        avx2_copy_block(d, s, chunk);
+        irq_restore(flags);
+
+        d += chunk;
+        s += chunk;
+        n -= chunk;
+    }
+
+    memcpy_sse2(d, s, n);
+    return dest;
+}
+
+static void* memset_avx2(void* dest, int c, size_t n) {
+    uint8_t* d = dest;
+    uint64_t pattern = 0x0101010101010101ULL * (uint8_t)c;
+
+    if (n < AVX2_MIN_SIZE) {
+        return memset_sse2(dest, c, n);
+    }
+
+    size_t head = -(uintptr_t)d & 31;
+    set_small(d, pattern, head);
+    d += head;
+    n -= head;
+
+    while (n >= 128) {
+        size_t chunk = n < AVX2_CHUNK ? (n & ~(size_t)127) : AVX2_CHUNK;
+
+        uint64_t flags = irq_save();
+        avx2_set_block(d, pattern, chunk);
+        irq_restore(flags);
+
+        d += chunk;
+        n -= chunk;
+    }
+
+    memset_sse2(d, c, n);
+    return dest;
+}
+
+// ---- dispatch --------------------------------------------------------------
+
+static MemVariant variants[] = {
+    { "sse2", memcpy_sse2, memset_sse2, 1 },
+    { "erms", memcpy_erms, memset_erms, 0 },
+    { "avx2", memcpy_avx2, memset_avx2, 0 },
+};
+
+#define VARIANT_COUNT ((int)(sizeof(variants) / sizeof(variants[0])))
+
+static const MemVariant* selected = &variants[0];
+
+void* memcpy(void* dest, const void* src, size_t n) {
+    if (n < MEM_LARGE_SIZE) {
+        return memcpy_sse2(dest, src, n);
+    }
+    return selected->copy(dest, src, n);
+}
+
+void* memset(void* dest, int c, size_t n) {
+    if (n < MEM_LARGE_SIZE) {
+        return memset_sse2(dest, c, n);
+    }
+    return selected->set(dest, c, n);
+}
+
+void* memmove(void* dest, const void* src, size_t n) {
+    uint8_t* d = dest;
+    const uint8_t* s = src;
+
+    // No overlap, or dest below src: every variant copies forward and
+    // reads each block before writing it
+    if ((uintptr_t)d - (uintptr_t)s >= n) {
+        return memcpy(dest, src, n);
+    }
+    if (d == s) {
+        return dest;
+    }
+
+    // dest overlaps the end of src, copy backwards
+    while (n >= 8) {
+        n -= 8;
+        *(u64_u*)(d + n) = *(const u64_u*)(s + n);
+    }
+    while (n > 0) {
+        n--;
+        d[n] = s[n];
+    }
+    return dest;
+}
+
+int memcmp(const void* a, const void* b, size_t n) {
+    const uint8_t* x = a;
+    const uint8_t* y = b;
+
+    // Skip equal words, then find the differing byte
+    while (n >= 8 && *(const u64_u*)x == *(const u64_u*)y) {
+        x += 8;
+        y += 8;
+        n -= 8;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (x[i] != y[i]) {
+            return x[i] - y[i];
+        }
+    }
+    return 0;
+}
+
+void* memset16(uint16_t* dest, uint16_t value, size_t count) {
+    uint64_t pattern = 0x0001000100010001ULL * value;
+    size_t i = 0;
+
+    if (count >= 8) {
+        v16_u v = { (long long)pattern, (long long)pattern };
+        for (; i + 8 <= count; i += 8) {
+            *(v16_u*)(dest + i) = v;
+        }
+    }
+    for (; i < count; i++) {
+        dest[i] = value;
+    }
+    return dest;
+}
+
+size_t strlen(const char* str) {
+    // Aligned 16 byte loads never cross into an unmapped page
+    uintptr_t addr = (uintptr_t)str;
+    const v16qi* block = (const v16qi*)(addr & ~(uintptr_t)15);
+    const v16qi zero = { 0 };
+
+    uint32_t mask = __builtin_ia32_pmovmskb128(__builtin_ia32_pcmpeqb128(*block, zero));
+    mask &= ~0u << (addr & 15);
+
+    while (!mask) {
+        block++;
+        mask = __builtin_ia32_pmovmskb128(__builtin_ia32_pcmpeqb128(*block, zero));
+    }
+
+    return (const char*)block + __builtin_ctz(mask) - str;
+}
+
+int strcmp(const char* a, const char* b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return (uint8_t)*a - (uint8_t)*b;
+}
+
+int strncmp(const char* a, const char* b, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (a[i] != b[i] || !a[i]) {
+            return (uint8_t)a[i] - (uint8_t)b[i];
+        }
+    }
+    return 0;
+}
+
+char* strcpy(char* dest, const char* src) {
+    memcpy(dest, src, strlen(src) + 1);
+    return dest;
+}
+
+// Let the CPU keep ymm state (it is never live across an interrupt,
+// see memcpy_avx2)
+static int enable_avx(const CpuInfo* cpu) {
+    uint32_t needed = CPUID1_ECX_XSAVE | CPUID1_ECX_AVX;
+    if ((cpu->features_ecx & needed) != needed) {
+        return 0;
+    }
+
+    uint64_t cr4;
+    asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+    if (!(cr4 & CR4_OSXSAVE)) {
+        asm volatile ("mov %0, %%cr4" : : "r"(cr4 | CR4_OSXSAVE));
+    }
+
+    uint32_t lo, hi;
+    asm volatile ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    if ((lo & XCR0_X87_SSE_AVX) != XCR0_X87_SSE_AVX) {
+        lo |= XCR0_X87_SSE_AVX;
+        asm volatile ("xsetbv" : : "a"(lo), "d"(hi), "c"(0));
+    }
+    return 1;
+}
+
+void mem_init(const CpuInfo* cpu) {
+    // extended_features holds CPUID.(EAX=7,ECX=0):EBX in its low half
+    uint32_t ebx7 = (uint32_t)cpu->extended_features;
+
+    variants[1].usable = (ebx7 & CPUID7_EBX_ERMS) != 0;
+    variants[2].usable = (ebx7 & CPUID7_EBX_AVX2) && enable_avx(cpu);
+
+    // rep movsb wins for large blocks when it is fast, AVX2 otherwise
+    if (variants[1].usable) {
+        selected = &variants[1];
+    } else if (variants[2].usable) {
+        selected = &variants[2];
+    } else {
+        selected = &variants[0];
+    }
+}
+
+int mem_variant_count(void) {
+    return VARIANT_COUNT;
+}
+
+const MemVariant* mem_variant(int index) {
+    if (index < 0 || index >= VARIANT_COUNT) {
+        return NULL;
+    }
+    return &variants[index];
+}
+
+const char* mem_selected_variant(void) {
+    return selected->name;
+}
+
+// ---- benchmark -------------------------------------------------------------
+
+#define BENCH_BUFFER_SIZE 0x100000
+#define BENCH_BYTES       (8 * 0x100000)
+#define BENCH_RUNS        3
+
+// Bytes per cycle with two decimals, padded to width
+static void print_rate(uint64_t bytes, uint64_t cycles, int width) {
+    if (cycles == 0) {
+        cycles = 1;
+    }
+    uint64_t rate = bytes * 100 / cycles;
+
+    int digits = 1;
+    for (uint64_t v = rate / 100; v >= 10; v /= 10) {
+        digits++;
+    }
+    for (int i = digits + 3; i < width; i++) {
+        putchar(' ', COLOR_DEFAULT);
+    }
+
+    print_dec(rate / 100, 0x0A);
+    putchar('.', 0x0A);
+    if (rate % 100 < 10) {
+        putchar('0', 0x0A);
+    }
+    print_dec(rate % 100, 0x0A);
+}
+
+// Best of a few runs, so one interrupt does not spoil a result
+static uint64_t bench_variant(const MemVariant* variant, int set, uint8_t* dst,
+                              const uint8_t* src, uint32_t size, uint32_t rounds) {
+    uint64_t best = ~0ULL;
+
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        // Walk through the buffer so large sizes are not all cache hits
+        uint64_t start = tsc_read_ordered();
+        for (uint32_t r = 0; r < rounds; r++) {
+            uint32_t offset = (r * size) & (BENCH_BUFFER_SIZE - 1);
+            if (set) {
+                variant->set(dst + offset, r, size);
+            } else {
+                variant->copy(dst + offset, src + offset, size);
+            }
+        }
+        uint64_t cycles = tsc_read_ordered() - start;
+
+        if (cycles < best) {
+            best = cycles;
+        }
+    }
+    return best;
+}
+
+void mem_benchmark(void) {
+    static const uint32_t sizes[] = { 64, 256, 1024, 4096, 16384, 65536, 262144, 1048576 };
+
+    uint8_t* src = (uint8_t*)kmalloc(BENCH_BUFFER_SIZE);
+    uint8_t* dst = (uint8_t*)kmalloc(BENCH_BUFFER_SIZE);
+    if (!src || !dst) {
+        print("Not enough memory for the benchmark\n", 0x0C);
+        kfree(src);
+        kfree(dst);
+        return;
+    }
+    memset(src, 0x5A, BENCH_BUFFER_SIZE);
+    memset(dst, 0, BENCH_BUFFER_SIZE);
+
+    print("Large copies use: ", 0x0E);
+    print(selected->name, 0x0A);
+    print("   (bytes per TSC cycle, copy / set)\n", 0x07);
+
+    print("size    ", 0x0B);
+    for (int v = 0; v < VARIANT_COUNT; v++) {
+        if (variants[v].usable) {
+            print("          ", 0x0B);
+            print(variants[v].name, 0x0B);
+            print("   ", 0x0B);
+        }
+    }
+    print("\n", COLOR_DEFAULT);
+
+    for (uint32_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        uint32_t size = sizes[i];
+        uint32_t rounds = BENCH_BYTES / size;
+
+        print_dec(size, COLOR_DEFAULT);
+        int len = 0;
+        for (uint32_t v = size; v; v /= 10) {
+            len++;
+        }
+        for (; len < 8; len++) {
+            putchar(' ', COLOR_DEFAULT);
+        }
+
+        for (int v = 0; v < VARIANT_COUNT; v++) {
+            if (!variants[v].usable) {
+                continue;
+            }
+
+            uint64_t copy_cycles = bench_variant(&variants[v], 0, dst, src, size, rounds);
+            uint64_t set_cycles = bench_variant(&variants[v], 1, dst, src, size, rounds);
+
+            print_rate((uint64_t)rounds * size, copy_cycles, 8);
+            print(" /", COLOR_DEFAULT);
+            print_rate((uint64_t)rounds * size, set_cycles, 6);
+        }
+        print("\n", COLOR_DEFAULT);
+    }
+
+    kfree(src);
+    kfree(dst);
+}
@@ -0,0 +1,45 @@
+#ifndef LIB_STRING_H
+#define LIB_STRING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "../boot.h"
+
+// Kernel mem* / str* routines. The compiler may also emit calls to
+// memcpy, memmove, memset and memcmp on its own.
+void* memcpy(void* dest, const void* src, size_t n);
+void* memmove(void* dest, const void* src, size_t n);
+void* memset(void* dest, int c, size_t n);
+int memcmp(const void* a, const void* b, size_t n);
+
+// Fill count 16-bit cells (console lines)
+void* memset16(uint16_t* dest, uint16_t value, size_t count);
+
+size_t strlen(const char* str);
+int strcmp(const char* a, const char* b);
+int strncmp(const char* a, const char* b, size_t n);
+char* strcpy(char* dest, const char* src);
+
+// Copies and fills of at least this size use the variant picked by
+// mem_init(), smaller ones always use SSE2
+#define MEM_LARGE_SIZE 2048
+
+// Pick the fastest variants the CPU supports (ERMS, AVX2 or SSE2).
+// Everything works before this is called, just with SSE2 only.
+void mem_init(const CpuInfo* cpu);
+
+typedef struct {
+    const char* name;
+    void* (*copy)(void* dest, const void* src, size_t n);
+    void* (*set)(void* dest, int c, size_t n);
+    int usable;
+} MemVariant;
+
+int mem_variant_count(void);
+const MemVariant* mem_variant(int index);
+const char* mem_selected_variant(void);
+
+// Throughput of every usable variant for a range of sizes
+void mem_benchmark(void);
+
+#endif
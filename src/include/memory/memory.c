@@ -1,12 +1,20 @@
 #include "memory.h"
+#include "paging.h"
+#include "pmm.h"
 #include "../text/text_utils.h"
+#include "../lib/string.h"
+#include "../../kernel/lock.h"
+#include "../../kernel/smp.h"
 #include <stddef.h>
 
 // Simple heap allocator implementation
-#define HEAP_START 0x100000  // 1MB
-#define HEAP_SIZE  0x400000  // 4MB
 #define BLOCK_MAGIC 0xDEADBEEF
 
+// The heap grows in chunks of at least HEAP_GROW_MIN and gives pages back
+// once HEAP_SHRINK_MIN bytes at its end are free
+#define HEAP_GROW_MIN   0x10000   // 64KB
+#define HEAP_SHRINK_MIN 0x40000   // 256KB
+
 typedef struct HeapBlock {
     uint32_t magic;
     uint32_t size;
@@ -15,22 +23,458 @@ typedef struct HeapBlock {
     struct HeapBlock* prev;
 } HeapBlock;
 
+// Free blocks keep their free list links in the (otherwise unused) payload,
+// so every block needs room for them
+typedef struct FreeLinks {
+    HeapBlock* next;
+    HeapBlock* prev;
+} FreeLinks;
+
+#define MIN_BLOCK_SIZE sizeof(FreeLinks)
+
+// Size classes
+// small: one class per 8 bytes below SMALL_LIMIT, so a non-empty class
+//        always fits and the lookup is a single bit scan
+// large: one class per power of two, only the first list needs a search
+#define SMALL_LIMIT   512
+#define SMALL_CLASSES (SMALL_LIMIT / 8)
+#define LARGE_SHIFT   9   // log2(SMALL_LIMIT)
+#define LARGE_CLASSES (32 - LARGE_SHIFT)
+#define NUM_CLASSES   (SMALL_CLASSES + LARGE_CLASSES)
+
+// Large allocations get their own page mappings, tracked per area
+typedef struct VmArea {
+    uint64_t base;
+    uint32_t pages;
+    uint32_t unmap_pending;       // freed while other CPUs ran work, still mapped
+    struct VmArea* next;
+} VmArea;
+
+// The heap is shared by all CPUs, threads and interrupt handlers. Host
+// builds (tools/bench_alloc) run in user mode and can't disable interrupts,
+// they count as a single CPU.
+#ifdef HEAP_NO_LOCK
+#define HEAP_MAX_CPUS 1
+static inline uint64_t heap_lock(McsNode* node) { (void)node; return 0; }
+static inline void heap_unlock(McsNode* node, uint64_t flags) { (void)node; (void)flags; }
+static inline uint64_t cache_enter(void) { return 0; }
+static inline void cache_exit(uint64_t flags) { (void)flags; }
+static inline uint32_t heap_cpu(void) { return 0; }
+static inline int heap_quiesce(void) { return 0; }
+static inline void heap_resume(void) { }
+#else
+#define HEAP_MAX_CPUS MAX_CPUS
+// Every CPU refills and flushes its magazines through this one, so it
+// is a queue lock
+static LockStats heap_lock_stats = LOCK_STATS_INIT("heap");
+static McsLock heap_mcs = MCS_LOCK_INIT(&heap_lock_stats);
+static inline uint64_t heap_lock(McsNode* node) { return mcs_lock_irqsave(&heap_mcs, node); }
+static inline void heap_unlock(McsNode* node, uint64_t flags) { mcs_unlock_irqrestore(&heap_mcs, node, flags); }
+// A CPU's own cache only has to keep its interrupt handlers out
+static inline uint64_t cache_enter(void) { return irq_save(); }
+static inline void cache_exit(uint64_t flags) { irq_restore(flags); }
+static inline uint32_t heap_cpu(void) { return this_cpu()->index; }
+// Other CPUs may hold stale TLB entries while they run work items, so
+// pages are only unmapped when none does (work_quiesce() never waits)
+static inline int heap_quiesce(void) { return work_quiesce(); }
+static inline void heap_resume(void) { work_resume(); }
+#endif
+
+// Per-CPU magazines of small blocks in front of the heap. kmalloc/kfree
+// of a cached size only touch the calling CPU's magazine, the heap lock
+// is taken once per MAG_BATCH blocks to refill or flush it. Cached
+// blocks count as used for the heap and carry BLOCK_CACHED as magic.
+#define BLOCK_CACHED      0xCAC4EDB1
+#define MAG_CLASS_SHIFT   4                                   // classes 16 bytes apart
+#define MAG_CLASSES       16
+#define MAG_MAX_SIZE      (MAG_CLASSES << MAG_CLASS_SHIFT)    // 256 bytes
+#define MAG_SIZE          32                                  // blocks per class and CPU
+#define MAG_BATCH         16                                  // moved to or from the heap at once
+
+typedef struct {
+    uint32_t count;
+    void* blocks[MAG_SIZE];
+} Magazine;
+
+typedef struct {
+    Magazine mags[MAG_CLASSES];
+} HeapCpuCache;
+
+// Caches are allocated on a CPU's first small kmalloc, the statistics
+// have to work before the heap does
+static HeapCpuCache* cpu_caches[HEAP_MAX_CPUS];
+static HeapCpuStats cpu_stats[HEAP_MAX_CPUS] __attribute__((aligned(64)));
+
 static HeapBlock* heap_start = NULL;
+static HeapBlock* heap_tail = NULL;       // block with the highest address
 static uint8_t* heap_memory = (uint8_t*)HEAP_START;
+static uint8_t* heap_end = (uint8_t*)HEAP_START;
 static uint32_t heap_initialized = 0;
-static uint32_t total_allocated = 0;
-static uint32_t total_freed = 0;
+
+static VmArea* vm_areas = NULL;           // sorted by base
+static uint32_t large_pages = 0;
+static uint32_t pending_areas = 0;   // VmAreas waiting for their unmap
+
+static HeapBlock* free_lists[NUM_CLASSES];
+static uint32_t class_counts[NUM_CLASSES];
+static uint64_t small_bitmap = 0;   // bit n set -> free_lists[n] not empty
+static uint32_t large_bitmap = 0;   // bit n set -> free_lists[SMALL_CLASSES + n] not empty
+
+// Kept up to date by every heap operation, so queries never walk the heap
+static uint32_t used_bytes = 0;     // used blocks including headers
+static uint32_t used_blocks = 0;
+static uint32_t peak_used = 0;
+static uint32_t free_bytes = 0;     // payload of free blocks
+static uint32_t free_blocks = 0;
+
+static inline FreeLinks* block_links(HeapBlock* block) {
+    return (FreeLinks*)((uint8_t*)block + sizeof(HeapBlock));
+}
+
+static inline uint32_t size_class(uint32_t size) {
+    if (size < SMALL_LIMIT) {
+        return size >> 3;
+    }
+    return SMALL_CLASSES + (31 - __builtin_clz(size)) - LARGE_SHIFT;
+}
+
+static inline void class_mark(uint32_t cls) {
+    if (cls < SMALL_CLASSES) {
+        small_bitmap |= 1ULL << cls;
+    } else {
+        large_bitmap |= 1U << (cls - SMALL_CLASSES);
+    }
+}
+
+static inline void class_clear(uint32_t cls) {
+    if (cls < SMALL_CLASSES) {
+        small_bitmap &= ~(1ULL << cls);
+    } else {
+        large_bitmap &= ~(1U << (cls - SMALL_CLASSES));
+    }
+}
+
+static void free_list_insert(HeapBlock* block) {
+    uint32_t cls = size_class(block->size);
+    FreeLinks* links = block_links(block);
+
+    links->prev = NULL;
+    links->next = free_lists[cls];
+    if (free_lists[cls]) {
+        block_links(free_lists[cls])->prev = block;
+    }
+    free_lists[cls] = block;
+    class_mark(cls);
+
+    class_counts[cls]++;
+    free_bytes += block->size;
+    free_blocks++;
+}
+
+static void free_list_remove(HeapBlock* block) {
+    uint32_t cls = size_class(block->size);
+    FreeLinks* links = block_links(block);
+
+    if (links->prev) {
+        block_links(links->prev)->next = links->next;
+    } else {
+        free_lists[cls] = links->next;
+        if (!links->next) {
+            class_clear(cls);
+        }
+    }
+    if (links->next) {
+        block_links(links->next)->prev = links->prev;
+    }
+
+    class_counts[cls]--;
+    free_bytes -= block->size;
+    free_blocks--;
+}
+
+// Find the first non-empty class >= cls
+static int next_class(uint32_t cls) {
+    if (cls < SMALL_CLASSES) {
+        uint64_t small = small_bitmap & (~0ULL << cls);
+        if (small) {
+            return __builtin_ctzll(small);
+        }
+        cls = SMALL_CLASSES;
+    }
+
+    uint32_t large = large_bitmap & (~0U << (cls - SMALL_CLASSES));
+    if (large) {
+        return SMALL_CLASSES + __builtin_ctz(large);
+    }
+    return -1;
+}
+
+static HeapBlock* find_free_block(uint32_t size) {
+    uint32_t cls = size_class(size);
+
+    // Large classes span a power of two, so the exact class may hold
+    // blocks that are too small: search it first
+    if (cls >= SMALL_CLASSES) {
+        for (HeapBlock* block = free_lists[cls]; block; block = block_links(block)->next) {
+            if (block->magic != BLOCK_MAGIC) {
+                print("Heap corruption detected!\n", 0x0C);
+                return NULL;
+            }
+            if (block->size >= size) {
+                return block;
+            }
+        }
+        cls++;
+        if (cls >= NUM_CLASSES) {
+            return NULL;
+        }
+    }
+
+    // Every block in any higher class is big enough
+    int found = next_class(cls);
+    if (found < 0) {
+        return NULL;
+    }
+
+    HeapBlock* block = free_lists[found];
+    if (block->magic != BLOCK_MAGIC) {
+        print("Heap corruption detected!\n", 0x0C);
+        return NULL;
+    }
+    return block;
+}
+
+// Cut a block down to size, the rest goes back on a free list
+static void split_block(HeapBlock* block, uint32_t size) {
+    if (block->size < size + sizeof(HeapBlock) + MIN_BLOCK_SIZE) {
+        return;
+    }
+
+    HeapBlock* new_block = (HeapBlock*)((uint8_t*)block + sizeof(HeapBlock) + size);
+    new_block->magic = BLOCK_MAGIC;
+    new_block->size = block->size - size - sizeof(HeapBlock);
+    new_block->is_free = 1;
+    new_block->next = block->next;
+    new_block->prev = block;
+
+    if (block->next) {
+        block->next->prev = new_block;
+    }
+    block->next = new_block;
+    block->size = size;
+    if (heap_tail == block) {
+        heap_tail = new_block;
+    }
+
+    free_list_insert(new_block);
+}
+
+// Map more pages at the end of the heap so a free block of at least
+// size bytes sits at its tail
+static int heap_grow(uint32_t size) {
+    uint32_t need = size + sizeof(HeapBlock);
+    if (heap_tail && heap_tail->is_free) {
+        need = size > heap_tail->size ? size - heap_tail->size : 0;
+    }
+
+    uint32_t grow = (need + HEAP_GROW_MIN - 1) & ~(HEAP_GROW_MIN - 1);
+    if (grow == 0 || (uint64_t)(heap_end - heap_memory) + grow > HEAP_MAX_SIZE) {
+        return -1;
+    }
+
+    if (paging_map_pages((uint64_t)heap_end, grow / PAGE_SIZE, PAGE_WRITE)) {
+        return -1;
+    }
+
+    if (heap_tail && heap_tail->is_free) {
+        free_list_remove(heap_tail);
+        heap_tail->size += grow;
+        free_list_insert(heap_tail);
+    } else {
+        HeapBlock* block = (HeapBlock*)heap_end;
+        block->magic = BLOCK_MAGIC;
+        block->size = grow - sizeof(HeapBlock);
+        block->is_free = 1;
+        block->next = NULL;
+        block->prev = heap_tail;
+        if (heap_tail) {
+            heap_tail->next = block;
+        }
+        heap_tail = block;
+        free_list_insert(block);
+    }
+
+    heap_end += grow;
+    return 0;
+}
+
+// Give whole pages at the end of a free tail block back
+static void heap_shrink(HeapBlock* block) {
+    if (block != heap_tail) {
+        return;
+    }
+
+    uintptr_t keep = (uintptr_t)block + sizeof(HeapBlock) + MIN_BLOCK_SIZE;
+    keep = (keep + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1);
+    if (keep < (uintptr_t)heap_memory + HEAP_INITIAL_SIZE) {
+        keep = (uintptr_t)heap_memory + HEAP_INITIAL_SIZE;
+    }
+
+    // Work items running elsewhere: try again on a later free
+    if ((uintptr_t)heap_end < keep + HEAP_SHRINK_MIN || heap_quiesce() != 0) {
+        return;
+    }
+
+    uint32_t release = (uint32_t)((uintptr_t)heap_end - keep);
+    paging_unmap_pages(keep, release / PAGE_SIZE);
+    heap_resume();
+    block->size -= release;
+    heap_end -= release;
+}
+
+static void* heap_alloc(uint32_t size);
+static uint64_t heap_free(void* ptr);
+
+// Unmap the large areas freed while other CPUs ran work items
+static void reap_areas(void) {
+    if (!pending_areas || heap_quiesce() != 0) {
+        return;
+    }
+
+    VmArea** link = &vm_areas;
+    while (*link) {
+        VmArea* area = *link;
+        if (!area->unmap_pending) {
+            link = &area->next;
+            continue;
+        }
+        *link = area->next;
+        paging_unmap_pages(area->base, area->pages);
+        large_pages -= area->pages;
+        pending_areas--;
+        heap_free(area);
+    }
+    heap_resume();
+}
+
+// The heap lock is held, so the area itself comes straight from the heap
+static void* large_alloc(uint32_t size, uint32_t align) {
+    // In 64 bit, sizes near 4GB would round up to 0 pages
+    uint64_t page_count = ((uint64_t)size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (page_count >= (KERNEL_VMAP_END - KERNEL_VMAP_BASE) / PAGE_SIZE) {
+        print("Out of memory!\n", 0x0C);
+        return NULL;
+    }
+    uint32_t pages = (uint32_t)page_count;
+    if (align < PAGE_SIZE) {
+        align = PAGE_SIZE;
+    }
+
+    reap_areas();
+
+    VmArea* area = (VmArea*)heap_alloc(sizeof(VmArea));
+    if (!area) {
+        return NULL;
+    }
+
+    // First fit gap in the address space, one unmapped guard page after each area
+    uint64_t base = KERNEL_VMAP_BASE;
+    VmArea** link = &vm_areas;
+    while (1) {
+        base = (base + align - 1) & ~(uint64_t)(align - 1);
+        if (!*link || base + (uint64_t)(pages + 1) * PAGE_SIZE <= (*link)->base) {
+            break;
+        }
+        base = (*link)->base + (uint64_t)((*link)->pages + 1) * PAGE_SIZE;
+        link = &(*link)->next;
+    }
+
+    if (base + (uint64_t)(pages + 1) * PAGE_SIZE > KERNEL_VMAP_END ||
+        paging_map_pages(base, pages, PAGE_WRITE)) {
+        heap_free(area);
+        print("Out of memory!\n", 0x0C);
+        return NULL;
+    }
+
+    area->base = base;
+    area->pages = pages;
+    area->unmap_pending = 0;
+    area->next = *link;
+    *link = area;
+
+    large_pages += pages;
+    return (void*)base;
+}
+
+// Returns the number of bytes given back, 0 for a bad pointer
+static uint64_t large_free(void* ptr) {
+    VmArea** link = &vm_areas;
+    while (*link && (*link)->base != (uint64_t)ptr) {
+        link = &(*link)->next;
+    }
+
+    if (!*link) {
+        print("Invalid free - not a large allocation!\n", 0x0C);
+        return 0;
+    }
+
+    VmArea* area = *link;
+    if (area->unmap_pending) {
+        print("Double free detected!\n", 0x0C);
+        return 0;
+    }
+
+    // The area keeps its address range until it can be unmapped
+    uint32_t pages = area->pages;
+    if (heap_quiesce() != 0) {
+        area->unmap_pending = 1;
+        pending_areas++;
+        return (uint64_t)pages * PAGE_SIZE;
+    }
+
+    *link = area->next;
+    paging_unmap_pages(area->base, pages);
+    heap_resume();
+    large_pages -= pages;
+    heap_free(area);
+    return (uint64_t)pages * PAGE_SIZE;
+}
+
+static void* use_block(HeapBlock* block) {
+    block->is_free = 0;
+
+    used_bytes += block->size + sizeof(HeapBlock);
+    used_blocks++;
+    if (used_bytes > peak_used) {
+        peak_used = used_bytes;
+    }
+
+    return (void*)((uint8_t*)block + sizeof(HeapBlock));
+}
+
+static inline int is_large(void* ptr) {
+    return (uint64_t)ptr >= KERNEL_VMAP_BASE && (uint64_t)ptr < KERNEL_VMAP_END;
+}
 
 void memory_init(void) {
     if (heap_initialized) return;
 
-    // Initialize the first block
-    heap_start = (HeapBlock*)heap_memory;
-    heap_start->magic = BLOCK_MAGIC;
-    heap_start->size = HEAP_SIZE - sizeof(HeapBlock);
-    heap_start->is_free = 1;
-    heap_start->next = NULL;
-    heap_start->prev = NULL;
+    for (int i = 0; i < NUM_CLASSES; i++) {
+        free_lists[i] = NULL;
+        class_counts[i] = 0;
+    }
+    small_bitmap = 0;
+    large_bitmap = 0;
+
+    // Map the initial arena, the first block covers all of it
+    heap_start = NULL;
+    heap_tail = NULL;
+    heap_end = heap_memory;
+    if (heap_grow(HEAP_INITIAL_SIZE - sizeof(HeapBlock))) {
+        print("Failed to map the kernel heap!\n", 0x0C);
+        return;
+    }
+    heap_start = heap_tail;
 
     heap_initialized = 1;
 
@@ -39,143 +483,470 @@ void memory_init(void) {
     print("Heap at: ", COLOR_DEFAULT);
     print_hex(HEAP_START, COLOR_DEFAULT);
     print(" Size: ", COLOR_DEFAULT);
-    print_hex(HEAP_SIZE, COLOR_DEFAULT);
-    print(" bytes\n", COLOR_DEFAULT);
+    print_hex(HEAP_INITIAL_SIZE, COLOR_DEFAULT);
+    print(" bytes (grows up to ", COLOR_DEFAULT);
+    print_hex(HEAP_MAX_SIZE, COLOR_DEFAULT);
+    print(")\n", COLOR_DEFAULT);
 }
 
-void* kmalloc(uint32_t size) {
+static void* heap_alloc(uint32_t size) {
     if (!heap_initialized) {
         memory_init();
+        if (!heap_initialized) return NULL;
     }
 
     if (size == 0) return NULL;
 
+    if (size >= LARGE_ALLOC_THRESHOLD) {
+        return large_alloc(size, PAGE_SIZE);
+    }
+
     // Align size to 8 bytes
     size = (size + 7) & ~7;
+    if (size < MIN_BLOCK_SIZE) {
+        size = MIN_BLOCK_SIZE;
+    }
 
-    HeapBlock* current = heap_start;
-    while (current) {
-        if (current->magic != BLOCK_MAGIC) {
-            print("Heap corruption detected!\n", 0x0C);
+    HeapBlock* current = find_free_block(size);
+    if (!current) {
+        if (heap_grow(size)) {
+            print("Out of memory!\n", 0x0C);
             return NULL;
         }
+        current = heap_tail;
+    }
 
-        if (current->is_free && current->size >= size) {
-            // Found a suitable block
-            if (current->size > size + sizeof(HeapBlock) + 8) {
-                // Split the block
-                HeapBlock* new_block = (HeapBlock*)((uint8_t*)current + sizeof(HeapBlock) + size);
-                new_block->magic = BLOCK_MAGIC;
-                new_block->size = current->size - size - sizeof(HeapBlock);
-                new_block->is_free = 1;
-                new_block->next = current->next;
-                new_block->prev = current;
+    free_list_remove(current);
+    split_block(current, size);
 
-                if (current->next) {
-                    current->next->prev = new_block;
-                }
-                current->next = new_block;
-                current->size = size;
-            }
+    return use_block(current);
+}
+
+static void* heap_alloc_aligned(uint32_t size, uint32_t align) {
+    if (!heap_initialized) {
+        memory_init();
+        if (!heap_initialized) return NULL;
+    }
+
+    if (size == 0) return NULL;
 
-            current->is_free = 0;
-            total_allocated += size;
-            return (void*)((uint8_t*)current + sizeof(HeapBlock));
+    // align has to be a power of two
+    if (align & (align - 1)) return NULL;
+    if (align <= 8) return heap_alloc(size);
+
+    if (size >= LARGE_ALLOC_THRESHOLD) {
+        return large_alloc(size, align);
+    }
+
+    size = (size + 7) & ~7;
+    if (size < MIN_BLOCK_SIZE) {
+        size = MIN_BLOCK_SIZE;
+    }
+
+    // Worst case we have to cut a free block off the front to reach the alignment
+    uint32_t search = size + align + sizeof(HeapBlock) + MIN_BLOCK_SIZE;
+    HeapBlock* current = find_free_block(search);
+    if (!current) {
+        if (heap_grow(search)) {
+            print("Out of memory!\n", 0x0C);
+            return NULL;
         }
+        current = heap_tail;
+    }
 
-        current = current->next;
+    free_list_remove(current);
+
+    uintptr_t payload = (uintptr_t)current + sizeof(HeapBlock);
+    if (payload & (align - 1)) {
+        // Leave at least a minimal free block in front of the aligned one
+        uintptr_t aligned = (payload + sizeof(HeapBlock) + MIN_BLOCK_SIZE + align - 1) & ~(uintptr_t)(align - 1);
+        HeapBlock* aligned_block = (HeapBlock*)(aligned - sizeof(HeapBlock));
+        uint32_t front = (uint32_t)((uintptr_t)aligned_block - payload);
+
+        aligned_block->magic = BLOCK_MAGIC;
+        aligned_block->size = current->size - front - sizeof(HeapBlock);
+        aligned_block->is_free = 1;
+        aligned_block->next = current->next;
+        aligned_block->prev = current;
+
+        if (current->next) {
+            current->next->prev = aligned_block;
+        }
+        current->next = aligned_block;
+        current->size = front;
+        if (heap_tail == current) {
+            heap_tail = aligned_block;
+        }
+
+        free_list_insert(current);
+        current = aligned_block;
     }
 
-    print("Out of memory!\n", 0x0C);
-    return NULL;
+    split_block(current, size);
+
+    return use_block(current);
 }
 
-void kfree(void* ptr) {
-    if (!ptr) return;
+// Returns the number of bytes given back, 0 for a bad pointer
+static uint64_t heap_free(void* ptr) {
+    if (!ptr) return 0;
+
+    if (is_large(ptr)) {
+        return large_free(ptr);
+    }
 
     HeapBlock* block = (HeapBlock*)((uint8_t*)ptr - sizeof(HeapBlock));
 
+    if (block->magic == BLOCK_CACHED) {
+        print("Double free detected!\n", 0x0C);
+        return 0;
+    }
+
     if (block->magic != BLOCK_MAGIC) {
         print("Invalid free - corrupted block!\n", 0x0C);
-        return;
+        return 0;
     }
 
     if (block->is_free) {
         print("Double free detected!\n", 0x0C);
-        return;
+        return 0;
     }
 
+    uint32_t freed = block->size;
     block->is_free = 1;
-    total_freed += block->size;
+    used_bytes -= block->size + sizeof(HeapBlock);
+    used_blocks--;
 
     // Coalesce with next block if it's free
     if (block->next && block->next->is_free) {
-        block->size += block->next->size + sizeof(HeapBlock);
-        HeapBlock* next_next = block->next->next;
+        HeapBlock* next = block->next;
+        free_list_remove(next);
+
+        block->size += next->size + sizeof(HeapBlock);
+        HeapBlock* next_next = next->next;
         if (next_next) {
             next_next->prev = block;
         }
         block->next = next_next;
+        if (heap_tail == next) {
+            heap_tail = block;
+        }
     }
 
     // Coalesce with previous block if it's free
     if (block->prev && block->prev->is_free) {
-        block->prev->size += block->size + sizeof(HeapBlock);
+        HeapBlock* prev = block->prev;
+        free_list_remove(prev);
+
+        prev->size += block->size + sizeof(HeapBlock);
         HeapBlock* next = block->next;
         if (next) {
-            next->prev = block->prev;
+            next->prev = prev;
+        }
+        prev->next = next;
+        if (heap_tail == block) {
+            heap_tail = prev;
         }
-        block->prev->next = next;
+        block = prev;
     }
+
+    heap_shrink(block);
+    free_list_insert(block);
+    return freed;
 }
 
-uint32_t get_total_allocated(void) {
-    return total_allocated;
+static inline HeapBlock* block_of(void* ptr) {
+    return (HeapBlock*)((uint8_t*)ptr - sizeof(HeapBlock));
 }
 
-uint32_t get_total_freed(void) {
-    return total_freed;
+// Bytes the caller really got, for the statistics
+static uint64_t usable_size(void* ptr, uint32_t size) {
+    if (is_large(ptr)) {
+        return ((uint64_t)size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    }
+    return block_of(ptr)->size;
 }
 
-uint32_t get_heap_usage(void) {
-    if (!heap_initialized) return 0;
+// This CPU's cache, NULL if there is no memory for one
+static HeapCpuCache* cpu_cache(uint32_t cpu) {
+    if (!cpu_caches[cpu]) {
+        McsNode node;
+        uint64_t flags = heap_lock(&node);
+        HeapCpuCache* cache = (HeapCpuCache*)heap_alloc(sizeof(HeapCpuCache));
+        heap_unlock(&node, flags);
+        if (!cache) {
+            return NULL;
+        }
+        memset(cache, 0, sizeof(HeapCpuCache));
+        cpu_caches[cpu] = cache;
+    }
+    return cpu_caches[cpu];
+}
 
-    uint32_t used = 0;
-    HeapBlock* current = heap_start;
+static void magazine_refill(Magazine* mag, uint32_t cls, HeapCpuStats* stats) {
+    uint32_t size = (cls + 1) << MAG_CLASS_SHIFT;
 
-    while (current) {
-        if (!current->is_free) {
-            used += current->size + sizeof(HeapBlock);
+    McsNode node;
+    uint64_t flags = heap_lock(&node);
+    while (mag->count < MAG_BATCH) {
+        void* ptr = heap_alloc(size);
+        if (!ptr) {
+            break;
         }
-        current = current->next;
+        block_of(ptr)->magic = BLOCK_CACHED;
+        mag->blocks[mag->count++] = ptr;
+        stats->cached_bytes += block_of(ptr)->size;
+    }
+    heap_unlock(&node, flags);
+    stats->refills++;
+}
+
+// Give the oldest half back, the recently freed blocks are still warm
+static void magazine_flush(Magazine* mag, HeapCpuStats* stats) {
+    McsNode node;
+    uint64_t flags = heap_lock(&node);
+    for (uint32_t i = 0; i < MAG_BATCH; i++) {
+        HeapBlock* block = block_of(mag->blocks[i]);
+        stats->cached_bytes -= block->size;
+        block->magic = BLOCK_MAGIC;
+        heap_free(mag->blocks[i]);
     }
+    heap_unlock(&node, flags);
 
-    return used;
+    mag->count -= MAG_BATCH;
+    memmove(mag->blocks, mag->blocks + MAG_BATCH, mag->count * sizeof(void*));
+    stats->flushes++;
 }
 
-uint32_t get_free_memory(void) {
-    if (!heap_initialized) return 0;
+// Largest class a block of this size can serve, -1 if it is not cached
+static inline int magazine_class(uint32_t block_size) {
+    uint32_t cls = (block_size >> MAG_CLASS_SHIFT) - 1;
+    return block_size >= (1U << MAG_CLASS_SHIFT) && cls < MAG_CLASSES ? (int)cls : -1;
+}
+
+void* kmalloc(uint32_t size) {
+    if (size && size <= MAG_MAX_SIZE && heap_initialized) {
+        uint32_t cls = (size - 1) >> MAG_CLASS_SHIFT;
+        uint64_t flags = cache_enter();
+        uint32_t cpu = heap_cpu();
+        HeapCpuCache* cache = cpu_cache(cpu);
+
+        if (cache) {
+            HeapCpuStats* stats = &cpu_stats[cpu];
+            Magazine* mag = &cache->mags[cls];
+            if (mag->count == 0) {
+                magazine_refill(mag, cls, stats);
+            }
+            if (mag->count) {
+                void* ptr = mag->blocks[--mag->count];
+                HeapBlock* block = block_of(ptr);
+                block->magic = BLOCK_MAGIC;
+
+                stats->cached_bytes -= block->size;
+                stats->allocated += block->size;
+                stats->allocs++;
+                stats->cache_hits++;
+                cache_exit(flags);
+                return ptr;
+            }
+        }
+        cache_exit(flags);
+    }
+
+    McsNode node;
+    uint64_t flags = heap_lock(&node);
+    void* ptr = heap_alloc(size);
+    if (ptr) {
+        HeapCpuStats* stats = &cpu_stats[heap_cpu()];
+        stats->allocated += usable_size(ptr, size);
+        stats->allocs++;
+    }
+    heap_unlock(&node, flags);
+    return ptr;
+}
+
+void* kmalloc_aligned(uint32_t size, uint32_t align) {
+    McsNode node;
+    uint64_t flags = heap_lock(&node);
+    void* ptr = heap_alloc_aligned(size, align);
+    if (ptr) {
+        HeapCpuStats* stats = &cpu_stats[heap_cpu()];
+        stats->allocated += usable_size(ptr, size);
+        stats->allocs++;
+    }
+    heap_unlock(&node, flags);
+    return ptr;
+}
+
+void kfree(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+
+    if (!is_large(ptr)) {
+        HeapBlock* block = block_of(ptr);
+        int cls = block->magic == BLOCK_MAGIC && !block->is_free ? magazine_class(block->size) : -1;
+
+        if (cls >= 0) {
+            uint64_t flags = cache_enter();
+            uint32_t cpu = heap_cpu();
+            HeapCpuCache* cache = cpu_caches[cpu];
 
-    uint32_t free = 0;
-    HeapBlock* current = heap_start;
+            if (cache) {
+                HeapCpuStats* stats = &cpu_stats[cpu];
+                Magazine* mag = &cache->mags[cls];
+                if (mag->count == MAG_SIZE) {
+                    magazine_flush(mag, stats);
+                }
 
-    while (current) {
-        if (current->is_free) {
-            free += current->size;
+                block->magic = BLOCK_CACHED;
+                mag->blocks[mag->count++] = ptr;
+                stats->cached_bytes += block->size;
+                stats->freed += block->size;
+                stats->frees++;
+                stats->cache_hits++;
+                cache_exit(flags);
+                return;
+            }
+            cache_exit(flags);
         }
-        current = current->next;
     }
 
-    return free;
+    // Bad pointers and double frees end up here and get reported
+    McsNode node;
+    uint64_t flags = heap_lock(&node);
+    uint64_t freed = heap_free(ptr);
+    if (freed) {
+        HeapCpuStats* stats = &cpu_stats[heap_cpu()];
+        stats->freed += freed;
+        stats->frees++;
+    }
+    reap_areas();
+    heap_unlock(&node, flags);
 }
 
-// Memory test function
-int memory_test(void) {
-    print("Running memory test...\n", 0x0E);
+uint32_t heap_cpu_count(void) {
+    return HEAP_MAX_CPUS;
+}
+
+void get_heap_cpu_stats(uint32_t cpu, HeapCpuStats* stats) {
+    memset(stats, 0, sizeof(HeapCpuStats));
+    if (cpu < HEAP_MAX_CPUS) {
+        *stats = cpu_stats[cpu];
+    }
+}
 
+// Sum over all CPUs, each one only ever writes its own counters
+static uint64_t sum_cpu_stat(size_t offset) {
+    uint64_t total = 0;
+    for (uint32_t cpu = 0; cpu < HEAP_MAX_CPUS; cpu++) {
+        total += *(const volatile uint64_t*)((const uint8_t*)&cpu_stats[cpu] + offset);
+    }
+    return total;
+}
+
+uint32_t get_total_allocated(void) {
+    return (uint32_t)sum_cpu_stat(offsetof(HeapCpuStats, allocated));
+}
+
+uint32_t get_total_freed(void) {
+    return (uint32_t)sum_cpu_stat(offsetof(HeapCpuStats, freed));
+}
+
+uint32_t get_cached_bytes(void) {
+    return (uint32_t)sum_cpu_stat(offsetof(HeapCpuStats, cached_bytes));
+}
+
+uint32_t get_heap_size(void) {
+    return (uint32_t)(heap_end - heap_memory);
+}
+
+uint32_t get_large_usage(void) {
+    return large_pages * PAGE_SIZE;
+}
+
+uint32_t get_heap_usage(void) {
+    return used_bytes;
+}
+
+uint32_t get_free_memory(void) {
+    return free_bytes;
+}
+
+uint32_t get_peak_usage(void) {
+    return peak_used;
+}
+
+// Lower bound of the sizes a class holds
+static uint32_t class_min_size(uint32_t cls) {
+    if (cls < SMALL_CLASSES) {
+        return cls << 3;
+    }
+    return 1U << (cls - SMALL_CLASSES + LARGE_SHIFT);
+}
+
+void get_heap_stats(HeapStats* stats) {
+    McsNode node;
+    uint64_t flags = heap_lock(&node);
+
+    stats->heap_size = get_heap_size();
+    stats->used_bytes = used_bytes;
+    stats->free_bytes = free_bytes;
+    stats->peak_used = peak_used;
+    stats->used_blocks = used_blocks;
+    stats->free_blocks = free_blocks;
+    stats->largest_free = 0;
+    stats->fragmentation = 0;
+
+    for (int i = 0; i < HEAP_HIST_BUCKETS; i++) {
+        stats->histogram[i] = 0;
+    }
+
+    // Free blocks per power of two, straight from the class counters
+    // (no class spans a power of two)
+    for (uint32_t cls = 0; cls < NUM_CLASSES; cls++) {
+        if (!class_counts[cls]) continue;
+
+        uint32_t min = class_min_size(cls);
+        int bucket = (31 - __builtin_clz(min)) - HEAP_HIST_MIN_SHIFT;
+        if (bucket < 0) bucket = 0;
+        if (bucket >= HEAP_HIST_BUCKETS) bucket = HEAP_HIST_BUCKETS - 1;
+        stats->histogram[bucket] += class_counts[cls];
+    }
+
+    // Largest free block: only the highest non-empty class needs a look
+    int top = -1;
+    if (large_bitmap) {
+        top = SMALL_CLASSES + 31 - __builtin_clz(large_bitmap);
+    } else if (small_bitmap) {
+        top = 63 - __builtin_clzll(small_bitmap);
+    }
+    if (top >= 0) {
+        for (HeapBlock* block = free_lists[top]; block; block = block_links(block)->next) {
+            if (block->size > stats->largest_free) {
+                stats->largest_free = block->size;
+            }
+        }
+    }
+
+    // External fragmentation: share of free memory outside the largest block
+    if (free_bytes) {
+        stats->fragmentation = (uint32_t)(100 - ((uint64_t)stats->largest_free * 100) / free_bytes);
+    }
+
+    heap_unlock(&node, flags);
+}
+
+// One pass of the memory test, sizes shift a little with every round
+// so long runs go through many block sizes
+static int memory_test_round(uint32_t round) {
     void* ptrs[10];
     uint32_t sizes[] = {32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384};
 
+    for (int i = 0; i < 10; i++) {
+        sizes[i] += (round * 8) % 64;
+    }
+
     // Test allocation
     for (int i = 0; i < 10; i++) {
         ptrs[i] = kmalloc(sizes[i]);
@@ -183,28 +954,28 @@ int memory_test(void) {
             print("Failed to allocate ", 0x0C);
             print_dec(sizes[i], 0x0C);
             print(" bytes\n", 0x0C);
+            while (i--) {
+                kfree(ptrs[i]);
+            }
             return 0;
         }
 
         // Write test pattern
-        uint8_t* mem = (uint8_t*)ptrs[i];
-        for (uint32_t j = 0; j < sizes[i]; j++) {
-            mem[j] = (uint8_t)(i + j);
-        }
+        memset(ptrs[i], 0xA0 + i + round, sizes[i]);
     }
 
-    // Test read back
-    for (int i = 0; i < 10; i++) {
+    // Test read back: the first byte is the pattern and every byte
+    // equals the next one
+    int ok = 1;
+    for (int i = 0; i < 10 && ok; i++) {
         uint8_t* mem = (uint8_t*)ptrs[i];
-        for (uint32_t j = 0; j < sizes[i]; j++) {
-            if (mem[j] != (uint8_t)(i + j)) {
-                print("Memory corruption detected at block ", 0x0C);
-                print_dec(i, 0x0C);
-                print(" offset ", 0x0C);
-                print_dec(j, 0x0C);
-                print("\n", 0x0C);
-                return 0;
-            }
+        if (mem[0] != (uint8_t)(0xA0 + i + round) || memcmp(mem, mem + 1, sizes[i] - 1) != 0) {
+            print("Memory corruption detected in block ", 0x0C);
+            print_dec(i, 0x0C);
+            print(" (round ", 0x0C);
+            print_dec(round, 0x0C);
+            print(")\n", 0x0C);
+            ok = 0;
         }
     }
 
@@ -212,6 +983,18 @@ int memory_test(void) {
     for (int i = 0; i < 10; i++) {
         kfree(ptrs[i]);
     }
+    return ok;
+}
+
+// Memory test function
+int memory_test(uint32_t rounds) {
+    print("Running memory test...\n", 0x0E);
+
+    for (uint32_t round = 0; round < rounds; round++) {
+        if (!memory_test_round(round)) {
+            return 0;
+        }
+    }
 
     print("Memory test passed!\n", 0x0A);
     return 1;
@@ -3,19 +3,65 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include "paging.h"
+
+// Kernel heap, mapped on demand
+#define HEAP_START        KERNEL_HEAP_BASE
+#define HEAP_INITIAL_SIZE 0x100000    // 1MB
+#define HEAP_MAX_SIZE     0x40000000  // 1GB
+
+// Allocations this big bypass the heap and get whole pages of their own
+#define LARGE_ALLOC_THRESHOLD 0x10000 // 64KB
 
 // Memory management functions
 void memory_init(void);
 void* kmalloc(uint32_t size);
+void* kmalloc_aligned(uint32_t size, uint32_t align);
 void kfree(void* ptr);
 
+// Free block histogram: bucket n counts blocks of 2^(n+4) .. 2^(n+5)-1 bytes
+#define HEAP_HIST_MIN_SHIFT 4
+#define HEAP_HIST_BUCKETS   27
+
+typedef struct {
+    uint32_t heap_size;         // mapped heap bytes
+    uint32_t used_bytes;        // used blocks including headers
+    uint32_t free_bytes;        // payload of free blocks
+    uint32_t peak_used;
+    uint32_t used_blocks;
+    uint32_t free_blocks;
+    uint32_t largest_free;
+    uint32_t fragmentation;     // external fragmentation in percent
+    uint32_t histogram[HEAP_HIST_BUCKETS];
+} HeapStats;
+
+// Per-CPU allocation counters, summed up by the getters below
+typedef struct {
+    uint64_t allocated;         // bytes handed out, block sizes
+    uint64_t freed;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t cache_hits;        // kmalloc/kfree served by the CPU's magazines
+    uint64_t refills;           // batches taken from the heap
+    uint64_t flushes;           // batches given back
+    uint64_t cached_bytes;      // sitting in the magazines right now
+} HeapCpuStats;
+
+uint32_t heap_cpu_count(void);
+void get_heap_cpu_stats(uint32_t cpu, HeapCpuStats* stats);
+
 // Memory statistics
 uint32_t get_total_allocated(void);
 uint32_t get_total_freed(void);
+uint32_t get_cached_bytes(void);
+uint32_t get_heap_size(void);
+uint32_t get_large_usage(void);
 uint32_t get_heap_usage(void);
 uint32_t get_free_memory(void);
+uint32_t get_peak_usage(void);
+void get_heap_stats(HeapStats* stats);
 
 // Memory testing
-int memory_test(void);
+int memory_test(uint32_t rounds);
 
 #endif
@@ -0,0 +1,235 @@
+#include "paging.h"
+#include "pmm.h"
+#include "../text/text_utils.h"
+#include "../lib/string.h"
+
+// Page table access through a recursive PML4 slot, so new tables never
+// need to be identity mapped
+#define RECURSIVE_BASE (0xFFFF000000000000ULL | ((uint64_t)PAGING_RECURSIVE_SLOT << 39))
+#define PT_BASE        RECURSIVE_BASE
+#define PD_BASE        (PT_BASE | ((uint64_t)PAGING_RECURSIVE_SLOT << 30))
+#define PDPT_BASE      (PD_BASE | ((uint64_t)PAGING_RECURSIVE_SLOT << 21))
+#define PML4_BASE      (PDPT_BASE | ((uint64_t)PAGING_RECURSIVE_SLOT << 12))
+
+// Power-on PAT (WB, WT, UC-, UC twice) with entry 1 turned into WC, so
+// PWT alone selects write-combining. Entry 3 (PCD | PWT) stays UC for
+// the MMIO registers.
+#define MSR_PAT        0x277
+#define PAT_VALUE      0x0007040600070106ULL
+#define CPUID_PAT      (1u << 16)
+
+static uint32_t paging_initialized = 0;
+static uint64_t mmio_next = KERNEL_MMIO_BASE;
+static volatile uint64_t tlb_generation = 0;
+static uint32_t pat_wc = 0;
+
+static inline uint64_t read_cr3(void) {
+    uint64_t value;
+    asm volatile ("mov %%cr3, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr3(uint64_t value) {
+    asm volatile ("mov %0, %%cr3" : : "r"(value) : "memory");
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    asm volatile ("wrmsr" : : "a"((uint32_t)value), "d"((uint32_t)(value >> 32)), "c"(msr));
+}
+
+static inline void invlpg(uint64_t virt) {
+    asm volatile ("invlpg (%0)" : : "r"(virt) : "memory");
+}
+
+static inline uint64_t* pml4e_ptr(uint64_t virt) {
+    return (uint64_t*)(PML4_BASE + ((virt >> 39) & 0x1FF) * 8);
+}
+
+static inline uint64_t* pdpte_ptr(uint64_t virt) {
+    return (uint64_t*)(PDPT_BASE + ((virt >> 30) & 0x3FFFF) * 8);
+}
+
+static inline uint64_t* pde_ptr(uint64_t virt) {
+    return (uint64_t*)(PD_BASE + ((virt >> 21) & 0x7FFFFFF) * 8);
+}
+
+static inline uint64_t* pte_ptr(uint64_t virt) {
+    return (uint64_t*)(PT_BASE + ((virt >> 12) & 0xFFFFFFFFFULL) * 8);
+}
+
+// Make sure the table that entry points to exists; table is where the
+// recursive mapping shows it
+static int ensure_table(uint64_t* entry, uint64_t* table) {
+    if (*entry & PAGE_PRESENT) {
+        return (*entry & PAGE_HUGE) ? -1 : 0;
+    }
+
+    uint64_t frame = pmm_alloc_page();
+    if (!frame) {
+        return -1;
+    }
+
+    *entry = frame | PAGE_PRESENT | PAGE_WRITE;
+
+    uint64_t table_page = (uint64_t)table & ~0xFFFULL;
+    invlpg(table_page);
+    memset((void*)table_page, 0, PAGE_SIZE);
+    return 0;
+}
+
+void paging_init(void) {
+    if (paging_initialized) return;
+
+    // The bootloader identity maps the low memory its tables live in
+    uint64_t pml4_phys = read_cr3() & PAGE_ADDR_MASK;
+    uint64_t* pml4 = (uint64_t*)pml4_phys;
+
+    pml4[PAGING_RECURSIVE_SLOT] = pml4_phys | PAGE_PRESENT | PAGE_WRITE;
+    write_cr3(read_cr3());
+
+    uint32_t eax = 1, ebx, ecx = 0, edx;
+    asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    pat_wc = (edx & CPUID_PAT) != 0;
+    paging_init_pat();
+
+    paging_initialized = 1;
+}
+
+void paging_init_pat(void) {
+    if (!pat_wc) return;
+
+    // Nothing may be cached under the old types while they change
+    asm volatile ("wbinvd" ::: "memory");
+    wrmsr(MSR_PAT, PAT_VALUE);
+    write_cr3(read_cr3());
+}
+
+uint64_t paging_wc_flags(void) {
+    return pat_wc ? PAGE_WC : 0;
+}
+
+int paging_map_page(uint64_t virt, uint64_t phys, uint64_t flags) {
+    if (!paging_initialized) return -1;
+
+    if (ensure_table(pml4e_ptr(virt), pdpte_ptr(virt)) ||
+        ensure_table(pdpte_ptr(virt), pde_ptr(virt)) ||
+        ensure_table(pde_ptr(virt), pte_ptr(virt))) {
+        return -1;
+    }
+
+    uint64_t* pte = pte_ptr(virt);
+    if (*pte & PAGE_PRESENT) {
+        print("paging: ", 0x0C);
+        print_hex(virt, 0x0C);
+        print(" is already mapped\n", 0x0C);
+        return -1;
+    }
+
+    *pte = (phys & PAGE_ADDR_MASK) | flags | PAGE_PRESENT;
+    invlpg(virt);
+    return 0;
+}
+
+static uint64_t* lookup_pte(uint64_t virt) {
+    if (!(*pml4e_ptr(virt) & PAGE_PRESENT)) return 0;
+    uint64_t pdpte = *pdpte_ptr(virt);
+    if (!(pdpte & PAGE_PRESENT) || (pdpte & PAGE_HUGE)) return 0;
+    uint64_t pde = *pde_ptr(virt);
+    if (!(pde & PAGE_PRESENT) || (pde & PAGE_HUGE)) return 0;
+    return pte_ptr(virt);
+}
+
+uint64_t paging_unmap_page(uint64_t virt) {
+    if (!paging_initialized) return 0;
+
+    uint64_t* pte = lookup_pte(virt);
+    if (!pte || !(*pte & PAGE_PRESENT)) {
+        return 0;
+    }
+
+    uint64_t phys = *pte & PAGE_ADDR_MASK;
+    *pte = 0;
+    invlpg(virt);
+    __atomic_add_fetch(&tlb_generation, 1, __ATOMIC_RELEASE);
+    return phys;
+}
+
+uint64_t paging_get_phys(uint64_t virt) {
+    if (!paging_initialized) return 0;
+    if (!(*pml4e_ptr(virt) & PAGE_PRESENT)) return 0;
+
+    // The bootloader may use 1GB or 2MB pages
+    uint64_t pdpte = *pdpte_ptr(virt);
+    if (!(pdpte & PAGE_PRESENT)) return 0;
+    if (pdpte & PAGE_HUGE) {
+        return (pdpte & PAGE_ADDR_MASK & ~0x3FFFFFFFULL) + (virt & 0x3FFFFFFF);
+    }
+
+    uint64_t pde = *pde_ptr(virt);
+    if (!(pde & PAGE_PRESENT)) return 0;
+    if (pde & PAGE_HUGE) {
+        return (pde & PAGE_ADDR_MASK & ~0x1FFFFFULL) + (virt & 0x1FFFFF);
+    }
+
+    uint64_t pte = *pte_ptr(virt);
+    if (!(pte & PAGE_PRESENT)) return 0;
+    return (pte & PAGE_ADDR_MASK) + (virt & 0xFFF);
+}
+
+int paging_map_pages(uint64_t virt, uint32_t count, uint64_t flags) {
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t frame = pmm_alloc_page();
+        if (!frame || paging_map_page(virt + (uint64_t)i * PAGE_SIZE, frame, flags)) {
+            if (frame) {
+                pmm_free_page(frame);
+            }
+            paging_unmap_pages(virt, i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void paging_unmap_pages(uint64_t virt, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t frame = paging_unmap_page(virt + (uint64_t)i * PAGE_SIZE);
+        if (frame) {
+            pmm_free_page(frame);
+        }
+    }
+}
+
+uint64_t paging_map_mmio(uint64_t phys, uint64_t size, uint64_t flags) {
+    if (!paging_initialized || size == 0) return 0;
+
+    uint64_t offset = phys & (PAGE_SIZE - 1);
+    uint64_t base = phys - offset;
+    uint64_t pages = (offset + size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    if (pages > (KERNEL_MMIO_END - mmio_next) / PAGE_SIZE) {
+        print("paging: MMIO window is full\n", 0x0C);
+        return 0;
+    }
+
+    uint64_t virt = mmio_next;
+    for (uint64_t i = 0; i < pages; i++) {
+        if (paging_map_page(virt + i * PAGE_SIZE, base + i * PAGE_SIZE, flags)) {
+            // Only unmap, the frames do not belong to the PMM
+            for (uint64_t j = 0; j < i; j++) {
+                paging_unmap_page(virt + j * PAGE_SIZE);
+            }
+            return 0;
+        }
+    }
+
+    mmio_next += pages * PAGE_SIZE;
+    return virt + offset;
+}
+
+uint64_t paging_tlb_generation(void) {
+    return __atomic_load_n(&tlb_generation, __ATOMIC_ACQUIRE);
+}
+
+void paging_flush_tlb(void) {
+    write_cr3(read_cr3());
+}
@@ -0,0 +1,71 @@
+#ifndef PAGING_H
+#define PAGING_H
+
+#include <stdint.h>
+
+#define KERNEL_OFFSET_HIGH 0xFFFFFFFF80000000ULL
+
+// Page table entry flags
+#define PAGE_PRESENT   0x001
+#define PAGE_WRITE     0x002
+#define PAGE_USER      0x004
+#define PAGE_PWT       0x008
+#define PAGE_PCD       0x010
+#define PAGE_HUGE      0x080
+#define PAGE_GLOBAL    0x100
+#define PAGE_NX        (1ULL << 63)
+
+// Write-combining, only valid once paging_init() programmed the PAT
+#define PAGE_WC        PAGE_PWT
+
+#define PAGE_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+// Kernel virtual memory layout (one PML4 slot = 512GB each)
+//   slot 256: growable kernel heap
+//   slot 257: whole page mappings for large allocations
+//   slot 258: device memory (framebuffer, MMIO registers)
+//   slot 510: recursive mapping of the page tables
+//   slot 511: kernel image (set up by the bootloader)
+// (the heap windows can be moved for the host allocator benchmark)
+#ifndef KERNEL_HEAP_BASE
+#define KERNEL_HEAP_BASE   0xFFFF800000000000ULL
+#define KERNEL_VMAP_BASE   0xFFFF808000000000ULL
+#define KERNEL_VMAP_END    0xFFFF810000000000ULL
+#endif
+
+#define KERNEL_MMIO_BASE   0xFFFF810000000000ULL
+#define KERNEL_MMIO_END    0xFFFF818000000000ULL
+
+#define PAGING_RECURSIVE_SLOT 510
+
+void paging_init(void);
+// Load the PAT paging_init() chose, every CPU runs this once
+void paging_init_pat(void);
+// PAGE_WC when the CPU has a PAT, 0 (uncached device memory) otherwise
+uint64_t paging_wc_flags(void);
+
+// Map one page, 0 on success
+int paging_map_page(uint64_t virt, uint64_t phys, uint64_t flags);
+// Unmap one page and return the physical address it pointed to (0 if none)
+uint64_t paging_unmap_page(uint64_t virt);
+// Physical address behind virt (0 if not mapped)
+uint64_t paging_get_phys(uint64_t virt);
+
+// Back count pages at virt with fresh frames, 0 on success
+int paging_map_pages(uint64_t virt, uint32_t count, uint64_t flags);
+// Unmap count pages at virt and give the frames back
+void paging_unmap_pages(uint64_t virt, uint32_t count);
+
+// Map size bytes of device memory at phys into the MMIO window and
+// return the virtual address of phys (0 on failure). Mappings stay for
+// the lifetime of the kernel.
+uint64_t paging_map_mmio(uint64_t phys, uint64_t size, uint64_t flags);
+
+// Counts unmaps. Only the CPU that unmaps flushes its TLB, so callers
+// unmap while no other CPU runs a work item (work_quiesce()); the others
+// compare this when they start the next one and flush the whole TLB
+// when it moved.
+uint64_t paging_tlb_generation(void);
+void paging_flush_tlb(void);
+
+#endif
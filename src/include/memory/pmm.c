@@ -0,0 +1,390 @@
+#include "pmm.h"
+#include "paging.h"
+#include "../text/text_utils.h"
+#include "../lib/string.h"
+#include <stddef.h>
+
+// Physical page frame allocator
+//
+// One bit per 4KB frame (1 = used), seeded from the usable E820 ranges.
+// Allocation scans 64 frames per step starting at a per-zone hint, so
+// single pages come out in near constant time.
+#define PMM_MAX_MEMORY      0x400000000ULL  // 16GB, frames above are ignored
+#define PMM_LOW_RESERVED    0x100000        // real mode area, bootloader, kernel image
+#define PMM_BOOT_MAP_LIMIT  0x800000        // identity mapped by the bootloader
+#define PMM_MAX_RESERVED    8
+
+typedef struct {
+    uint32_t start_pfn;     // first frame of the zone
+    uint32_t end_pfn;       // one past the last frame
+    uint32_t total_pages;
+    uint32_t free_pages;
+    uint32_t hint;          // first bitmap word that may have a free bit
+} PmmZone;
+
+typedef struct {
+    uint64_t base;
+    uint64_t end;
+} PmmRange;
+
+extern char _kernel_start[];
+extern char _kernel_end[];
+
+static uint64_t* bitmap = NULL;
+static uint32_t bitmap_words = 0;
+static uint32_t max_pfn = 0;
+static PmmZone zones[PMM_ZONE_COUNT];
+static MemmapInfo* memmap = NULL;
+static uint32_t pmm_initialized = 0;
+
+static inline uint32_t pfn_zone(uint32_t pfn) {
+    return pfn < (PMM_DMA_LIMIT >> PAGE_SHIFT) ? PMM_ZONE_DMA : PMM_ZONE_NORMAL;
+}
+
+static inline int frame_used(uint32_t pfn) {
+    return (bitmap[pfn >> 6] >> (pfn & 63)) & 1;
+}
+
+static void zone_account(uint32_t pfn, int freed) {
+    PmmZone* zone = &zones[pfn_zone(pfn)];
+    if (freed) {
+        zone->free_pages++;
+        if ((pfn >> 6) < zone->hint) {
+            zone->hint = pfn >> 6;
+        }
+    } else {
+        zone->free_pages--;
+    }
+}
+
+// Clear the bits [start, end), only touching frames that were used
+static void mark_free(uint32_t start, uint32_t end) {
+    for (uint32_t pfn = start; pfn < end; pfn++) {
+        if (frame_used(pfn)) {
+            bitmap[pfn >> 6] &= ~(1ULL << (pfn & 63));
+            zone_account(pfn, 1);
+        }
+    }
+}
+
+// Set the bits [start, end), only touching frames that were free
+static void mark_used(uint32_t start, uint32_t end) {
+    for (uint32_t pfn = start; pfn < end; pfn++) {
+        if (!frame_used(pfn)) {
+            bitmap[pfn >> 6] |= 1ULL << (pfn & 63);
+            zone_account(pfn, 0);
+        }
+    }
+}
+
+static inline uint64_t align_up(uint64_t value, uint64_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+static inline uint64_t align_down(uint64_t value, uint64_t align) {
+    return value & ~(align - 1);
+}
+
+static int ranges_overlap(uint64_t base, uint64_t end, const PmmRange* range) {
+    return base < range->end && range->base < end;
+}
+
+// Find room for the bitmap in usable memory that the bootloader identity maps
+static uint64_t place_bitmap(uint64_t size, const PmmRange* reserved, int reserved_count) {
+    for (int i = 0; i < memmap->entry_count; i++) {
+        E820Entry* entry = &memmap->entries[i];
+        if (entry->type != E820_TYPE_USABLE || entry->length == 0)
+            continue;
+
+        uint64_t region_end = align_down(entry->base + entry->length, PAGE_SIZE);
+        if (region_end > PMM_BOOT_MAP_LIMIT) {
+            region_end = PMM_BOOT_MAP_LIMIT;
+        }
+
+        uint64_t base = align_up(entry->base, PAGE_SIZE);
+        if (base < PMM_LOW_RESERVED) {
+            base = PMM_LOW_RESERVED;
+        }
+
+        // Step past every reserved range we run into
+        int moved = 1;
+        while (moved) {
+            moved = 0;
+            for (int r = 0; r < reserved_count; r++) {
+                if (ranges_overlap(base, base + size, &reserved[r])) {
+                    base = align_up(reserved[r].end, PAGE_SIZE);
+                    moved = 1;
+                }
+            }
+        }
+
+        if (base + size <= region_end) {
+            return base;
+        }
+    }
+    return 0;
+}
+
+void pmm_init(BootInfo* binfo) {
+    if (pmm_initialized || !binfo) return;
+
+    memmap = &binfo->memmap;
+
+    // Highest usable address decides the bitmap size
+    uint64_t max_addr = 0;
+    for (int i = 0; i < memmap->entry_count; i++) {
+        E820Entry* entry = &memmap->entries[i];
+        if (entry->type == E820_TYPE_USABLE && entry->base + entry->length > max_addr) {
+            max_addr = entry->base + entry->length;
+        }
+    }
+    if (max_addr > PMM_MAX_MEMORY) {
+        max_addr = PMM_MAX_MEMORY;
+    }
+
+    max_pfn = (uint32_t)(max_addr >> PAGE_SHIFT);
+    bitmap_words = (max_pfn + 63) / 64;
+    uint64_t bitmap_size = align_up((uint64_t)bitmap_words * sizeof(uint64_t), PAGE_SIZE);
+
+    // Ranges that must never be handed out
+    uint64_t binfo_base = (uint64_t)binfo;
+    if (binfo_base >= KERNEL_OFFSET_HIGH) {
+        binfo_base -= KERNEL_OFFSET_HIGH;
+    }
+    uint64_t binfo_size = sizeof(BootInfo) + memmap->entry_count * sizeof(E820Entry);
+
+    PmmRange reserved[PMM_MAX_RESERVED];
+    int reserved_count = 0;
+    reserved[reserved_count++] = (PmmRange){ 0, PMM_LOW_RESERVED };
+    reserved[reserved_count++] = (PmmRange){ (uint64_t)_kernel_start - KERNEL_OFFSET_HIGH,
+                                             (uint64_t)_kernel_end - KERNEL_OFFSET_HIGH };
+    reserved[reserved_count++] = (PmmRange){ binfo_base, binfo_base + binfo_size };
+
+    uint64_t bitmap_base = place_bitmap(bitmap_size, reserved, reserved_count);
+    if (!bitmap_base) {
+        print("PMM: no room for the frame bitmap!\n", 0x0C);
+        return;
+    }
+    reserved[reserved_count++] = (PmmRange){ bitmap_base, bitmap_base + bitmap_size };
+
+    bitmap = (uint64_t*)bitmap_base;
+
+    // Start with everything used
+    memset(bitmap, 0xFF, (size_t)bitmap_words * sizeof(uint64_t));
+
+    uint32_t dma_end = PMM_DMA_LIMIT >> PAGE_SHIFT;
+    zones[PMM_ZONE_DMA] = (PmmZone){ 0, dma_end < max_pfn ? dma_end : max_pfn, 0, 0, 0 };
+    zones[PMM_ZONE_NORMAL] = (PmmZone){ dma_end, max_pfn > dma_end ? max_pfn : dma_end, 0, 0, dma_end / 64 };
+
+    // Free the usable ranges (only whole frames) ...
+    for (int i = 0; i < memmap->entry_count; i++) {
+        E820Entry* entry = &memmap->entries[i];
+        if (entry->type != E820_TYPE_USABLE || entry->length == 0)
+            continue;
+
+        uint64_t start = align_up(entry->base, PAGE_SIZE) >> PAGE_SHIFT;
+        uint64_t end = align_down(entry->base + entry->length, PAGE_SIZE) >> PAGE_SHIFT;
+        if (end > max_pfn) end = max_pfn;
+        if (start < end) {
+            mark_free((uint32_t)start, (uint32_t)end);
+        }
+    }
+
+    // ... then take back anything another entry marks as not usable,
+    // E820 entries are allowed to overlap
+    for (int i = 0; i < memmap->entry_count; i++) {
+        E820Entry* entry = &memmap->entries[i];
+        if (entry->type == E820_TYPE_USABLE || entry->length == 0)
+            continue;
+        pmm_reserve_range(entry->base, entry->length);
+    }
+
+    for (int i = 0; i < PMM_ZONE_COUNT; i++) {
+        zones[i].total_pages = zones[i].free_pages;
+    }
+
+    for (int r = 0; r < reserved_count; r++) {
+        pmm_reserve_range(reserved[r].base, reserved[r].end - reserved[r].base);
+    }
+
+    pmm_initialized = 1;
+}
+
+void pmm_reserve_range(uint64_t base, uint64_t length) {
+    if (!bitmap || length == 0) return;
+
+    uint64_t start = align_down(base, PAGE_SIZE) >> PAGE_SHIFT;
+    uint64_t end = align_up(base + length, PAGE_SIZE) >> PAGE_SHIFT;
+    if (start >= max_pfn) return;
+    if (end > max_pfn) end = max_pfn;
+
+    mark_used((uint32_t)start, (uint32_t)end);
+}
+
+int pmm_range_usable(uint64_t base, uint64_t length) {
+    if (!memmap) return 0;
+
+    uint64_t end = base + length;
+
+    // Must not touch any non-usable entry ...
+    for (int i = 0; i < memmap->entry_count; i++) {
+        E820Entry* entry = &memmap->entries[i];
+        if (entry->type == E820_TYPE_USABLE || entry->length == 0)
+            continue;
+        if (base < entry->base + entry->length && entry->base < end)
+            return 0;
+    }
+
+    // ... and must be covered by usable entries
+    uint64_t pos = base;
+    int progress = 1;
+    while (pos < end && progress) {
+        progress = 0;
+        for (int i = 0; i < memmap->entry_count; i++) {
+            E820Entry* entry = &memmap->entries[i];
+            if (entry->type != E820_TYPE_USABLE)
+                continue;
+            if (entry->base <= pos && pos < entry->base + entry->length) {
+                pos = entry->base + entry->length;
+                progress = 1;
+            }
+        }
+    }
+    return pos >= end;
+}
+
+// Single frame: first clear bit at or after the zone hint
+static uint64_t zone_alloc_one(PmmZone* zone) {
+    uint32_t end_word = (zone->end_pfn + 63) / 64;
+
+    for (uint32_t w = zone->hint; w < end_word; w++) {
+        if (bitmap[w] == ~0ULL)
+            continue;
+
+        uint32_t pfn = w * 64 + __builtin_ctzll(~bitmap[w]);
+        if (pfn >= zone->end_pfn)
+            break;
+
+        bitmap[w] |= 1ULL << (pfn & 63);
+        zone->free_pages--;
+        zone->hint = w;
+        return (uint64_t)pfn << PAGE_SHIFT;
+    }
+
+    zone->hint = end_word;
+    return 0;
+}
+
+// Contiguous frames: first fit run of clear bits
+static uint64_t zone_alloc_run(PmmZone* zone, uint32_t count) {
+    uint32_t pfn = zone->hint * 64;
+    if (pfn < zone->start_pfn) {
+        pfn = zone->start_pfn;
+    }
+
+    while (pfn + count <= zone->end_pfn) {
+        // Skip full words in one step
+        if ((pfn & 63) == 0 && bitmap[pfn >> 6] == ~0ULL) {
+            pfn += 64;
+            continue;
+        }
+        if (frame_used(pfn)) {
+            pfn++;
+            continue;
+        }
+
+        uint32_t run = 0;
+        while (run < count && !frame_used(pfn + run)) {
+            run++;
+            // Whole free words count 64 at a time
+            uint32_t next = pfn + run;
+            if ((next & 63) == 0 && run + 64 <= count && bitmap[next >> 6] == 0) {
+                run += 63;
+            }
+        }
+
+        if (run >= count) {
+            mark_used(pfn, pfn + count);
+            return (uint64_t)pfn << PAGE_SHIFT;
+        }
+        pfn += run + 1;
+    }
+    return 0;
+}
+
+uint64_t pmm_alloc_pages_zone(uint32_t count, int zone) {
+    if (!pmm_initialized || count == 0 || zone < 0 || zone >= PMM_ZONE_COUNT) {
+        return 0;
+    }
+
+    PmmZone* z = &zones[zone];
+    if (z->free_pages < count) {
+        return 0;
+    }
+
+    if (count == 1) {
+        return zone_alloc_one(z);
+    }
+    return zone_alloc_run(z, count);
+}
+
+uint64_t pmm_alloc_pages(uint32_t count) {
+    // Keep the DMA zone for callers that need it, unless nothing else is left
+    uint64_t phys = pmm_alloc_pages_zone(count, PMM_ZONE_NORMAL);
+    if (!phys) {
+        phys = pmm_alloc_pages_zone(count, PMM_ZONE_DMA);
+    }
+    if (!phys) {
+        print("PMM: out of physical memory!\n", 0x0C);
+    }
+    return phys;
+}
+
+uint64_t pmm_alloc_page(void) {
+    return pmm_alloc_pages(1);
+}
+
+void pmm_free_pages(uint64_t phys, uint32_t count) {
+    if (!pmm_initialized) return;
+
+    uint64_t pfn = phys >> PAGE_SHIFT;
+    if ((phys & (PAGE_SIZE - 1)) || pfn + count > max_pfn) {
+        print("PMM: invalid free at ", 0x0C);
+        print_hex(phys, 0x0C);
+        print("\n", 0x0C);
+        return;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t frame = (uint32_t)pfn + i;
+        if (!frame_used(frame)) {
+            print("PMM: double free at ", 0x0C);
+            print_hex((uint64_t)frame << PAGE_SHIFT, 0x0C);
+            print("\n", 0x0C);
+            continue;
+        }
+        bitmap[frame >> 6] &= ~(1ULL << (frame & 63));
+        zone_account(frame, 1);
+    }
+}
+
+void pmm_free_page(uint64_t phys) {
+    pmm_free_pages(phys, 1);
+}
+
+uint32_t pmm_get_total_pages(void) {
+    return zones[PMM_ZONE_DMA].total_pages + zones[PMM_ZONE_NORMAL].total_pages;
+}
+
+uint32_t pmm_get_free_pages(void) {
+    return zones[PMM_ZONE_DMA].free_pages + zones[PMM_ZONE_NORMAL].free_pages;
+}
+
+uint32_t pmm_get_zone_free_pages(int zone) {
+    if (zone < 0 || zone >= PMM_ZONE_COUNT) return 0;
+    return zones[zone].free_pages;
+}
+
+uint64_t pmm_get_max_address(void) {
+    return (uint64_t)max_pfn << PAGE_SHIFT;
+}
@@ -0,0 +1,40 @@
+#ifndef PMM_H
+#define PMM_H
+
+#include <stdint.h>
+#include "../boot.h"
+
+#define PAGE_SIZE  0x1000
+#define PAGE_SHIFT 12
+
+// Physical memory zones
+#define PMM_ZONE_DMA    0   // below 16MB, reachable by ISA DMA
+#define PMM_ZONE_NORMAL 1   // everything above
+#define PMM_ZONE_COUNT  2
+
+#define PMM_DMA_LIMIT   0x1000000
+
+// Physical page frame allocator (bitmap, seeded from the E820 map)
+void pmm_init(BootInfo* binfo);
+
+// All allocation functions return a physical address, 0 on failure
+// (page 0 is never handed out)
+uint64_t pmm_alloc_page(void);
+uint64_t pmm_alloc_pages(uint32_t count);
+uint64_t pmm_alloc_pages_zone(uint32_t count, int zone);
+void pmm_free_page(uint64_t phys);
+void pmm_free_pages(uint64_t phys, uint32_t count);
+
+// Mark a range as in use (must be called before handing it out)
+void pmm_reserve_range(uint64_t base, uint64_t length);
+
+// 1 if the whole range is usable RAM according to the memory map
+int pmm_range_usable(uint64_t base, uint64_t length);
+
+// Statistics (in pages)
+uint32_t pmm_get_total_pages(void);
+uint32_t pmm_get_free_pages(void);
+uint32_t pmm_get_zone_free_pages(int zone);
+uint64_t pmm_get_max_address(void);
+
+#endif
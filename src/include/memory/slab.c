@@ -0,0 +1,334 @@
+#include "slab.h"
+#include "memory.h"
+#include "../text/text_utils.h"
+#include "../lib/string.h"
+
+// Object cache (slab) allocator on top of the kernel heap
+#define SLAB_MAGIC     0x51AB51AB
+#define SLAB_MIN_SIZE  0x1000   // one page
+#define SLAB_MAX_SIZE  0x20000  // 128KB
+#define SLAB_MIN_OBJS  8        // grow the slab until at least this many fit
+#define SLAB_KEEP_EMPTY 1       // empty slabs kept per cache before freeing
+
+struct Slab {
+    uint32_t magic;
+    uint32_t in_use;
+    kmem_cache* cache;
+    uint32_t hint;              // first bitmap word that may have a free slot
+    struct Slab* next;
+    struct Slab* prev;
+    uint64_t free_map[];        // a set bit is a free slot
+};
+
+// All caches share one set of counters, a destroyed cache's own would
+// stay on the lock statistics list
+static LockStats slab_lock_stats = LOCK_STATS_INIT("slab");
+static TicketLock list_lock = TICKET_LOCK_INIT(&slab_lock_stats);
+static kmem_cache* cache_list = NULL;
+
+static uint32_t align_up(uint32_t value, uint32_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+static void slab_list_add(Slab** list, Slab* slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+static void slab_list_remove(Slab** list, Slab* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+static inline uint32_t map_words(uint32_t objects) {
+    return (objects + 63) / 64;
+}
+
+// Slots per slab and where the first one starts, the bitmap in front of
+// them shrinks as fewer fit
+static void slab_layout(kmem_cache* cache) {
+    uint32_t align = cache->slot_size & -cache->slot_size;
+    if (align > 64) {
+        align = 64;
+    }
+
+    uint32_t objects = (cache->slab_size - sizeof(Slab)) / cache->slot_size;
+    uint32_t offset;
+    for (;;) {
+        offset = align_up(sizeof(Slab) + map_words(objects) * sizeof(uint64_t), align);
+        uint32_t fit = offset < cache->slab_size ? (cache->slab_size - offset) / cache->slot_size : 0;
+        if (fit >= objects) {
+            break;
+        }
+        objects = fit;
+    }
+
+    cache->objects_per_slab = objects;
+    cache->slot_offset = offset;
+}
+
+static Slab* slab_create(kmem_cache* cache) {
+    Slab* slab = (Slab*)kmalloc_aligned(cache->slab_size, cache->slab_size);
+    if (!slab) {
+        return NULL;
+    }
+
+    slab->magic = SLAB_MAGIC;
+    slab->in_use = 0;
+    slab->cache = cache;
+    slab->hint = 0;
+    slab->next = NULL;
+    slab->prev = NULL;
+
+    // Every slot starts out free
+    uint32_t objects = cache->objects_per_slab;
+    memset(slab->free_map, 0, map_words(objects) * sizeof(uint64_t));
+    for (uint32_t i = 0; i < objects / 64; i++) {
+        slab->free_map[i] = ~0ULL;
+    }
+    if (objects % 64) {
+        slab->free_map[objects / 64] = (1ULL << (objects % 64)) - 1;
+    }
+
+    // Objects are constructed once here and come back constructed
+    if (cache->ctor) {
+        uint8_t* slot = (uint8_t*)slab + cache->slot_offset;
+        for (uint32_t i = 0; i < objects; i++) {
+            cache->ctor(slot);
+            slot += cache->slot_size;
+        }
+    }
+
+    cache->total_slabs++;
+    cache->total_objects += cache->objects_per_slab;
+    cache->grow_count++;
+    return slab;
+}
+
+static void slab_destroy(kmem_cache* cache, Slab* slab) {
+    slab->magic = 0;
+    cache->total_slabs--;
+    cache->total_objects -= cache->objects_per_slab;
+    cache->shrink_count++;
+    kfree(slab);
+}
+
+kmem_cache* kmem_cache_create(const char* name, uint32_t size, uint32_t align, void (*ctor)(void* obj)) {
+    if (size == 0 || size > SLAB_MAX_SIZE / 2) {
+        return NULL;
+    }
+
+    if (align < sizeof(void*)) {
+        align = sizeof(void*);
+    }
+    if (align & (align - 1)) {
+        return NULL;
+    }
+
+    kmem_cache* cache = (kmem_cache*)kmalloc(sizeof(kmem_cache));
+    if (!cache) {
+        return NULL;
+    }
+
+    int i = 0;
+    for (; name && name[i] && i < KMEM_CACHE_NAME_LEN - 1; i++) {
+        cache->name[i] = name[i];
+    }
+    cache->name[i] = '\0';
+
+    cache->object_size = size;
+    cache->slot_size = align_up(size < sizeof(void*) ? sizeof(void*) : size, align);
+    cache->ctor = ctor;
+
+    cache->lock = (TicketLock)TICKET_LOCK_INIT(&slab_lock_stats);
+
+    // Pick the smallest slab that holds enough objects
+    cache->slab_size = SLAB_MIN_SIZE;
+    slab_layout(cache);
+    while (cache->slab_size < SLAB_MAX_SIZE && cache->objects_per_slab < SLAB_MIN_OBJS) {
+        cache->slab_size <<= 1;
+        slab_layout(cache);
+    }
+
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->empty = NULL;
+
+    cache->total_slabs = 0;
+    cache->empty_slabs = 0;
+    cache->active_objects = 0;
+    cache->total_objects = 0;
+    cache->alloc_count = 0;
+    cache->free_count = 0;
+    cache->grow_count = 0;
+    cache->shrink_count = 0;
+
+    uint64_t flags = ticket_lock_irqsave(&list_lock);
+    cache->next = cache_list;
+    cache_list = cache;
+    ticket_unlock_irqrestore(&list_lock, flags);
+
+    return cache;
+}
+
+void kmem_cache_destroy(kmem_cache* cache) {
+    if (!cache) return;
+
+    // Unlink from the cache list
+    uint64_t flags = ticket_lock_irqsave(&list_lock);
+    kmem_cache** link = &cache_list;
+    while (*link && *link != cache) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = cache->next;
+    }
+    ticket_unlock_irqrestore(&list_lock, flags);
+
+    if (cache->active_objects) {
+        print("kmem_cache_destroy: ", 0x0C);
+        print(cache->name, 0x0C);
+        print(" still has objects in use\n", 0x0C);
+    }
+
+    Slab** lists[] = { &cache->partial, &cache->full, &cache->empty };
+    for (int i = 0; i < 3; i++) {
+        while (*lists[i]) {
+            Slab* slab = *lists[i];
+            slab_list_remove(lists[i], slab);
+            slab_destroy(cache, slab);
+        }
+    }
+
+    kfree(cache);
+}
+
+void* kmem_cache_alloc(kmem_cache* cache) {
+    if (!cache) return NULL;
+
+    uint64_t flags = ticket_lock_irqsave(&cache->lock);
+    Slab* slab = cache->partial;
+    if (!slab) {
+        slab = cache->empty;
+        if (slab) {
+            slab_list_remove(&cache->empty, slab);
+            cache->empty_slabs--;
+        } else {
+            slab = slab_create(cache);
+            if (!slab) {
+                ticket_unlock_irqrestore(&cache->lock, flags);
+                return NULL;
+            }
+        }
+        slab_list_add(&cache->partial, slab);
+    }
+
+    // Lowest free slot; words before the hint are all in use
+    uint32_t word = slab->hint;
+    while (!slab->free_map[word]) {
+        word++;
+    }
+    uint32_t bit = (uint32_t)__builtin_ctzll(slab->free_map[word]);
+    slab->free_map[word] &= ~(1ULL << bit);
+    slab->hint = word;
+    slab->in_use++;
+
+    void* obj = (uint8_t*)slab + cache->slot_offset + (word * 64 + bit) * cache->slot_size;
+
+    if (slab->in_use == cache->objects_per_slab) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_add(&cache->full, slab);
+    }
+
+    cache->active_objects++;
+    cache->alloc_count++;
+    ticket_unlock_irqrestore(&cache->lock, flags);
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache* cache, void* obj) {
+    if (!cache || !obj) return;
+
+    Slab* slab = (Slab*)((uintptr_t)obj & ~(uintptr_t)(cache->slab_size - 1));
+
+    if (slab->magic != SLAB_MAGIC || slab->cache != cache) {
+        print("kmem_cache_free: object does not belong to ", 0x0C);
+        print(cache->name, 0x0C);
+        print("\n", 0x0C);
+        return;
+    }
+
+    uint32_t offset = (uint32_t)((uint8_t*)obj - (uint8_t*)slab);
+    uint32_t index = (offset - cache->slot_offset) / cache->slot_size;
+    if (offset < cache->slot_offset || (offset - cache->slot_offset) % cache->slot_size ||
+        index >= cache->objects_per_slab) {
+        print("kmem_cache_free: misaligned object\n", 0x0C);
+        return;
+    }
+
+    uint64_t flags = ticket_lock_irqsave(&cache->lock);
+    uint64_t mask = 1ULL << (index % 64);
+    if (slab->free_map[index / 64] & mask) {
+        ticket_unlock_irqrestore(&cache->lock, flags);
+        print("kmem_cache_free: double free in ", 0x0C);
+        print(cache->name, 0x0C);
+        print("\n", 0x0C);
+        return;
+    }
+
+    int was_full = slab->in_use == cache->objects_per_slab;
+
+    slab->free_map[index / 64] |= mask;
+    if (index / 64 < slab->hint) {
+        slab->hint = index / 64;
+    }
+    slab->in_use--;
+
+    cache->active_objects--;
+    cache->free_count++;
+
+    if (was_full) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_add(&cache->partial, slab);
+    }
+
+    if (slab->in_use == 0) {
+        slab_list_remove(&cache->partial, slab);
+        if (cache->empty_slabs < SLAB_KEEP_EMPTY) {
+            slab_list_add(&cache->empty, slab);
+            cache->empty_slabs++;
+        } else {
+            slab_destroy(cache, slab);
+        }
+    }
+    ticket_unlock_irqrestore(&cache->lock, flags);
+}
+
+void kmem_cache_shrink(kmem_cache* cache) {
+    if (!cache) return;
+
+    uint64_t flags = ticket_lock_irqsave(&cache->lock);
+    while (cache->empty) {
+        Slab* slab = cache->empty;
+        slab_list_remove(&cache->empty, slab);
+        cache->empty_slabs--;
+        slab_destroy(cache, slab);
+    }
+    ticket_unlock_irqrestore(&cache->lock, flags);
+}
+
+kmem_cache* kmem_cache_first(void) {
+    return cache_list;
+}
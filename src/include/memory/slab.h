@@ -0,0 +1,57 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "../../kernel/lock.h"
+
+#define KMEM_CACHE_NAME_LEN 16
+
+typedef struct Slab Slab;
+
+// Object cache: fixed size slots carved out of page aligned slabs. A
+// bitmap in each slab's header tracks the free slots, so double frees
+// are caught. Every cache has its own lock and may be used from
+// interrupt handlers.
+typedef struct kmem_cache {
+    char name[KMEM_CACHE_NAME_LEN];
+    uint32_t object_size;       // size asked for at creation
+    uint32_t slot_size;         // aligned size of one slot
+    uint32_t slab_size;         // bytes per slab (power of two)
+    uint32_t objects_per_slab;
+    uint32_t slot_offset;       // first slot, after the header and bitmap
+    void (*ctor)(void* obj);
+    TicketLock lock;
+
+    Slab* partial;              // slabs with used and free slots
+    Slab* full;                 // slabs without free slots
+    Slab* empty;                // slabs without used slots
+
+    // Statistics
+    uint32_t total_slabs;
+    uint32_t empty_slabs;
+    uint32_t active_objects;
+    uint32_t total_objects;
+    uint64_t alloc_count;
+    uint64_t free_count;
+    uint32_t grow_count;
+    uint32_t shrink_count;
+
+    struct kmem_cache* next;
+} kmem_cache;
+
+// Object cache functions. ctor (may be NULL) runs once per slot when its
+// slab is made, not on every allocation: objects have to be freed in
+// their constructed state.
+kmem_cache* kmem_cache_create(const char* name, uint32_t size, uint32_t align, void (*ctor)(void* obj));
+void kmem_cache_destroy(kmem_cache* cache);
+void* kmem_cache_alloc(kmem_cache* cache);
+void kmem_cache_free(kmem_cache* cache, void* obj);
+
+// Give empty slabs back to the heap
+void kmem_cache_shrink(kmem_cache* cache);
+
+// Iterate over all caches (for statistics)
+kmem_cache* kmem_cache_first(void);
+
+#endif
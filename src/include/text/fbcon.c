@@ -0,0 +1,204 @@
+#include "fbcon.h"
+#include "font/font.h"
+#include "text_utils.h"
+#include "../memory/memory.h"
+
+// Rendered glyphs are kept per cell value (character and attribute),
+// direct mapped by a hash of the cell
+#define GLYPH_CACHE_BITS 9
+#define GLYPH_CACHE_SIZE (1 << GLYPH_CACHE_BITS)
+
+typedef uint32_t v4u32 __attribute__((vector_size(16)));
+typedef long long v2i64 __attribute__((vector_size(16)));
+
+typedef struct {
+    v4u32 pixels[FONT_HEIGHT][FONT_WIDTH / 4];
+} Glyph;
+
+// Standard VGA text mode colors as 0x00RRGGBB
+static const uint32_t palette[16] = {
+    0x000000, 0x0000AA, 0x00AA00, 0x00AAAA, 0xAA0000, 0xAA00AA, 0xAA5500, 0xAAAAAA,
+    0x555555, 0x5555FF, 0x55FF55, 0x55FFFF, 0xFF5555, 0xFF55FF, 0xFFFF55, 0xFFFFFF
+};
+
+static uint8_t* framebuffer = NULL;
+static uint32_t fb_pitch = 0;
+static uint32_t fb_height = 0;
+static int screen_cols = 0;
+static int screen_rows = 0;
+static int streaming = 0;          // framebuffer lines allow 16 byte stores
+
+// Glyphs of the row being drawn, looked up once per cell
+static const Glyph** row_glyphs = NULL;
+
+static Glyph* glyph_cache = NULL;
+static uint32_t* glyph_tags = NULL;  // cell + 1, 0 for an empty slot
+
+// Pixel masks for 4 font bits, bit 3 is the leftmost pixel
+static v4u32 nibble_mask[16];
+
+static inline uint32_t glyph_slot(uint16_t cell) {
+    return (uint16_t)(cell * 40503u) >> (16 - GLYPH_CACHE_BITS);
+}
+
+static void glyph_render(Glyph* glyph, uint16_t cell) {
+    uint8_t c = cell & 0xFF;
+    uint8_t attr = cell >> 8;
+
+    uint32_t fg = palette[attr & 0x0F];
+    uint32_t bg = palette[attr >> 4];
+    v4u32 fgv = { fg, fg, fg, fg };
+    v4u32 bgv = { bg, bg, bg, bg };
+
+    for (int y = 0; y < FONT_HEIGHT; y++) {
+        uint8_t bits = c < FONT_GLYPHS ? font8x8[c][y * FONT_DATA_HEIGHT / FONT_HEIGHT] : 0;
+        v4u32 left = nibble_mask[bits >> 4];
+        v4u32 right = nibble_mask[bits & 0x0F];
+        glyph->pixels[y][0] = (fgv & left) | (bgv & ~left);
+        glyph->pixels[y][1] = (fgv & right) | (bgv & ~right);
+    }
+}
+
+static const Glyph* glyph_get(uint16_t cell) {
+    uint32_t slot = glyph_slot(cell);
+    Glyph* glyph = &glyph_cache[slot];
+
+    if (glyph_tags[slot] != (uint32_t)cell + 1) {
+        glyph_render(glyph, cell);
+        glyph_tags[slot] = (uint32_t)cell + 1;
+    }
+    return glyph;
+}
+
+// Store 16 bytes of pixels to video memory. With aligned lines this is
+// a non-temporal store; the framebuffer is mapped WC when the CPU has a
+// PAT, so sequential stores fill whole write-combining lines. Without a
+// PAT the mapping is uncached and every store goes out on its own.
+static inline void fb_store(uint8_t* dst, v4u32 pixels) {
+    if (streaming) {
+        __builtin_ia32_movntdq((v2i64*)dst, (v2i64)pixels);
+    } else {
+        volatile uint32_t* d = (volatile uint32_t*)dst;
+        d[0] = pixels[0];
+        d[1] = pixels[1];
+        d[2] = pixels[2];
+        d[3] = pixels[3];
+    }
+}
+
+static inline void fb_store_done(void) {
+    if (streaming) {
+        asm volatile ("sfence" ::: "memory");
+    }
+}
+
+static void fill_screen(uint32_t color) {
+    v4u32 value = { color, color, color, color };
+    uint32_t bytes = screen_cols * FONT_WIDTH * 4;
+
+    for (uint32_t y = 0; y < fb_height; y++) {
+        uint8_t* line = framebuffer + (uint64_t)y * fb_pitch;
+        for (uint32_t x = 0; x < bytes; x += 16) {
+            fb_store(line + x, value);
+        }
+    }
+    fb_store_done();
+}
+
+int fbcon_init(const VideoInfo* video) {
+    if (video->type != 1 || video->bpp != 32 || !video->framebuffer) {
+        return -1;
+    }
+    if (video->width < FONT_WIDTH || video->height < FONT_HEIGHT ||
+        video->pitch < (uint32_t)video->width * 4) {
+        return -1;
+    }
+
+    uint64_t size = (uint64_t)video->pitch * video->height;
+    uint64_t virt = paging_map_mmio(video->framebuffer, size, PAGE_WRITE | paging_wc_flags());
+    if (!virt) {
+        return -1;
+    }
+
+    screen_cols = video->width / FONT_WIDTH;
+    screen_rows = video->height / FONT_HEIGHT;
+
+    row_glyphs = (const Glyph**)kmalloc(screen_cols * sizeof(Glyph*));
+    glyph_cache = (Glyph*)kmalloc_aligned(GLYPH_CACHE_SIZE * sizeof(Glyph), 16);
+    glyph_tags = (uint32_t*)kmalloc(GLYPH_CACHE_SIZE * sizeof(uint32_t));
+    if (!row_glyphs || !glyph_cache || !glyph_tags) {
+        kfree(row_glyphs);
+        kfree(glyph_cache);
+        kfree(glyph_tags);
+        return -1;
+    }
+
+    for (int i = 0; i < GLYPH_CACHE_SIZE; i++) {
+        glyph_tags[i] = 0;
+    }
+
+    for (int n = 0; n < 16; n++) {
+        for (int i = 0; i < 4; i++) {
+            nibble_mask[n][i] = (n & (8 >> i)) ? 0xFFFFFFFF : 0;
+        }
+    }
+
+    framebuffer = (uint8_t*)virt;
+    fb_pitch = video->pitch;
+    fb_height = video->height;
+    streaming = ((virt | fb_pitch) & 15) == 0;
+
+    // Most of the console is printable text in the default color
+    for (int c = ' '; c <= '~'; c++) {
+        glyph_get((COLOR_DEFAULT << 8) | c);
+    }
+
+    fill_screen(palette[0]);
+    return 0;
+}
+
+int fbcon_cols(void) {
+    return screen_cols;
+}
+
+int fbcon_rows(void) {
+    return screen_rows;
+}
+
+void fbcon_draw_row(int row, const uint16_t* cells, int count, int cursor_col) {
+    if (!framebuffer || row < 0 || row >= screen_rows) {
+        return;
+    }
+    if (count > screen_cols) {
+        count = screen_cols;
+    }
+
+    for (int col = 0; col < count; col++) {
+        row_glyphs[col] = glyph_get(cells[col]);
+    }
+
+    // Write scanline by scanline so the stores to video memory are
+    // sequential, each glyph contributes two 16 byte pieces per line
+    uint8_t* base = framebuffer + (uint64_t)row * FONT_HEIGHT * fb_pitch;
+    for (int y = 0; y < FONT_HEIGHT; y++) {
+        uint8_t* line = base + (uint64_t)y * fb_pitch;
+        for (int col = 0; col < count; col++) {
+            fb_store(line, row_glyphs[col]->pixels[y][0]);
+            fb_store(line + 16, row_glyphs[col]->pixels[y][1]);
+            line += FONT_WIDTH * 4;
+        }
+    }
+
+    // Underline cursor in the last two scanlines, like the VGA one
+    if (cursor_col >= 0 && cursor_col < count) {
+        uint32_t fg = palette[(cells[cursor_col] >> 8) & 0x0F];
+        v4u32 value = { fg, fg, fg, fg };
+        for (int y = FONT_HEIGHT - 2; y < FONT_HEIGHT; y++) {
+            uint8_t* cell = base + (uint64_t)y * fb_pitch + cursor_col * FONT_WIDTH * 4;
+            fb_store(cell, value);
+            fb_store(cell + 16, value);
+        }
+    }
+
+    fb_store_done();
+}
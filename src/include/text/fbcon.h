@@ -0,0 +1,22 @@
+#ifndef FBCON_H
+#define FBCON_H
+
+#include <stdint.h>
+#include "../boot.h"
+
+// Linear framebuffer backend for the console. It draws rows of VGA
+// style cells (character | attribute << 8) with the built-in font.
+
+// Map the framebuffer described by the bootloader, 0 on success.
+// Only 32 bpp graphics modes are supported.
+int fbcon_init(const VideoInfo* video);
+
+// Size of the screen in character cells
+int fbcon_cols(void);
+int fbcon_rows(void);
+
+// Draw count cells as screen row row, with an underline cursor at
+// cursor_col (-1 for none)
+void fbcon_draw_row(int row, const uint16_t* cells, int count, int cursor_col);
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef FONT_H
+#define FONT_H
+
+#include <stdint.h>
+
+// Built-in console font: 8x8 glyphs drawn with every row doubled,
+// giving 8x16 character cells like the VGA text mode font
+#define FONT_GLYPHS       128
+#define FONT_DATA_HEIGHT  8
+#define FONT_WIDTH        8
+#define FONT_HEIGHT       16
+
+extern const uint8_t font8x8[FONT_GLYPHS][FONT_DATA_HEIGHT];
+
+#endif
@@ -0,0 +1,101 @@
+#include "font.h"
+
+// 8x8 glyphs for printable ASCII, bit 7 is the leftmost pixel.
+// Everything outside 0x20-0x7E is blank.
+const uint8_t font8x8[FONT_GLYPHS][FONT_DATA_HEIGHT] = {
+    [0x20] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },   // ' '
+    [0x21] = { 0x18, 0x3C, 0x3C, 0x18, 0x18, 0x00, 0x18, 0x00 },   // '!'
+    [0x22] = { 0x6C, 0x6C, 0x48, 0x00, 0x00, 0x00, 0x00, 0x00 },   // '"'
+    [0x23] = { 0x6C, 0x6C, 0xFE, 0x6C, 0xFE, 0x6C, 0x6C, 0x00 },   // '#'
+    [0x24] = { 0x18, 0x7C, 0xC0, 0x78, 0x0C, 0xF8, 0x18, 0x00 },   // '$'
+    [0x25] = { 0x00, 0xC6, 0xCC, 0x18, 0x30, 0x66, 0xC6, 0x00 },   // '%'
+    [0x26] = { 0x38, 0x6C, 0x38, 0x76, 0xDC, 0xCC, 0x76, 0x00 },   // '&'
+    [0x27] = { 0x30, 0x30, 0x60, 0x00, 0x00, 0x00, 0x00, 0x00 },   // '\''
+    [0x28] = { 0x0C, 0x18, 0x30, 0x30, 0x30, 0x18, 0x0C, 0x00 },   // '('
+    [0x29] = { 0x30, 0x18, 0x0C, 0x0C, 0x0C, 0x18, 0x30, 0x00 },   // ')'
+    [0x2A] = { 0x00, 0x66, 0x3C, 0xFF, 0x3C, 0x66, 0x00, 0x00 },   // '*'
+    [0x2B] = { 0x00, 0x18, 0x18, 0x7E, 0x18, 0x18, 0x00, 0x00 },   // '+'
+    [0x2C] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x18, 0x18, 0x30 },   // ','
+    [0x2D] = { 0x00, 0x00, 0x00, 0x7E, 0x00, 0x00, 0x00, 0x00 },   // '-'
+    [0x2E] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x18, 0x18, 0x00 },   // '.'
+    [0x2F] = { 0x06, 0x0C, 0x18, 0x30, 0x60, 0xC0, 0x80, 0x00 },   // '/'
+    [0x30] = { 0x7C, 0xC6, 0xCE, 0xDE, 0xF6, 0xE6, 0x7C, 0x00 },   // '0'
+    [0x31] = { 0x18, 0x38, 0x18, 0x18, 0x18, 0x18, 0x7E, 0x00 },   // '1'
+    [0x32] = { 0x78, 0xCC, 0x0C, 0x38, 0x60, 0xCC, 0xFC, 0x00 },   // '2'
+    [0x33] = { 0x78, 0xCC, 0x0C, 0x38, 0x0C, 0xCC, 0x78, 0x00 },   // '3'
+    [0x34] = { 0x1C, 0x3C, 0x6C, 0xCC, 0xFE, 0x0C, 0x1E, 0x00 },   // '4'
+    [0x35] = { 0xFC, 0xC0, 0xF8, 0x0C, 0x0C, 0xCC, 0x78, 0x00 },   // '5'
+    [0x36] = { 0x38, 0x60, 0xC0, 0xF8, 0xCC, 0xCC, 0x78, 0x00 },   // '6'
+    [0x37] = { 0xFC, 0xCC, 0x0C, 0x18, 0x30, 0x30, 0x30, 0x00 },   // '7'
+    [0x38] = { 0x78, 0xCC, 0xCC, 0x78, 0xCC, 0xCC, 0x78, 0x00 },   // '8'
+    [0x39] = { 0x78, 0xCC, 0xCC, 0x7C, 0x0C, 0x18, 0x70, 0x00 },   // '9'
+    [0x3A] = { 0x00, 0x18, 0x18, 0x00, 0x00, 0x18, 0x18, 0x00 },   // ':'
+    [0x3B] = { 0x00, 0x18, 0x18, 0x00, 0x00, 0x18, 0x18, 0x30 },   // ';'
+    [0x3C] = { 0x0C, 0x18, 0x30, 0x60, 0x30, 0x18, 0x0C, 0x00 },   // '<'
+    [0x3D] = { 0x00, 0x00, 0x7E, 0x00, 0x00, 0x7E, 0x00, 0x00 },   // '='
+    [0x3E] = { 0x60, 0x30, 0x18, 0x0C, 0x18, 0x30, 0x60, 0x00 },   // '>'
+    [0x3F] = { 0x78, 0xCC, 0x0C, 0x18, 0x30, 0x00, 0x30, 0x00 },   // '?'
+    [0x40] = { 0x7C, 0xC6, 0xDE, 0xDE, 0xDE, 0xC0, 0x78, 0x00 },   // '@'
+    [0x41] = { 0x30, 0x78, 0xCC, 0xCC, 0xFC, 0xCC, 0xCC, 0x00 },   // 'A'
+    [0x42] = { 0xFC, 0x66, 0x66, 0x7C, 0x66, 0x66, 0xFC, 0x00 },   // 'B'
+    [0x43] = { 0x3C, 0x66, 0xC0, 0xC0, 0xC0, 0x66, 0x3C, 0x00 },   // 'C'
+    [0x44] = { 0xF8, 0x6C, 0x66, 0x66, 0x66, 0x6C, 0xF8, 0x00 },   // 'D'
+    [0x45] = { 0xFE, 0x62, 0x68, 0x78, 0x68, 0x62, 0xFE, 0x00 },   // 'E'
+    [0x46] = { 0xFE, 0x62, 0x68, 0x78, 0x68, 0x60, 0xF0, 0x00 },   // 'F'
+    [0x47] = { 0x3C, 0x66, 0xC0, 0xC0, 0xCE, 0x66, 0x3E, 0x00 },   // 'G'
+    [0x48] = { 0xCC, 0xCC, 0xCC, 0xFC, 0xCC, 0xCC, 0xCC, 0x00 },   // 'H'
+    [0x49] = { 0x78, 0x30, 0x30, 0x30, 0x30, 0x30, 0x78, 0x00 },   // 'I'
+    [0x4A] = { 0x1E, 0x0C, 0x0C, 0x0C, 0xCC, 0xCC, 0x78, 0x00 },   // 'J'
+    [0x4B] = { 0xE6, 0x66, 0x6C, 0x78, 0x6C, 0x66, 0xE6, 0x00 },   // 'K'
+    [0x4C] = { 0xF0, 0x60, 0x60, 0x60, 0x62, 0x66, 0xFE, 0x00 },   // 'L'
+    [0x4D] = { 0xC6, 0xEE, 0xFE, 0xFE, 0xD6, 0xC6, 0xC6, 0x00 },   // 'M'
+    [0x4E] = { 0xC6, 0xE6, 0xF6, 0xDE, 0xCE, 0xC6, 0xC6, 0x00 },   // 'N'
+    [0x4F] = { 0x38, 0x6C, 0xC6, 0xC6, 0xC6, 0x6C, 0x38, 0x00 },   // 'O'
+    [0x50] = { 0xFC, 0x66, 0x66, 0x7C, 0x60, 0x60, 0xF0, 0x00 },   // 'P'
+    [0x51] = { 0x78, 0xCC, 0xCC, 0xCC, 0xDC, 0x78, 0x1C, 0x00 },   // 'Q'
+    [0x52] = { 0xFC, 0x66, 0x66, 0x7C, 0x6C, 0x66, 0xE6, 0x00 },   // 'R'
+    [0x53] = { 0x78, 0xCC, 0xE0, 0x70, 0x1C, 0xCC, 0x78, 0x00 },   // 'S'
+    [0x54] = { 0xFC, 0xB4, 0x30, 0x30, 0x30, 0x30, 0x78, 0x00 },   // 'T'
+    [0x55] = { 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xFC, 0x00 },   // 'U'
+    [0x56] = { 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0x78, 0x30, 0x00 },   // 'V'
+    [0x57] = { 0xC6, 0xC6, 0xC6, 0xD6, 0xFE, 0xEE, 0xC6, 0x00 },   // 'W'
+    [0x58] = { 0xC6, 0xC6, 0x6C, 0x38, 0x38, 0x6C, 0xC6, 0x00 },   // 'X'
+    [0x59] = { 0xCC, 0xCC, 0xCC, 0x78, 0x30, 0x30, 0x78, 0x00 },   // 'Y'
+    [0x5A] = { 0xFE, 0xC6, 0x8C, 0x18, 0x32, 0x66, 0xFE, 0x00 },   // 'Z'
+    [0x5B] = { 0x78, 0x60, 0x60, 0x60, 0x60, 0x60, 0x78, 0x00 },   // '['
+    [0x5C] = { 0xC0, 0x60, 0x30, 0x18, 0x0C, 0x06, 0x02, 0x00 },   // '\\'
+    [0x5D] = { 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0x78, 0x00 },   // ']'
+    [0x5E] = { 0x10, 0x38, 0x6C, 0xC6, 0x00, 0x00, 0x00, 0x00 },   // '^'
+    [0x5F] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF },   // '_'
+    [0x60] = { 0x30, 0x30, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00 },   // '`'
+    [0x61] = { 0x00, 0x00, 0x78, 0x0C, 0x7C, 0xCC, 0x76, 0x00 },   // 'a'
+    [0x62] = { 0xE0, 0x60, 0x60, 0x7C, 0x66, 0x66, 0xDC, 0x00 },   // 'b'
+    [0x63] = { 0x00, 0x00, 0x78, 0xCC, 0xC0, 0xCC, 0x78, 0x00 },   // 'c'
+    [0x64] = { 0x1C, 0x0C, 0x0C, 0x7C, 0xCC, 0xCC, 0x76, 0x00 },   // 'd'
+    [0x65] = { 0x00, 0x00, 0x78, 0xCC, 0xFC, 0xC0, 0x78, 0x00 },   // 'e'
+    [0x66] = { 0x38, 0x6C, 0x60, 0xF0, 0x60, 0x60, 0xF0, 0x00 },   // 'f'
+    [0x67] = { 0x00, 0x00, 0x76, 0xCC, 0xCC, 0x7C, 0x0C, 0xF8 },   // 'g'
+    [0x68] = { 0xE0, 0x60, 0x6C, 0x76, 0x66, 0x66, 0xE6, 0x00 },   // 'h'
+    [0x69] = { 0x30, 0x00, 0x70, 0x30, 0x30, 0x30, 0x78, 0x00 },   // 'i'
+    [0x6A] = { 0x0C, 0x00, 0x0C, 0x0C, 0x0C, 0xCC, 0xCC, 0x78 },   // 'j'
+    [0x6B] = { 0xE0, 0x60, 0x66, 0x6C, 0x78, 0x6C, 0xE6, 0x00 },   // 'k'
+    [0x6C] = { 0x70, 0x30, 0x30, 0x30, 0x30, 0x30, 0x78, 0x00 },   // 'l'
+    [0x6D] = { 0x00, 0x00, 0xCC, 0xFE, 0xFE, 0xD6, 0xC6, 0x00 },   // 'm'
+    [0x6E] = { 0x00, 0x00, 0xF8, 0xCC, 0xCC, 0xCC, 0xCC, 0x00 },   // 'n'
+    [0x6F] = { 0x00, 0x00, 0x78, 0xCC, 0xCC, 0xCC, 0x78, 0x00 },   // 'o'
+    [0x70] = { 0x00, 0x00, 0xDC, 0x66, 0x66, 0x7C, 0x60, 0xF0 },   // 'p'
+    [0x71] = { 0x00, 0x00, 0x76, 0xCC, 0xCC, 0x7C, 0x0C, 0x1E },   // 'q'
+    [0x72] = { 0x00, 0x00, 0xDC, 0x76, 0x66, 0x60, 0xF0, 0x00 },   // 'r'
+    [0x73] = { 0x00, 0x00, 0x7C, 0xC0, 0x78, 0x0C, 0xF8, 0x00 },   // 's'
+    [0x74] = { 0x10, 0x30, 0x7C, 0x30, 0x30, 0x34, 0x18, 0x00 },   // 't'
+    [0x75] = { 0x00, 0x00, 0xCC, 0xCC, 0xCC, 0xCC, 0x76, 0x00 },   // 'u'
+    [0x76] = { 0x00, 0x00, 0xCC, 0xCC, 0xCC, 0x78, 0x30, 0x00 },   // 'v'
+    [0x77] = { 0x00, 0x00, 0xC6, 0xD6, 0xFE, 0xFE, 0x6C, 0x00 },   // 'w'
+    [0x78] = { 0x00, 0x00, 0xC6, 0x6C, 0x38, 0x6C, 0xC6, 0x00 },   // 'x'
+    [0x79] = { 0x00, 0x00, 0xCC, 0xCC, 0xCC, 0x7C, 0x0C, 0xF8 },   // 'y'
+    [0x7A] = { 0x00, 0x00, 0xFC, 0x98, 0x30, 0x64, 0xFC, 0x00 },   // 'z'
+    [0x7B] = { 0x1C, 0x30, 0x30, 0xE0, 0x30, 0x30, 0x1C, 0x00 },   // '{'
+    [0x7C] = { 0x18, 0x18, 0x18, 0x00, 0x18, 0x18, 0x18, 0x00 },   // '|'
+    [0x7D] = { 0xE0, 0x30, 0x30, 0x1C, 0x30, 0x30, 0xE0, 0x00 },   // '}'
+    [0x7E] = { 0x76, 0xDC, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },   // '~'
+};
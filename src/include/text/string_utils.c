@@ -1,34 +1,47 @@
 #include "string_utils.h"
+#include "../lib/string.h"
 
 int str_equals(const char* a, const char* b) {
-    while (*a && *b && *a == *b) {
-        a++;
-        b++;
-    }
-    return *a == *b;
+    return strcmp(a, b) == 0;
 }
 
 int str_starts_with(const char* str, const char* prefix) {
-    while (*prefix && *str == *prefix) {
-        str++;
-        prefix++;
-    }
-    return *prefix == '\0';
+    return strncmp(str, prefix, strlen(prefix)) == 0;
 }
 
 int str_length(const char* str) {
-    int len = 0;
-    while (*str++) {
-        len++;
-    }
-    return len;
+    return (int)strlen(str);
 }
 
 void str_copy(char* dest, const char* src, int max_len) {
-    int i = 0;
-    while (src[i] && i < max_len - 1) {
-        dest[i] = src[i];
-        i++;
+    if (max_len <= 0) {
+        return;
     }
-    dest[i] = '\0';
+
+    size_t len = strlen(src);
+    if (len > (size_t)max_len - 1) {
+        len = max_len - 1;
+    }
+    memcpy(dest, src, len);
+    dest[len] = '\0';
+}
+
+int str_to_uint(const char* str, uint32_t* value) {
+    uint64_t result = 0;
+
+    if (!*str) {
+        return -1;
+    }
+    for (; *str; str++) {
+        if (*str < '0' || *str > '9') {
+            return -1;
+        }
+        result = result * 10 + (*str - '0');
+        if (result > 0xFFFFFFFF) {
+            return -1;
+        }
+    }
+
+    *value = (uint32_t)result;
+    return 0;
 }
@@ -1,10 +1,15 @@
 #ifndef STRING_UTILS_H
 #define STRING_UTILS_H
 
+#include <stdint.h>
+
 // String utility functions for the shell
 int str_equals(const char* a, const char* b);
 int str_starts_with(const char* str, const char* prefix);
 int str_length(const char* str);
 void str_copy(char* dest, const char* src, int max_len);
 
+// Parse a decimal number, 0 on success, -1 if str isn't one
+int str_to_uint(const char* str, uint32_t* value);
+
 #endif
@@ -1,4 +1,8 @@
 #include "../../include/text/text_utils.h"
+#include "fbcon.h"
+#include "../memory/memory.h"
+#include "../lib/string.h"
+#include "../../kernel/lock.h"
 
 #define VGA_WIDTH 80
 #define VGA_HEIGHT 25
@@ -8,9 +12,84 @@
 #define VGA_CRTC_INDEX_PORT 0x3D4
 #define VGA_CRTC_DATA_PORT  0x3D5
 
+// Largest screen the console handles (2048x2048 pixels in 8x16 cells)
+#define CONSOLE_MAX_COLS 256
+#define CONSOLE_MAX_ROWS 128
+
 static int cursor_row = 0;
 static int cursor_col = 0;
 
+// Screen size in cells, VGA text mode until console_init_late()
+// switches to the framebuffer
+static int console_cols = VGA_WIDTH;
+static int console_rows = VGA_HEIGHT;
+static int use_framebuffer = 0;
+
+// The framebuffer has no hardware cursor, it is drawn with the row
+static int fb_cursor_enabled = 0;
+static int fb_cursor_row = 0;
+static int fb_cursor_col = 0;
+
+// Last position written to the VGA cursor registers
+static int vga_cursor_pos = -1;
+
+// Copy of all output, usually the serial port
+static ConsoleMirror console_mirror = NULL;
+
+// Held while drawing or moving the cursor, see console_write()
+static LockStats console_lock_stats = LOCK_STATS_INIT("console");
+static TicketLock console_lock = TICKET_LOCK_INIT(&console_lock_stats);
+
+// The console is a ring of lines in RAM, console_cols cells each.
+// top_line is the absolute line number shown in screen row 0, so
+// scrolling the ring just advances it (the screen is still redrawn, see
+// scroll_up()). Until console_init_late() runs the ring
+// is a small static one that holds a bit more than one screen.
+#define BOOT_HISTORY_LINES 32
+
+static uint16_t boot_history[BOOT_HISTORY_LINES * VGA_WIDTH] __attribute__((aligned(8)));
+static uint16_t* history = boot_history;
+static uint32_t history_lines = BOOT_HISTORY_LINES;   // power of two
+static uint32_t top_line = 0;
+
+// Lines scrolled back from the live screen with Page Up
+static uint32_t view_offset = 0;
+
+// Screen rows that changed since the last flush_dirty()
+#define DIRTY_WORDS (CONSOLE_MAX_ROWS / 64)
+static uint64_t dirty_rows[DIRTY_WORDS];
+
+_Static_assert((CONSOLE_HISTORY_LINES & (CONSOLE_HISTORY_LINES - 1)) == 0,
+               "CONSOLE_HISTORY_LINES must be a power of two");
+_Static_assert(BOOT_HISTORY_LINES >= VGA_HEIGHT, "the ring must hold a full screen");
+
+static inline uint16_t* history_line(uint32_t line) {
+    return &history[(line & (history_lines - 1)) * console_cols];
+}
+
+// Cells of a row of the live screen
+static inline uint16_t* screen_row(int row) {
+    return history_line(top_line + row);
+}
+
+// Oldest line that is still in the ring
+static uint32_t oldest_line(void) {
+    uint32_t end = top_line + console_rows;
+    return end > history_lines ? end - history_lines : 0;
+}
+
+static inline void mark_dirty(int row) {
+    dirty_rows[row / 64] |= 1ULL << (row % 64);
+}
+
+static void mark_all_dirty(void) {
+    for (int row = 0; row < console_rows; row++) {
+        mark_dirty(row);
+    }
+}
+
+static void flush_dirty(void);
+
 // Port I/O functions
 static inline void outb(uint16_t port, uint8_t data) {
     asm volatile ("outb %0, %1" : : "a"(data), "Nd"(port));
@@ -22,24 +101,65 @@ static inline uint8_t inb(uint16_t port) {
     return result;
 }
 
-// Disable the blinking VGA cursor
-void disable_cursor(void) {
+// Hide the cursor, console_lock held
+static void hide_cursor(void) {
+    if (use_framebuffer) {
+        fb_cursor_enabled = 0;
+        mark_dirty(fb_cursor_row);
+        flush_dirty();
+        return;
+    }
+
     outb(VGA_CRTC_INDEX_PORT, 0x0A);  // Cursor Start Register
     outb(VGA_CRTC_DATA_PORT, 0x20);   // Set bit 5 to disable cursor
 }
 
+// Disable the blinking VGA cursor
+void disable_cursor(void) {
+    uint64_t flags = ticket_lock_irqsave(&console_lock);
+    hide_cursor();
+    ticket_unlock_irqrestore(&console_lock, flags);
+}
+
 // Enable the VGA cursor
 void enable_cursor(uint8_t cursor_start, uint8_t cursor_end) {
-    outb(VGA_CRTC_INDEX_PORT, 0x0A);
-    outb(VGA_CRTC_DATA_PORT, (inb(VGA_CRTC_DATA_PORT) & 0xC0) | cursor_start);
+    uint64_t flags = ticket_lock_irqsave(&console_lock);
+
+    if (use_framebuffer) {
+        fb_cursor_enabled = 1;
+        mark_dirty(fb_cursor_row);
+        flush_dirty();
+    } else {
+        outb(VGA_CRTC_INDEX_PORT, 0x0A);
+        outb(VGA_CRTC_DATA_PORT, (inb(VGA_CRTC_DATA_PORT) & 0xC0) | cursor_start);
 
-    outb(VGA_CRTC_INDEX_PORT, 0x0B);
-    outb(VGA_CRTC_DATA_PORT, (inb(VGA_CRTC_DATA_PORT) & 0xE0) | cursor_end);
+        outb(VGA_CRTC_INDEX_PORT, 0x0B);
+        outb(VGA_CRTC_DATA_PORT, (inb(VGA_CRTC_DATA_PORT) & 0xE0) | cursor_end);
+    }
+
+    ticket_unlock_irqrestore(&console_lock, flags);
 }
 
-// Update VGA cursor position
-void update_cursor(int row, int col) {
+// Move the cursor, console_lock held
+static void move_cursor(int row, int col) {
+    if (use_framebuffer) {
+        if (row == fb_cursor_row && col == fb_cursor_col) {
+            return;
+        }
+        mark_dirty(fb_cursor_row);
+        fb_cursor_row = row;
+        fb_cursor_col = col;
+        mark_dirty(row);
+        flush_dirty();
+        return;
+    }
+
+    // Skip the four port writes when the cursor did not move
     uint16_t pos = row * VGA_WIDTH + col;
+    if (pos == vga_cursor_pos) {
+        return;
+    }
+    vga_cursor_pos = pos;
 
     outb(VGA_CRTC_INDEX_PORT, 0x0F);  // Low byte
     outb(VGA_CRTC_DATA_PORT, (uint8_t)(pos & 0xFF));
@@ -47,121 +167,205 @@ void update_cursor(int row, int col) {
     outb(VGA_CRTC_DATA_PORT, (uint8_t)((pos >> 8) & 0xFF));
 }
 
+// Update VGA cursor position
+void update_cursor(int row, int col) {
+    uint64_t flags = ticket_lock_irqsave(&console_lock);
+    move_cursor(row, col);
+    ticket_unlock_irqrestore(&console_lock, flags);
+}
+
+static void flush_row(int row)
+{
+    const uint16_t* cells = history_line(top_line - view_offset + row);
+
+    if (use_framebuffer) {
+        int cursor = -1;
+        if (fb_cursor_enabled && view_offset == 0 && row == fb_cursor_row) {
+            cursor = fb_cursor_col;
+        }
+        fbcon_draw_row(row, cells, console_cols, cursor);
+        return;
+    }
+
+    // Video memory is only written, so a plain bulk copy is fine
+    memcpy((void*)&VGAMEMORY[row * VGA_WIDTH], cells, VGA_WIDTH * sizeof(uint16_t));
+}
+
+// Draw the dirty rows, console_lock held
+static void flush_dirty(void)
+{
+    for (int word = 0; word < DIRTY_WORDS; word++) {
+        while (dirty_rows[word]) {
+            int row = word * 64 + __builtin_ctzll(dirty_rows[word]);
+            dirty_rows[word] &= dirty_rows[word] - 1;
+            flush_row(row);
+        }
+    }
+}
+
+void console_flush(void)
+{
+    uint64_t flags = ticket_lock_irqsave(&console_lock);
+    flush_dirty();
+    ticket_unlock_irqrestore(&console_lock, flags);
+}
+
+static void clear_line(uint16_t* cells, unsigned char color)
+{
+    memset16(cells, (color << 8) | ' ', console_cols);
+}
+
 void clear(unsigned char color)
 {
-    unsigned short blank = (color << 8) | ' ';
-    for (int i = 0; i < VGA_WIDTH * VGA_HEIGHT; i++)
-    {
-        VGAMEMORY[i] = blank;
+    uint64_t flags = ticket_lock_irqsave(&console_lock);
+
+    // Only the live screen is blanked, the history above it stays
+    for (int row = 0; row < console_rows; row++) {
+        clear_line(screen_row(row), color);
     }
+    view_offset = 0;
+    mark_all_dirty();
+    flush_dirty();
+
     cursor_row = 0;
     cursor_col = 0;
 
     // Disable cursor initially (shell will enable it when needed)
-    disable_cursor();
+    hide_cursor();
+
+    ticket_unlock_irqrestore(&console_lock, flags);
 }
 
 static void scroll_up(void)
 {
-    // Move all lines up by one
-    for (int row = 0; row < VGA_HEIGHT - 1; row++) {
-        for (int col = 0; col < VGA_WIDTH; col++) {
-            VGAMEMORY[row * VGA_WIDTH + col] = VGAMEMORY[(row + 1) * VGA_WIDTH + col];
-        }
-    }
+    // The old top row becomes history, only the new bottom row is cleared
+    top_line++;
+    clear_line(screen_row(console_rows - 1), COLOR_DEFAULT);
+
+    // Every row moved, so every row is redrawn: about 3 MB of stores on
+    // a 1024x768 framebuffer, paced by video memory bandwidth. Copying
+    // the pixels up instead would store as much and also read it all
+    // back from uncached or WC video memory, which is slower still.
+    mark_all_dirty();
+    cursor_row = console_rows - 1;
+}
 
-    // Clear the last line
-    unsigned short blank = (COLOR_DEFAULT << 8) | ' ';
-    for (int col = 0; col < VGA_WIDTH; col++) {
-        VGAMEMORY[(VGA_HEIGHT - 1) * VGA_WIDTH + col] = blank;
+static void new_line(void)
+{
+    cursor_col = 0;
+    cursor_row++;
+    if (cursor_row >= console_rows) {
+        scroll_up();
     }
+}
 
-    cursor_row = VGA_HEIGHT - 1;
+void console_set_mirror(ConsoleMirror mirror)
+{
+    console_mirror = mirror;
 }
 
-void putchar(char c, unsigned char color)
+ConsoleMirror console_get_mirror(void)
 {
-    if (c == '\n')
-    {
-        cursor_col = 0;
-        cursor_row++;
-        if (cursor_row >= VGA_HEIGHT) {
-            scroll_up();
-        }
-        return;
+    return console_mirror;
+}
+
+// Draw len bytes into the ring and flush once at the end. Runs of
+// printable characters are copied straight into the current line.
+// The lock keeps output from different threads and CPUs from mixing.
+void console_write(const char* str, size_t len, unsigned char color)
+{
+    uint64_t flags = ticket_lock_irqsave(&console_lock);
+
+    if (console_mirror) {
+        console_mirror(str, len);
     }
 
-    if (c == '\b')
-    {
-        // Handle backspace
-        if (cursor_col > 0) {
-            cursor_col--;
-            VGAMEMORY[cursor_row * VGA_WIDTH + cursor_col] = (color << 8) | ' ';
-        }
-        return;
+    // New output jumps back to the live screen
+    if (view_offset) {
+        view_offset = 0;
+        mark_all_dirty();
     }
 
-    VGAMEMORY[cursor_row * VGA_WIDTH + cursor_col] = (color << 8) | c;
+    uint16_t attr = (uint16_t)color << 8;
+    size_t i = 0;
 
-    cursor_col++;
-    if (cursor_col >= VGA_WIDTH)
-    {
-        cursor_col = 0;
-        cursor_row++;
-        if (cursor_row >= VGA_HEIGHT) {
-            scroll_up();
+    while (i < len) {
+        char c = str[i];
+
+        if (c == '\n') {
+            new_line();
+            i++;
+            continue;
+        }
+
+        if (c == '\b') {
+            // Handle backspace
+            if (cursor_col > 0) {
+                cursor_col--;
+                screen_row(cursor_row)[cursor_col] = attr | ' ';
+                mark_dirty(cursor_row);
+            }
+            i++;
+            continue;
+        }
+
+        // Copy up to the end of the line or the next control character
+        uint16_t* cells = screen_row(cursor_row);
+        int col = cursor_col;
+        while (i < len && col < console_cols && str[i] != '\n' && str[i] != '\b') {
+            cells[col++] = attr | (unsigned char)str[i++];
+        }
+
+        mark_dirty(cursor_row);
+        cursor_col = col;
+        if (cursor_col >= console_cols) {
+            new_line();
         }
     }
+
+    flush_dirty();
+    ticket_unlock_irqrestore(&console_lock, flags);
+}
+
+void putchar(char c, unsigned char color)
+{
+    console_write(&c, 1, color);
 }
 
 void print(const char* str, unsigned char color)
 {
-    for (int i = 0; str[i] != '\0'; i++)
-    {
-        putchar(str[i], color);
-    }
+    console_write(str, strlen(str), color);
 }
 
 void print_hex(uint64_t num, unsigned char color)
 {
     const char* hex_chars = "0123456789ABCDEF";
-    char buffer[17];
-    buffer[16] = '\0';
+    char buffer[18];
 
-    int pos = 15;
-    while (pos >= 0)
+    int pos = 17;
+    do
     {
-        buffer[pos] = hex_chars[num & 0xF];
+        buffer[pos--] = hex_chars[num & 0xF];
         num >>= 4;
-        pos--;
-        if (num == 0 && pos >= 0)
-            break;
-    }
+    } while (num != 0);
 
-    putchar('0', color);
-    putchar('x', color);
-    print(&buffer[pos + 1], color);
+    buffer[pos--] = 'x';
+    buffer[pos] = '0';
+    console_write(&buffer[pos], sizeof(buffer) - pos, color);
 }
 
 void print_dec(uint64_t num, unsigned char color)
 {
-    if (num == 0)
-    {
-        putchar('0', color);
-        return;
-    }
-
-    char buffer[21];
+    char buffer[20];
     int pos = 20;
-    buffer[pos] = '\0';
 
-    while (num > 0)
+    do
     {
         buffer[--pos] = '0' + (num % 10);
         num /= 10;
-    }
+    } while (num > 0);
 
-    print(&buffer[pos], color);
+    console_write(&buffer[pos], sizeof(buffer) - pos, color);
 }
 
 // New functions for cursor management
@@ -173,11 +377,106 @@ int get_cursor_col(void) {
     return cursor_col;
 }
 
+int get_console_cols(void) {
+    return console_cols;
+}
+
+int get_console_rows(void) {
+    return console_rows;
+}
+
 void set_cursor_position(int row, int col) {
-    if (row >= 0 && row < VGA_HEIGHT && col >= 0 && col < VGA_WIDTH) {
+    uint64_t flags = ticket_lock_irqsave(&console_lock);
+    if (row >= 0 && row < console_rows && col >= 0 && col < console_cols) {
         cursor_row = row;
         cursor_col = col;
         // Update hardware cursor position
-        update_cursor(row, col);
+        move_cursor(row, col);
+    }
+    ticket_unlock_irqrestore(&console_lock, flags);
+}
+
+// Move the visible window through the history, positive is back in time
+void console_scroll_view(int lines)
+{
+    uint64_t flags = ticket_lock_irqsave(&console_lock);
+    uint32_t max_offset = top_line - oldest_line();
+    int64_t offset = (int64_t)view_offset + lines;
+
+    if (offset < 0) {
+        offset = 0;
+    } else if (offset > max_offset) {
+        offset = max_offset;
+    }
+
+    if ((uint32_t)offset != view_offset) {
+        view_offset = (uint32_t)offset;
+        mark_all_dirty();
+        flush_dirty();
+    }
+    ticket_unlock_irqrestore(&console_lock, flags);
+}
+
+void console_page_up(void)
+{
+    console_scroll_view(console_rows - 1);
+}
+
+void console_page_down(void)
+{
+    console_scroll_view(-(console_rows - 1));
+}
+
+// Switch to the framebuffer when the bootloader set a graphics mode,
+// then move the ring from the static boot buffer to a large heap one
+void console_init_late(const VideoInfo* video)
+{
+    if (history != boot_history) {
+        return;
+    }
+
+    int framebuffer = video && fbcon_init(video) == 0;
+    int cols = VGA_WIDTH;
+    int rows = VGA_HEIGHT;
+    if (framebuffer) {
+        cols = fbcon_cols() < CONSOLE_MAX_COLS ? fbcon_cols() : CONSOLE_MAX_COLS;
+        rows = fbcon_rows() < CONSOLE_MAX_ROWS ? fbcon_rows() : CONSOLE_MAX_ROWS;
+    }
+
+    uint16_t* ring = (uint16_t*)kmalloc(CONSOLE_HISTORY_LINES * cols * sizeof(uint16_t));
+    if (!ring) {
+        print("Console history allocation failed\n", 0x0C);
+        return;
     }
+
+    memset16(ring, (COLOR_DEFAULT << 8) | ' ', CONSOLE_HISTORY_LINES * (size_t)cols);
+
+    uint64_t flags = ticket_lock_irqsave(&console_lock);
+
+    int copy_cols = cols < console_cols ? cols : console_cols;
+    uint32_t end = top_line + console_rows;
+    for (uint32_t line = oldest_line(); line < end; line++) {
+        memcpy(&ring[(line & (CONSOLE_HISTORY_LINES - 1)) * cols], history_line(line),
+               copy_cols * sizeof(uint16_t));
+    }
+
+    // Keep the cursor line at the same place relative to the bottom
+    uint32_t cursor_line = top_line + cursor_row;
+
+    history = ring;
+    history_lines = CONSOLE_HISTORY_LINES;
+    console_cols = cols;
+    console_rows = rows;
+    use_framebuffer = framebuffer;
+
+    top_line = cursor_line + 1 >= (uint32_t)rows ? cursor_line + 1 - rows : 0;
+    cursor_row = cursor_line - top_line;
+    if (cursor_col >= cols) {
+        cursor_col = cols - 1;
+    }
+
+    view_offset = 0;
+    mark_all_dirty();
+    flush_dirty();
+    ticket_unlock_irqrestore(&console_lock, flags);
 }
@@ -2,18 +2,47 @@
 #define TEXT_UTILS_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include "../boot.h"
 
 #define COLOR_DEFAULT 0x0F
 
+// Lines of scrollback kept once the heap is up (power of two)
+#define CONSOLE_HISTORY_LINES 4096
+
 void clear(unsigned char color);
+
+// Bulk output, print() and friends all end up here
+void console_write(const char* str, size_t len, unsigned char color);
 void putchar(char c, unsigned char color);
 void print(const char* str, unsigned char color);
 void print_hex(uint64_t num, unsigned char color);
 void print_dec(uint64_t num, unsigned char color);
 
+// Everything written to the console is also passed to the mirror
+// (the serial port), NULL turns it off
+typedef void (*ConsoleMirror)(const char* str, size_t len);
+void console_set_mirror(ConsoleMirror mirror);
+ConsoleMirror console_get_mirror(void);
+
+// Output is drawn into a RAM ring of lines, print() and putchar()
+// flush it themselves, console_flush() copies any pending rows to VGA
+void console_flush(void);
+
+// Picks the framebuffer if there is one and sets up the scrollback,
+// call it once paging and kmalloc work
+void console_init_late(const VideoInfo* video);
+
+// Scrollback
+void console_scroll_view(int lines);
+void console_page_up(void);
+void console_page_down(void);
+
 // Cursor management functions
 int get_cursor_row(void);
 int get_cursor_col(void);
+int get_console_cols(void);
+int get_console_rows(void);
 void set_cursor_position(int row, int col);
 
 // VGA cursor control
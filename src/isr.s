@@ -0,0 +1,79 @@
+; interrupt and exception entry stubs
+
+[BITS 64]
+
+section .text
+extern interrupt_dispatch
+global isr_stub_table
+
+; every stub pushes an error code (0 if the cpu does not push one)
+; and its vector number, so all of them share one frame layout
+%assign i 0
+%rep 256
+isr_stub_%+i:
+%if i == 8 || i == 10 || i == 11 || i == 12 || i == 13 || i == 14 || i == 17 || i == 21 || i == 29 || i == 30
+    ; the cpu already pushed an error code
+%else
+    push qword 0
+%endif
+    push qword i
+    jmp isr_common
+%assign i i+1
+%endrep
+
+isr_common:
+    push rax
+    push rbx
+    push rcx
+    push rdx
+    push rsi
+    push rdi
+    push rbp
+    push r8
+    push r9
+    push r10
+    push r11
+    push r12
+    push r13
+    push r14
+    push r15
+
+    ; the C handlers may touch SSE registers, save them too
+    ; (rsp is 16 byte aligned here: cpu frame 40 + 16 + 15 * 8 = 176)
+    sub rsp, 512
+    fxsave [rsp]
+
+    cld
+    lea rdi, [rsp + 512]        ; InterruptFrame*
+    call interrupt_dispatch
+
+    fxrstor [rsp]
+    add rsp, 512
+
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rbp
+    pop rdi
+    pop rsi
+    pop rdx
+    pop rcx
+    pop rbx
+    pop rax
+
+    add rsp, 16                 ; vector and error code
+    iretq
+
+section .rodata
+align 8
+isr_stub_table:
+%assign i 0
+%rep 256
+    dq isr_stub_%+i
+%assign i i+1
+%endrep
@@ -0,0 +1,208 @@
+#include "acpi.h"
+#include "../include/memory/paging.h"
+#include "../include/memory/pmm.h"
+#include "../include/text/text_utils.h"
+#include "../include/lib/string.h"
+
+#define ACPI_TABLE_MAX   0x100000   // sanity limit for a table length
+
+// MADT entry types
+#define MADT_LAPIC           0
+#define MADT_IOAPIC          1
+#define MADT_LAPIC_OVERRIDE  5
+
+#define MADT_LAPIC_ENABLED   0x1
+#define MADT_PCAT_COMPAT     0x1
+
+typedef struct {
+    char signature[8];          // "RSD PTR "
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;           // 0 for ACPI 1.0, 2 from ACPI 2.0 on
+    uint32_t rsdt_address;
+    // ACPI 2.0
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed)) AcpiRsdp;
+
+typedef struct {
+    AcpiHeader header;
+    uint32_t lapic_address;
+    uint32_t flags;
+} __attribute__((packed)) AcpiMadt;
+
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed)) MadtEntry;
+
+static const AcpiHeader* root = NULL;   // RSDT or XSDT
+static int root_is_xsdt = 0;
+static MadtInfo madt;
+static int madt_valid = 0;
+
+static int checksum_ok(const void* data, uint32_t length) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        sum += bytes[i];
+    }
+    return sum == 0;
+}
+
+// Tables are plain RAM, but may lie anywhere, so they go through the
+// MMIO window. The header tells how much of the table to map.
+static const AcpiHeader* map_table(uint64_t phys) {
+    if (!phys) {
+        return NULL;
+    }
+
+    const AcpiHeader* header = (const AcpiHeader*)paging_map_mmio(phys, sizeof(AcpiHeader), 0);
+    if (!header) {
+        return NULL;
+    }
+
+    uint32_t length = header->length;
+    if (length < sizeof(AcpiHeader) || length > ACPI_TABLE_MAX) {
+        return NULL;
+    }
+
+    // Small tables usually fit in the page that is already mapped
+    if ((phys & (PAGE_SIZE - 1)) + length > PAGE_SIZE) {
+        header = (const AcpiHeader*)paging_map_mmio(phys, length, 0);
+        if (!header) {
+            return NULL;
+        }
+    }
+
+    return checksum_ok(header, length) ? header : NULL;
+}
+
+static uint32_t root_entry_count(void) {
+    uint32_t size = root_is_xsdt ? 8 : 4;
+    return (root->length - sizeof(AcpiHeader)) / size;
+}
+
+static uint64_t root_entry(uint32_t index) {
+    const uint8_t* entries = (const uint8_t*)root + sizeof(AcpiHeader);
+    if (root_is_xsdt) {
+        uint64_t address;
+        memcpy(&address, entries + index * 8, 8);
+        return address;
+    }
+    uint32_t address;
+    memcpy(&address, entries + index * 4, 4);
+    return address;
+}
+
+const AcpiHeader* acpi_find_table(const char* signature) {
+    if (!root) {
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < root_entry_count(); i++) {
+        uint64_t phys = root_entry(i);
+
+        // Look at the signature first, so only the table we want gets
+        // mapped in full
+        const AcpiHeader* header = (const AcpiHeader*)paging_map_mmio(phys, sizeof(AcpiHeader), 0);
+        if (!header || memcmp(header->signature, signature, 4) != 0) {
+            continue;
+        }
+
+        const AcpiHeader* table = map_table(phys);
+        if (table) {
+            return table;
+        }
+    }
+    return NULL;
+}
+
+static void parse_madt(const AcpiMadt* table) {
+    memset(&madt, 0, sizeof(madt));
+    madt.lapic_address = table->lapic_address;
+    madt.pic_compatible = (table->flags & MADT_PCAT_COMPAT) != 0;
+
+    const uint8_t* entry = (const uint8_t*)table + sizeof(AcpiMadt);
+    const uint8_t* end = (const uint8_t*)table + table->header.length;
+
+    while (entry + sizeof(MadtEntry) <= end) {
+        const MadtEntry* head = (const MadtEntry*)entry;
+        if (head->length < sizeof(MadtEntry) || entry + head->length > end) {
+            break;
+        }
+
+        switch (head->type) {
+            case MADT_LAPIC: {
+                // acpi processor id, apic id, flags
+                uint8_t apic_id = entry[3];
+                uint32_t flags;
+                memcpy(&flags, entry + 4, 4);
+
+                // Online capable ones would need hotplug, leave them alone
+                if ((flags & MADT_LAPIC_ENABLED) && madt.cpu_count < ACPI_MAX_CPUS) {
+                    madt.apic_ids[madt.cpu_count++] = apic_id;
+                }
+                break;
+            }
+            case MADT_IOAPIC:
+                // Only the first one, that is all a PC has
+                if (!madt.ioapic_address) {
+                    uint32_t address;
+                    memcpy(&address, entry + 4, 4);
+                    memcpy(&madt.ioapic_gsi_base, entry + 8, 4);
+                    madt.ioapic_address = address;
+                }
+                break;
+            case MADT_LAPIC_OVERRIDE:
+                memcpy(&madt.lapic_address, entry + 4, 8);
+                break;
+            default:
+                break;
+        }
+
+        entry += head->length;
+    }
+
+    madt_valid = madt.cpu_count > 0 && madt.lapic_address != 0;
+}
+
+int acpi_init(const AcpiInfo* info) {
+    if (!info || !info->rsdp_address) {
+        return -1;
+    }
+
+    const AcpiRsdp* rsdp = (const AcpiRsdp*)paging_map_mmio(info->rsdp_address, sizeof(AcpiRsdp), 0);
+    if (!rsdp || memcmp(rsdp->signature, "RSD PTR ", 8) != 0 || !checksum_ok(rsdp, 20)) {
+        print("acpi: no valid RSDP\n", 0x0C);
+        return -1;
+    }
+
+    // Prefer the XSDT, its entries are 64 bit
+    if (rsdp->revision >= 2 && rsdp->xsdt_address &&
+        checksum_ok(rsdp, sizeof(AcpiRsdp))) {
+        root = map_table(rsdp->xsdt_address);
+        root_is_xsdt = root != NULL;
+    }
+    if (!root) {
+        root = map_table(rsdp->rsdt_address);
+    }
+    if (!root) {
+        print("acpi: no valid RSDT\n", 0x0C);
+        return -1;
+    }
+
+    const AcpiMadt* table = (const AcpiMadt*)acpi_find_table("APIC");
+    if (!table) {
+        print("acpi: no MADT\n", 0x0C);
+        return -1;
+    }
+    parse_madt(table);
+    return madt_valid ? 0 : -1;
+}
+
+const MadtInfo* acpi_madt(void) {
+    return madt_valid ? &madt : NULL;
+}
@@ -0,0 +1,42 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include <stdint.h>
+#include "../include/boot.h"
+
+#define ACPI_MAX_CPUS 16
+
+// Common header of every ACPI table
+typedef struct {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) AcpiHeader;
+
+// What the MADT says about the interrupt controllers
+typedef struct {
+    uint64_t lapic_address;
+    uint32_t cpu_count;                     // enabled processors, the BSP included
+    uint8_t apic_ids[ACPI_MAX_CPUS];
+    uint64_t ioapic_address;                // 0 if there is none
+    uint32_t ioapic_gsi_base;
+    uint8_t pic_compatible;                 // dual 8259 present as well
+} MadtInfo;
+
+// Find the RSDT/XSDT from the pointer the bootloader passed and read the
+// MADT. 0 on success, -1 if the tables are missing or broken.
+int acpi_init(const AcpiInfo* info);
+
+// Mapped table with a valid checksum, NULL if there is none
+const AcpiHeader* acpi_find_table(const char* signature);
+
+// NULL before a successful acpi_init()
+const MadtInfo* acpi_madt(void);
+
+#endif
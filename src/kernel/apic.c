@@ -0,0 +1,88 @@
+#include "apic.h"
+#include <stddef.h>
+#include "time.h"
+#include "idt.h"
+#include "../include/memory/paging.h"
+
+// ICR fields
+#define ICR_FIXED         0x00000
+#define ICR_INIT          0x00500
+#define ICR_STARTUP       0x00600
+#define ICR_PENDING       0x01000
+#define ICR_ASSERT        0x04000
+#define ICR_ALL_BUT_SELF  0xC0000
+
+#define SVR_ENABLE        0x100
+
+static volatile uint32_t* lapic = NULL;
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+}
+
+int lapic_init(uint64_t phys) {
+    if (lapic) {
+        return 0;
+    }
+
+    // Registers must not be cached
+    uint64_t virt = paging_map_mmio(phys, 0x1000, PAGE_WRITE | PAGE_PCD | PAGE_PWT);
+    if (!virt) {
+        return -1;
+    }
+    lapic = (volatile uint32_t*)virt;
+    return 0;
+}
+
+int lapic_present(void) {
+    return lapic != NULL;
+}
+
+void lapic_enable(void) {
+    lapic_write(LAPIC_SVR, SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+}
+
+uint8_t lapic_id(void) {
+    return lapic ? lapic_read(LAPIC_ID) >> 24 : 0;
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+// Writing the low half sends the IPI. Every CPU has its own ICR, only
+// an interrupt handler on this CPU could get in between.
+static void send_ipi(uint8_t apic_id, uint32_t command) {
+    if (!lapic) {
+        return;
+    }
+
+    uint64_t flags = irq_save();
+
+    lapic_write(LAPIC_ICR_HIGH, (uint32_t)apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, command);
+
+    while (lapic_read(LAPIC_ICR_LOW) & ICR_PENDING) {
+        asm volatile ("pause");
+    }
+
+    irq_restore(flags);
+}
+
+void lapic_send_init(uint8_t apic_id) {
+    send_ipi(apic_id, ICR_INIT | ICR_ASSERT);
+    udelay(10000);
+}
+
+void lapic_send_startup(uint8_t apic_id, uint8_t page) {
+    send_ipi(apic_id, ICR_STARTUP | ICR_ASSERT | page);
+    udelay(200);
+}
+
+void lapic_send_ipi_others(uint8_t vector) {
+    send_ipi(0, ICR_FIXED | ICR_ASSERT | ICR_ALL_BUT_SELF | vector);
+}
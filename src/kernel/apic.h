@@ -0,0 +1,34 @@
+#ifndef APIC_H
+#define APIC_H
+
+#include <stdint.h>
+
+// Local APIC registers (offsets into its MMIO page)
+#define LAPIC_ID        0x020
+#define LAPIC_EOI       0x0B0
+#define LAPIC_SVR       0x0F0
+#define LAPIC_ICR_LOW   0x300
+#define LAPIC_ICR_HIGH  0x310
+
+#define LAPIC_SPURIOUS_VECTOR  0xFF
+#define IPI_WAKE_VECTOR        0xF0    // only wakes a halted CPU
+
+// Map the local APIC registers, 0 on success
+int lapic_init(uint64_t phys);
+int lapic_present(void);
+
+// Software enable the local APIC of the calling CPU
+void lapic_enable(void);
+
+uint8_t lapic_id(void);
+void lapic_eoi(void);
+
+// Start an application processor: INIT, then STARTUP with the page
+// number of the real mode code it should run
+void lapic_send_init(uint8_t apic_id);
+void lapic_send_startup(uint8_t apic_id, uint8_t page);
+
+// Fixed IPI to every CPU except the calling one
+void lapic_send_ipi_others(uint8_t vector);
+
+#endif
@@ -0,0 +1,136 @@
+#include "idt.h"
+#include "pic.h"
+#include "sched.h"
+#include "../include/text/text_utils.h"
+
+#define IDT_TYPE_INTERRUPT 0x8E   // present, ring 0, 64-bit interrupt gate
+
+typedef struct {
+    uint16_t offset_low;
+    uint16_t selector;
+    uint8_t  ist;
+    uint8_t  type_attr;
+    uint16_t offset_mid;
+    uint32_t offset_high;
+    uint32_t reserved;
+} __attribute__((packed)) IdtEntry;
+
+typedef struct {
+    uint16_t limit;
+    uint64_t base;
+} __attribute__((packed)) IdtPointer;
+
+extern uint64_t isr_stub_table[IDT_ENTRIES];
+
+static IdtEntry idt[IDT_ENTRIES] __attribute__((aligned(16)));
+static InterruptHandler handlers[IDT_ENTRIES];
+
+static const char* exception_names[32] = {
+    "Divide Error", "Debug", "NMI", "Breakpoint",
+    "Overflow", "Bound Range Exceeded", "Invalid Opcode", "Device Not Available",
+    "Double Fault", "Coprocessor Segment Overrun", "Invalid TSS", "Segment Not Present",
+    "Stack-Segment Fault", "General Protection Fault", "Page Fault", "Reserved",
+    "x87 Floating-Point", "Alignment Check", "Machine Check", "SIMD Floating-Point",
+    "Virtualization", "Control Protection", "Reserved", "Reserved",
+    "Reserved", "Reserved", "Reserved", "Reserved",
+    "Hypervisor Injection", "VMM Communication", "Security", "Reserved"
+};
+
+static void idt_set_entry(uint8_t vector, uint64_t handler, uint16_t selector) {
+    idt[vector].offset_low = handler & 0xFFFF;
+    idt[vector].selector = selector;
+    idt[vector].ist = 0;
+    idt[vector].type_attr = IDT_TYPE_INTERRUPT;
+    idt[vector].offset_mid = (handler >> 16) & 0xFFFF;
+    idt[vector].offset_high = (handler >> 32) & 0xFFFFFFFF;
+    idt[vector].reserved = 0;
+}
+
+void idt_init(void) {
+    // Use whatever code segment the bootloader left us in
+    uint16_t cs;
+    asm volatile ("mov %%cs, %0" : "=r"(cs));
+
+    for (int i = 0; i < IDT_ENTRIES; i++) {
+        idt_set_entry(i, isr_stub_table[i], cs);
+        handlers[i] = 0;
+    }
+
+    IdtPointer idtr = { sizeof(idt) - 1, (uint64_t)idt };
+    asm volatile ("lidt %0" : : "m"(idtr));
+
+    pic_init();
+}
+
+void interrupt_register(uint8_t vector, InterruptHandler handler) {
+    handlers[vector] = handler;
+}
+
+void irq_register(uint8_t irq, InterruptHandler handler) {
+    interrupt_register(IRQ_BASE + irq, handler);
+    pic_unmask(irq);
+}
+
+static void exception_panic(InterruptFrame* frame) {
+    print("\nEXCEPTION: ", 0x4F);
+    print(exception_names[frame->vector], 0x4F);
+    print("\n", COLOR_DEFAULT);
+
+    print("Error code: ", 0x0C);
+    print_hex(frame->error_code, 0x0C);
+    print("  RIP: ", 0x0C);
+    print_hex(frame->rip, 0x0C);
+    print("  RSP: ", 0x0C);
+    print_hex(frame->rsp, 0x0C);
+    print("\n", COLOR_DEFAULT);
+
+    if (frame->vector == 14) {
+        uint64_t cr2;
+        asm volatile ("mov %%cr2, %0" : "=r"(cr2));
+        print("Faulting address: ", 0x0C);
+        print_hex(cr2, 0x0C);
+        print("\n", COLOR_DEFAULT);
+    }
+
+    print("System halted.\n", 0x0C);
+    while (1) {
+        asm volatile ("cli; hlt");
+    }
+}
+
+// Called from isr_common in isr.s
+void interrupt_dispatch(InterruptFrame* frame) {
+    uint8_t vector = (uint8_t)frame->vector;
+
+    if (vector >= IRQ_BASE && vector < IRQ_BASE + 16) {
+        uint8_t irq = vector - IRQ_BASE;
+
+        // Spurious IRQ 7/15: not in service, so no EOI (except the
+        // master's cascade for a spurious slave IRQ)
+        if ((irq == 7 || irq == 15) && !(pic_get_isr() & (1 << irq))) {
+            if (irq == 15) {
+                pic_send_eoi(0);
+            }
+            return;
+        }
+
+        if (handlers[vector]) {
+            handlers[vector](frame);
+        }
+        pic_send_eoi(irq);
+
+        // Only switch after the EOI, the PIC would hold back this IRQ
+        // (and every lower priority one) until the thread runs again
+        sched_irq_exit();
+        return;
+    }
+
+    if (handlers[vector]) {
+        handlers[vector](frame);
+        return;
+    }
+
+    if (vector < 32) {
+        exception_panic(frame);
+    }
+}
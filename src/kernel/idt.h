@@ -0,0 +1,68 @@
+#ifndef IDT_H
+#define IDT_H
+
+#include <stdint.h>
+
+#define IDT_ENTRIES   256
+#define IRQ_BASE      0x20    // first vector used for hardware IRQs
+
+// Legacy IRQ numbers
+#define IRQ_TIMER     0
+#define IRQ_KEYBOARD  1
+#define IRQ_COM1      4
+
+// Register state pushed by the entry stubs in isr.s
+typedef struct {
+    uint64_t r15, r14, r13, r12, r11, r10, r9, r8;
+    uint64_t rbp, rdi, rsi, rdx, rcx, rbx, rax;
+    uint64_t vector;
+    uint64_t error_code;
+    // pushed by the cpu
+    uint64_t rip, cs, rflags, rsp, ss;
+} __attribute__((packed)) InterruptFrame;
+
+typedef void (*InterruptHandler)(InterruptFrame* frame);
+
+void idt_init(void);
+
+// Install a handler for any vector
+void interrupt_register(uint8_t vector, InterruptHandler handler);
+
+// Install a handler for a legacy IRQ and unmask it, EOI is sent for it
+void irq_register(uint8_t irq, InterruptHandler handler);
+
+static inline void interrupts_enable(void) {
+    asm volatile ("sti" ::: "memory");
+}
+
+static inline void interrupts_disable(void) {
+    asm volatile ("cli" ::: "memory");
+}
+
+// Disable interrupts and return the previous state for irq_restore()
+static inline uint64_t irq_save(void) {
+    uint64_t flags;
+    asm volatile ("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint64_t flags) {
+    if (flags & 0x200) {
+        asm volatile ("sti" ::: "memory");
+    }
+}
+
+// Interrupts are on, so this isn't an interrupt handler
+static inline int irqs_enabled(void) {
+    uint64_t flags;
+    asm volatile ("pushfq; pop %0" : "=r"(flags) : : "memory");
+    return (flags & 0x200) != 0;
+}
+
+// Sleep until the next interrupt; sti only takes effect after hlt has
+// started, so an interrupt that is already pending still wakes us up
+static inline void cpu_idle(void) {
+    asm volatile ("sti; hlt" ::: "memory");
+}
+
+#endif
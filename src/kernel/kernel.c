@@ -1,14 +1,33 @@
 #include "../include/boot.h"
 #include "../include/text/text_utils.h"
 #include "../drivers/keyboard/keyboard.h"
+#include "../drivers/serial/serial.h"
+#include "../drivers/disk/disk_driver.h"
+#include "../drivers/disk/virtio_blk.h"
+#include "../drivers/block/bcache.h"
+#include "../file_system/emexfs/emexfs.h"
 #include "../include/memory/memory.h"
+#include "../include/memory/pmm.h"
+#include "../include/memory/paging.h"
+#include "../include/lib/string.h"
 #include "../shell/shell.h"
+#include "idt.h"
+#include "time.h"
+#include "sched.h"
+#include "smp.h"
 
 void stmain(BootInfo* binfo)
 {
     if (!binfo)
         goto halt;
 
+    // this_cpu() works from here on, the heap keeps per-CPU caches
+    smp_init_bsp();
+
+    // Mirror the console to COM1 from the first line on, for headless runs
+    if (serial_init() == 0)
+        console_set_mirror(serial_write);
+
     clear(COLOR_DEFAULT);
 
     print("emexOS3 loaded successful with XBL2 \n", 0x4D);
@@ -68,12 +87,100 @@ void stmain(BootInfo* binfo)
     }
 
     print("\nInitializing...\n", COLOR_DEFAULT);
+    if (time_init(&binfo->cpu) == 0) {
+        print("Initializing Timer", 0x0A);
+        print("   : finished (", 0x0E);
+        print_dec(tsc_hz() / 1000000, 0x0E);
+        print(tsc_invariant() ? " MHz TSC, invariant)\n" : " MHz TSC)\n", 0x0E);
+    } else {
+        print("Initializing Timer", 0x0A);
+        print("   : no TSC\n", 0x0C);
+    }
+
+    mem_init(&binfo->cpu);
+    print("Initializing Memory routines", 0x0A);
+    print("   : finished (", 0x0E);
+    print(mem_selected_variant(), 0x0E);
+    print(")\n", 0x0E);
+
+    pmm_init(binfo);
+    print("Initializing Physical memory", 0x0A);
+    print("   : finished\n", 0x0E);
+    print_dec((uint64_t)pmm_get_free_pages() * PAGE_SIZE / 1024, COLOR_DEFAULT);
+    print(" KB free of ", COLOR_DEFAULT);
+    print_dec((uint64_t)pmm_get_total_pages() * PAGE_SIZE / 1024, COLOR_DEFAULT);
+    print(" KB usable\n", COLOR_DEFAULT);
+
+    paging_init();
+    memory_init();
+    console_init_late(&binfo->video);
+
+    idt_init();
+    print("Initializing Interrupts", 0x0A);
+    print("   : finished\n", 0x0E);
+
     keyboard_init();
     print("Initializing Keyboard driver", 0x0A);
     print("   : finished\n", 0x0E);
 
+    serial_enable_irq();
+    print("Initializing Serial port", 0x0A);
+    print(serial_present() ? "   : finished (COM1)\n" : "   : no COM1\n", 0x0E);
+
+    int disks = disk_init(&binfo->disk);
+    print("Initializing Disk driver", 0x0A);
+    print("   : finished (", 0x0E);
+    print_dec(disks, 0x0E);
+    print(disks == 1 ? " ATA drive)\n" : " ATA drives)\n", 0x0E);
+
+    int virtio_disks = virtio_blk_init();
+    print("Initializing virtio-blk", 0x0A);
+    print("   : finished (", 0x0E);
+    print_dec(virtio_disks, 0x0E);
+    print(virtio_disks == 1 ? " disk)\n" : " disks)\n", 0x0E);
+
+    // From here on stmain() is the "main" thread, which runs the shell
+    sched_init();
+    print("Initializing Scheduler", 0x0A);
+    print("   : finished\n", 0x0E);
+
+    uint32_t cache_blocks = bcache_init();
+    print("Initializing Buffer cache", 0x0A);
+    print("   : finished (", 0x0E);
+    print_dec((uint64_t)cache_blocks * BCACHE_BLOCK_SIZE / 1024, 0x0E);
+    print(" KB)\n", 0x0E);
+
+    uint32_t cpus = smp_init(binfo);
+    print("Initializing SMP", 0x0A);
+    print("   : finished (", 0x0E);
+    print_dec(cpus, 0x0E);
+    print(cpus == 1 ? " CPU)\n" : " CPUs)\n", 0x0E);
+
+    interrupts_enable();
+
+    // Mounting reads through the cache, which waits for disk interrupts
+    int fs_dev = -1;
+    for (int dev = 0; dev < block_count() && fs_dev < 0; dev++) {
+        if (emexfs_mount(dev) == 0) {
+            fs_dev = dev;
+        }
+    }
+    print("Mounting emexFS", 0x0A);
+    if (fs_dev >= 0) {
+        BlockDeviceInfo disk;
+        EmexfsInfo fs;
+        block_get_info(fs_dev, &disk);
+        emexfs_get_info(&fs);
+        print("   : finished (", 0x0E);
+        print(disk.name, 0x0E);
+        print(", ", 0x0E);
+        print_dec(fs.mount_us, 0x0E);
+        print(fs.recovered ? " us, recovered)\n" : " us)\n", 0x0E);
+    } else {
+        print("   : no filesystem\n", 0x0E);
+    }
+
     print("\nInitializing...\n", COLOR_DEFAULT);
-    // Memory manager will be initialized in the shell
 
     //print("\nLoading Shell...\n", COLOR_DEFAULT);
 
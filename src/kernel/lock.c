@@ -0,0 +1,189 @@
+#include "lock.h"
+#include "time.h"
+
+#define RW_WRITER          0x80000000u
+#define RW_WRITER_WAITING  0x40000000u
+#define RW_READERS         0x3FFFFFFFu
+
+#if LOCK_STATS
+static LockStats* volatile stats_head = NULL;
+
+static void stats_register(LockStats* stats) {
+    if (__atomic_exchange_n(&stats->registered, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+
+    LockStats* head = __atomic_load_n(&stats_head, __ATOMIC_RELAXED);
+    do {
+        stats->next = head;
+    } while (!__atomic_compare_exchange_n(&stats_head, &head, stats, 0,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static inline uint64_t wait_begin(void) {
+    return tsc_read();
+}
+
+// After every acquire, wait_start is 0 if the lock was free. Readers
+// share a lock, so the counters are updated atomically.
+static void stats_acquired(LockStats* stats, uint64_t wait_start) {
+    if (!stats) {
+        return;
+    }
+    if (!stats->registered) {
+        stats_register(stats);
+    }
+    __atomic_fetch_add(&stats->acquires, 1, __ATOMIC_RELAXED);
+
+    if (wait_start) {
+        uint64_t cycles = tsc_read() - wait_start;
+        __atomic_fetch_add(&stats->contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats->spin_cycles, cycles, __ATOMIC_RELAXED);
+
+        uint64_t max = __atomic_load_n(&stats->max_spin, __ATOMIC_RELAXED);
+        while (cycles > max &&
+               !__atomic_compare_exchange_n(&stats->max_spin, &max, cycles, 0,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
+    }
+}
+#else
+static inline uint64_t wait_begin(void) { return 1; }
+static inline void stats_acquired(LockStats* stats, uint64_t wait_start) {
+    (void)stats;
+    (void)wait_start;
+}
+#endif
+
+void ticket_lock(TicketLock* lock) {
+    uint32_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+    uint32_t owner = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE);
+    uint64_t wait_start = 0;
+
+    if (owner != ticket) {
+        wait_start = wait_begin();
+        do {
+            // Back off for every waiter ahead of us, fewer reads of the
+            // line the owner is about to write
+            for (uint32_t i = ticket - owner; i; i--) {
+                cpu_relax();
+            }
+            owner = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE);
+        } while (owner != ticket);
+    }
+    stats_acquired(lock->stats, wait_start);
+}
+
+void ticket_unlock(TicketLock* lock) {
+    // Only the holder writes owner
+    __atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+}
+
+void mcs_lock(McsLock* lock, McsNode* node) {
+    node->next = NULL;
+    node->locked = 1;
+
+    McsNode* prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+    uint64_t wait_start = 0;
+
+    if (prev) {
+        // Queue up behind prev and spin on our own node until it hands over
+        wait_start = wait_begin();
+        __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+        while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE)) {
+            cpu_relax();
+        }
+    }
+    stats_acquired(lock->stats, wait_start);
+}
+
+void mcs_unlock(McsLock* lock, McsNode* node) {
+    McsNode* next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+
+    if (!next) {
+        // Nobody behind us, unless one swapped the tail and hasn't
+        // linked itself in yet
+        McsNode* expected = node;
+        if (__atomic_compare_exchange_n(&lock->tail, &expected, NULL, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            return;
+        }
+        while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE))) {
+            cpu_relax();
+        }
+    }
+    __atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+}
+
+void read_lock(RwLock* lock) {
+    uint64_t wait_start = 0;
+
+    while (1) {
+        uint32_t state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+        // A waiting writer keeps new readers out, so it can't starve
+        if (!(state & (RW_WRITER | RW_WRITER_WAITING)) &&
+            __atomic_compare_exchange_n(&lock->state, &state, state + 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+        if (!wait_start) {
+            wait_start = wait_begin();
+        }
+        cpu_relax();
+    }
+    stats_acquired(lock->stats, wait_start);
+}
+
+void read_unlock(RwLock* lock) {
+    __atomic_fetch_sub(&lock->state, 1, __ATOMIC_RELEASE);
+}
+
+void write_lock(RwLock* lock) {
+    uint64_t wait_start = 0;
+
+    while (1) {
+        uint32_t state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+        if ((state & ~RW_WRITER_WAITING) == 0) {
+            // Free: take it, which also clears the waiting bit. Other
+            // waiting writers set it again on their next round.
+            if (__atomic_compare_exchange_n(&lock->state, &state, RW_WRITER, 0,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (!(state & RW_WRITER_WAITING)) {
+            __atomic_fetch_or(&lock->state, RW_WRITER_WAITING, __ATOMIC_RELAXED);
+        }
+        if (!wait_start) {
+            wait_start = wait_begin();
+        }
+        cpu_relax();
+    }
+    stats_acquired(lock->stats, wait_start);
+}
+
+void write_unlock(RwLock* lock) {
+    // Keep the waiting bit of writers queued behind us
+    __atomic_fetch_and(&lock->state, ~RW_WRITER, __ATOMIC_RELEASE);
+}
+
+#if LOCK_STATS
+const LockStats* lock_stats_list(void) {
+    return __atomic_load_n(&stats_head, __ATOMIC_ACQUIRE);
+}
+
+void lock_stats_reset(void) {
+    for (LockStats* stats = (LockStats*)lock_stats_list(); stats; stats = stats->next) {
+        __atomic_store_n(&stats->acquires, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->contended, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->spin_cycles, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->max_spin, 0, __ATOMIC_RELAXED);
+    }
+}
+#else
+const LockStats* lock_stats_list(void) {
+    return NULL;
+}
+
+void lock_stats_reset(void) {
+}
+#endif
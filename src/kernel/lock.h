@@ -0,0 +1,128 @@
+#ifndef LOCK_H
+#define LOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "idt.h"
+
+// Locks for data shared between CPUs:
+//   TicketLock  FIFO spinlock, for short sections with little contention
+//   McsLock     queue lock, every waiter spins on its own node instead of
+//               the lock's cache line, for the contended ones
+//   RwLock      many readers or one writer, waiting writers go first
+// The irqsave variants also keep interrupt handlers on this CPU out and
+// must be used for anything an interrupt handler takes as well.
+
+// Contention counters, build with LOCK_STATS=0 to leave them out
+#ifndef LOCK_STATS
+#define LOCK_STATS 1
+#endif
+
+// Counters of one lock, it shows up in lock_stats_list() after its
+// first acquire
+typedef struct LockStats {
+    const char* name;
+    uint64_t acquires;
+    uint64_t contended;           // acquires that had to wait
+    uint64_t spin_cycles;         // TSC cycles spent waiting
+    uint64_t max_spin;            // longest single wait
+    volatile uint32_t registered;
+    struct LockStats* next;
+} LockStats;
+
+#define LOCK_STATS_INIT(lock_name) { .name = (lock_name) }
+
+typedef struct {
+    volatile uint32_t next;       // next ticket handed out
+    volatile uint32_t owner;      // ticket being served
+    LockStats* stats;
+} TicketLock;
+
+typedef struct McsNode {
+    struct McsNode* volatile next;
+    volatile uint32_t locked;
+} McsNode;
+
+// The caller passes a node that stays alive until the unlock, usually
+// on its stack
+typedef struct {
+    McsNode* volatile tail;
+    LockStats* stats;
+} McsLock;
+
+typedef struct {
+    volatile uint32_t state;      // reader count and the writer bits
+    LockStats* stats;
+} RwLock;
+
+#define TICKET_LOCK_INIT(stats) { 0, 0, (stats) }
+#define MCS_LOCK_INIT(stats)    { NULL, (stats) }
+#define RW_LOCK_INIT(stats)     { 0, (stats) }
+
+static inline void cpu_relax(void) {
+    asm volatile ("pause" ::: "memory");
+}
+
+void ticket_lock(TicketLock* lock);
+void ticket_unlock(TicketLock* lock);
+
+void mcs_lock(McsLock* lock, McsNode* node);
+void mcs_unlock(McsLock* lock, McsNode* node);
+
+void read_lock(RwLock* lock);
+void read_unlock(RwLock* lock);
+void write_lock(RwLock* lock);
+void write_unlock(RwLock* lock);
+
+static inline uint64_t ticket_lock_irqsave(TicketLock* lock) {
+    uint64_t flags = irq_save();
+    ticket_lock(lock);
+    return flags;
+}
+
+static inline void ticket_unlock_irqrestore(TicketLock* lock, uint64_t flags) {
+    ticket_unlock(lock);
+    irq_restore(flags);
+}
+
+static inline uint64_t mcs_lock_irqsave(McsLock* lock, McsNode* node) {
+    uint64_t flags = irq_save();
+    mcs_lock(lock, node);
+    return flags;
+}
+
+static inline void mcs_unlock_irqrestore(McsLock* lock, McsNode* node, uint64_t flags) {
+    mcs_unlock(lock, node);
+    irq_restore(flags);
+}
+
+static inline uint64_t read_lock_irqsave(RwLock* lock) {
+    uint64_t flags = irq_save();
+    read_lock(lock);
+    return flags;
+}
+
+static inline void read_unlock_irqrestore(RwLock* lock, uint64_t flags) {
+    read_unlock(lock);
+    irq_restore(flags);
+}
+
+static inline uint64_t write_lock_irqsave(RwLock* lock) {
+    uint64_t flags = irq_save();
+    write_lock(lock);
+    return flags;
+}
+
+static inline void write_unlock_irqrestore(RwLock* lock, uint64_t flags) {
+    write_unlock(lock);
+    irq_restore(flags);
+}
+
+// Every lock with counters that was taken at least once, newest first.
+// Entries are never removed, walk them with ->next.
+const LockStats* lock_stats_list(void);
+
+// Zero the counters of all listed locks
+void lock_stats_reset(void);
+
+#endif
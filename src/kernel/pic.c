@@ -0,0 +1,61 @@
+#include "pic.h"
+#include "../include/io.h"
+
+#define PIC_EOI       0x20
+#define PIC_READ_ISR  0x0B
+
+#define ICW1_INIT     0x10
+#define ICW1_ICW4     0x01
+#define ICW4_8086     0x01
+
+void pic_init(void) {
+    // Start the init sequence in cascade mode
+    outb(PIC1_COMMAND, ICW1_INIT | ICW1_ICW4);
+    io_wait();
+    outb(PIC2_COMMAND, ICW1_INIT | ICW1_ICW4);
+    io_wait();
+
+    // Vector offsets
+    outb(PIC1_DATA, PIC1_OFFSET);
+    io_wait();
+    outb(PIC2_DATA, PIC2_OFFSET);
+    io_wait();
+
+    // Slave PIC sits on IRQ2 of the master
+    outb(PIC1_DATA, 0x04);
+    io_wait();
+    outb(PIC2_DATA, 0x02);
+    io_wait();
+
+    outb(PIC1_DATA, ICW4_8086);
+    io_wait();
+    outb(PIC2_DATA, ICW4_8086);
+    io_wait();
+
+    // Everything masked except the cascade, drivers unmask their own IRQ
+    outb(PIC1_DATA, 0xFB);
+    outb(PIC2_DATA, 0xFF);
+}
+
+void pic_mask(uint8_t irq) {
+    uint16_t port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+    outb(port, inb(port) | (1 << (irq & 7)));
+}
+
+void pic_unmask(uint8_t irq) {
+    uint16_t port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+    outb(port, inb(port) & ~(1 << (irq & 7)));
+}
+
+void pic_send_eoi(uint8_t irq) {
+    if (irq >= 8) {
+        outb(PIC2_COMMAND, PIC_EOI);
+    }
+    outb(PIC1_COMMAND, PIC_EOI);
+}
+
+uint16_t pic_get_isr(void) {
+    outb(PIC1_COMMAND, PIC_READ_ISR);
+    outb(PIC2_COMMAND, PIC_READ_ISR);
+    return ((uint16_t)inb(PIC2_COMMAND) << 8) | inb(PIC1_COMMAND);
+}
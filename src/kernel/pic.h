@@ -0,0 +1,24 @@
+#ifndef PIC_H
+#define PIC_H
+
+#include <stdint.h>
+
+// 8259 PIC ports
+#define PIC1_COMMAND 0x20
+#define PIC1_DATA    0x21
+#define PIC2_COMMAND 0xA0
+#define PIC2_DATA    0xA1
+
+// IRQs are remapped behind the CPU exceptions
+#define PIC1_OFFSET  0x20
+#define PIC2_OFFSET  0x28
+
+void pic_init(void);
+void pic_mask(uint8_t irq);
+void pic_unmask(uint8_t irq);
+void pic_send_eoi(uint8_t irq);
+
+// In-service register of both PICs (bit n = IRQ n)
+uint16_t pic_get_isr(void);
+
+#endif
@@ -0,0 +1,390 @@
+#include "sched.h"
+#include "idt.h"
+#include "time.h"
+#include "../include/memory/memory.h"
+#include "../include/text/text_utils.h"
+#include "../include/lib/string.h"
+
+#define STACK_CANARY 0x57AC4B0B57AC4B0BULL
+
+extern void context_switch(uint64_t* old_rsp, uint64_t new_rsp);
+
+static Thread boot_thread;
+static Thread* current = &boot_thread;
+static Thread* previous = NULL;      // the thread we just switched away from
+static Thread* all_threads = NULL;
+static uint32_t next_id = 0;
+static int running = 0;
+
+// Run queue: one FIFO per priority and a bitmap of the non-empty ones,
+// so picking the next thread is a single bit scan
+static Thread* queue_head[SCHED_PRIORITIES];
+static Thread* queue_tail[SCHED_PRIORITIES];
+static uint32_t ready_mask = 0;
+
+_Static_assert(SCHED_PRIORITIES <= 32, "the ready mask has 32 bits");
+
+// Sleeping threads, sorted by wake_tick
+static Thread* sleepers = NULL;
+
+static volatile uint64_t ticks = 0;
+static int slice_left = SCHED_TIMESLICE;
+static int need_resched = 0;
+
+static uint64_t switch_start = 0;
+static SchedStats stats = { .switch_min = ~0ULL };
+
+static void runqueue_push(Thread* thread) {
+    int prio = thread->priority;
+
+    thread->next = NULL;
+    if (queue_tail[prio]) {
+        queue_tail[prio]->next = thread;
+    } else {
+        queue_head[prio] = thread;
+    }
+    queue_tail[prio] = thread;
+    ready_mask |= 1U << prio;
+}
+
+// Never empty once the idle thread exists
+static Thread* runqueue_pop(void) {
+    int prio = __builtin_ctz(ready_mask);
+    Thread* thread = queue_head[prio];
+
+    queue_head[prio] = thread->next;
+    if (!queue_head[prio]) {
+        queue_tail[prio] = NULL;
+        ready_mask &= ~(1U << prio);
+    }
+    thread->next = NULL;
+    return thread;
+}
+
+static void make_ready(Thread* thread) {
+    thread->state = THREAD_READY;
+    runqueue_push(thread);
+
+    if (thread->priority < current->priority) {
+        need_resched = 1;
+    }
+}
+
+static void thread_free(Thread* thread) {
+    for (Thread** link = &all_threads; *link; link = &(*link)->all_next) {
+        if (*link == thread) {
+            *link = thread->all_next;
+            break;
+        }
+    }
+    stats.threads--;
+
+    kfree(thread->stack);
+    kfree(thread);
+}
+
+// First thing a thread does after context_switch() returns into it
+static void switch_finish(void) {
+    uint64_t now = tsc_read();
+    uint64_t cycles = now - switch_start;
+
+    stats.switch_total += cycles;
+    if (cycles < stats.switch_min) {
+        stats.switch_min = cycles;
+    }
+    if (cycles > stats.switch_max) {
+        stats.switch_max = cycles;
+    }
+    current->run_start = now;
+
+    // A thread can't free the stack it runs on, the next one does it
+    // (the boot thread has neither a heap stack nor a heap struct)
+    if (previous->state == THREAD_DEAD && previous->stack) {
+        thread_free(previous);
+    }
+}
+
+// Pick the next thread and switch to it, interrupts must be off.
+// Returns 1 if another thread ran in between.
+static int schedule(void) {
+    Thread* prev = current;
+
+    if (prev->stack && *(uint64_t*)prev->stack != STACK_CANARY) {
+        print("\nKernel stack overflow in thread ", 0x4F);
+        print(prev->name, 0x4F);
+        print("\nSystem halted.\n", 0x0C);
+        while (1) {
+            asm volatile ("cli; hlt");
+        }
+    }
+
+    // Preempted or yielding threads go to the back of their queue
+    if (prev->state == THREAD_RUNNING) {
+        prev->state = THREAD_READY;
+        runqueue_push(prev);
+    }
+
+    need_resched = 0;
+    slice_left = SCHED_TIMESLICE;
+
+    Thread* next = runqueue_pop();
+    next->state = THREAD_RUNNING;
+    if (next == prev) {
+        return 0;
+    }
+
+    switch_start = tsc_read();
+    prev->run_cycles += switch_start - prev->run_start;
+    next->switches++;
+    stats.switches++;
+
+    previous = prev;
+    current = next;
+    context_switch(&prev->rsp, next->rsp);
+
+    switch_finish();
+    return 1;
+}
+
+// New threads start here through the return address of their stack
+static void thread_bootstrap(void) {
+    switch_finish();
+    interrupts_enable();
+
+    current->entry(current->arg);
+    thread_exit();
+}
+
+static void idle_entry(void* arg) {
+    (void)arg;
+    while (1) {
+        cpu_idle();
+    }
+}
+
+static void timer_irq(InterruptFrame* frame) {
+    (void)frame;
+    ticks++;
+    stats.ticks = ticks;
+
+    while (sleepers && sleepers->wake_tick <= ticks) {
+        Thread* thread = sleepers;
+        sleepers = thread->next;
+        make_ready(thread);
+    }
+
+    if (--slice_left <= 0) {
+        need_resched = 1;
+    }
+}
+
+void sched_init(void) {
+    boot_thread.id = next_id++;
+    boot_thread.state = THREAD_RUNNING;
+    boot_thread.priority = PRIORITY_NORMAL;
+    strcpy(boot_thread.name, "main");
+    boot_thread.run_start = tsc_read();
+    all_threads = &boot_thread;
+    stats.threads = 1;
+
+    if (!thread_create("idle", idle_entry, NULL, PRIORITY_IDLE)) {
+        print("sched: no memory for the idle thread\n", 0x0C);
+        return;
+    }
+
+    pit_start_periodic(SCHED_HZ);
+    irq_register(IRQ_TIMER, timer_irq);
+    running = 1;
+}
+
+int sched_running(void) {
+    return running;
+}
+
+Thread* thread_create(const char* name, ThreadEntry entry, void* arg, int priority) {
+    if (priority < 0 || priority >= SCHED_PRIORITIES) {
+        return NULL;
+    }
+
+    Thread* thread = (Thread*)kmalloc(sizeof(Thread));
+    uint8_t* stack = (uint8_t*)kmalloc_aligned(THREAD_STACK_SIZE, 16);
+    if (!thread || !stack) {
+        kfree(thread);
+        kfree(stack);
+        return NULL;
+    }
+
+    memset(thread, 0, sizeof(Thread));
+    size_t len = strlen(name);
+    if (len > THREAD_NAME_LENGTH - 1) {
+        len = THREAD_NAME_LENGTH - 1;
+    }
+    memcpy(thread->name, name, len);
+
+    thread->priority = priority;
+    thread->stack = stack;
+    thread->entry = entry;
+    thread->arg = arg;
+
+    // Overflows run into the canary at the bottom
+    *(uint64_t*)stack = STACK_CANARY;
+
+    // What context_switch() pops: six callee saved registers and the
+    // return address. The zero above it keeps the ABI stack alignment.
+    uint64_t* sp = (uint64_t*)(stack + THREAD_STACK_SIZE);
+    *--sp = 0;
+    *--sp = (uint64_t)thread_bootstrap;
+    for (int i = 0; i < 6; i++) {
+        *--sp = 0;
+    }
+    thread->rsp = (uint64_t)sp;
+
+    uint64_t flags = irq_save();
+    thread->id = next_id++;
+    thread->all_next = all_threads;
+    all_threads = thread;
+    stats.threads++;
+    make_ready(thread);
+    irq_restore(flags);
+
+    // Let a more important thread start right away
+    if (need_resched) {
+        thread_yield();
+    }
+
+    return thread;
+}
+
+void thread_exit(void) {
+    interrupts_disable();
+    current->state = THREAD_DEAD;
+    schedule();
+
+    // Not reached, the next thread frees this one
+    while (1) {
+        asm volatile ("hlt");
+    }
+}
+
+void thread_yield(void) {
+    if (!running) {
+        return;
+    }
+
+    uint64_t flags = irq_save();
+    schedule();
+    irq_restore(flags);
+}
+
+void thread_sleep_ms(uint64_t ms) {
+    if (!running) {
+        udelay(ms * 1000);
+        return;
+    }
+
+    uint64_t flags = irq_save();
+
+    current->state = THREAD_SLEEPING;
+    current->wake_tick = ticks + (ms * SCHED_HZ + 999) / 1000;
+    if (current->wake_tick == ticks) {
+        current->wake_tick++;
+    }
+
+    Thread** link = &sleepers;
+    while (*link && (*link)->wake_tick <= current->wake_tick) {
+        link = &(*link)->next;
+    }
+    current->next = *link;
+    *link = current;
+
+    schedule();
+    irq_restore(flags);
+}
+
+Thread* thread_current(void) {
+    return current;
+}
+
+void wait_queue_sleep(WaitQueue* queue) {
+    if (!running) {
+        cpu_idle();
+        interrupts_disable();
+        return;
+    }
+
+    current->state = THREAD_BLOCKED;
+    current->next = NULL;
+    if (queue->tail) {
+        queue->tail->next = current;
+    } else {
+        queue->head = current;
+    }
+    queue->tail = current;
+
+    schedule();
+}
+
+void wait_queue_wake_all(WaitQueue* queue) {
+    uint64_t flags = irq_save();
+
+    Thread* thread = queue->head;
+    queue->head = NULL;
+    queue->tail = NULL;
+
+    while (thread) {
+        Thread* next = thread->next;
+        make_ready(thread);
+        thread = next;
+    }
+
+    irq_restore(flags);
+}
+
+uint64_t sched_ticks(void) {
+    return ticks;
+}
+
+void sched_irq_exit(void) {
+    if (running && need_resched && schedule()) {
+        stats.preemptions++;
+    }
+}
+
+void sched_get_stats(SchedStats* out) {
+    uint64_t flags = irq_save();
+    *out = stats;
+    irq_restore(flags);
+}
+
+int sched_snapshot(ThreadInfo* info, int max) {
+    int count = 0;
+    uint64_t flags = irq_save();
+
+    // The running thread's time is only added up when it switches
+    current->run_cycles += tsc_read() - current->run_start;
+    current->run_start = tsc_read();
+
+    for (Thread* thread = all_threads; thread && count < max; thread = thread->all_next) {
+        info[count].id = thread->id;
+        info[count].state = thread->state;
+        info[count].priority = thread->priority;
+        memcpy(info[count].name, thread->name, THREAD_NAME_LENGTH);
+        info[count].switches = thread->switches;
+        info[count].run_cycles = thread->run_cycles;
+        count++;
+    }
+
+    irq_restore(flags);
+    return count;
+}
+
+const char* thread_state_name(ThreadState state) {
+    switch (state) {
+        case THREAD_READY:    return "ready";
+        case THREAD_RUNNING:  return "running";
+        case THREAD_BLOCKED:  return "blocked";
+        case THREAD_SLEEPING: return "sleeping";
+        case THREAD_DEAD:     return "dead";
+    }
+    return "?";
+}
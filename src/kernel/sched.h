@@ -0,0 +1,107 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdint.h>
+
+// Preemptive priority scheduler for kernel threads. Lower numbers run
+// first, threads of the same priority share the CPU round robin.
+
+#define SCHED_HZ              1000   // timer ticks per second
+#define SCHED_TIMESLICE       10     // ticks before an equal priority thread gets a turn
+#define SCHED_PRIORITIES      32
+
+#define PRIORITY_HIGH         8
+#define PRIORITY_NORMAL       16
+#define PRIORITY_LOW          24     // background jobs
+#define PRIORITY_IDLE         (SCHED_PRIORITIES - 1)
+
+#define THREAD_STACK_SIZE     0x4000
+#define THREAD_NAME_LENGTH    16
+
+typedef void (*ThreadEntry)(void* arg);
+
+typedef enum {
+    THREAD_READY,
+    THREAD_RUNNING,
+    THREAD_BLOCKED,
+    THREAD_SLEEPING,
+    THREAD_DEAD
+} ThreadState;
+
+typedef struct Thread {
+    uint64_t rsp;                 // saved by context_switch
+    uint32_t id;
+    ThreadState state;
+    int priority;
+    char name[THREAD_NAME_LENGTH];
+
+    uint8_t* stack;               // NULL for the boot thread
+    ThreadEntry entry;
+    void* arg;
+
+    struct Thread* next;          // run queue, wait queue or sleep list
+    struct Thread* all_next;      // every thread
+    uint64_t wake_tick;
+
+    uint64_t switches;            // times it was switched to
+    uint64_t run_cycles;
+    uint64_t run_start;
+
+    void* plug;                   // BlockPlug collecting the thread's bios
+} Thread;
+
+// Threads waiting for an event, woken from interrupt handlers
+typedef struct {
+    Thread* head;
+    Thread* tail;
+} WaitQueue;
+
+typedef struct {
+    uint64_t ticks;
+    uint64_t switches;
+    uint64_t preemptions;         // switches at the end of an interrupt
+    uint64_t switch_min;          // cycles from leaving one thread to running the next
+    uint64_t switch_max;
+    uint64_t switch_total;
+    uint32_t threads;
+} SchedStats;
+
+typedef struct {
+    uint32_t id;
+    ThreadState state;
+    int priority;
+    char name[THREAD_NAME_LENGTH];
+    uint64_t switches;
+    uint64_t run_cycles;
+} ThreadInfo;
+
+// Turn the running code into the first thread, start the idle thread
+// and the timer tick
+void sched_init(void);
+int sched_running(void);
+
+// New thread, ready to run. NULL if there is no memory.
+Thread* thread_create(const char* name, ThreadEntry entry, void* arg, int priority);
+void thread_exit(void) __attribute__((noreturn));
+void thread_yield(void);
+void thread_sleep_ms(uint64_t ms);
+Thread* thread_current(void);
+
+// Block until woken, call with interrupts off and check the condition
+// again afterwards. Before sched_init() this just waits for an interrupt.
+void wait_queue_sleep(WaitQueue* queue);
+void wait_queue_wake_all(WaitQueue* queue);
+
+uint64_t sched_ticks(void);
+
+// Switch threads if needed, called by interrupt_dispatch() after the EOI
+void sched_irq_exit(void);
+
+void sched_get_stats(SchedStats* stats);
+
+// Copy of the thread list, returns the number of entries filled
+int sched_snapshot(ThreadInfo* info, int max);
+
+const char* thread_state_name(ThreadState state);
+
+#endif
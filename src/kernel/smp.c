@@ -0,0 +1,320 @@
+#include "smp.h"
+#include "apic.h"
+#include "idt.h"
+#include "time.h"
+#include "lock.h"
+#include "../include/memory/memory.h"
+#include "../include/memory/paging.h"
+#include "../include/memory/pmm.h"
+#include "../include/text/text_utils.h"
+#include "../include/lib/string.h"
+
+#define MSR_EFER          0xC0000080
+#define MSR_GS_BASE       0xC0000101
+
+#define EFER_LME          (1ULL << 8)
+#define EFER_NXE          (1ULL << 11)
+#define CR4_PCIDE         (1ULL << 17)
+#define CR4_OSXSAVE       (1ULL << 18)
+
+#define LOW_MEMORY_END    0xA0000      // EBDA and ROMs above
+#define BOOT_STACK_GUARD  0x10000      // how much below rsp may still be in use
+#define AP_START_TIMEOUT  100000000ULL // ns
+
+// Fields at the end of ap_boot.s
+typedef struct {
+    uint64_t cr3;
+    uint64_t cr4;
+    uint64_t efer;
+    uint64_t cr0;
+    uint64_t stack;
+    uint64_t entry;
+    uint64_t cpu;
+} __attribute__((packed)) TrampolineData;
+
+typedef struct {
+    uint16_t limit;
+    uint64_t base;
+} __attribute__((packed)) DescriptorPointer;
+
+extern uint8_t ap_trampoline_start[];
+extern uint8_t ap_trampoline_end[];
+extern uint8_t ap_trampoline_data[];
+
+extern char _kernel_start[];
+extern char _kernel_end[];
+
+static Cpu bsp_cpu __attribute__((aligned(64)));
+static Cpu* cpus[MAX_CPUS];
+static volatile uint32_t cpu_count = 0;
+
+// BSP state the APs copy once they run 64 bit code
+static DescriptorPointer bsp_gdtr;
+static DescriptorPointer bsp_idtr;
+static uint16_t bsp_cs;
+static uint16_t bsp_ds;
+static uint64_t bsp_cr4;
+static uint64_t bsp_xcr0;
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    asm volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    asm volatile ("wrmsr" : : "a"((uint32_t)value), "d"((uint32_t)(value >> 32)), "c"(msr));
+}
+
+static inline uint64_t read_cr(int reg) {
+    uint64_t value = 0;
+    switch (reg) {
+        case 0: asm volatile ("mov %%cr0, %0" : "=r"(value)); break;
+        case 3: asm volatile ("mov %%cr3, %0" : "=r"(value)); break;
+        case 4: asm volatile ("mov %%cr4, %0" : "=r"(value)); break;
+    }
+    return value;
+}
+
+static void cpu_setup(Cpu* cpu, uint32_t index, uint8_t apic_id) {
+    memset(cpu, 0, sizeof(Cpu));
+    cpu->self = cpu;
+    cpu->index = index;
+    cpu->apic_id = apic_id;
+    cpu->rng = 0x9E3779B97F4A7C15ULL * (index + 1);
+}
+
+static void wake_ipi(InterruptFrame* frame) {
+    (void)frame;
+    lapic_eoi();
+}
+
+// First C code on an AP: its own stack, interrupts off and still the
+// trampoline's GDT
+static void __attribute__((noreturn)) ap_entry(Cpu* cpu) {
+    asm volatile ("lgdt %0\n\t"
+                  "pushq %1\n\t"
+                  "leaq 1f(%%rip), %%rax\n\t"
+                  "pushq %%rax\n\t"
+                  "lretq\n"
+                  "1:\n\t"
+                  "mov %w2, %%ds\n\t"
+                  "mov %w2, %%es\n\t"
+                  "mov %w2, %%ss"
+                  : : "m"(bsp_gdtr), "r"((uint64_t)bsp_cs), "r"((uint64_t)bsp_ds) : "rax", "memory");
+    asm volatile ("lidt %0" : : "m"(bsp_idtr));
+
+    // Same SSE/AVX state as the BSP, mem_init() may have picked AVX2
+    asm volatile ("mov %0, %%cr4" : : "r"(bsp_cr4));
+    if (bsp_cr4 & CR4_OSXSAVE) {
+        asm volatile ("xsetbv" : : "a"((uint32_t)bsp_xcr0), "d"((uint32_t)(bsp_xcr0 >> 32)), "c"(0));
+    }
+
+    // Same memory types as the BSP, the framebuffer is mapped WC
+    paging_init_pat();
+
+    wrmsr(MSR_GS_BASE, (uint64_t)cpu);
+    lapic_enable();
+
+    cpu->apic_id = lapic_id();
+    __atomic_store_n(&cpu->online, 1, __ATOMIC_RELEASE);
+
+    work_worker(cpu);
+}
+
+// Where an AP that missed its start ends up if it wakes up after all
+static void __attribute__((noreturn)) ap_park(Cpu* cpu) {
+    (void)cpu;
+    for (;;) {
+        asm volatile ("cli; hlt");
+    }
+}
+
+// 1 if page is the table at phys or one of the tables below it. Only the
+// bootloader's tables live under 1MB, the PMM never hands out that range.
+static int is_boot_table(uint64_t phys, int level, uint64_t page) {
+    if (phys == page) {
+        return 1;
+    }
+    if (level == 1) {
+        return 0;
+    }
+
+    const uint64_t* entries = (const uint64_t*)phys;
+    for (int i = 0; i < 512; i++) {
+        if (level == 4 && i == PAGING_RECURSIVE_SLOT) {
+            continue;
+        }
+        uint64_t entry = entries[i];
+        if (!(entry & PAGE_PRESENT) || (level < 4 && (entry & PAGE_HUGE))) {
+            continue;
+        }
+        uint64_t next = entry & PAGE_ADDR_MASK;
+        if (next < 0x100000 && is_boot_table(next, level - 1, page)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static uint64_t low_phys(uint64_t addr) {
+    return addr >= KERNEL_OFFSET_HIGH ? addr - KERNEL_OFFSET_HIGH : addr;
+}
+
+static int overlaps(uint64_t page, uint64_t start, uint64_t end) {
+    return page < end && page + PAGE_SIZE > start;
+}
+
+// The trampoline needs a page below 1MB. The PMM keeps all of that for
+// the bootloader's leftovers, so pick one by hand that is usable RAM and
+// holds neither the kernel, the boot info, the boot stack nor one of
+// the page tables we still run on.
+static uint64_t find_trampoline_page(BootInfo* binfo) {
+    uint64_t kernel_start = low_phys((uint64_t)_kernel_start);
+    uint64_t kernel_end = low_phys((uint64_t)_kernel_end);
+    uint64_t binfo_start = low_phys((uint64_t)binfo);
+    uint64_t binfo_end = binfo_start + sizeof(BootInfo) + binfo->memmap.entry_count * sizeof(E820Entry);
+
+    uint64_t rsp;
+    asm volatile ("mov %%rsp, %0" : "=r"(rsp));
+    rsp = low_phys(rsp);
+
+    uint64_t pml4 = read_cr(3) & PAGE_ADDR_MASK;
+
+    for (uint64_t page = PAGE_SIZE; page + PAGE_SIZE <= LOW_MEMORY_END; page += PAGE_SIZE) {
+        if (!pmm_range_usable(page, PAGE_SIZE) ||
+            overlaps(page, kernel_start, kernel_end) ||
+            overlaps(page, binfo_start, binfo_end) ||
+            overlaps(page, rsp - BOOT_STACK_GUARD, rsp + PAGE_SIZE) ||
+            (pml4 < 0x100000 && is_boot_table(pml4, 4, page))) {
+            continue;
+        }
+        return page;
+    }
+    return 0;
+}
+
+static int start_ap(uint8_t apic_id, uint64_t page, volatile TrampolineData* data) {
+    Cpu* cpu = (Cpu*)kmalloc_aligned(sizeof(Cpu), 64);
+    uint8_t* stack = (uint8_t*)kmalloc_aligned(AP_STACK_SIZE, 16);
+    if (!cpu || !stack) {
+        kfree(cpu);
+        kfree(stack);
+        return -1;
+    }
+
+    cpu_setup(cpu, cpu_count, apic_id);
+    cpu->stack = stack;
+    data->stack = (uint64_t)(stack + AP_STACK_SIZE);
+    data->cpu = (uint64_t)cpu;
+
+    // INIT, then STARTUP, and a second STARTUP if the first one got lost
+    lapic_send_init(apic_id);
+    for (int attempt = 0; attempt < 2 && !cpu->online; attempt++) {
+        lapic_send_startup(apic_id, (uint8_t)(page >> PAGE_SHIFT));
+
+        uint64_t deadline = ktime_ns() + AP_START_TIMEOUT;
+        while (!__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE) && ktime_ns() < deadline) {
+            cpu_relax();
+        }
+    }
+
+    if (!cpu->online) {
+        // It might still wake up later, so its memory stays and the
+        // trampoline sends it to ap_park() instead of ap_entry(). The
+        // trampoline is not used again, a late AP would take over
+        // whatever stack and Cpu the next start put there.
+        data->entry = (uint64_t)ap_park;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        print("smp: CPU with APIC id ", 0x0C);
+        print_dec(apic_id, 0x0C);
+        print(" did not start\n", 0x0C);
+        return -1;
+    }
+
+    cpus[cpu_count] = cpu;
+    __atomic_store_n(&cpu_count, cpu_count + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void smp_init_bsp(void) {
+    cpu_setup(&bsp_cpu, 0, 0);
+    bsp_cpu.online = 1;
+    wrmsr(MSR_GS_BASE, (uint64_t)&bsp_cpu);
+    cpus[0] = &bsp_cpu;
+    cpu_count = 1;
+}
+
+uint32_t smp_init(BootInfo* binfo) {
+    if (acpi_init(&binfo->acpi) != 0) {
+        return cpu_count;
+    }
+
+    const MadtInfo* madt = acpi_madt();
+    if (lapic_init(madt->lapic_address) != 0) {
+        print("smp: can't map the local APIC\n", 0x0C);
+        return cpu_count;
+    }
+    bsp_cpu.apic_id = lapic_id();
+    interrupt_register(IPI_WAKE_VECTOR, wake_ipi);
+
+    if (madt->cpu_count < 2) {
+        return cpu_count;
+    }
+
+    // The trampoline loads CR3 in 32 bit mode
+    uint64_t cr3 = read_cr(3);
+    if (cr3 >= 0x100000000ULL) {
+        print("smp: page tables above 4GB, staying on one CPU\n", 0x0C);
+        return cpu_count;
+    }
+
+    uint64_t page = find_trampoline_page(binfo);
+    if (!page) {
+        print("smp: no free page below 1MB for the AP trampoline\n", 0x0C);
+        return cpu_count;
+    }
+
+    // The low megabyte is still identity mapped
+    size_t size = ap_trampoline_end - ap_trampoline_start;
+    memcpy((void*)page, ap_trampoline_start, size);
+
+    volatile TrampolineData* data = (volatile TrampolineData*)(page + (ap_trampoline_data - ap_trampoline_start));
+    data->cr3 = cr3;
+    data->cr4 = read_cr(4) & ~CR4_PCIDE;   // PCIDE needs long mode first
+    data->efer = (rdmsr(MSR_EFER) & EFER_NXE) | EFER_LME;
+    data->cr0 = read_cr(0);
+    data->entry = (uint64_t)ap_entry;
+
+    asm volatile ("sgdt %0" : "=m"(bsp_gdtr));
+    asm volatile ("sidt %0" : "=m"(bsp_idtr));
+    asm volatile ("mov %%cs, %0" : "=r"(bsp_cs));
+    asm volatile ("mov %%ss, %0" : "=r"(bsp_ds));
+    bsp_cr4 = read_cr(4);
+    if (bsp_cr4 & CR4_OSXSAVE) {
+        uint32_t lo, hi;
+        asm volatile ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+        bsp_xcr0 = ((uint64_t)hi << 32) | lo;
+    }
+
+    // One at a time, they share the trampoline. After a failed start it
+    // belongs to the CPU that did not answer, so the rest stay off.
+    for (uint32_t i = 0; i < madt->cpu_count && cpu_count < MAX_CPUS; i++) {
+        if (madt->apic_ids[i] != bsp_cpu.apic_id &&
+            start_ap(madt->apic_ids[i], page, data) != 0) {
+            print("smp: not starting the remaining CPUs\n", 0x0C);
+            break;
+        }
+    }
+
+    work_set_cpus(cpu_count);
+    return cpu_count;
+}
+
+uint32_t smp_cpu_count(void) {
+    return __atomic_load_n(&cpu_count, __ATOMIC_ACQUIRE);
+}
+
+Cpu* smp_cpu(uint32_t index) {
+    return index < smp_cpu_count() ? cpus[index] : NULL;
+}
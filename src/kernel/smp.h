@@ -0,0 +1,44 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+#include "acpi.h"
+#include "work.h"
+#include "../include/boot.h"
+
+#define MAX_CPUS       ACPI_MAX_CPUS
+#define AP_STACK_SIZE  0x4000
+
+// Per-CPU data, GS points at it on every CPU
+typedef struct Cpu {
+    struct Cpu* self;             // gs:0, see this_cpu()
+    uint32_t index;               // 0 is the BSP
+    uint8_t apic_id;
+    volatile int online;
+
+    uint8_t* stack;               // NULL for the BSP
+    uint64_t tlb_generation;      // paging_tlb_generation() at the last flush
+    uint64_t rng;                 // picks the victims to steal from
+    WorkStats stats;
+
+    WorkDeque deque;
+} Cpu;
+
+static inline Cpu* this_cpu(void) {
+    Cpu* cpu;
+    asm volatile ("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+// Per-CPU data for the BSP (CPU 0), before anything uses this_cpu()
+void smp_init_bsp(void);
+
+// Find the other CPUs in the ACPI MADT and start them. Threads keep
+// running on the BSP only, the others run work from parallel_for().
+// Returns the number of CPUs online.
+uint32_t smp_init(BootInfo* binfo);
+
+uint32_t smp_cpu_count(void);
+Cpu* smp_cpu(uint32_t index);
+
+#endif
@@ -0,0 +1,125 @@
+#include "time.h"
+#include "idt.h"
+#include "../include/io.h"
+
+#define CPUID_EDX_TSC          (1 << 4)
+#define CPUID_EXT_POWER        0x80000007
+#define CPUID_EXT_INVARIANT    (1 << 8)
+
+// Each calibration run counts the PIT down for 10 ms, the fastest run
+// had the least overhead around it
+#define CALIBRATE_MS     10
+#define CALIBRATE_RUNS   5
+
+static uint64_t hz = 0;
+static uint64_t boot_tsc = 0;
+static int invariant = 0;
+
+// ns = cycles * ns_mult >> 32, ns_mult = 10^9 << 32 / hz
+static uint64_t ns_mult = 0;
+
+static inline void cpuid(uint32_t leaf, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d) {
+    asm volatile ("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(0));
+}
+
+// TSC cycles for one run of PIT channel 2 in one-shot mode, which
+// raises its output once the count reaches zero
+static uint64_t calibrate_once(uint16_t count) {
+    // Gate on, speaker off
+    outb(PIT_GATE_PORT, (inb(PIT_GATE_PORT) & ~0x02) | 0x01);
+
+    outb(PIT_COMMAND, 0xB0);    // channel 2, lobyte/hibyte, mode 0
+    outb(PIT_CHANNEL2, count & 0xFF);
+    outb(PIT_CHANNEL2, count >> 8);
+
+    uint64_t start = tsc_read_ordered();
+    while (!(inb(PIT_GATE_PORT) & 0x20)) {
+    }
+    return tsc_read_ordered() - start;
+}
+
+int time_init(const CpuInfo* cpu) {
+    if (!(cpu->features_edx & CPUID_EDX_TSC)) {
+        return -1;
+    }
+
+    // The boot info only has the basic leaves, the invariant TSC flag
+    // lives in the extended power management leaf
+    uint32_t a, b, c, d;
+    cpuid(0x80000000, &a, &b, &c, &d);
+    if (a >= CPUID_EXT_POWER) {
+        cpuid(CPUID_EXT_POWER, &a, &b, &c, &d);
+        invariant = (d & CPUID_EXT_INVARIANT) != 0;
+    }
+
+    uint16_t count = PIT_HZ * CALIBRATE_MS / 1000;
+    uint64_t best = ~0ULL;
+
+    uint64_t flags = irq_save();
+    for (int run = 0; run < CALIBRATE_RUNS; run++) {
+        uint64_t cycles = calibrate_once(count);
+        if (cycles < best) {
+            best = cycles;
+        }
+    }
+    irq_restore(flags);
+
+    hz = best * PIT_HZ / count;
+    if (!hz) {
+        return -1;
+    }
+
+    ns_mult = (1000000000ULL << 32) / hz;
+    boot_tsc = tsc_read();
+    return 0;
+}
+
+uint64_t tsc_hz(void) {
+    return hz;
+}
+
+int tsc_invariant(void) {
+    return invariant;
+}
+
+uint64_t cycles_to_ns(uint64_t cycles) {
+    return (uint64_t)(((unsigned __int128)cycles * ns_mult) >> 32);
+}
+
+// Split into seconds so nothing overflows (and no 128 bit division)
+uint64_t ns_to_cycles(uint64_t ns) {
+    return ns / 1000000000 * hz + ns % 1000000000 * hz / 1000000000;
+}
+
+uint64_t ktime_ns(void) {
+    if (!hz) {
+        return 0;
+    }
+    return cycles_to_ns(tsc_read() - boot_tsc);
+}
+
+void udelay(uint64_t us) {
+    if (!hz) {
+        // Roughly a microsecond per port write
+        while (us--) {
+            io_wait();
+        }
+        return;
+    }
+
+    uint64_t end = tsc_read() + ns_to_cycles(us * 1000);
+    while (tsc_read() < end) {
+        asm volatile ("pause");
+    }
+}
+
+void pit_start_periodic(uint32_t hz) {
+    uint32_t divisor = PIT_HZ / hz;
+    if (divisor > 0xFFFF) {
+        divisor = 0xFFFF;
+    }
+
+    outb(PIT_COMMAND, 0x34);    // channel 0, lobyte/hibyte, rate generator
+    outb(PIT_CHANNEL0, divisor & 0xFF);
+    outb(PIT_CHANNEL0, divisor >> 8);
+}
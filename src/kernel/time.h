@@ -0,0 +1,49 @@
+#ifndef TIME_H
+#define TIME_H
+
+#include <stdint.h>
+#include "../include/boot.h"
+
+// 8254 PIT, used as the reference clock for the TSC
+#define PIT_HZ           1193182
+#define PIT_CHANNEL0     0x40
+#define PIT_CHANNEL2     0x42
+#define PIT_COMMAND      0x43
+#define PIT_GATE_PORT    0x61    // channel 2 gate (bit 0) and output (bit 5)
+
+// Raw time stamp counter
+static inline uint64_t tsc_read(void) {
+    uint32_t lo, hi;
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// TSC read that waits for earlier instructions, for timing code
+static inline uint64_t tsc_read_ordered(void) {
+    uint32_t lo, hi;
+    asm volatile ("lfence; rdtsc" : "=a"(lo), "=d"(hi) : : "memory");
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// Measure the TSC frequency against the PIT. 0 on success, -1 if the
+// CPU has no TSC (time then stands still).
+int time_init(const CpuInfo* cpu);
+
+uint64_t tsc_hz(void);
+
+// The TSC runs at a constant rate in all power states
+int tsc_invariant(void);
+
+// Nanoseconds since time_init()
+uint64_t ktime_ns(void);
+
+uint64_t cycles_to_ns(uint64_t cycles);
+uint64_t ns_to_cycles(uint64_t ns);
+
+// Busy wait
+void udelay(uint64_t us);
+
+// Periodic interrupts from PIT channel 0 on IRQ 0
+void pit_start_periodic(uint32_t hz);
+
+#endif
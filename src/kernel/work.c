@@ -0,0 +1,323 @@
+#include "work.h"
+#include "smp.h"
+#include "apic.h"
+#include "idt.h"
+#include "lock.h"
+#include "../include/memory/memory.h"
+#include "../include/memory/paging.h"
+
+#define DEQUE_MASK (WORK_DEQUE_SIZE - 1)
+
+_Static_assert((WORK_DEQUE_SIZE & DEQUE_MASK) == 0, "WORK_DEQUE_SIZE must be a power of two");
+
+typedef struct ParallelJob {
+    RangeFunc func;
+    void* arg;
+    uint64_t grain;
+    WorkItem* items;              // pool, slots come back once an item runs
+    uint32_t item_count;
+    volatile uint32_t item_next;  // where the next search starts
+    volatile uint64_t pending;    // elements not done yet
+} ParallelJob;
+
+static volatile uint32_t active_cpus = 1;
+
+// Work items running right now, GATE_CLOSED while a CPU unmaps memory
+#define GATE_CLOSED 0x80000000u
+static volatile uint32_t item_gate = 0;
+
+// Owner side. Several threads share the BSP's deque, so these also run
+// with interrupts off to keep a preempted owner from getting overtaken.
+static int deque_push(WorkDeque* deque, WorkItem* item) {
+    uint64_t flags = irq_save();
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+
+    if (bottom - top >= WORK_DEQUE_SIZE) {
+        irq_restore(flags);
+        return -1;
+    }
+
+    deque->items[bottom & DEQUE_MASK] = item;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    irq_restore(flags);
+    return 0;
+}
+
+static WorkItem* deque_pop(WorkDeque* deque) {
+    uint64_t flags = irq_save();
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+    WorkItem* item = NULL;
+    if (top <= bottom) {
+        item = deque->items[bottom & DEQUE_MASK];
+        if (top == bottom) {
+            // The last one, a thief may want it too
+            if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+                                             __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                item = NULL;
+            }
+            __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        }
+    } else {
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+
+    irq_restore(flags);
+    return item;
+}
+
+// Thief side, any CPU
+static WorkItem* deque_steal(WorkDeque* deque) {
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+    if (top >= bottom) {
+        return NULL;
+    }
+
+    WorkItem* item = deque->items[top & DEQUE_MASK];
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    return item;
+}
+
+static int deque_empty(WorkDeque* deque) {
+    return __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE) >=
+           __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+}
+
+static uint32_t next_random(Cpu* cpu) {
+    // xorshift64
+    uint64_t x = cpu->rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    cpu->rng = x;
+    return (uint32_t)(x >> 32);
+}
+
+// Our own newest piece first, then the oldest one of a random victim
+static WorkItem* find_work(Cpu* cpu) {
+    WorkItem* item = deque_pop(&cpu->deque);
+    if (item) {
+        return item;
+    }
+
+    uint32_t count = active_cpus;
+    if (count < 2) {
+        return NULL;
+    }
+
+    for (uint32_t tries = 0; tries < count; tries++) {
+        Cpu* victim = smp_cpu(next_random(cpu) % count);
+        if (!victim || victim == cpu) {
+            continue;
+        }
+        item = deque_steal(&victim->deque);
+        if (item) {
+            cpu->stats.steals++;
+            return item;
+        }
+        cpu->stats.steal_misses++;
+    }
+    return NULL;
+}
+
+static int work_available(void) {
+    for (uint32_t i = 0; i < active_cpus; i++) {
+        Cpu* cpu = smp_cpu(i);
+        if (cpu && !deque_empty(&cpu->deque)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// A free slot of the pool, NULL when all are in deques or not yet read.
+// Callers then keep the whole range, so running out only costs
+// parallelism.
+static WorkItem* job_item(ParallelJob* job, uint64_t start, uint64_t end) {
+    uint32_t first = __atomic_fetch_add(&job->item_next, 1, __ATOMIC_RELAXED);
+
+    for (uint32_t i = 0; i < job->item_count; i++) {
+        WorkItem* item = &job->items[(first + i) % job->item_count];
+        uint32_t free = 0;
+        if (!__atomic_load_n(&item->used, __ATOMIC_RELAXED) &&
+            __atomic_compare_exchange_n(&item->used, &free, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            item->job = job;
+            item->start = start;
+            item->end = end;
+            return item;
+        }
+    }
+    return NULL;
+}
+
+static void gate_enter(void) {
+    for (;;) {
+        uint32_t gate = __atomic_load_n(&item_gate, __ATOMIC_RELAXED);
+        if (!(gate & GATE_CLOSED) &&
+            __atomic_compare_exchange_n(&item_gate, &gate, gate + 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return;
+        }
+        cpu_relax();
+    }
+}
+
+static void gate_leave(void) {
+    __atomic_sub_fetch(&item_gate, 1, __ATOMIC_RELEASE);
+}
+
+int work_quiesce(void) {
+    uint32_t open = 0;
+    return __atomic_compare_exchange_n(&item_gate, &open, GATE_CLOSED, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ? 0 : -1;
+}
+
+void work_resume(void) {
+    __atomic_store_n(&item_gate, 0, __ATOMIC_RELEASE);
+}
+
+static void run_item(Cpu* cpu, WorkItem* item) {
+    // There are no TLB shootdowns: unmaps only happen while no item runs
+    // (work_quiesce()) and flush the unmapping CPU's TLB, the others
+    // flush here before they touch memory again
+    gate_enter();
+    uint64_t generation = paging_tlb_generation();
+    if (cpu->tlb_generation != generation) {
+        paging_flush_tlb();
+        cpu->tlb_generation = generation;
+    }
+
+    ParallelJob* job = item->job;
+    uint64_t start = item->start;
+    uint64_t end = item->end;
+    __atomic_store_n(&item->used, 0, __ATOMIC_RELEASE);
+
+    // Leave the upper half for others until the piece is small enough
+    while (end - start > job->grain) {
+        uint64_t mid = start + (end - start) / 2;
+        WorkItem* half = job_item(job, mid, end);
+        if (!half || deque_push(&cpu->deque, half) != 0) {
+            break;
+        }
+        end = mid;
+    }
+
+    job->func(start, end, job->arg);
+    cpu->stats.items++;
+    gate_leave();
+
+    __atomic_sub_fetch(&job->pending, end - start, __ATOMIC_RELEASE);
+}
+
+void parallel_for(uint64_t start, uint64_t end, uint64_t grain, RangeFunc func, void* arg) {
+    if (start >= end) {
+        return;
+    }
+    if (grain == 0) {
+        grain = 1;
+    }
+
+    uint64_t pieces = (end - start + grain - 1) / grain;
+    if (pieces == 1 || active_cpus < 2) {
+        func(start, end, arg);
+        return;
+    }
+
+    // Halving keeps at most one waiting piece per size on a CPU's deque,
+    // so a few per CPU and level cover the whole split tree
+    uint32_t levels = 64 - __builtin_clzll(pieces);
+    uint32_t count = active_cpus * (levels + 1);
+
+    ParallelJob job = {
+        .func = func,
+        .arg = arg,
+        .grain = grain,
+        .items = (WorkItem*)kmalloc(count * sizeof(WorkItem)),
+        .item_count = count,
+        .item_next = 0,
+        .pending = end - start,
+    };
+    if (!job.items) {
+        func(start, end, arg);
+        return;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        job.items[i].used = 0;
+    }
+
+    Cpu* cpu = this_cpu();
+    WorkItem* root = job_item(&job, start, end);
+    if (deque_push(&cpu->deque, root) != 0) {
+        run_item(cpu, root);
+    } else {
+        lapic_send_ipi_others(IPI_WAKE_VECTOR);
+    }
+
+    // Help until every piece is done, the job lives on this stack
+    while (__atomic_load_n(&job.pending, __ATOMIC_ACQUIRE)) {
+        WorkItem* item = find_work(cpu);
+        if (item) {
+            run_item(cpu, item);
+        } else {
+            cpu_relax();
+        }
+    }
+
+    kfree(job.items);
+}
+
+void work_set_cpus(uint32_t count) {
+    uint32_t online = smp_cpu_count();
+    if (count < 1) {
+        count = 1;
+    }
+    if (count > online) {
+        count = online;
+    }
+    active_cpus = count;
+}
+
+uint32_t work_get_cpus(void) {
+    return active_cpus;
+}
+
+void work_worker(Cpu* cpu) {
+    uint32_t idle = 0;
+
+    while (1) {
+        WorkItem* item = cpu->index < active_cpus ? find_work(cpu) : NULL;
+        if (item) {
+            run_item(cpu, item);
+            idle = 0;
+            continue;
+        }
+
+        if (++idle < WORK_SPIN_ROUNDS) {
+            cpu_relax();
+            continue;
+        }
+
+        // Nothing for a while: halt until the next wake IPI. The check
+        // runs with interrupts off, an IPI sent after it still ends the hlt.
+        idle = 0;
+        interrupts_disable();
+        if (work_available() && cpu->index < active_cpus) {
+            interrupts_enable();
+            continue;
+        }
+        cpu->stats.sleeps++;
+        cpu_idle();
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef WORK_H
+#define WORK_H
+
+#include <stdint.h>
+
+// Fork-join work pool. Every CPU owns a deque of work items: it pushes
+// and pops at the bottom, idle CPUs steal from the top of a random other
+// one (Chase-Lev). Ranges are split in halves until a piece is small
+// enough, so the big pieces are the ones that get stolen.
+
+#define WORK_DEQUE_SIZE   256      // items per CPU, a power of two
+#define WORK_SPIN_ROUNDS  20000    // looks for work before an idle AP halts
+
+typedef void (*RangeFunc)(uint64_t start, uint64_t end, void* arg);
+
+struct ParallelJob;
+
+typedef struct {
+    struct ParallelJob* job;
+    uint64_t start;
+    uint64_t end;
+    volatile uint32_t used;       // handed out, until its runner read it
+} WorkItem;
+
+typedef struct {
+    // owner and thieves write different ends, keep them on their own lines
+    volatile int64_t top __attribute__((aligned(64)));
+    volatile int64_t bottom __attribute__((aligned(64)));
+    WorkItem* volatile items[WORK_DEQUE_SIZE] __attribute__((aligned(64)));
+} WorkDeque;
+
+typedef struct {
+    uint64_t items;               // pieces run on this CPU
+    uint64_t steals;              // pieces taken from another CPU
+    uint64_t steal_misses;        // victims that had nothing
+    uint64_t sleeps;              // times an AP halted for lack of work
+} WorkStats;
+
+struct Cpu;
+
+// Call func on pieces of [start, end) no bigger than grain, spread over
+// the CPUs, and return once all of them are done. func runs on any CPU
+// with interrupts on and must not sleep, yield or touch the scheduler.
+void parallel_for(uint64_t start, uint64_t end, uint64_t grain, RangeFunc func, void* arg);
+
+// Use only the first count CPUs (at least the BSP), for scaling tests
+void work_set_cpus(uint32_t count);
+uint32_t work_get_cpus(void);
+
+// Unmapping memory is only safe while no CPU runs a work item: the
+// others flush their TLB when they start the next one. Closes the gate
+// for new items and returns 0 if none is running, -1 (nothing changed)
+// otherwise, it never waits. work_resume() opens it again.
+int work_quiesce(void);
+void work_resume(void);
+
+// Where an application processor spends its life
+void work_worker(struct Cpu* cpu) __attribute__((noreturn));
+
+#endif
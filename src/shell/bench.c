@@ -0,0 +1,455 @@
+#include "bench.h"
+#include "../kernel/time.h"
+#include "../kernel/sched.h"
+#include "../kernel/smp.h"
+#include "../include/text/text_utils.h"
+#include "../include/memory/memory.h"
+#include "../include/lib/string.h"
+
+#define PRINT_LINE "The quick brown fox jumps over the lazy dog 0123456789 ABCDEFGH"
+
+typedef struct {
+    const char* name;
+    const char* help;
+    uint32_t iterations;
+    int (*setup)(void);       // optional, 0 on success
+    void (*step)(void);       // the timed part
+    void (*teardown)(void);   // optional
+} Benchmark;
+
+// State shared by setup, step and teardown
+static void* volatile sink;
+static uint8_t* copy_src = NULL;
+static uint8_t* copy_dst = NULL;
+static int print_row = 0;
+static ConsoleMirror saved_mirror = NULL;
+static volatile int partner_stop = 0;
+static volatile int partner_done = 0;
+
+static void step_kmalloc(void) {
+    sink = kmalloc(64);
+    kfree(sink);
+}
+
+static void step_kmalloc_page(void) {
+    sink = kmalloc(4096);
+    kfree(sink);
+}
+
+static int setup_memcpy(void) {
+    copy_src = (uint8_t*)kmalloc(4096);
+    copy_dst = (uint8_t*)kmalloc(4096);
+    if (!copy_src || !copy_dst) {
+        kfree(copy_src);
+        kfree(copy_dst);
+        return -1;
+    }
+    memset(copy_src, 0x5A, 4096);
+    return 0;
+}
+
+static void step_memcpy(void) {
+    memcpy(copy_dst, copy_src, 4096);
+}
+
+static void teardown_memcpy(void) {
+    kfree(copy_src);
+    kfree(copy_dst);
+}
+
+// Console benchmarks would flood the serial port and time it instead
+static int setup_console(void) {
+    saved_mirror = console_get_mirror();
+    console_set_mirror(NULL);
+    print_row = get_cursor_row();
+    return 0;
+}
+
+static void teardown_console(void) {
+    print("\n", COLOR_DEFAULT);
+    console_set_mirror(saved_mirror);
+}
+
+// One line of text redrawn in place, no scrolling
+static void step_print(void) {
+    set_cursor_position(print_row, 0);
+    print(PRINT_LINE, COLOR_DEFAULT);
+}
+
+// A new line on the last row: the ring scrolls and every row is redrawn
+static void step_scroll(void) {
+    set_cursor_position(get_console_rows() - 1, 0);
+    putchar('\n', COLOR_DEFAULT);
+}
+
+// The partner only yields back, so every step is two context switches
+static void yield_partner(void* arg) {
+    (void)arg;
+    while (!partner_stop) {
+        thread_yield();
+    }
+    partner_done = 1;
+}
+
+static int setup_yield(void) {
+    partner_stop = 0;
+    partner_done = 0;
+    if (!thread_create("bench-yield", yield_partner, NULL, thread_current()->priority)) {
+        return -1;
+    }
+    return 0;
+}
+
+static void step_yield(void) {
+    thread_yield();
+}
+
+static void teardown_yield(void) {
+    partner_stop = 1;
+    while (!partner_done) {
+        thread_yield();
+    }
+}
+
+static const Benchmark benchmarks[] = {
+    { "kmalloc",   "kmalloc(64) + kfree",             10000, NULL,          step_kmalloc,      NULL },
+    { "kmalloc4k", "kmalloc(4096) + kfree",           10000, NULL,          step_kmalloc_page, NULL },
+    { "memcpy4k",  "memcpy of 4 KB",                  10000, setup_memcpy,  step_memcpy,       teardown_memcpy },
+    { "print",     "print() of a 64 character line",   1000, setup_console, step_print,        teardown_console },
+    { "scroll",    "scroll_up() and full redraw",       500, setup_console, step_scroll,       teardown_console },
+    { "yield",     "yield to another thread and back", 10000, setup_yield,   step_yield,        teardown_yield },
+};
+
+#define BENCH_COUNT (int)(sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+int bench_count(void) {
+    return BENCH_COUNT;
+}
+
+const char* bench_name(int index) {
+    return index >= 0 && index < BENCH_COUNT ? benchmarks[index].name : NULL;
+}
+
+const char* bench_help(int index) {
+    return index >= 0 && index < BENCH_COUNT ? benchmarks[index].help : NULL;
+}
+
+static void sort_samples(uint64_t* samples, uint32_t count) {
+    // Shell sort with the Ciura gaps, plenty for a few thousand samples
+    static const uint32_t gaps[] = { 701, 301, 132, 57, 23, 10, 4, 1 };
+
+    for (uint32_t g = 0; g < sizeof(gaps) / sizeof(gaps[0]); g++) {
+        uint32_t gap = gaps[g];
+        for (uint32_t i = gap; i < count; i++) {
+            uint64_t value = samples[i];
+            uint32_t j = i;
+            while (j >= gap && samples[j - gap] > value) {
+                samples[j] = samples[j - gap];
+                j -= gap;
+            }
+            samples[j] = value;
+        }
+    }
+}
+
+// Cost of the two TSC reads around every sample
+static uint64_t timer_overhead(void) {
+    uint64_t best = ~0ULL;
+    for (int i = 0; i < 64; i++) {
+        uint64_t start = tsc_read_ordered();
+        uint64_t cycles = tsc_read_ordered() - start;
+        if (cycles < best) {
+            best = cycles;
+        }
+    }
+    return best;
+}
+
+static void print_column(uint64_t value, int width, unsigned char color) {
+    int digits = 1;
+    for (uint64_t v = value; v >= 10; v /= 10) {
+        digits++;
+    }
+    while (digits++ < width) {
+        putchar(' ', COLOR_DEFAULT);
+    }
+    print_dec(value, color);
+}
+
+void bench_print_header(void) {
+    print("name         iters       min    median       p99  (ns)\n", 0x0B);
+}
+
+int bench_run(const char* name, uint32_t iterations) {
+    const Benchmark* bench = NULL;
+    for (int i = 0; i < BENCH_COUNT; i++) {
+        if (strcmp(benchmarks[i].name, name) == 0) {
+            bench = &benchmarks[i];
+            break;
+        }
+    }
+    if (!bench) {
+        return -1;
+    }
+
+    if (!tsc_hz()) {
+        print("No TSC, nothing to measure with\n", 0x0C);
+        return 0;
+    }
+
+    if (iterations == 0) {
+        iterations = bench->iterations;
+    }
+    if (iterations > BENCH_MAX_ITERATIONS) {
+        iterations = BENCH_MAX_ITERATIONS;
+    }
+
+    uint64_t* samples = (uint64_t*)kmalloc(iterations * sizeof(uint64_t));
+    if (!samples) {
+        print("Not enough memory for the samples\n", 0x0C);
+        return 0;
+    }
+    if (bench->setup && bench->setup() != 0) {
+        print(bench->name, 0x0C);
+        print(": setup failed\n", 0x0C);
+        kfree(samples);
+        return 0;
+    }
+
+    uint64_t overhead = timer_overhead();
+
+    for (uint32_t i = 0; i < iterations; i++) {
+        uint64_t start = tsc_read_ordered();
+        bench->step();
+        uint64_t cycles = tsc_read_ordered() - start;
+        samples[i] = cycles > overhead ? cycles - overhead : 0;
+    }
+
+    if (bench->teardown) {
+        bench->teardown();
+    }
+
+    sort_samples(samples, iterations);
+    uint64_t min = samples[0];
+    uint64_t median = samples[iterations / 2];
+    uint64_t p99 = samples[(uint64_t)iterations * 99 / 100];
+
+    int len = strlen(bench->name);
+    print(bench->name, 0x0B);
+    while (len++ < 10) {
+        putchar(' ', COLOR_DEFAULT);
+    }
+    print_column(iterations, 8, COLOR_DEFAULT);
+    print_column(cycles_to_ns(min), 10, 0x0A);
+    print_column(cycles_to_ns(median), 10, 0x0A);
+    print_column(cycles_to_ns(p99), 10, 0x0E);
+    print("\n", COLOR_DEFAULT);
+
+    kfree(samples);
+    return 0;
+}
+
+// Parallel benchmarks: the same amount of work on 1, 2, ... CPUs
+typedef struct {
+    const char* name;
+    const char* help;
+    uint32_t param;                       // default for the optional argument
+    const char* unit;                     // of the rate column
+    uint64_t rate_scale;                  // work * rate_scale / ns gives the rate
+    int (*setup)(uint32_t param);         // 0 on success
+    void (*run)(void);                    // the timed part, calls parallel_for()
+    int (*check)(void);                   // optional, 0 if the result is right
+    void (*teardown)(void);
+} ParallelBenchmark;
+
+#define PARALLEL_RUNS 3
+
+static uint64_t parallel_work = 0;        // bytes or operations per run
+
+// sum: add up a buffer, memory bandwidth bound
+#define SUM_GRAIN 16384                   // words per piece, 128 KB
+
+static uint64_t* sum_data = NULL;
+static uint64_t sum_words = 0;
+static volatile uint64_t sum_total = 0;
+
+static void sum_range(uint64_t start, uint64_t end, void* arg) {
+    (void)arg;
+    uint64_t sum = 0;
+    for (uint64_t i = start; i < end; i++) {
+        sum += sum_data[i];
+    }
+    __atomic_fetch_add(&sum_total, sum, __ATOMIC_RELAXED);
+}
+
+static int setup_sum(uint32_t megabytes) {
+    // kmalloc() takes 32 bit sizes
+    if (megabytes > 1024) {
+        return -1;
+    }
+    sum_words = (uint64_t)megabytes * 1024 * 1024 / sizeof(uint64_t);
+    sum_data = (uint64_t*)kmalloc(sum_words * sizeof(uint64_t));
+    if (!sum_data) {
+        return -1;
+    }
+    for (uint64_t i = 0; i < sum_words; i++) {
+        sum_data[i] = i;
+    }
+    parallel_work = sum_words * sizeof(uint64_t);
+    return 0;
+}
+
+static void run_sum(void) {
+    sum_total = 0;
+    parallel_for(0, sum_words, SUM_GRAIN, sum_range, NULL);
+}
+
+static int check_sum(void) {
+    return sum_total == sum_words * (sum_words - 1) / 2 ? 0 : -1;
+}
+
+static void teardown_sum(void) {
+    kfree(sum_data);
+}
+
+// kmalloc: small allocations freed in batches, the heap lock bound part
+// is what the per-CPU magazines take away
+#define ALLOC_PIECES  64
+#define ALLOC_BATCH   16
+
+static uint32_t alloc_rounds = 0;         // batches per piece
+static volatile uint32_t alloc_failures = 0;
+
+static void alloc_range(uint64_t start, uint64_t end, void* arg) {
+    (void)arg;
+    void* ptrs[ALLOC_BATCH];
+
+    for (uint64_t piece = start; piece < end; piece++) {
+        for (uint32_t round = 0; round < alloc_rounds; round++) {
+            for (int i = 0; i < ALLOC_BATCH; i++) {
+                ptrs[i] = kmalloc(32 + (i & 7) * 16);
+            }
+            for (int i = 0; i < ALLOC_BATCH; i++) {
+                if (!ptrs[i]) {
+                    __atomic_fetch_add(&alloc_failures, 1, __ATOMIC_RELAXED);
+                }
+                kfree(ptrs[i]);
+            }
+        }
+    }
+}
+
+static int setup_alloc(uint32_t thousands) {
+    alloc_rounds = (thousands * 1000 + ALLOC_PIECES * ALLOC_BATCH - 1) / (ALLOC_PIECES * ALLOC_BATCH);
+    alloc_failures = 0;
+    parallel_work = (uint64_t)alloc_rounds * ALLOC_PIECES * ALLOC_BATCH;
+    return 0;
+}
+
+static void run_alloc(void) {
+    parallel_for(0, ALLOC_PIECES, 1, alloc_range, NULL);
+}
+
+static int check_alloc(void) {
+    return alloc_failures ? -1 : 0;
+}
+
+static const ParallelBenchmark parallel_benchmarks[] = {
+    { "sum",     "sum of a buffer, size in MB",               32,   "MB/s",   1000,    setup_sum,   run_sum,   check_sum,   teardown_sum },
+    { "kmalloc", "kmalloc + kfree of 32-144 bytes, thousands", 1000, "Kops/s", 1000000, setup_alloc, run_alloc, check_alloc, NULL },
+};
+
+#define PARALLEL_COUNT (int)(sizeof(parallel_benchmarks) / sizeof(parallel_benchmarks[0]))
+
+int parallel_bench_count(void) {
+    return PARALLEL_COUNT;
+}
+
+const char* parallel_bench_name(int index) {
+    return index >= 0 && index < PARALLEL_COUNT ? parallel_benchmarks[index].name : NULL;
+}
+
+const char* parallel_bench_help(int index) {
+    return index >= 0 && index < PARALLEL_COUNT ? parallel_benchmarks[index].help : NULL;
+}
+
+int bench_parallel(const char* name, uint32_t param) {
+    const ParallelBenchmark* bench = NULL;
+    for (int i = 0; i < PARALLEL_COUNT; i++) {
+        if (strcmp(parallel_benchmarks[i].name, name) == 0) {
+            bench = &parallel_benchmarks[i];
+            break;
+        }
+    }
+    if (!bench) {
+        return -1;
+    }
+
+    if (!tsc_hz()) {
+        print("No TSC, nothing to measure with\n", 0x0C);
+        return 0;
+    }
+
+    if (bench->setup(param ? param : bench->param) != 0) {
+        print(bench->name, 0x0C);
+        print(": setup failed\n", 0x0C);
+        return 0;
+    }
+
+    uint32_t online = smp_cpu_count();
+    uint32_t saved = work_get_cpus();
+    uint64_t base_ns = 0;
+
+    print("cpus   best us", 0x0B);
+    int len = strlen(bench->unit);
+    while (len++ < 10) {
+        putchar(' ', 0x0B);
+    }
+    print(bench->unit, 0x0B);
+    print("     speedup\n", 0x0B);
+
+    for (uint32_t cpus = 1; cpus <= online; cpus++) {
+        work_set_cpus(cpus);
+
+        // Best of a few runs, the first one also warms up caches and TLBs
+        uint64_t best = ~0ULL;
+        for (int run = 0; run < PARALLEL_RUNS; run++) {
+            uint64_t start = ktime_ns();
+            bench->run();
+            uint64_t ns = ktime_ns() - start;
+            if (ns < best) {
+                best = ns;
+            }
+        }
+        if (bench->check && bench->check() != 0) {
+            print("wrong result with ", 0x0C);
+            print_dec(cpus, 0x0C);
+            print(" CPUs\n", 0x0C);
+            break;
+        }
+        if (best == 0) {
+            best = 1;
+        }
+        if (cpus == 1) {
+            base_ns = best;
+        }
+
+        uint64_t speedup = base_ns * 100 / best;
+        print_column(cpus, 4, 0x0B);
+        print_column(best / 1000, 10, 0x0A);
+        print_column(parallel_work * bench->rate_scale / best, 10, 0x0A);
+        print_column(speedup / 100, 8, 0x0E);
+        putchar('.', 0x0E);
+        if (speedup % 100 < 10) {
+            putchar('0', 0x0E);
+        }
+        print_dec(speedup % 100, 0x0E);
+        print("x\n", 0x0E);
+    }
+
+    work_set_cpus(saved);
+    if (bench->teardown) {
+        bench->teardown();
+    }
+    return 0;
+}
@@ -0,0 +1,32 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+
+// Micro-benchmarks for the bench command. Every iteration is timed
+// with the TSC on its own and min / median / p99 are reported.
+
+#define BENCH_MAX_ITERATIONS 10000
+
+int bench_count(void);
+const char* bench_name(int index);
+const char* bench_help(int index);
+
+// Run a benchmark and print its line, 0 iterations uses its default.
+// -1 if there is no benchmark with that name.
+int bench_run(const char* name, uint32_t iterations);
+
+// Column titles for the lines printed by bench_run()
+void bench_print_header(void);
+
+// Parallel benchmarks for the parbench command. The same work is run
+// with parallel_for() on 1, 2, ... CPUs, each line shows the best time
+// and the speedup over one CPU.
+int parallel_bench_count(void);
+const char* parallel_bench_name(int index);
+const char* parallel_bench_help(int index);
+
+// 0 uses the benchmark's default size. -1 if there is no such benchmark.
+int bench_parallel(const char* name, uint32_t param);
+
+#endif
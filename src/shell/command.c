@@ -0,0 +1,156 @@
+#include "command.h"
+#include "../include/text/text_utils.h"
+#include "../include/lib/string.h"
+#include "../kernel/lock.h"
+#include <stdint.h>
+
+#define COMMAND_MASK (COMMAND_MAX - 1)
+#define HELP_NAME_WIDTH 9
+
+_Static_assert((COMMAND_MAX & COMMAND_MASK) == 0, "COMMAND_MAX must be a power of two");
+
+// Open addressing with linear probing, the table is at most full
+static const ShellCommand* table[COMMAND_MAX];
+
+// Registration order, for help and completion
+static const ShellCommand* commands[COMMAND_MAX];
+static int command_count = 0;
+
+// Lookups from every shell, registration is rare
+static LockStats command_lock_stats = LOCK_STATS_INIT("commands");
+static RwLock command_lock = RW_LOCK_INIT(&command_lock_stats);
+
+// FNV-1a over the first len characters
+static uint32_t command_hash(const char* name, int len) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int is_space(char c) {
+    return c == ' ' || c == '\t';
+}
+
+int command_register(const ShellCommand* command) {
+    if (!command || !command->name || !command->handler) {
+        return -1;
+    }
+
+    uint64_t flags = write_lock_irqsave(&command_lock);
+    if (command_count == COMMAND_MAX) {
+        write_unlock_irqrestore(&command_lock, flags);
+        print("command: table full, dropping ", 0x0C);
+        print(command->name, 0x0C);
+        print("\n", COLOR_DEFAULT);
+        return -1;
+    }
+
+    uint32_t slot = command_hash(command->name, strlen(command->name)) & COMMAND_MASK;
+    while (table[slot]) {
+        if (strcmp(table[slot]->name, command->name) == 0) {
+            write_unlock_irqrestore(&command_lock, flags);
+            return -1;
+        }
+        slot = (slot + 1) & COMMAND_MASK;
+    }
+
+    table[slot] = command;
+    commands[command_count++] = command;
+    write_unlock_irqrestore(&command_lock, flags);
+    return 0;
+}
+
+const ShellCommand* command_find(const char* name) {
+    uint32_t slot = command_hash(name, strlen(name)) & COMMAND_MASK;
+    const ShellCommand* found = NULL;
+    uint64_t flags = read_lock_irqsave(&command_lock);
+
+    // An empty slot ends the probe, commands are never removed
+    for (int probes = 0; probes < COMMAND_MAX && table[slot]; probes++) {
+        if (strcmp(table[slot]->name, name) == 0) {
+            found = table[slot];
+            break;
+        }
+        slot = (slot + 1) & COMMAND_MASK;
+    }
+
+    read_unlock_irqrestore(&command_lock, flags);
+    return found;
+}
+
+int command_tokenize(char* line, char** argv, int max_args) {
+    int argc = 0;
+
+    while (*line) {
+        while (is_space(*line)) {
+            *line++ = '\0';
+        }
+        if (!*line) {
+            break;
+        }
+        if (argc == max_args) {
+            break;
+        }
+
+        argv[argc++] = line;
+        while (*line && !is_space(*line)) {
+            line++;
+        }
+    }
+    return argc;
+}
+
+int command_execute(char* line) {
+    char* argv[COMMAND_MAX_ARGS];
+    int argc = command_tokenize(line, argv, COMMAND_MAX_ARGS);
+
+    if (argc == 0) {
+        return 0;
+    }
+
+    const ShellCommand* command = command_find(argv[0]);
+    if (!command) {
+        return -1;
+    }
+
+    command->handler(argc, argv);
+    return 0;
+}
+
+void command_print_help(void) {
+    // Entries below the count never change, only the count needs the lock
+    uint64_t flags = read_lock_irqsave(&command_lock);
+    int count = command_count;
+    read_unlock_irqrestore(&command_lock, flags);
+
+    for (int i = 0; i < count; i++) {
+        int len = strlen(commands[i]->name);
+        print("  ", 0x07);
+        print(commands[i]->name, 0x07);
+        while (len++ < HELP_NAME_WIDTH) {
+            putchar(' ', 0x07);
+        }
+        print("- ", 0x07);
+        print(commands[i]->help ? commands[i]->help : "", 0x07);
+        print("\n", 0x07);
+    }
+}
+
+const ShellCommand* command_next_match(const char* prefix, int len, int* index) {
+    const ShellCommand* found = NULL;
+    uint64_t flags = read_lock_irqsave(&command_lock);
+
+    while (*index < command_count) {
+        const ShellCommand* command = commands[(*index)++];
+        if (strncmp(command->name, prefix, len) == 0) {
+            found = command;
+            break;
+        }
+    }
+
+    read_unlock_irqrestore(&command_lock, flags);
+    return found;
+}
@@ -0,0 +1,38 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+
+// Shell command registry. Commands are looked up by a hash of their
+// name, help and Tab completion walk them in registration order.
+
+#define COMMAND_MAX 64           // power of two, size of the hash table
+#define COMMAND_MAX_ARGS 16
+
+// argv[0] is the command name, the strings live in the command line
+typedef void (*CommandHandler)(int argc, char** argv);
+
+typedef struct {
+    const char* name;
+    CommandHandler handler;
+    const char* help;
+} ShellCommand;
+
+// Register a command, the struct must stay valid. 0 on success, -1 if
+// the name is taken or the table is full.
+int command_register(const ShellCommand* command);
+
+const ShellCommand* command_find(const char* name);
+
+// Split line into words in place, returns the number of words
+int command_tokenize(char* line, char** argv, int max_args);
+
+// Tokenize and run a command line, 0 if the command was found
+int command_execute(char* line);
+
+// Print every command with its help text
+void command_print_help(void);
+
+// Iterate over commands starting with prefix: index is the position to
+// continue from, 0 for the first call. NULL when there are no more.
+const ShellCommand* command_next_match(const char* prefix, int len, int* index);
+
+#endif
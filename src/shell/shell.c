@@ -1,24 +1,165 @@
 #include "../include/text/text_utils.h"
 #include "../drivers/keyboard/keyboard.h"
+#include "../drivers/serial/serial.h"
+#include "../drivers/disk/disk_driver.h"
+#include "../drivers/disk/virtio_blk.h"
+#include "../drivers/block/block.h"
+#include "../drivers/block/bcache.h"
+#include "../file_system/emexfs/emexfs.h"
+#include "../kernel/sched.h"
+#include "../kernel/time.h"
+#include "../kernel/smp.h"
+#include "../kernel/lock.h"
 #include "../include/text/string_utils.h"
 #include "../include/memory/memory.h"
+#include "../include/memory/slab.h"
+#include "../include/memory/pmm.h"
+#include "../include/lib/string.h"
 #include "../include/boot.h"
+#include "command.h"
+#include "bench.h"
 #include <stdbool.h>
 
 #define COMMAND_BUFFER_SIZE 256
+#define KEY_BATCH_SIZE 16
 
 static char command_buffer[COMMAND_BUFFER_SIZE];
 static int buffer_pos = 0;
 static int prompt_start_row = 0;
 static int prompt_start_col = 0;
 
-static void process_command(const char* command);
-static void command_help(void);
-static void command_clear(void);
-static void command_echo(const char* args);
-static void command_keytest(void);
-static void command_meminfo(void);
-static void command_memtest(void);
+// Keys drained from the keyboard ring but not handled yet
+static char key_batch[KEY_BATCH_SIZE];
+static int key_batch_pos = 0;
+static int key_batch_len = 0;
+
+static void process_command(char* command);
+static void command_help(int argc, char** argv);
+static void command_clear(int argc, char** argv);
+static void command_echo(int argc, char** argv);
+static void command_keytest(int argc, char** argv);
+static void command_meminfo(int argc, char** argv);
+static void command_heapmap(int argc, char** argv);
+static void command_slabinfo(int argc, char** argv);
+static void command_memtest(int argc, char** argv);
+static void command_membench(int argc, char** argv);
+static void command_serial(int argc, char** argv);
+static void command_bench(int argc, char** argv);
+static void command_ps(int argc, char** argv);
+static void command_smp(int argc, char** argv);
+static void command_parbench(int argc, char** argv);
+static void command_locks(int argc, char** argv);
+static void command_disk(int argc, char** argv);
+static void command_iostat(int argc, char** argv);
+static void command_cache(int argc, char** argv);
+static void command_fs(int argc, char** argv);
+
+// Built-in commands, help lists them in this order
+static const ShellCommand builtin_commands[] = {
+    { "help",     command_help,     "Show this help message" },
+    { "clear",    command_clear,    "Clear the screen" },
+    { "echo",     command_echo,     "Echo text to screen" },
+    { "keytest",  command_keytest,  "Test keyboard input" },
+    { "meminfo",  command_meminfo,  "Show memory information" },
+    { "heapmap",  command_heapmap,  "Show heap fragmentation report" },
+    { "slabinfo", command_slabinfo, "Show object cache statistics" },
+    { "memtest",  command_memtest,  "Run memory allocation test, 'memtest <rounds> &' in the background" },
+    { "membench", command_membench, "Measure memcpy/memset throughput" },
+    { "bench",    command_bench,    "Run micro-benchmarks, 'bench' lists them" },
+    { "ps",       command_ps,       "Show threads and context switch times" },
+    { "smp",      command_smp,      "Show the CPUs and their work queue statistics" },
+    { "parbench", command_parbench, "Scaling over 1..N CPUs, 'parbench' lists the benchmarks" },
+    { "locks",    command_locks,    "Lock contention counters, 'locks reset' zeroes them" },
+    { "serial",   command_serial,   "COM1 statistics, 'serial mirror on|off'" },
+    { "disk",     command_disk,     "ATA and virtio disks, 'disk bench [drive|vdN] [MB] [pio]' reads sequentially" },
+    { "iostat",   command_iostat,   "Block layer queues, 'iostat reset', 'iostat bench [dev] [MB]' reads 4 KB bios" },
+    { "cache",    command_cache,    "Buffer cache, 'cache sync|drop|reset', 'cache bench [dev] [MB]' reads twice" },
+    { "fs",       command_fs,       "emexFS, 'fs mount <dev>|umount|sync', 'fs ls|cat|mkdir|rm <path>', 'fs append <path> <text>'" },
+};
+
+// Next key, refilling the batch from the keyboard ring when it runs dry.
+// Page Up/Down scroll the console here and never reach the caller.
+static char shell_next_key(void) {
+    while (true) {
+        if (key_batch_pos == key_batch_len) {
+            // The whole batch is handled, move the cursor once before sleeping
+            update_cursor(get_cursor_row(), get_cursor_col());
+            keyboard_wait();
+            key_batch_len = keyboard_read_keys(key_batch, KEY_BATCH_SIZE);
+            key_batch_pos = 0;
+        }
+
+        char key = key_batch[key_batch_pos++];
+        if (key == KEYCODE_PAGE_UP) {
+            console_page_up();
+        } else if (key == KEYCODE_PAGE_DOWN) {
+            console_page_down();
+        } else {
+            return key;
+        }
+    }
+}
+
+// Add a character to the command line and echo it
+static void shell_insert(char key) {
+    if (buffer_pos < COMMAND_BUFFER_SIZE - 1) {
+        command_buffer[buffer_pos] = key;
+        buffer_pos++;
+        putchar(key, COLOR_DEFAULT);
+    }
+}
+
+// Tab: complete the command name as far as it is unambiguous, list the
+// candidates when it can't be extended
+static void shell_complete(void) {
+    for (int i = 0; i < buffer_pos; i++) {
+        if (command_buffer[i] == ' ') {
+            return;  // only the command name is completed
+        }
+    }
+
+    int index = 0;
+    const ShellCommand* first = command_next_match(command_buffer, buffer_pos, &index);
+    if (!first) {
+        return;
+    }
+
+    // Longest prefix shared by all matches
+    int common = strlen(first->name);
+    int matches = 1;
+    const ShellCommand* command;
+    while ((command = command_next_match(command_buffer, buffer_pos, &index))) {
+        int i = buffer_pos;
+        while (i < common && command->name[i] == first->name[i]) {
+            i++;
+        }
+        common = i;
+        matches++;
+    }
+
+    if (common > buffer_pos || matches == 1) {
+        for (int i = buffer_pos; i < common; i++) {
+            shell_insert(first->name[i]);
+        }
+        if (matches == 1) {
+            shell_insert(' ');
+        }
+        return;
+    }
+
+    print("\n", COLOR_DEFAULT);
+    index = 0;
+    while ((command = command_next_match(command_buffer, buffer_pos, &index))) {
+        print(command->name, 0x0B);
+        print("  ", COLOR_DEFAULT);
+    }
+    print("\n> ", 0x0F);
+
+    prompt_start_row = get_cursor_row();
+    prompt_start_col = get_cursor_col();
+    command_buffer[buffer_pos] = '\0';
+    print(command_buffer, COLOR_DEFAULT);
+}
 
 void shell() {
     print("emexOS3 beta ", 0x0E);
@@ -27,6 +168,10 @@ void shell() {
     // Initialize memory manager
     memory_init();
 
+    for (unsigned i = 0; i < sizeof(builtin_commands) / sizeof(builtin_commands[0]); i++) {
+        command_register(&builtin_commands[i]);
+    }
+
 
     // Enable cursor for shell input (nice blinking cursor)
     enable_cursor(14, 15);
@@ -38,144 +183,181 @@ void shell() {
         prompt_start_row = get_cursor_row();
         prompt_start_col = get_cursor_col();
 
-        // Update hardware cursor position
-        update_cursor(prompt_start_row, prompt_start_col);
-
         // Read command
         buffer_pos = 0;
         command_buffer[0] = '\0';
 
         while (true) {
-            if (keyboard_has_key()) {
-                char key = keyboard_get_key();
+            // Sleep until the keyboard IRQ delivers keys
+            char key = shell_next_key();
+
+            if (key == '\n') {
+                // Enter pressed - execute command
+                putchar('\n', COLOR_DEFAULT);
+                command_buffer[buffer_pos] = '\0';
+
+                if (buffer_pos > 0) {
+                    process_command(command_buffer);
+                }
+                break;
 
-                if (key == '\n') {
-                    // Enter pressed - execute command
-                    putchar('\n', COLOR_DEFAULT);
+            } else if (key == '\b') {
+                // Backspace pressed
+                if (buffer_pos > 0) {
+                    buffer_pos--;
                     command_buffer[buffer_pos] = '\0';
 
-                    if (buffer_pos > 0) {
-                        process_command(command_buffer);
-                    }
-                    break;
-
-                } else if (key == '\b') {
-                    // Backspace pressed
-                    if (buffer_pos > 0) {
-                        buffer_pos--;
-                        command_buffer[buffer_pos] = '\0';
-
-                        // Handle cursor position properly
-                        int current_row = get_cursor_row();
-                        int current_col = get_cursor_col();
-
-                        if (current_col > 0) {
-                            // Simple case: move cursor back and clear character
-                            putchar('\b', COLOR_DEFAULT);
-                            update_cursor(get_cursor_row(), get_cursor_col());
-                        } else {
-                            // Handle wrapping to previous line
-                            if (current_row > prompt_start_row) {
-                                set_cursor_position(current_row - 1, 79);
-                                putchar(' ', COLOR_DEFAULT);
-                                set_cursor_position(current_row - 1, 79);
-                            }
+                    // Handle cursor position properly
+                    int current_row = get_cursor_row();
+                    int current_col = get_cursor_col();
+
+                    if (current_col > 0) {
+                        // Simple case: move cursor back and clear character
+                        putchar('\b', COLOR_DEFAULT);
+                    } else {
+                        // Handle wrapping to previous line
+                        if (current_row > prompt_start_row) {
+                            set_cursor_position(current_row - 1, get_console_cols() - 1);
+                            putchar(' ', COLOR_DEFAULT);
+                            set_cursor_position(current_row - 1, get_console_cols() - 1);
                         }
                     }
+                }
 
-                } else if (key == '\t') {
-                    // Tab completion could be implemented here
-                    continue;
-
-                } else if (key == 27) {
-                    // Escape key - clear current line
-                    // Go back to prompt start and clear everything after it
-                    set_cursor_position(prompt_start_row, prompt_start_col);
+            } else if (key == '\t') {
+                shell_complete();
 
-                    // Clear the rest of the line(s)
-                    while (buffer_pos > 0) {
-                        putchar(' ', COLOR_DEFAULT);
-                        buffer_pos--;
-                    }
+            } else if (key == 27) {
+                // Escape key - clear current line
+                // Go back to prompt start and clear everything after it
+                set_cursor_position(prompt_start_row, prompt_start_col);
 
-                    // Reset cursor to prompt start
-                    set_cursor_position(prompt_start_row, prompt_start_col);
-                    buffer_pos = 0;
-                    command_buffer[0] = '\0';
-
-                } else if (key >= 32 && key <= 126) {
-                    // Printable character
-                    if (buffer_pos < COMMAND_BUFFER_SIZE - 1) {
-                        command_buffer[buffer_pos] = key;
-                        buffer_pos++;
-                        putchar(key, COLOR_DEFAULT);
-                        // Update cursor position after typing
-                        update_cursor(get_cursor_row(), get_cursor_col());
-                    }
+                // Clear the rest of the line(s)
+                while (buffer_pos > 0) {
+                    putchar(' ', COLOR_DEFAULT);
+                    buffer_pos--;
                 }
-            }
 
-            // Small delay to prevent busy waiting
-            for (volatile int i = 0; i < 1000; i++);
+                // Reset cursor to prompt start
+                set_cursor_position(prompt_start_row, prompt_start_col);
+                buffer_pos = 0;
+                command_buffer[0] = '\0';
+
+            } else if (key >= 32 && key <= 126) {
+                // Printable character
+                shell_insert(key);
+            }
         }
     }
 }
 
-static void process_command(const char* command) {
-    if (str_equals(command, "help")) {
-        command_help();
+static void run_command(char* command) {
+    // Keep the original text for the error, tokenizing splits it up
+    char line[COMMAND_BUFFER_SIZE];
+    str_copy(line, command, COMMAND_BUFFER_SIZE);
+
+    if (command_execute(command) != 0) {
+        print("Unknown command: ", 0x0C);
+        print(line, 0x0C);
+        print("\nType 'help' for available commands\n", 0x07);
     }
-    else if (str_equals(command, "clear")) {
-        command_clear();
+}
+
+// Background job, arg is its own copy of the command line
+static void shell_job(void* arg) {
+    char* line = (char*)arg;
+    run_command(line);
+    kfree(line);
+}
+
+static void start_job(const char* command) {
+    while (*command == ' ') {
+        command++;
     }
-    else if (str_starts_with(command, "echo ")) {
-        command_echo(command + 5); // Skip "echo "
+    if (!*command) {
+        return;
     }
-    else if (str_equals(command, "keytest")) {
-        command_keytest();
+
+    char* line = (char*)kmalloc(COMMAND_BUFFER_SIZE);
+    if (!line) {
+        print("Not enough memory for a job\n", 0x0C);
+        return;
     }
-    else if (str_equals(command, "meminfo")) {
-        command_meminfo();
+    str_copy(line, command, COMMAND_BUFFER_SIZE);
+
+    // The thread is named after the command
+    char name[THREAD_NAME_LENGTH];
+    int len = 0;
+    while (command[len] && command[len] != ' ' && len < THREAD_NAME_LENGTH - 1) {
+        name[len] = command[len];
+        len++;
     }
-    else if (str_equals(command, "memtest")) {
-        command_memtest();
+    name[len] = '\0';
+
+    Thread* thread = thread_create(name, shell_job, line, PRIORITY_LOW);
+    if (!thread) {
+        print("Could not start the job\n", 0x0C);
+        kfree(line);
+        return;
     }
-    else if (str_equals(command, "")) {
-        // Empty command, do nothing
+
+    print("[", 0x07);
+    print_dec(thread->id, 0x0B);
+    print("] ", 0x07);
+    print(name, 0x07);
+    print(" running in the background\n", 0x07);
+}
+
+static void process_command(char* command) {
+    // A trailing '&' runs the command in its own thread
+    int len = str_length(command);
+    while (len > 0 && command[len - 1] == ' ') {
+        len--;
     }
-    else {
-        print("Unknown command: ", 0x0C);
-        print(command, 0x0C);
-        print("\nType 'help' for available commands\n", 0x07);
+    if (len > 0 && command[len - 1] == '&') {
+        command[len - 1] = '\0';
+        start_job(command);
+        return;
     }
+
+    run_command(command);
 }
 
-static void command_help(void) {
+static void command_help(int argc, char** argv) {
+    (void)argc;
+    (void)argv;
+
     print("Available commands:\n", 0x0E);
-    print("  help     - Show this help message\n", 0x07);
-    print("  clear    - Clear the screen\n", 0x07);
-    print("  echo     - Echo text to screen\n", 0x07);
-    print("  keytest  - Test keyboard input\n", 0x07);
-    print("  meminfo  - Show memory information\n", 0x07);
-    print("  memtest  - Run memory allocation test\n", 0x07);
+    command_print_help();
     print("\n", COLOR_DEFAULT);
 }
 
-static void command_clear(void) {
+static void command_clear(int argc, char** argv) {
+    (void)argc;
+    (void)argv;
+
     clear(COLOR_DEFAULT);
 }
 
-static void command_echo(const char* args) {
-    if (*args == '\0') {
+static void command_echo(int argc, char** argv) {
+    if (argc < 2) {
         print("Usage: echo <text>\n", 0x0C);
         return;
     }
 
-    print(args, 0x0A);
+    for (int i = 1; i < argc; i++) {
+        print(argv[i], 0x0A);
+        if (i + 1 < argc) {
+            putchar(' ', 0x0A);
+        }
+    }
     print("\n", COLOR_DEFAULT);
 }
 
-static void command_keytest(void) {
+static void command_keytest(int argc, char** argv) {
+    (void)argc;
+    (void)argv;
+
     print("Keyboard Test Mode - Press keys to see their codes\n", 0x0E);
     print("Press ESC to exit\n\n", 0x07);
 
@@ -183,40 +365,56 @@ static void command_keytest(void) {
     disable_cursor();
 
     while (true) {
-        if (keyboard_has_key()) {
-            char key = keyboard_get_key();
+        char key = shell_next_key();
 
-            if (key == 27) { // ESC
-                print("\nExiting keyboard test mode\n", 0x0E);
-                // Re-enable cursor when returning to shell
-                enable_cursor(14, 15);
-                break;
-            }
+        if (key == 27) { // ESC
+            print("\nExiting keyboard test mode\n", 0x0E);
+            // Re-enable cursor when returning to shell
+            enable_cursor(14, 15);
+            break;
+        }
 
-            print("Key: '", COLOR_DEFAULT);
-            if (key >= 32 && key <= 126) {
-                putchar(key, 0x0A);
-            } else {
-                print("?", 0x0C);
-            }
-            print("' ASCII: ", COLOR_DEFAULT);
-            print_dec((uint64_t)key, 0x0B);
-            print(" (0x", COLOR_DEFAULT);
-            print_hex((uint64_t)key, 0x0B);
-            print(")\n", COLOR_DEFAULT);
+        print("Key: '", COLOR_DEFAULT);
+        if (key >= 32 && key <= 126) {
+            putchar(key, 0x0A);
+        } else {
+            print("?", 0x0C);
         }
+        print("' ASCII: ", COLOR_DEFAULT);
+        print_dec((uint64_t)key, 0x0B);
+        print(" (0x", COLOR_DEFAULT);
+        print_hex((uint64_t)key, 0x0B);
+        print(")\n", COLOR_DEFAULT);
+    }
+}
 
-        // Small delay
-        for (volatile int i = 0; i < 10000; i++);
+static void print_padded_dec(uint64_t num, int width, unsigned char color) {
+    int digits = 1;
+    for (uint64_t n = num; n >= 10; n /= 10) {
+        digits++;
+    }
+    print_dec(num, color);
+    while (digits++ < width) {
+        putchar(' ', color);
     }
 }
 
-static void command_meminfo(void) {
+static void command_meminfo(int argc, char** argv) {
+    (void)argc;
+    (void)argv;
+
+    uint32_t heap_usage = get_heap_usage();
+    uint32_t heap_size = get_heap_size();
+
     print("Memory Information:\n", 0x0E);
     print("==================\n", 0x0E);
 
     print("Heap Usage:     ", COLOR_DEFAULT);
-    print_dec(get_heap_usage(), 0x0B);
+    print_dec(heap_usage, 0x0B);
+    print(" bytes\n", COLOR_DEFAULT);
+
+    print("Peak Usage:     ", COLOR_DEFAULT);
+    print_dec(get_peak_usage(), 0x0B);
     print(" bytes\n", COLOR_DEFAULT);
 
     print("Free Memory:    ", COLOR_DEFAULT);
@@ -231,20 +429,178 @@ static void command_meminfo(void) {
     print_dec(get_total_freed(), 0x09);
     print(" bytes\n", COLOR_DEFAULT);
 
-    uint32_t heap_size = 0x400000; // 4MB
-    uint32_t used_percent = (get_heap_usage() * 100) / heap_size;
+    print("CPU Caches:     ", COLOR_DEFAULT);
+    print_dec(get_cached_bytes(), 0x0B);
+    print(" bytes\n", COLOR_DEFAULT);
+
+    // Share of kmalloc/kfree calls the per-CPU magazines answered
+    for (uint32_t cpu = 0; cpu < smp_cpu_count() && cpu < heap_cpu_count(); cpu++) {
+        HeapCpuStats cpu_stats;
+        get_heap_cpu_stats(cpu, &cpu_stats);
+        uint64_t calls = cpu_stats.allocs + cpu_stats.frees;
+
+        print("  cpu ", COLOR_DEFAULT);
+        print_padded_dec(cpu, 3, 0x0B);
+        print_padded_dec(cpu_stats.allocs, 10, COLOR_DEFAULT);
+        print(" allocs ", COLOR_DEFAULT);
+        print_padded_dec(cpu_stats.frees, 10, COLOR_DEFAULT);
+        print(" frees ", COLOR_DEFAULT);
+        print_dec(calls ? cpu_stats.cache_hits * 100 / calls : 0, 0x0A);
+        print("% cached\n", COLOR_DEFAULT);
+    }
+
+    print("Heap Size:      ", COLOR_DEFAULT);
+    print_dec(heap_size, 0x0B);
+    print(" bytes mapped\n", COLOR_DEFAULT);
+
+    print("Large Allocs:   ", COLOR_DEFAULT);
+    print_dec(get_large_usage(), 0x0B);
+    print(" bytes\n", COLOR_DEFAULT);
+
+    uint32_t used_percent = heap_size ? (uint32_t)(((uint64_t)heap_usage * 100) / heap_size) : 0;
 
     print("Heap Usage:     ", COLOR_DEFAULT);
     print_dec(used_percent, 0x0C);
     print("%\n", COLOR_DEFAULT);
 
+    print("Physical RAM:   ", COLOR_DEFAULT);
+    print_dec((uint64_t)pmm_get_total_pages() * PAGE_SIZE / 1024, 0x0B);
+    print(" KB usable, ", COLOR_DEFAULT);
+    print_dec((uint64_t)pmm_get_free_pages() * PAGE_SIZE / 1024, 0x0A);
+    print(" KB free (DMA zone ", COLOR_DEFAULT);
+    print_dec((uint64_t)pmm_get_zone_free_pages(PMM_ZONE_DMA) * PAGE_SIZE / 1024, 0x0A);
+    print(" KB free)\n", COLOR_DEFAULT);
+
     print("\n", COLOR_DEFAULT);
 }
 
-static void command_memtest(void) {
+// Print a size with a K/M suffix, returns the number of characters
+static int print_size(uint32_t bytes, unsigned char color) {
+    const char* suffix = "";
+    if (bytes >= 1024 * 1024) {
+        bytes /= 1024 * 1024;
+        suffix = "M";
+    } else if (bytes >= 1024) {
+        bytes /= 1024;
+        suffix = "K";
+    }
+
+    int width = str_length(suffix);
+    for (uint32_t n = bytes; n; n /= 10) {
+        width++;
+    }
+
+    print_dec(bytes, color);
+    print(suffix, color);
+    return width;
+}
+
+static void command_heapmap(int argc, char** argv) {
+    (void)argc;
+    (void)argv;
+
+    HeapStats stats;
+    get_heap_stats(&stats);
+
+    print("Heap Fragmentation:\n", 0x0E);
+    print("==================\n", 0x0E);
+
+    print("Used:           ", COLOR_DEFAULT);
+    print_dec(stats.used_bytes, 0x0B);
+    print(" bytes in ", COLOR_DEFAULT);
+    print_dec(stats.used_blocks, 0x0B);
+    print(" blocks\n", COLOR_DEFAULT);
+
+    print("Free:           ", COLOR_DEFAULT);
+    print_dec(stats.free_bytes, 0x0A);
+    print(" bytes in ", COLOR_DEFAULT);
+    print_dec(stats.free_blocks, 0x0A);
+    print(" blocks\n", COLOR_DEFAULT);
+
+    print("Largest Free:   ", COLOR_DEFAULT);
+    print_dec(stats.largest_free, 0x0A);
+    print(" bytes\n", COLOR_DEFAULT);
+
+    print("Fragmentation:  ", COLOR_DEFAULT);
+    print_dec(stats.fragmentation, stats.fragmentation > 50 ? 0x0C : 0x0A);
+    print("% (free memory outside the largest block)\n", COLOR_DEFAULT);
+
+    // Free block histogram, one bar per power of two
+    uint32_t max_count = 0;
+    for (int i = 0; i < HEAP_HIST_BUCKETS; i++) {
+        if (stats.histogram[i] > max_count) {
+            max_count = stats.histogram[i];
+        }
+    }
+
+    if (max_count) {
+        print("\nFree blocks by size:\n", 0x0E);
+    }
+
+    for (int i = 0; i < HEAP_HIST_BUCKETS && max_count; i++) {
+        if (!stats.histogram[i]) continue;
+
+        print("  >=", 0x07);
+        int width = print_size(1U << (i + HEAP_HIST_MIN_SHIFT), 0x07);
+        while (width++ < 7) {
+            putchar(' ', COLOR_DEFAULT);
+        }
+
+        print_padded_dec(stats.histogram[i], 7, 0x0B);
+
+        uint32_t bar = (stats.histogram[i] * 40 + max_count - 1) / max_count;
+        for (uint32_t b = 0; b < bar; b++) {
+            putchar('#', 0x0A);
+        }
+        print("\n", COLOR_DEFAULT);
+    }
+
+    print("\n", COLOR_DEFAULT);
+}
+
+static void command_slabinfo(int argc, char** argv) {
+    (void)argc;
+    (void)argv;
+
+    print("Object Caches:\n", 0x0E);
+    print("==================\n", 0x0E);
+
+    kmem_cache* cache = kmem_cache_first();
+    if (!cache) {
+        print("No caches\n\n", 0x07);
+        return;
+    }
+
+    print("name            size  active  total   slabs  allocs    frees\n", 0x07);
+
+    for (; cache; cache = cache->next) {
+        int len = str_length(cache->name);
+        print(cache->name, 0x0B);
+        while (len++ < 16) {
+            putchar(' ', COLOR_DEFAULT);
+        }
+        print_padded_dec(cache->object_size, 6, COLOR_DEFAULT);
+        print_padded_dec(cache->active_objects, 8, 0x0A);
+        print_padded_dec(cache->total_objects, 8, COLOR_DEFAULT);
+        print_padded_dec(cache->total_slabs, 7, COLOR_DEFAULT);
+        print_padded_dec(cache->alloc_count, 10, 0x0D);
+        print_dec(cache->free_count, 0x09);
+        print("\n", COLOR_DEFAULT);
+    }
+
+    print("\n", COLOR_DEFAULT);
+}
+
+static void command_memtest(int argc, char** argv) {
+    uint32_t rounds = 1;
+    if (argc > 1 && (str_to_uint(argv[1], &rounds) != 0 || rounds == 0)) {
+        print("Usage: memtest [rounds]\n", 0x0C);
+        return;
+    }
+
     print("Starting memory test...\n", 0x0E);
 
-    if (memory_test()) {
+    if (memory_test(rounds)) {
         print("Memory test completed successfully!\n", 0x0A);
     } else {
         print("Memory test failed!\n", 0x0C);
@@ -252,3 +608,1080 @@ static void command_memtest(void) {
 
     print("\n", COLOR_DEFAULT);
 }
+
+static void command_membench(int argc, char** argv) {
+    (void)argc;
+    (void)argv;
+
+    print("Measuring memory copy and fill throughput...\n", 0x0E);
+    mem_benchmark();
+    print("\n", COLOR_DEFAULT);
+}
+
+static void command_serial(int argc, char** argv) {
+    if (!serial_present()) {
+        print("No serial port\n", 0x0C);
+        return;
+    }
+
+    if (argc == 3 && str_equals(argv[1], "mirror")) {
+        if (str_equals(argv[2], "on")) {
+            console_set_mirror(serial_write);
+        } else if (str_equals(argv[2], "off")) {
+            console_set_mirror(NULL);
+        } else {
+            print("Usage: serial mirror on|off\n", 0x0C);
+        }
+        return;
+    }
+    if (argc != 1) {
+        print("Usage: serial [mirror on|off]\n", 0x0C);
+        return;
+    }
+
+    SerialStats stats;
+    serial_get_stats(&stats);
+
+    print("Serial Port (COM1):\n", 0x0E);
+    print("==================\n", 0x0E);
+
+    print("Mirror:         ", COLOR_DEFAULT);
+    print(console_get_mirror() == serial_write ? "on\n" : "off\n", 0x0B);
+
+    print("Sent:           ", COLOR_DEFAULT);
+    print_dec(stats.tx_bytes, 0x0A);
+    print(" bytes, ", COLOR_DEFAULT);
+    print_dec(stats.tx_dropped, stats.tx_dropped ? 0x0C : 0x0A);
+    print(" dropped\n", COLOR_DEFAULT);
+
+    print("Received:       ", COLOR_DEFAULT);
+    print_dec(stats.rx_bytes, 0x0A);
+    print(" bytes, ", COLOR_DEFAULT);
+    print_dec(stats.rx_errors, stats.rx_errors ? 0x0C : 0x0A);
+    print(" errors\n", COLOR_DEFAULT);
+
+    print("Interrupts:     ", COLOR_DEFAULT);
+    print_dec(stats.interrupts, 0x0B);
+    print("\n\n", COLOR_DEFAULT);
+}
+
+static void command_bench(int argc, char** argv) {
+    uint32_t iterations = 0;
+
+    if (argc < 2) {
+        print("Usage: bench <name|all> [iterations]\n", 0x0E);
+        for (int i = 0; i < bench_count(); i++) {
+            int len = str_length(bench_name(i));
+            print("  ", 0x07);
+            print(bench_name(i), 0x07);
+            while (len++ < 10) {
+                putchar(' ', 0x07);
+            }
+            print("- ", 0x07);
+            print(bench_help(i), 0x07);
+            print("\n", 0x07);
+        }
+        print("\n", COLOR_DEFAULT);
+        return;
+    }
+
+    if (argc > 2 && (str_to_uint(argv[2], &iterations) != 0 || iterations == 0)) {
+        print("Invalid iteration count: ", 0x0C);
+        print(argv[2], 0x0C);
+        print("\n", COLOR_DEFAULT);
+        return;
+    }
+
+    bench_print_header();
+    if (str_equals(argv[1], "all")) {
+        for (int i = 0; i < bench_count(); i++) {
+            bench_run(bench_name(i), iterations);
+        }
+    } else if (bench_run(argv[1], iterations) != 0) {
+        print("Unknown benchmark: ", 0x0C);
+        print(argv[1], 0x0C);
+        print("\n", COLOR_DEFAULT);
+        return;
+    }
+    print("\n", COLOR_DEFAULT);
+}
+
+static void command_ps(int argc, char** argv) {
+    (void)argc;
+    (void)argv;
+
+    ThreadInfo threads[32];
+    int count = sched_snapshot(threads, 32);
+
+    print("Threads:\n", 0x0E);
+    print("==================\n", 0x0E);
+    print("id   name            state     prio  switches  cpu ms\n", 0x07);
+
+    for (int i = 0; i < count; i++) {
+        print_padded_dec(threads[i].id, 5, 0x0B);
+
+        int len = str_length(threads[i].name);
+        print(threads[i].name, 0x0B);
+        while (len++ < 16) {
+            putchar(' ', COLOR_DEFAULT);
+        }
+
+        const char* state = thread_state_name(threads[i].state);
+        len = str_length(state);
+        print(state, threads[i].state == THREAD_RUNNING ? 0x0A : COLOR_DEFAULT);
+        while (len++ < 10) {
+            putchar(' ', COLOR_DEFAULT);
+        }
+
+        print_padded_dec(threads[i].priority, 6, COLOR_DEFAULT);
+        print_padded_dec(threads[i].switches, 10, COLOR_DEFAULT);
+        print_dec(cycles_to_ns(threads[i].run_cycles) / 1000000, 0x0D);
+        print("\n", COLOR_DEFAULT);
+    }
+
+    SchedStats stats;
+    sched_get_stats(&stats);
+
+    print("\nTicks:          ", COLOR_DEFAULT);
+    print_dec(stats.ticks, 0x0B);
+    print(" (", COLOR_DEFAULT);
+    print_dec(SCHED_HZ, COLOR_DEFAULT);
+    print(" Hz)\n", COLOR_DEFAULT);
+
+    print("Switches:       ", COLOR_DEFAULT);
+    print_dec(stats.switches, 0x0B);
+    print(" (", COLOR_DEFAULT);
+    print_dec(stats.preemptions, 0x0B);
+    print(" from interrupts)\n", COLOR_DEFAULT);
+
+    if (stats.switches) {
+        print("Switch latency: ", COLOR_DEFAULT);
+        print_dec(stats.switch_min, 0x0A);
+        print(" min / ", COLOR_DEFAULT);
+        print_dec(stats.switch_total / stats.switches, 0x0A);
+        print(" avg / ", COLOR_DEFAULT);
+        print_dec(stats.switch_max, 0x0C);
+        print(" max cycles\n", COLOR_DEFAULT);
+    }
+
+    print("\n", COLOR_DEFAULT);
+}
+
+static void command_smp(int argc, char** argv) {
+    (void)argc;
+    (void)argv;
+
+    uint32_t count = smp_cpu_count();
+
+    print("CPUs:\n", 0x0E);
+    print("==================\n", 0x0E);
+    print("cpu  apic  pieces     steals     misses     sleeps\n", 0x07);
+
+    for (uint32_t i = 0; i < count; i++) {
+        Cpu* cpu = smp_cpu(i);
+        print_padded_dec(cpu->index, 5, 0x0B);
+        print_padded_dec(cpu->apic_id, 6, COLOR_DEFAULT);
+        print_padded_dec(cpu->stats.items, 11, COLOR_DEFAULT);
+        print_padded_dec(cpu->stats.steals, 11, 0x0A);
+        print_padded_dec(cpu->stats.steal_misses, 11, COLOR_DEFAULT);
+        print_dec(cpu->stats.sleeps, COLOR_DEFAULT);
+        print(i == 0 ? "  (BSP)\n" : "\n", COLOR_DEFAULT);
+    }
+
+    print("\nOnline:         ", COLOR_DEFAULT);
+    print_dec(count, 0x0B);
+    print(" (", COLOR_DEFAULT);
+    print_dec(work_get_cpus(), 0x0B);
+    print(" taking work)\n\n", COLOR_DEFAULT);
+}
+
+static void command_locks(int argc, char** argv) {
+    if (!LOCK_STATS) {
+        print("Lock counters are off, build with LOCK_STATS=1\n", 0x0C);
+        return;
+    }
+
+    if (argc == 2 && str_equals(argv[1], "reset")) {
+        lock_stats_reset();
+        print("Lock counters reset\n", COLOR_DEFAULT);
+        return;
+    }
+
+    print("Locks:\n", 0x0E);
+    print("==================\n", 0x0E);
+    print("name        acquires     contended  wait%  avg spin   max spin (cycles)\n", 0x07);
+
+    for (const LockStats* stats = lock_stats_list(); stats; stats = stats->next) {
+        uint64_t acquires = stats->acquires;
+        uint64_t contended = stats->contended;
+
+        int len = str_length(stats->name);
+        print(stats->name, 0x0B);
+        while (len++ < 12) {
+            putchar(' ', 0x0B);
+        }
+        print_padded_dec(acquires, 13, COLOR_DEFAULT);
+        print_padded_dec(contended, 11, contended ? 0x0E : COLOR_DEFAULT);
+        print_padded_dec(acquires ? contended * 100 / acquires : 0, 7, COLOR_DEFAULT);
+        print_padded_dec(contended ? stats->spin_cycles / contended : 0, 11, COLOR_DEFAULT);
+        print_dec(stats->max_spin, COLOR_DEFAULT);
+        print("\n", COLOR_DEFAULT);
+    }
+    print("\n", COLOR_DEFAULT);
+}
+
+static void command_parbench(int argc, char** argv) {
+    uint32_t param = 0;
+
+    if (argc < 2) {
+        print("Usage: parbench <name> [size]\n", 0x0E);
+        for (int i = 0; i < parallel_bench_count(); i++) {
+            int len = str_length(parallel_bench_name(i));
+            print("  ", 0x07);
+            print(parallel_bench_name(i), 0x07);
+            while (len++ < 10) {
+                putchar(' ', 0x07);
+            }
+            print("- ", 0x07);
+            print(parallel_bench_help(i), 0x07);
+            print("\n", 0x07);
+        }
+        print("\n", COLOR_DEFAULT);
+        return;
+    }
+
+    if (argc > 2 && (str_to_uint(argv[2], &param) != 0 || param == 0 || param > 100000)) {
+        print("Invalid size: ", 0x0C);
+        print(argv[2], 0x0C);
+        print("\n", COLOR_DEFAULT);
+        return;
+    }
+
+    if (bench_parallel(argv[1], param) != 0) {
+        print("Unknown benchmark: ", 0x0C);
+        print(argv[1], 0x0C);
+        print("\n", COLOR_DEFAULT);
+        return;
+    }
+    print("\n", COLOR_DEFAULT);
+}
+
+// Requests the disk benchmark keeps queued, so the driver can start the
+// next one without waiting for the shell to wake up
+#define DISK_BENCH_DEPTH   4
+#define DISK_BENCH_SECTORS 512
+
+// Both drivers take DiskRequests, the benchmark runs against either
+typedef struct {
+    int drive;
+    uint64_t sectors;
+    uint32_t max_sectors;
+    const char* mode;
+    int (*submit_batch)(DiskRequest** reqs, int count);
+    int (*wait)(DiskRequest* req);
+} DiskBenchTarget;
+
+static int ata_submit_batch(DiskRequest** reqs, int count) {
+    for (int i = 0; i < count; i++) {
+        if (disk_submit(reqs[i]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void disk_bench(const DiskBenchTarget* target, uint32_t mb, uint32_t flags) {
+    uint32_t chunk = DISK_BENCH_SECTORS;
+    if (chunk > target->max_sectors) {
+        chunk = target->max_sectors;
+    }
+    if (chunk > target->sectors) {
+        chunk = (uint32_t)target->sectors;
+    }
+
+    DiskRequest requests[DISK_BENCH_DEPTH];
+    void* buffers[DISK_BENCH_DEPTH] = {0};
+    int active[DISK_BENCH_DEPTH] = {0};
+    for (int i = 0; i < DISK_BENCH_DEPTH; i++) {
+        buffers[i] = kmalloc(chunk * DISK_SECTOR_SIZE);
+        if (!buffers[i]) {
+            print("Not enough memory for the buffers\n", 0x0C);
+            for (int j = 0; j < i; j++) {
+                kfree(buffers[j]);
+            }
+            return;
+        }
+    }
+
+    // The image is small, reads wrap around to sector 0
+    uint64_t total = (uint64_t)mb * 1024 * 1024 / DISK_SECTOR_SIZE;
+    uint64_t submitted = 0;
+    uint64_t completed = 0;
+    uint64_t lba = 0;
+    uint32_t errors = 0;
+    int failed = 0;
+    uint64_t start = ktime_ns();
+
+    // The first round goes out as one batch, later ones one by one
+    // as each request finishes
+    DiskRequest* batch[DISK_BENCH_DEPTH];
+    int batched = 0;
+
+    for (int i = 0; completed < total && !failed; i = (i + 1) % DISK_BENCH_DEPTH) {
+        if (active[i]) {
+            if (target->wait(&requests[i]) != 0) {
+                errors++;
+            }
+            completed += requests[i].count;
+            active[i] = 0;
+        }
+
+        if (submitted < total) {
+            if (lba + chunk > target->sectors) {
+                lba = 0;
+            }
+            requests[i] = (DiskRequest){
+                .drive = target->drive,
+                .op = DISK_READ,
+                .flags = flags,
+                .lba = lba,
+                .count = chunk,
+                .buffer = buffers[i],
+            };
+            batch[batched++] = &requests[i];
+            active[i] = 1;
+            lba += chunk;
+            submitted += chunk;
+        }
+
+        if (batched && (submitted >= total || i == DISK_BENCH_DEPTH - 1 || completed)) {
+            if (target->submit_batch(batch, batched) != 0) {
+                print("Submitting a request failed\n", 0x0C);
+                failed = 1;
+                // Only the ones the driver took are pending
+                for (int b = 0; b < batched; b++) {
+                    active[batch[b] - requests] = batch[b]->status == DISK_PENDING;
+                }
+            }
+            batched = 0;
+        }
+    }
+
+    // Only left over after a failed submit
+    for (int i = 0; i < DISK_BENCH_DEPTH; i++) {
+        if (active[i]) {
+            target->wait(&requests[i]);
+        }
+    }
+
+    uint64_t ns = ktime_ns() - start;
+    for (int i = 0; i < DISK_BENCH_DEPTH; i++) {
+        kfree(buffers[i]);
+    }
+    if (failed) {
+        return;
+    }
+
+    print("Read ", COLOR_DEFAULT);
+    print_dec(completed * DISK_SECTOR_SIZE / 1024, 0x0B);
+    print(" KB in ", COLOR_DEFAULT);
+    print_dec(ns / 1000000, 0x0B);
+    print(" ms: ", COLOR_DEFAULT);
+    print_dec(ns ? completed * DISK_SECTOR_SIZE * 1000 / ns : 0, 0x0A);
+    print(" MB/s (", COLOR_DEFAULT);
+    print(target->mode, COLOR_DEFAULT);
+    print(")", COLOR_DEFAULT);
+    if (errors) {
+        print(", ", COLOR_DEFAULT);
+        print_dec(errors, 0x0C);
+        print(" errors", 0x0C);
+    }
+    print("\n\n", COLOR_DEFAULT);
+}
+
+// "vdN" names a virtio disk, a plain number an ATA drive
+static int disk_bench_target(const char* name, int pio, DiskBenchTarget* target) {
+    uint32_t drive;
+
+    if (name[0] == 'v' && name[1] == 'd') {
+        VirtioBlkInfo info;
+        if (str_to_uint(name + 2, &drive) != 0 || virtio_blk_get_info((int)drive, &info) != 0) {
+            return -1;
+        }
+        target->sectors = info.sectors;
+        target->max_sectors = info.max_sectors;
+        target->mode = "virtio";
+        target->submit_batch = virtio_blk_submit_batch;
+        target->wait = virtio_blk_wait;
+    } else {
+        DiskDriveInfo info;
+        if (str_to_uint(name, &drive) != 0 || disk_get_info((int)drive, &info) != 0) {
+            return -1;
+        }
+        target->sectors = info.sectors;
+        target->max_sectors = DISK_MAX_TRANSFER;
+        target->mode = pio || !info.dma ? "ATA PIO" : "ATA DMA";
+        target->submit_batch = ata_submit_batch;
+        target->wait = disk_wait;
+    }
+
+    target->drive = (int)drive;
+    return 0;
+}
+
+static void print_virtio_disks(void) {
+    for (int i = 0; i < virtio_blk_count(); i++) {
+        VirtioBlkInfo info;
+        VirtioBlkStats stats;
+        virtio_blk_get_info(i, &info);
+        virtio_blk_get_stats(i, &stats);
+
+        print("vd", 0x0B);
+        print_padded_dec(i, 2, 0x0B);
+        print("virtio-blk  ", 0x0B);
+        print_dec(info.sectors * DISK_SECTOR_SIZE / 1024, COLOR_DEFAULT);
+        print(" KB, queue ", COLOR_DEFAULT);
+        print_dec(info.queue_size, COLOR_DEFAULT);
+        print(", ", COLOR_DEFAULT);
+        print_dec(info.max_sectors, COLOR_DEFAULT);
+        print(info.read_only ? " sectors/request, read only\n" : " sectors/request\n", COLOR_DEFAULT);
+
+        print("   requests ", 0x07);
+        print_dec(stats.requests, COLOR_DEFAULT);
+        print(", read ", 0x07);
+        print_dec(stats.sectors_read, COLOR_DEFAULT);
+        print(", written ", 0x07);
+        print_dec(stats.sectors_written, COLOR_DEFAULT);
+        print(" sectors, ", 0x07);
+        print_dec(stats.errors, stats.errors ? 0x0C : COLOR_DEFAULT);
+        print(" errors\n", 0x07);
+
+        print("   doorbells ", 0x07);
+        print_dec(stats.notifies, COLOR_DEFAULT);
+        print(" (", 0x07);
+        print_dec(stats.notifies_skipped, COLOR_DEFAULT);
+        print(" skipped, up to ", 0x07);
+        print_dec(stats.max_batch, COLOR_DEFAULT);
+        print(" requests), ", 0x07);
+        print_dec(stats.interrupts, COLOR_DEFAULT);
+        print(" interrupts for ", 0x07);
+        print_dec(stats.drained, COLOR_DEFAULT);
+        print(" completions\n", 0x07);
+
+        print("   queue ", 0x07);
+        print_dec(stats.queue_depth, COLOR_DEFAULT);
+        print(" (max ", 0x07);
+        print_dec(stats.max_queue_depth, COLOR_DEFAULT);
+        print("), ring full ", 0x07);
+        print_dec(stats.ring_full, COLOR_DEFAULT);
+        print(" times\n", 0x07);
+    }
+}
+
+static void command_disk(int argc, char** argv) {
+    if (argc > 1 && str_equals(argv[1], "bench")) {
+        uint32_t mb = 64;
+        int pio = argc > 2 && str_equals(argv[argc - 1], "pio");
+        int numbers = argc - 2 - pio;
+
+        // The boot disk by default, wherever it is attached
+        char boot_name[2] = { (char)('0' + disk_boot_drive()), '\0' };
+        const char* drive = boot_name;
+        if (disk_boot_drive() < 0) {
+            drive = virtio_blk_count() ? "vd0" : "0";
+        }
+        if (numbers > 0) {
+            drive = argv[2];
+        }
+
+        DiskBenchTarget target;
+        if ((numbers > 1 && (str_to_uint(argv[3], &mb) != 0 || mb == 0)) || numbers > 2) {
+            print("Usage: disk bench [drive|vdN] [MB] [pio]\n", 0x0C);
+            return;
+        }
+        if (disk_bench_target(drive, pio, &target) != 0) {
+            print("No such drive: ", 0x0C);
+            print(drive, 0x0C);
+            print("\n", COLOR_DEFAULT);
+            return;
+        }
+        disk_bench(&target, mb, pio ? DISK_REQ_PIO : 0);
+        return;
+    }
+    if (argc != 1) {
+        print("Usage: disk [bench [drive|vdN] [MB] [pio]]\n", 0x0C);
+        return;
+    }
+
+    print("Disks:\n", 0x0E);
+    print("==================\n", 0x0E);
+
+    int found = virtio_blk_count();
+    for (int i = 0; i < DISK_MAX_DRIVES; i++) {
+        DiskDriveInfo info;
+        if (disk_get_info(i, &info) != 0) {
+            continue;
+        }
+        found++;
+
+        DiskStats stats;
+        disk_get_stats(i, &stats);
+
+        print_padded_dec(i, 4, 0x0B);
+        print(info.model, 0x0B);
+        print("  ", COLOR_DEFAULT);
+        print_dec(info.sectors * DISK_SECTOR_SIZE / 1024, COLOR_DEFAULT);
+        print(" KB, ", COLOR_DEFAULT);
+        print(info.lba48 ? "LBA48, " : "LBA28, ", COLOR_DEFAULT);
+        print(info.dma ? "DMA" : "PIO", info.dma ? 0x0A : 0x0E);
+        print(i == disk_boot_drive() ? "  (boot)\n" : "\n", COLOR_DEFAULT);
+
+        print("   requests ", 0x07);
+        print_dec(stats.requests, COLOR_DEFAULT);
+        print(", read ", 0x07);
+        print_dec(stats.sectors_read, COLOR_DEFAULT);
+        print(", written ", 0x07);
+        print_dec(stats.sectors_written, COLOR_DEFAULT);
+        print(" sectors\n", 0x07);
+
+        print("   commands ", 0x07);
+        print_dec(stats.dma_commands, COLOR_DEFAULT);
+        print(" DMA / ", 0x07);
+        print_dec(stats.pio_commands, COLOR_DEFAULT);
+        print(" PIO, ", 0x07);
+        print_dec(stats.interrupts, COLOR_DEFAULT);
+        print(" interrupts, ", 0x07);
+        print_dec(stats.errors, stats.errors ? 0x0C : COLOR_DEFAULT);
+        print(" errors, queue ", 0x07);
+        print_dec(stats.queue_depth, COLOR_DEFAULT);
+        print(" (max ", 0x07);
+        print_dec(stats.max_queue_depth, COLOR_DEFAULT);
+        print(")\n", 0x07);
+    }
+    print_virtio_disks();
+    if (!found) {
+        print("No drives\n", 0x07);
+    }
+
+    const DiskInfo* boot = disk_boot_info();
+    print("\nBIOS boot drive ", COLOR_DEFAULT);
+    print_hex(boot->drive_number, 0x0B);
+    print(": ", COLOR_DEFAULT);
+    print_dec(boot->heads, COLOR_DEFAULT);
+    print(" heads, ", COLOR_DEFAULT);
+    print_dec(boot->sectors_per_track, COLOR_DEFAULT);
+    print(" sectors/track, ", COLOR_DEFAULT);
+    print_dec(boot->total_sectors, COLOR_DEFAULT);
+    print(" sectors\n\n", COLOR_DEFAULT);
+}
+
+// 4 KB bios the iostat benchmark submits under one plug before it waits
+#define IOSTAT_BENCH_BIOS 64
+
+// Completed bios at the last iostat, for the IOPS since then
+static uint64_t iostat_completed[BLOCK_MAX_DEVICES];
+static uint64_t iostat_last_ns = 0;
+
+static void print_latency_bucket(int bucket, uint64_t count) {
+    print("  <", 0x07);
+    if (bucket < 10) {
+        print_dec(1u << bucket, COLOR_DEFAULT);
+        print("us ", 0x07);
+    } else {
+        print_dec(1u << (bucket - 10), COLOR_DEFAULT);
+        print("ms ", 0x07);
+    }
+    print_dec(count, COLOR_DEFAULT);
+}
+
+// Sequential page sized reads, adjacent in memory as well, so they merge
+// into large requests
+static void iostat_bench(int dev, uint32_t mb) {
+    BlockDeviceInfo info;
+    block_get_info(dev, &info);
+
+    uint32_t sectors = PAGE_SIZE / DISK_SECTOR_SIZE;
+    uint64_t total = (uint64_t)mb * 1024 * 1024 / DISK_SECTOR_SIZE;
+    if (total > info.sectors) {
+        total = info.sectors - info.sectors % sectors;
+    }
+
+    uint8_t* buffer = (uint8_t*)kmalloc(IOSTAT_BENCH_BIOS * PAGE_SIZE);
+    Bio* bios = (Bio*)kmalloc(IOSTAT_BENCH_BIOS * sizeof(Bio));
+    if (!buffer || !bios) {
+        print("Out of memory\n", 0x0C);
+        kfree(buffer);
+        kfree(bios);
+        return;
+    }
+
+    BlockStats before;
+    block_get_stats(dev, &before);
+    uint64_t start = ktime_ns();
+    uint64_t done = 0;
+    int errors = 0;
+
+    while (done < total) {
+        int count = 0;
+        BlockPlug plug;
+        block_start_plug(&plug);
+        for (; count < IOSTAT_BENCH_BIOS && done + (uint64_t)(count + 1) * sectors <= total; count++) {
+            Bio* bio = &bios[count];
+            memset(bio, 0, sizeof(Bio));
+            bio->dev = dev;
+            bio->op = DISK_READ;
+            bio->sector = done + (uint64_t)count * sectors;
+            bio->count = sectors;
+            bio->buffer = buffer + (uint64_t)count * PAGE_SIZE;
+            if (block_submit(bio) != 0) {
+                break;
+            }
+        }
+        block_finish_plug(&plug);
+
+        for (int i = 0; i < count; i++) {
+            errors += block_wait(&bios[i]) != 0;
+        }
+        if (!count || errors) {
+            break;
+        }
+        done += (uint64_t)count * sectors;
+    }
+
+    uint64_t ns = ktime_ns() - start;
+    BlockStats after;
+    block_get_stats(dev, &after);
+    kfree(buffer);
+    kfree(bios);
+
+    uint64_t bios_done = after.bios - before.bios;
+    uint64_t requests = after.requests - before.requests;
+    print("Read ", COLOR_DEFAULT);
+    print_dec(done * DISK_SECTOR_SIZE / 1024, 0x0B);
+    print(" KB in ", COLOR_DEFAULT);
+    print_dec(ns / 1000000, 0x0B);
+    print(" ms: ", COLOR_DEFAULT);
+    print_dec(ns ? done * DISK_SECTOR_SIZE * 1000 / ns : 0, 0x0A);
+    print(" MB/s, ", COLOR_DEFAULT);
+    print_dec(bios_done, 0x0B);
+    print(" bios in ", COLOR_DEFAULT);
+    print_dec(requests, 0x0B);
+    print(" requests", COLOR_DEFAULT);
+    if (errors) {
+        print(", ", COLOR_DEFAULT);
+        print_dec(errors, 0x0C);
+        print(" errors", 0x0C);
+    }
+    print("\n\n", COLOR_DEFAULT);
+}
+
+static void command_iostat(int argc, char** argv) {
+    if (argc == 2 && str_equals(argv[1], "reset")) {
+        for (int i = 0; i < block_count(); i++) {
+            block_reset_stats(i);
+            iostat_completed[i] = 0;
+        }
+        iostat_last_ns = ktime_ns();
+        print("Block statistics reset\n", 0x0A);
+        return;
+    }
+
+    if (argc > 1 && str_equals(argv[1], "bench")) {
+        int dev = 0;
+        uint32_t mb = 16;
+        if (argc > 2) {
+            dev = block_find(argv[2]);
+        }
+        if (argc > 4 || (argc > 3 && (str_to_uint(argv[3], &mb) != 0 || mb == 0))) {
+            print("Usage: iostat bench [dev] [MB]\n", 0x0C);
+            return;
+        }
+        if (dev < 0 || dev >= block_count()) {
+            print("No such block device\n", 0x0C);
+            return;
+        }
+        iostat_bench(dev, mb);
+        return;
+    }
+
+    if (argc != 1) {
+        print("Usage: iostat [reset | bench [dev] [MB]]\n", 0x0C);
+        return;
+    }
+
+    print("Block Devices:\n", 0x0E);
+    print("==================\n", 0x0E);
+    if (!block_count()) {
+        print("No block devices\n\n", 0x07);
+        return;
+    }
+
+    uint64_t now = ktime_ns();
+    uint64_t interval = iostat_last_ns ? now - iostat_last_ns : now;
+    iostat_last_ns = now;
+
+    for (int i = 0; i < block_count(); i++) {
+        BlockDeviceInfo info;
+        BlockStats stats;
+        block_get_info(i, &info);
+        block_get_stats(i, &stats);
+
+        print(info.name, 0x0B);
+        print("  ", COLOR_DEFAULT);
+        print(info.driver, COLOR_DEFAULT);
+        print(", ", COLOR_DEFAULT);
+        print_dec(info.sectors * DISK_SECTOR_SIZE / (1024 * 1024), COLOR_DEFAULT);
+        print(" MB, ", COLOR_DEFAULT);
+        print_dec(info.max_sectors / 2, COLOR_DEFAULT);
+        print(" KB requests, depth ", COLOR_DEFAULT);
+        print_dec(info.depth, COLOR_DEFAULT);
+        print("\n", COLOR_DEFAULT);
+
+        uint64_t completed = stats.completed - iostat_completed[i];
+        iostat_completed[i] = stats.completed;
+        print("   IOPS ", 0x07);
+        print_dec(interval ? completed * 1000000000ull / interval : 0, 0x0A);
+        print(", bios ", 0x07);
+        print_dec(stats.bios, COLOR_DEFAULT);
+        print(", requests ", 0x07);
+        print_dec(stats.requests, COLOR_DEFAULT);
+        print(", merged ", 0x07);
+        print_dec(stats.back_merges, COLOR_DEFAULT);
+        print(" back / ", 0x07);
+        print_dec(stats.front_merges, COLOR_DEFAULT);
+        print(" front\n", 0x07);
+
+        print("   read ", 0x07);
+        print_dec(stats.sectors_read / 2, COLOR_DEFAULT);
+        print(" KB, written ", 0x07);
+        print_dec(stats.sectors_written / 2, COLOR_DEFAULT);
+        print(" KB, flushes ", 0x07);
+        print_dec(stats.flushes, COLOR_DEFAULT);
+        print(", expired ", 0x07);
+        print_dec(stats.expired, COLOR_DEFAULT);
+        print(", errors ", 0x07);
+        print_dec(stats.errors, stats.errors ? 0x0C : COLOR_DEFAULT);
+        print("\n", 0x07);
+
+        print("   queued ", 0x07);
+        print_dec(stats.queued, COLOR_DEFAULT);
+        print(", in flight ", 0x07);
+        print_dec(stats.in_flight, COLOR_DEFAULT);
+        print(", max depth ", 0x07);
+        print_dec(stats.max_queue_depth, COLOR_DEFAULT);
+        print(", avg latency ", 0x07);
+        print_dec(stats.completed ? stats.latency_total_us / stats.completed : 0, COLOR_DEFAULT);
+        print(" us\n", 0x07);
+
+        if (stats.completed) {
+            print("  ", 0x07);
+            for (int b = 0; b < BLOCK_LATENCY_BUCKETS; b++) {
+                if (stats.latency[b]) {
+                    print_latency_bucket(b, stats.latency[b]);
+                }
+            }
+            print("\n", COLOR_DEFAULT);
+        }
+    }
+    print("\n", COLOR_DEFAULT);
+}
+
+// One pass over the first blocks of a device through the cache,
+// returns the nanoseconds it took or 0 on an error
+static uint64_t cache_bench_pass(int dev, uint64_t blocks) {
+    uint64_t start = ktime_ns();
+    for (uint64_t block = 0; block < blocks; block++) {
+        Buffer* buf = bcache_read(dev, block);
+        if (!buf) {
+            print("Read error at block ", 0x0C);
+            print_dec(block, 0x0C);
+            print("\n", COLOR_DEFAULT);
+            return 0;
+        }
+        bcache_release(buf);
+    }
+    uint64_t ns = ktime_ns() - start;
+    return ns ? ns : 1;
+}
+
+static void cache_bench(int dev, uint32_t mb) {
+    BlockDeviceInfo info;
+    block_get_info(dev, &info);
+
+    uint64_t blocks = (uint64_t)mb * 1024 * 1024 / BCACHE_BLOCK_SIZE;
+    if (blocks > info.sectors / BCACHE_BLOCK_SECTORS) {
+        blocks = info.sectors / BCACHE_BLOCK_SECTORS;
+    }
+
+    // Start cold so the first pass shows the read-ahead
+    bcache_invalidate(dev);
+    bcache_reset_stats();
+
+    for (int pass = 1; pass <= 2; pass++) {
+        uint64_t ns = cache_bench_pass(dev, blocks);
+        if (!ns) {
+            return;
+        }
+        BCacheStats stats;
+        bcache_get_stats(&stats);
+
+        print("Pass ", COLOR_DEFAULT);
+        print_dec(pass, COLOR_DEFAULT);
+        print(": ", COLOR_DEFAULT);
+        print_dec(blocks * BCACHE_BLOCK_SIZE / 1024, 0x0B);
+        print(" KB in ", COLOR_DEFAULT);
+        print_dec(ns / 1000000, 0x0B);
+        print(" ms, ", COLOR_DEFAULT);
+        print_dec(blocks * BCACHE_BLOCK_SIZE * 1000 / ns, 0x0A);
+        print(" MB/s, ", COLOR_DEFAULT);
+        print_dec(stats.hits, COLOR_DEFAULT);
+        print(" hits / ", COLOR_DEFAULT);
+        print_dec(stats.misses, COLOR_DEFAULT);
+        print(" misses so far\n", COLOR_DEFAULT);
+    }
+    print("\n", COLOR_DEFAULT);
+}
+
+static void command_cache(int argc, char** argv) {
+    if (argc == 2 && str_equals(argv[1], "sync")) {
+        if (bcache_sync(-1) == 0) {
+            print("Dirty blocks written\n", 0x0A);
+        } else {
+            print("Write errors\n", 0x0C);
+        }
+        return;
+    }
+    if (argc == 2 && str_equals(argv[1], "drop")) {
+        bcache_invalidate(-1);
+        print("Clean blocks dropped\n", 0x0A);
+        return;
+    }
+    if (argc == 2 && str_equals(argv[1], "reset")) {
+        bcache_reset_stats();
+        print("Cache statistics reset\n", 0x0A);
+        return;
+    }
+    if (argc > 1 && str_equals(argv[1], "bench")) {
+        int dev = 0;
+        uint32_t mb = 8;
+        if (argc > 2) {
+            dev = block_find(argv[2]);
+        }
+        if (argc > 4 || (argc > 3 && (str_to_uint(argv[3], &mb) != 0 || mb == 0))) {
+            print("Usage: cache bench [dev] [MB]\n", 0x0C);
+            return;
+        }
+        if (dev < 0 || dev >= block_count()) {
+            print("No such block device\n", 0x0C);
+            return;
+        }
+        cache_bench(dev, mb);
+        return;
+    }
+    if (argc != 1) {
+        print("Usage: cache [sync | drop | reset | bench [dev] [MB]]\n", 0x0C);
+        return;
+    }
+
+    BCacheStats stats;
+    bcache_get_stats(&stats);
+
+    print("Buffer Cache:\n", 0x0E);
+    print("==================\n", 0x0E);
+    if (!stats.capacity) {
+        print("Not initialized\n\n", 0x07);
+        return;
+    }
+
+    print("Size        ", 0x07);
+    print_dec((uint64_t)stats.capacity * BCACHE_BLOCK_SIZE / 1024, 0x0B);
+    print(" KB, ", COLOR_DEFAULT);
+    print_dec((uint64_t)stats.allocated * BCACHE_BLOCK_SIZE / 1024, COLOR_DEFAULT);
+    print(" KB allocated\n", COLOR_DEFAULT);
+
+    print("2Q          ", 0x07);
+    print_dec(stats.a1in, COLOR_DEFAULT);
+    print(" A1in, ", 0x07);
+    print_dec(stats.am, COLOR_DEFAULT);
+    print(" Am, ", 0x07);
+    print_dec(stats.a1out, COLOR_DEFAULT);
+    print(" ghosts, ", 0x07);
+    print_dec(stats.dirty, stats.dirty ? 0x0E : COLOR_DEFAULT);
+    print(" dirty\n", 0x07);
+
+    uint64_t lookups = stats.hits + stats.misses;
+    print("Lookups     ", 0x07);
+    print_dec(stats.hits, 0x0A);
+    print(" hits, ", 0x07);
+    print_dec(stats.misses, COLOR_DEFAULT);
+    print(" misses (", 0x07);
+    print_dec(lookups ? stats.hits * 100 / lookups : 0, 0x0A);
+    print("% hit), ", 0x07);
+    print_dec(stats.ghost_hits, COLOR_DEFAULT);
+    print(" ghost hits, ", 0x07);
+    print_dec(stats.evictions, COLOR_DEFAULT);
+    print(" evictions\n", 0x07);
+
+    print("Read-ahead  ", 0x07);
+    print_dec(stats.readahead, COLOR_DEFAULT);
+    print(" blocks, ", 0x07);
+    print_dec(stats.readahead_hits, COLOR_DEFAULT);
+    print(" used\n", 0x07);
+
+    print("Write-back  ", 0x07);
+    print_dec(stats.writebacks, COLOR_DEFAULT);
+    print(" blocks, ", 0x07);
+    print_dec(stats.flusher_runs, COLOR_DEFAULT);
+    print(" flusher passes, ", 0x07);
+    print_dec(stats.errors, stats.errors ? 0x0C : COLOR_DEFAULT);
+    print(" errors\n\n", 0x07);
+}
+
+static void fs_list_entry(const char* name, const FsNode* node, void* arg) {
+    (void)arg;
+    int len = str_length(name);
+    print(name, node->type == FS_DIR ? 0x0B : COLOR_DEFAULT);
+    if (node->type == FS_DIR) {
+        putchar('/', 0x0B);
+        len++;
+    }
+    while (len++ < 28) {
+        putchar(' ', COLOR_DEFAULT);
+    }
+    print_padded_dec(node->size, 10, COLOR_DEFAULT);
+    print("\n", COLOR_DEFAULT);
+}
+
+static void fs_cat(const char* path) {
+    FsNode node;
+    if (emexfs_lookup(path, &node) != 0 || node.type != FS_FILE) {
+        print("No such file\n", 0x0C);
+        return;
+    }
+
+    char chunk[513];
+    uint64_t offset = 0;
+    int got;
+    while ((got = emexfs_read(&node, offset, chunk, sizeof(chunk) - 1)) > 0) {
+        chunk[got] = '\0';
+        print(chunk, COLOR_DEFAULT);
+        offset += (uint64_t)got;
+    }
+    if (got < 0) {
+        print("\nRead error\n", 0x0C);
+    }
+}
+
+// The words after the path, space separated, as one line at the end
+static void fs_append(const char* path, int argc, char** argv) {
+    FsNode node;
+    if (emexfs_lookup(path, &node) != 0 && emexfs_create(path, FS_FILE, &node) != 0) {
+        print("Can't create the file\n", 0x0C);
+        return;
+    }
+    if (node.type != FS_FILE) {
+        print("Not a file\n", 0x0C);
+        return;
+    }
+
+    for (int i = 0; i < argc; i++) {
+        const char* text = i + 1 < argc ? " " : "\n";
+        if (emexfs_write(&node, node.size, argv[i], (uint32_t)str_length(argv[i])) < 0 ||
+            emexfs_write(&node, node.size, text, 1) < 0) {
+            print("Write error\n", 0x0C);
+            return;
+        }
+    }
+}
+
+static void command_fs(int argc, char** argv) {
+    if (argc == 3 && str_equals(argv[1], "mount")) {
+        int dev = block_find(argv[2]);
+        if (dev < 0) {
+            print("No such block device\n", 0x0C);
+        } else if (emexfs_mount(dev) != 0) {
+            print("No emexFS there, or one is mounted already\n", 0x0C);
+        } else {
+            print("Mounted\n", 0x0A);
+        }
+        return;
+    }
+    if (argc == 2 && (str_equals(argv[1], "umount") || str_equals(argv[1], "sync"))) {
+        int result = str_equals(argv[1], "umount") ? emexfs_unmount() : emexfs_sync();
+        if (result == 0) {
+            print("Written back\n", 0x0A);
+        } else {
+            print("Nothing mounted or write errors\n", 0x0C);
+        }
+        return;
+    }
+    if (argc <= 3 && argc > 1 && str_equals(argv[1], "ls")) {
+        if (emexfs_readdir(argc == 3 ? argv[2] : "/", fs_list_entry, NULL) < 0) {
+            print("No such directory\n", 0x0C);
+        }
+        return;
+    }
+    if (argc == 3 && str_equals(argv[1], "cat")) {
+        fs_cat(argv[2]);
+        return;
+    }
+    if (argc == 3 && str_equals(argv[1], "mkdir")) {
+        if (emexfs_create(argv[2], FS_DIR, NULL) != 0) {
+            print("Can't create the directory\n", 0x0C);
+        }
+        return;
+    }
+    if (argc == 3 && str_equals(argv[1], "rm")) {
+        if (emexfs_remove(argv[2]) != 0) {
+            print("No such file or directory not empty\n", 0x0C);
+        }
+        return;
+    }
+    if (argc > 3 && str_equals(argv[1], "append")) {
+        fs_append(argv[2], argc - 3, argv + 3);
+        return;
+    }
+    if (argc != 1) {
+        print("Usage: fs [mount <dev> | umount | sync | ls [path] | cat <path> | mkdir <path> | rm <path> | append <path> <text>]\n", 0x0C);
+        return;
+    }
+
+    EmexfsInfo info;
+    emexfs_get_info(&info);
+
+    print("emexFS:\n", 0x0E);
+    print("==================\n", 0x0E);
+    if (info.dev < 0) {
+        print("Nothing mounted\n\n", 0x07);
+        return;
+    }
+
+    BlockDeviceInfo disk;
+    block_get_info(info.dev, &disk);
+    print("Device      ", 0x07);
+    print(disk.name, 0x0B);
+    print(", label ", 0x07);
+    print(info.label, 0x0B);
+    print("\n", COLOR_DEFAULT);
+
+    print("Blocks      ", 0x07);
+    print_dec(info.free_blocks, 0x0A);
+    print(" free of ", 0x07);
+    print_dec(info.block_count, COLOR_DEFAULT);
+    print(" (", 0x07);
+    print_dec((uint64_t)info.free_blocks * EMEXFS_BLOCK_SIZE / (1024 * 1024), 0x0A);
+    print(" MB), ", 0x07);
+    print_dec(info.groups, COLOR_DEFAULT);
+    print(info.groups == 1 ? " group\n" : " groups\n", 0x07);
+
+    print("Inodes      ", 0x07);
+    print_dec(info.free_inodes, 0x0A);
+    print(" free of ", 0x07);
+    print_dec(info.inode_count, COLOR_DEFAULT);
+    print("\n", COLOR_DEFAULT);
+
+    print("Mount       ", 0x07);
+    print_dec(info.mount_us, 0x0B);
+    print(" us", 0x07);
+    print(info.recovered ? ", counts rebuilt after an unclean unmount\n\n" : "\n\n", 0x07);
+}
@@ -0,0 +1,29 @@
+; thread context switch
+
+[BITS 64]
+
+section .text
+global context_switch
+
+; void context_switch(uint64_t* old_rsp, uint64_t new_rsp)
+; saves the callee saved registers on the old stack, stores its rsp and
+; continues on the new one. everything else is caller saved in C, and
+; the interrupt state is restored by whoever resumes.
+context_switch:
+    push rbx
+    push rbp
+    push r12
+    push r13
+    push r14
+    push r15
+
+    mov [rdi], rsp
+    mov rsp, rsi
+
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbp
+    pop rbx
+    ret
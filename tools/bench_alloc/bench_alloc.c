@@ -0,0 +1,496 @@
+// Host side benchmark for the kernel heap (src/include/memory/memory.c)
+//
+// Runs synthetic workloads or replays alloc/free traces against the real
+// allocator and reports throughput, latency percentiles, peak footprint
+// and fragmentation. Every workload runs in its own process so each one
+// starts with a fresh heap.
+//
+// Trace format, one operation per line ('#' starts a comment):
+//   a <id> <size>            kmalloc
+//   m <id> <size> <align>    kmalloc_aligned
+//   f <id>                   kfree
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "mock_kernel.h"
+#include "memory/memory.h"
+
+typedef enum { OP_ALLOC, OP_ALLOC_ALIGNED, OP_FREE } OpKind;
+
+typedef struct {
+    uint8_t kind;
+    uint32_t id;
+    uint32_t size;
+    uint32_t align;
+} Op;
+
+typedef struct {
+    Op* ops;
+    size_t count;
+    size_t capacity;
+    uint32_t max_id;
+} Trace;
+
+typedef struct {
+    const char* name;
+    void (*generate)(Trace* trace, size_t ops);
+    const char* description;
+} Workload;
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static uint32_t rng_range(uint32_t low, uint32_t high) {
+    return low + (uint32_t)(rng() % (high - low + 1));
+}
+
+static void trace_push(Trace* trace, OpKind kind, uint32_t id, uint32_t size, uint32_t align) {
+    if (trace->count == trace->capacity) {
+        trace->capacity = trace->capacity ? trace->capacity * 2 : 4096;
+        trace->ops = realloc(trace->ops, trace->capacity * sizeof(Op));
+        if (!trace->ops) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    trace->ops[trace->count++] = (Op){ (uint8_t)kind, id, size, align };
+    if (id > trace->max_id) {
+        trace->max_id = id;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Synthetic workloads
+// ---------------------------------------------------------------------------
+
+// Random replacement in a fixed live set, sizes from pick_size()
+static void generate_churn(Trace* trace, size_t ops, uint32_t live, uint32_t (*pick_size)(void)) {
+    for (uint32_t id = 0; id < live; id++) {
+        trace_push(trace, OP_ALLOC, id, pick_size(), 0);
+    }
+    while (trace->count + 2 <= ops) {
+        uint32_t id = (uint32_t)(rng() % live);
+        trace_push(trace, OP_FREE, id, 0, 0);
+        trace_push(trace, OP_ALLOC, id, pick_size(), 0);
+    }
+    for (uint32_t id = 0; id < live; id++) {
+        trace_push(trace, OP_FREE, id, 0, 0);
+    }
+}
+
+static uint32_t size_small(void) {
+    return rng_range(16, 256);
+}
+
+static uint32_t size_mixed(void) {
+    uint32_t p = (uint32_t)(rng() % 100);
+    if (p < 70) return rng_range(16, 128);
+    if (p < 95) return rng_range(129, 4096);
+    if (p < 99) return rng_range(4097, 32768);
+    return rng_range(65536, 524288);
+}
+
+static void gen_churn(Trace* trace, size_t ops) {
+    generate_churn(trace, ops, 4096, size_small);
+}
+
+static void gen_mixed(Trace* trace, size_t ops) {
+    generate_churn(trace, ops, 2048, size_mixed);
+}
+
+// Allocate a big working set, then free it in random order
+static void gen_ramp(Trace* trace, size_t ops) {
+    uint32_t count = (uint32_t)(ops / 2);
+    uint32_t* order = malloc(count * sizeof(uint32_t));
+
+    for (uint32_t id = 0; id < count; id++) {
+        trace_push(trace, OP_ALLOC, id, rng_range(16, 1024), 0);
+        order[id] = id;
+    }
+    for (uint32_t i = count; i > 1; i--) {
+        uint32_t j = (uint32_t)(rng() % i);
+        uint32_t tmp = order[i - 1];
+        order[i - 1] = order[j];
+        order[j] = tmp;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        trace_push(trace, OP_FREE, order[i], 0, 0);
+    }
+    free(order);
+}
+
+// Bursts of allocations released in reverse order (call-tree like)
+static void gen_lifo(Trace* trace, size_t ops) {
+    while (trace->count < ops) {
+        uint32_t burst = rng_range(1, 64);
+        for (uint32_t id = 0; id < burst; id++) {
+            trace_push(trace, OP_ALLOC, id, rng_range(8, 2048), 0);
+        }
+        for (uint32_t id = burst; id > 0; id--) {
+            trace_push(trace, OP_FREE, id - 1, 0, 0);
+        }
+    }
+}
+
+// Mix of plain and aligned allocations (slabs, DMA buffers)
+static void gen_aligned(Trace* trace, size_t ops) {
+    const uint32_t live = 1024;
+    for (uint32_t id = 0; id < live; id++) {
+        trace_push(trace, OP_ALLOC, id, size_small(), 0);
+    }
+    while (trace->count + 2 <= ops) {
+        uint32_t id = (uint32_t)(rng() % live);
+        trace_push(trace, OP_FREE, id, 0, 0);
+        if (rng() % 4 == 0) {
+            trace_push(trace, OP_ALLOC_ALIGNED, id, rng_range(64, 8192), 64U << (rng() % 7));
+        } else {
+            trace_push(trace, OP_ALLOC, id, size_small(), 0);
+        }
+    }
+    for (uint32_t id = 0; id < live; id++) {
+        trace_push(trace, OP_FREE, id, 0, 0);
+    }
+}
+
+static const Workload workloads[] = {
+    { "churn",   gen_churn,   "random replacement, 4096 live blocks of 16-256 bytes" },
+    { "mixed",   gen_mixed,   "random replacement, 2048 live blocks of 16 bytes to 512KB" },
+    { "ramp",    gen_ramp,    "allocate a working set, free it in random order" },
+    { "lifo",    gen_lifo,    "bursts of up to 64 blocks freed in reverse order" },
+    { "aligned", gen_aligned, "churn with 25% kmalloc_aligned (64B-4KB alignment)" },
+};
+
+#define WORKLOAD_COUNT (sizeof(workloads) / sizeof(workloads[0]))
+
+// ---------------------------------------------------------------------------
+// Traces on disk
+// ---------------------------------------------------------------------------
+
+static int trace_load(Trace* trace, const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return -1;
+    }
+
+    char line[256];
+    int line_no = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line_no++;
+        char* hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+
+        char kind;
+        unsigned id, size, align;
+        int fields = sscanf(line, " %c %u %u %u", &kind, &id, &size, &align);
+        if (fields <= 0) continue;
+
+        if (kind == 'a' && fields >= 3) {
+            trace_push(trace, OP_ALLOC, id, size, 0);
+        } else if (kind == 'm' && fields == 4) {
+            trace_push(trace, OP_ALLOC_ALIGNED, id, size, align);
+        } else if (kind == 'f' && fields >= 2) {
+            trace_push(trace, OP_FREE, id, 0, 0);
+        } else {
+            fprintf(stderr, "%s:%d: bad trace line\n", path, line_no);
+            fclose(file);
+            return -1;
+        }
+    }
+
+    fclose(file);
+    return 0;
+}
+
+static int trace_save(const Trace* trace, const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        perror(path);
+        return -1;
+    }
+
+    for (size_t i = 0; i < trace->count; i++) {
+        const Op* op = &trace->ops[i];
+        if (op->kind == OP_ALLOC) {
+            fprintf(file, "a %u %u\n", op->id, op->size);
+        } else if (op->kind == OP_ALLOC_ALIGNED) {
+            fprintf(file, "m %u %u %u\n", op->id, op->size, op->align);
+        } else {
+            fprintf(file, "f %u\n", op->id);
+        }
+    }
+
+    fclose(file);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Replay
+// ---------------------------------------------------------------------------
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int compare_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t percentile(const uint32_t* sorted, size_t count, double p) {
+    if (count == 0) return 0;
+    size_t index = (size_t)(p * (double)(count - 1));
+    return sorted[index];
+}
+
+// Cost of the timing itself, subtracted from every sample
+static uint32_t timer_overhead(void) {
+    uint64_t best = UINT64_MAX;
+    for (int i = 0; i < 10000; i++) {
+        uint64_t start = now_ns();
+        uint64_t end = now_ns();
+        if (end - start < best) {
+            best = end - start;
+        }
+    }
+    return (uint32_t)best;
+}
+
+static void print_latency(const char* label, uint32_t* samples, size_t count) {
+    qsort(samples, count, sizeof(uint32_t), compare_u32);
+    printf("  %-6s %9zu ops  p50 %6u  p90 %6u  p99 %6u  p99.9 %7u  max %8u ns\n",
+           label, count,
+           percentile(samples, count, 0.50), percentile(samples, count, 0.90),
+           percentile(samples, count, 0.99), percentile(samples, count, 0.999),
+           count ? samples[count - 1] : 0);
+}
+
+static int replay(const char* name, const Trace* trace) {
+    if (mock_kernel_init()) {
+        return 1;
+    }
+    memory_init();
+
+    uint8_t** blocks = calloc(trace->max_id + 1, sizeof(uint8_t*));
+    uint32_t* sizes = calloc(trace->max_id + 1, sizeof(uint32_t));
+    uint32_t* alloc_ns = malloc(trace->count * sizeof(uint32_t));
+    uint32_t* free_ns = malloc(trace->count * sizeof(uint32_t));
+    size_t allocs = 0, frees = 0, errors = 0;
+
+    uint64_t live_bytes = 0, peak_live = 0;
+    uint32_t max_frag = 0;
+    uint32_t overhead = timer_overhead();
+    uint64_t total_ns = 0;
+
+    for (size_t i = 0; i < trace->count; i++) {
+        const Op* op = &trace->ops[i];
+        uint64_t start, elapsed;
+
+        if (op->kind == OP_FREE) {
+            uint8_t* block = blocks[op->id];
+            if (!block) {
+                errors++;
+                continue;
+            }
+
+            // Pattern written at allocation must have survived
+            if (block[0] != (uint8_t)op->id || block[sizes[op->id] - 1] != (uint8_t)op->id) {
+                fprintf(stderr, "%s: block %u corrupted\n", name, op->id);
+                errors++;
+            }
+
+            start = now_ns();
+            kfree(block);
+            elapsed = now_ns() - start;
+
+            free_ns[frees++] = elapsed > overhead ? (uint32_t)(elapsed - overhead) : 0;
+            live_bytes -= sizes[op->id];
+            blocks[op->id] = NULL;
+        } else {
+            if (blocks[op->id]) {
+                // Trace reuses a live id: drop the old block untimed
+                kfree(blocks[op->id]);
+                live_bytes -= sizes[op->id];
+            }
+
+            start = now_ns();
+            uint8_t* block = op->kind == OP_ALLOC ? kmalloc(op->size) : kmalloc_aligned(op->size, op->align);
+            elapsed = now_ns() - start;
+
+            if (!block || op->size == 0) {
+                errors += block == NULL && op->size != 0;
+                blocks[op->id] = NULL;
+                continue;
+            }
+            if (op->kind == OP_ALLOC_ALIGNED && ((uintptr_t)block & (op->align - 1))) {
+                fprintf(stderr, "%s: misaligned block %u\n", name, op->id);
+                errors++;
+            }
+
+            alloc_ns[allocs++] = elapsed > overhead ? (uint32_t)(elapsed - overhead) : 0;
+            block[0] = (uint8_t)op->id;
+            block[op->size - 1] = (uint8_t)op->id;
+            blocks[op->id] = block;
+            sizes[op->id] = op->size;
+
+            live_bytes += op->size;
+            if (live_bytes > peak_live) {
+                peak_live = live_bytes;
+            }
+        }
+        total_ns += elapsed > overhead ? elapsed - overhead : 0;
+
+        if ((i & 1023) == 0) {
+            HeapStats stats;
+            get_heap_stats(&stats);
+            if (stats.fragmentation > max_frag) {
+                max_frag = stats.fragmentation;
+            }
+        }
+    }
+
+    HeapStats stats;
+    get_heap_stats(&stats);
+
+    uint64_t peak_footprint = mock_peak_mapped_pages * 4096;
+    double seconds = (double)total_ns / 1e9;
+
+    printf("%s: %zu ops, %.2f Mops/s (allocator time %.3f s)\n",
+           name, allocs + frees, seconds > 0 ? (double)(allocs + frees) / seconds / 1e6 : 0.0, seconds);
+    print_latency("alloc", alloc_ns, allocs);
+    print_latency("free", free_ns, frees);
+    printf("  peak live %llu KB, peak footprint %llu KB (%.2fx), peak heap usage %u KB\n",
+           (unsigned long long)(peak_live / 1024), (unsigned long long)(peak_footprint / 1024),
+           peak_live ? (double)peak_footprint / (double)peak_live : 0.0, get_peak_usage() / 1024);
+    printf("  fragmentation max %u%%, at end %u%% (%u free blocks, largest %u bytes)\n",
+           max_frag, stats.fragmentation, stats.free_blocks, stats.largest_free);
+    if (errors) {
+        printf("  %zu errors\n", errors);
+    }
+    printf("\n");
+
+    free(blocks);
+    free(sizes);
+    free(alloc_ns);
+    free(free_ns);
+    return errors ? 1 : 0;
+}
+
+// Fresh process per run, so every workload starts with an empty heap
+static int run_isolated(const char* name, const Trace* trace) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0) {
+        exit(replay(name, trace));
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (WIFSIGNALED(status)) {
+        printf("%s: crashed with signal %d\n\n", name, WTERMSIG(status));
+        return 1;
+    }
+    return WEXITSTATUS(status);
+}
+
+static void usage(const char* argv0) {
+    printf("Usage: %s [-n ops] [-s seed] [-w workload] [-t trace] [-r file] [-v]\n", argv0);
+    printf("  -n ops       operations per synthetic workload (default 1000000)\n");
+    printf("  -s seed      random seed\n");
+    printf("  -w workload  run only this workload (default: all)\n");
+    printf("  -t trace     replay a trace file (may be given more than once)\n");
+    printf("  -r file      record the generated workload to file (needs -w)\n");
+    printf("  -v           show allocator console output\n");
+    printf("Workloads:\n");
+    for (size_t i = 0; i < WORKLOAD_COUNT; i++) {
+        printf("  %-8s %s\n", workloads[i].name, workloads[i].description);
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t ops = 1000000;
+    const char* only = NULL;
+    const char* record = NULL;
+    const char* traces[16];
+    int trace_count = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:w:t:r:vh")) != -1) {
+        switch (opt) {
+            case 'n': ops = strtoull(optarg, NULL, 0); break;
+            case 's': rng_state = strtoull(optarg, NULL, 0) | 1; break;
+            case 'w': only = optarg; break;
+            case 't':
+                if (trace_count < 16) traces[trace_count++] = optarg;
+                break;
+            case 'r': record = optarg; break;
+            case 'v': mock_verbose = 1; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (record && !only) {
+        fprintf(stderr, "-r needs -w to pick the workload to record\n");
+        return 1;
+    }
+
+    int failed = 0;
+
+    for (int i = 0; i < trace_count; i++) {
+        Trace trace = {0};
+        if (trace_load(&trace, traces[i])) {
+            return 1;
+        }
+        failed |= run_isolated(traces[i], &trace);
+        free(trace.ops);
+    }
+
+    if (trace_count && !only) {
+        return failed;
+    }
+
+    int matched = 0;
+    for (size_t i = 0; i < WORKLOAD_COUNT; i++) {
+        if (only && strcmp(only, workloads[i].name) != 0)
+            continue;
+        matched = 1;
+
+        Trace trace = {0};
+        workloads[i].generate(&trace, ops);
+
+        if (record && trace_save(&trace, record)) {
+            return 1;
+        }
+
+        failed |= run_isolated(workloads[i].name, &trace);
+        free(trace.ops);
+    }
+
+    if (!matched) {
+        fprintf(stderr, "unknown workload: %s\n", only);
+        usage(argv[0]);
+        return 1;
+    }
+    return failed;
+}
@@ -0,0 +1,81 @@
+// Host stand-ins for the kernel pieces memory.c depends on
+//
+// The heap and large allocation windows are reserved PROT_NONE at the
+// addresses the benchmark is built with; "mapping" a page makes it
+// read/write, "unmapping" drops it again, so stray accesses still fault.
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+
+#include "mock_kernel.h"
+#include "memory/memory.h"
+#include "memory/pmm.h"
+
+#define VMAP_RESERVE (16ULL << 30)  // address space reserved for large allocations
+
+uint64_t mock_mapped_pages = 0;
+uint64_t mock_peak_mapped_pages = 0;
+int mock_verbose = 0;
+
+int mock_kernel_init(void) {
+    void* heap = mmap((void*)KERNEL_HEAP_BASE, HEAP_MAX_SIZE, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+    if (heap == MAP_FAILED) {
+        perror("mock: reserving the heap window");
+        return -1;
+    }
+
+    void* vmap = mmap((void*)KERNEL_VMAP_BASE, VMAP_RESERVE, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+    if (vmap == MAP_FAILED) {
+        perror("mock: reserving the large allocation window");
+        return -1;
+    }
+    return 0;
+}
+
+int paging_map_pages(uint64_t virt, uint32_t count, uint64_t flags) {
+    (void)flags;
+
+    if (virt >= KERNEL_VMAP_BASE && virt + (uint64_t)count * PAGE_SIZE > KERNEL_VMAP_BASE + VMAP_RESERVE) {
+        return -1;
+    }
+    if (mprotect((void*)virt, (uint64_t)count * PAGE_SIZE, PROT_READ | PROT_WRITE)) {
+        return -1;
+    }
+
+    mock_mapped_pages += count;
+    if (mock_mapped_pages > mock_peak_mapped_pages) {
+        mock_peak_mapped_pages = mock_mapped_pages;
+    }
+    return 0;
+}
+
+void paging_unmap_pages(uint64_t virt, uint32_t count) {
+    madvise((void*)virt, (uint64_t)count * PAGE_SIZE, MADV_DONTNEED);
+    mprotect((void*)virt, (uint64_t)count * PAGE_SIZE, PROT_NONE);
+    mock_mapped_pages -= count;
+}
+
+// Console output of the allocator (errors only matter when verbose)
+void print(const char* str, unsigned char color) {
+    (void)color;
+    if (mock_verbose) {
+        fputs(str, stderr);
+    }
+}
+
+void print_hex(uint64_t num, unsigned char color) {
+    (void)color;
+    if (mock_verbose) {
+        fprintf(stderr, "0x%llX", (unsigned long long)num);
+    }
+}
+
+void print_dec(uint64_t num, unsigned char color) {
+    (void)color;
+    if (mock_verbose) {
+        fprintf(stderr, "%llu", (unsigned long long)num);
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef MOCK_KERNEL_H
+#define MOCK_KERNEL_H
+
+#include <stdint.h>
+
+// Pages currently mapped for the heap and large allocations
+extern uint64_t mock_mapped_pages;
+extern uint64_t mock_peak_mapped_pages;
+
+// Show the allocator's console output on stderr
+extern int mock_verbose;
+
+// Reserve the heap windows, call before the first kmalloc
+int mock_kernel_init(void);
+
+// Console functions memory.c prints through
+void print(const char* str, unsigned char color);
+void print_hex(uint64_t num, unsigned char color);
+void print_dec(uint64_t num, unsigned char color);
+
+#endif
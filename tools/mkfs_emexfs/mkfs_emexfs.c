@@ -0,0 +1,324 @@
+// Host side mkfs for emexFS (src/file_system/emexfs/format.h)
+//
+// Creates an image for the second QEMU -drive and copies host files and
+// directories into its root:
+//   mkfs.emexfs [-s MB] [-i inodes] [-L label] image [file|dir ...]
+//
+// Everything is laid out in order on a fresh disk: each file gets one
+// extent, each directory gets just enough hash buckets that none of them
+// overflows. The result is unmounted clean, so the kernel mounts it from
+// the superblock and summary without scanning.
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "file_system/emexfs/format.h"
+
+typedef struct {
+    char name[EMEXFS_NAME_MAX + 1];
+    uint32_t inode;
+    uint8_t type;
+} Entry;
+
+static uint8_t* image;
+static EmexfsSuper super;
+static uint32_t next_block;
+static uint32_t next_inode = EMEXFS_ROOT_INODE;
+
+static uint8_t* block_data(uint32_t block) {
+    return image + (uint64_t)block * EMEXFS_BLOCK_SIZE;
+}
+
+static EmexfsInode* inode_at(uint32_t ino) {
+    return (EmexfsInode*)(block_data(super.inode_table_start + ino / EMEXFS_INODES_PER_BLOCK) +
+                          (ino % EMEXFS_INODES_PER_BLOCK) * EMEXFS_INODE_SIZE);
+}
+
+static void die(const char* message, const char* what) {
+    fprintf(stderr, "mkfs.emexfs: %s%s%s\n", message, what ? ": " : "", what ? what : "");
+    exit(1);
+}
+
+static uint32_t alloc_blocks(uint64_t count) {
+    if (count > super.block_count - next_block) {
+        die("image is full", NULL);
+    }
+    uint32_t first = next_block;
+    next_block += (uint32_t)count;
+    return first;
+}
+
+static uint32_t alloc_inode(void) {
+    if (next_inode >= super.inode_count) {
+        die("out of inodes, use -i", NULL);
+    }
+    return next_inode++;
+}
+
+static void set_bits(uint32_t start_block, uint32_t from, uint32_t to) {
+    for (uint32_t bit = from; bit < to; bit++) {
+        uint64_t* words = (uint64_t*)block_data(start_block + bit / EMEXFS_BITS_PER_BLOCK);
+        uint32_t index = bit % EMEXFS_BITS_PER_BLOCK;
+        words[index / 64] |= 1ull << (index % 64);
+    }
+}
+
+static uint32_t add_file(const char* path, const struct stat* st) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        die("can't open", path);
+    }
+
+    uint32_t ino = alloc_inode();
+    EmexfsInode* inode = inode_at(ino);
+    inode->type = EMEXFS_TYPE_FILE;
+    inode->links = 1;
+    inode->size = (uint64_t)st->st_size;
+    inode->mtime = (uint64_t)st->st_mtime;
+
+    uint64_t blocks = (inode->size + EMEXFS_BLOCK_SIZE - 1) / EMEXFS_BLOCK_SIZE;
+    if (blocks) {
+        uint32_t first = alloc_blocks(blocks);
+        if (fread(block_data(first), 1, inode->size, file) != inode->size) {
+            die("can't read", path);
+        }
+        inode->extent_count = 1;
+        inode->extents[0].disk_block = first;
+        inode->extents[0].length = (uint32_t)blocks;
+    }
+    fclose(file);
+    return ino;
+}
+
+// Hash table for the entries: the fewest buckets without an overflow
+static void fill_dir(uint32_t ino, const Entry* entries, uint32_t count, uint64_t mtime) {
+    uint32_t buckets = 1;
+    uint32_t* fill = calloc(EMEXFS_DIR_MAX_BUCKETS, sizeof(uint32_t));
+    for (;;) {
+        memset(fill, 0, EMEXFS_DIR_MAX_BUCKETS * sizeof(uint32_t));
+        int overflow = 0;
+        for (uint32_t i = 0; i < count && !overflow; i++) {
+            uint32_t hash = emexfs_hash(entries[i].name, (uint32_t)strlen(entries[i].name));
+            overflow = ++fill[hash & (buckets - 1)] > EMEXFS_DIRENTS_PER_BLOCK;
+        }
+        if (!overflow) {
+            break;
+        }
+        if (buckets == EMEXFS_DIR_MAX_BUCKETS) {
+            die("too many entries in a directory", NULL);
+        }
+        buckets *= 2;
+    }
+
+    uint32_t first = alloc_blocks(buckets);
+    memset(fill, 0, EMEXFS_DIR_MAX_BUCKETS * sizeof(uint32_t));
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t length = (uint32_t)strlen(entries[i].name);
+        uint32_t hash = emexfs_hash(entries[i].name, length);
+        uint32_t bucket = hash & (buckets - 1);
+        EmexfsDirent* slot = (EmexfsDirent*)block_data(first + bucket) + fill[bucket]++;
+        slot->inode = entries[i].inode;
+        slot->hash = hash;
+        slot->name_len = (uint8_t)length;
+        slot->type = entries[i].type;
+        memcpy(slot->name, entries[i].name, length);
+    }
+    free(fill);
+
+    EmexfsInode* inode = inode_at(ino);
+    inode->type = EMEXFS_TYPE_DIR;
+    inode->links = 1;
+    inode->dir_buckets = buckets;
+    inode->size = (uint64_t)buckets * EMEXFS_BLOCK_SIZE;
+    inode->mtime = mtime;
+    inode->extent_count = 1;
+    inode->extents[0].disk_block = first;
+    inode->extents[0].length = buckets;
+}
+
+static void add_entry(Entry** entries, uint32_t* count, const char* name, const char* path);
+
+static uint32_t add_dir(const char* path, const struct stat* st) {
+    DIR* dir = opendir(path);
+    if (!dir) {
+        die("can't open", path);
+    }
+    uint32_t ino = alloc_inode();
+
+    Entry* entries = NULL;
+    uint32_t count = 0;
+    struct dirent* de;
+    while ((de = readdir(dir))) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+            continue;
+        }
+        char* child;
+        if (asprintf(&child, "%s/%s", path, de->d_name) < 0) {
+            die("out of memory", NULL);
+        }
+        add_entry(&entries, &count, de->d_name, child);
+        free(child);
+    }
+    closedir(dir);
+
+    fill_dir(ino, entries, count, (uint64_t)st->st_mtime);
+    free(entries);
+    return ino;
+}
+
+static void add_entry(Entry** entries, uint32_t* count, const char* name, const char* path) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        die("can't stat", path);
+    }
+    if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "mkfs.emexfs: skipping %s\n", path);
+        return;
+    }
+    if (!*name || strlen(name) > EMEXFS_NAME_MAX) {
+        die("name too long", path);
+    }
+    for (uint32_t i = 0; i < *count; i++) {
+        if (!strcmp((*entries)[i].name, name)) {
+            die("duplicate name", name);
+        }
+    }
+
+    *entries = realloc(*entries, (*count + 1) * sizeof(Entry));
+    if (!*entries) {
+        die("out of memory", NULL);
+    }
+    Entry* entry = &(*entries)[(*count)++];
+    strcpy(entry->name, name);
+    if (S_ISDIR(st.st_mode)) {
+        entry->type = EMEXFS_TYPE_DIR;
+        entry->inode = add_dir(path, &st);
+    } else {
+        entry->type = EMEXFS_TYPE_FILE;
+        entry->inode = add_file(path, &st);
+    }
+}
+
+static uint32_t blocks_for(uint64_t bytes) {
+    return (uint32_t)((bytes + EMEXFS_BLOCK_SIZE - 1) / EMEXFS_BLOCK_SIZE);
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: mkfs.emexfs [-s MB] [-i inodes] [-L label] image [file|dir ...]\n");
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    uint64_t size_mb = 32;
+    uint64_t inodes = 0;
+    const char* label = "emexfs";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:i:L:h")) != -1) {
+        switch (opt) {
+            case 's': size_mb = strtoull(optarg, NULL, 0); break;
+            case 'i': inodes = strtoull(optarg, NULL, 0); break;
+            case 'L': label = optarg; break;
+            default: usage();
+        }
+    }
+    if (optind >= argc) {
+        usage();
+    }
+    const char* output = argv[optind++];
+
+    uint64_t block_count = size_mb * (1024 * 1024 / EMEXFS_BLOCK_SIZE);
+    if (block_count < 64 || block_count > 0xFFFFFFFFull) {
+        die("size must be 1 MB to 16 TB", NULL);
+    }
+    if (!inodes) {
+        inodes = block_count / 4;                        // one per 16 KB
+    }
+    inodes = (inodes + EMEXFS_INODES_PER_BLOCK - 1) / EMEXFS_INODES_PER_BLOCK * EMEXFS_INODES_PER_BLOCK;
+    if (inodes < EMEXFS_INODES_PER_BLOCK || inodes > block_count) {
+        die("bad inode count", NULL);
+    }
+
+    super.magic = EMEXFS_MAGIC;
+    super.version = EMEXFS_VERSION;
+    super.block_size = EMEXFS_BLOCK_SIZE;
+    super.block_count = (uint32_t)block_count;
+    super.inode_count = (uint32_t)inodes;
+    super.root_inode = EMEXFS_ROOT_INODE;
+    super.state = EMEXFS_STATE_CLEAN;
+    super.created = (uint64_t)time(NULL);
+    strncpy(super.label, label, sizeof(super.label) - 1);
+
+    uint32_t groups = blocks_for(block_count / 8 + (block_count % 8 != 0));
+    super.summary_start = 1;
+    super.summary_blocks = blocks_for((uint64_t)groups * sizeof(uint32_t));
+    super.block_bitmap_start = super.summary_start + super.summary_blocks;
+    super.block_bitmap_blocks = groups;
+    super.inode_bitmap_start = super.block_bitmap_start + groups;
+    super.inode_bitmap_blocks = blocks_for(inodes / 8 + (inodes % 8 != 0));
+    super.inode_table_start = super.inode_bitmap_start + super.inode_bitmap_blocks;
+    super.inode_table_blocks = (uint32_t)(inodes / EMEXFS_INODES_PER_BLOCK);
+    super.data_start = super.inode_table_start + super.inode_table_blocks;
+    if (super.data_start + 1 >= block_count) {
+        die("image too small for its metadata", NULL);
+    }
+
+    image = calloc(block_count, EMEXFS_BLOCK_SIZE);
+    if (!image) {
+        die("out of memory", NULL);
+    }
+    next_block = super.data_start;
+
+    // Inode 0 is never handed out; the root takes inode 1 before its children
+    uint32_t root = alloc_inode();
+    Entry* entries = NULL;
+    uint32_t count = 0;
+    for (int i = optind; i < argc; i++) {
+        char* copy = strdup(argv[i]);
+        char* end = copy + strlen(copy);
+        while (end > copy + 1 && end[-1] == '/') {
+            *--end = '\0';
+        }
+        char* name = strrchr(copy, '/');
+        add_entry(&entries, &count, name ? name + 1 : copy, argv[i]);
+        free(copy);
+    }
+    fill_dir(root, entries, count, super.created);
+    free(entries);
+
+    // Used: metadata and data so far, and the bits past the end
+    set_bits(super.block_bitmap_start, 0, next_block);
+    set_bits(super.block_bitmap_start, super.block_count, groups * EMEXFS_BITS_PER_BLOCK);
+    set_bits(super.inode_bitmap_start, 0, next_inode);
+    set_bits(super.inode_bitmap_start, super.inode_count, super.inode_bitmap_blocks * EMEXFS_BITS_PER_BLOCK);
+
+    uint32_t* summary = (uint32_t*)block_data(super.summary_start);
+    for (uint32_t g = 0; g < groups; g++) {
+        uint64_t first = (uint64_t)g * EMEXFS_BITS_PER_BLOCK;
+        uint64_t last = first + EMEXFS_BITS_PER_BLOCK;
+        if (last > block_count) {
+            last = block_count;
+        }
+        summary[g] = next_block >= last ? 0 : (uint32_t)(last - (next_block > first ? next_block : first));
+        super.free_blocks += summary[g];
+    }
+    super.free_inodes = super.inode_count - next_inode;
+    super.checksum = emexfs_checksum(&super);
+    memcpy(block_data(0), &super, sizeof(super));
+
+    FILE* out = fopen(output, "wb");
+    if (!out || fwrite(image, EMEXFS_BLOCK_SIZE, block_count, out) != block_count || fclose(out) != 0) {
+        die("can't write", output);
+    }
+
+    printf("%s: %u blocks, %u inodes, %u groups, %u blocks and %u inodes used\n", output,
+           super.block_count, super.inode_count, groups, next_block, next_inode);
+    free(image);
+    return 0;
+}